@@ -124,6 +124,66 @@ bool CameraModel::IsInFov(double x, double y, double z) const {
   return IsInFov(Eigen::Vector3d(x, y, z));
 }
 
+void CameraModel::CameraCoordinates(PointBatch const& points, PointBatch* cam_points) const {
+  // Equivalent to applying cam_t_global_ to each row, but done one
+  // coordinate at a time, for all points.
+  Eigen::Matrix3d const R = cam_t_global_.linear();
+  Eigen::Vector3d const t = cam_t_global_.translation();
+  cam_points->resize(points.rows(), 3);
+  for (int row = 0; row < 3; row++)
+    cam_points->col(row).array() = R(row, 0) * points.col(0).array()
+      + R(row, 1) * points.col(1).array() + R(row, 2) * points.col(2).array() + t[row];
+}
+
+void CameraModel::ImageCoordinates(PointBatch const& points, PixelBatch* pixels) const {
+  PointBatch cam_points;
+  CameraCoordinates(points, &cam_points);
+
+  Eigen::Vector2d const& focal = params_.GetFocalVector();
+  pixels->resize(points.rows(), 2);
+  pixels->col(0).array() = focal[0] * cam_points.col(0).array() / cam_points.col(2).array();
+  pixels->col(1).array() = focal[1] * cam_points.col(1).array() / cam_points.col(2).array();
+}
+
+void CameraModel::IsInFov(PointBatch const& points, MaskBatch* in_fov) const {
+  PointBatch cam_points;
+  CameraCoordinates(points, &cam_points);
+
+  // Same logic as for a single point
+  Eigen::Vector2d const& focal = params_.GetFocalVector();
+  Eigen::Vector2d const& half = params_.GetDistortedHalfSize();
+  Eigen::ArrayXd x = focal[0] * cam_points.col(0).array() / cam_points.col(2).array();
+  Eigen::ArrayXd y = focal[1] * cam_points.col(1).array() / cam_points.col(2).array();
+  *in_fov = (cam_points.col(2).array() > 0.0) && (x >= -half[0]) && (x < half[0]) &&
+    (y >= -half[1]) && (y < half[1]);
+}
+
+void CameraModel::DistortedImageCoordinates(PointBatch const& points, PixelBatch* dist_pixels,
+                                            MaskBatch* valid) const {
+  PointBatch cam_points;
+  CameraCoordinates(points, &cam_points);
+
+  // The undistorted pixels, relative to the undistorted image center
+  Eigen::Vector2d const& focal = params_.GetFocalVector();
+  Eigen::Vector2d const& half = params_.GetUndistortedHalfSize();
+  PixelBatch undist_pixels(points.rows(), 2);
+  undist_pixels.col(0).array() = focal[0] * cam_points.col(0).array() / cam_points.col(2).array();
+  undist_pixels.col(1).array() = focal[1] * cam_points.col(1).array() / cam_points.col(2).array();
+
+  // If out of the undistorted image, there's some uncertainty whether
+  // distortion will work, so such pixels are not valid.
+  *valid = (cam_points.col(2).array() > 0.0) &&
+    (undist_pixels.col(0).array().abs() <= half[0]) &&
+    (undist_pixels.col(1).array().abs() <= half[1]);
+
+  // Avoid passing bad values to the distortion model
+  for (Eigen::Index it = 0; it < undist_pixels.rows(); it++) {
+    if (!(*valid)[it]) undist_pixels.row(it).setZero();
+  }
+
+  params_.DistortPixels(undist_pixels, dist_pixels);
+}
+
 // Rodrigues is a collapsed Angle Axis Representation
 void RotationToRodrigues(Eigen::Matrix3d const& rotation,
                          Eigen::Vector3d * vector) {
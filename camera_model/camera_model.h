@@ -28,6 +28,13 @@
 
 namespace camera {
 
+// Many points or pixels, one per row. With the default column-major
+// storage each coordinate is contiguous (structure of arrays), so
+// operations over all points vectorize well.
+typedef Eigen::Matrix<double, Eigen::Dynamic, 3> PointBatch;
+typedef Eigen::Matrix<double, Eigen::Dynamic, 2> PixelBatch;
+typedef Eigen::Array<bool, Eigen::Dynamic, 1>    MaskBatch;
+
 /**
  * A model of a camera, with transformation matrix and camera parameters.
  **/
@@ -60,6 +67,19 @@ class CameraModel {
   bool IsInFov(const Eigen::Vector3d & p) const;
   bool IsInFov(double x, double y, double z) const;
 
+  // Batch versions of CameraCoordinates(), ImageCoordinates() and
+  // IsInFov(), for many world points.
+  void CameraCoordinates(PointBatch const& points, PointBatch* cam_points) const;
+  void ImageCoordinates(PointBatch const& points, PixelBatch* pixels) const;
+  void IsInFov(PointBatch const& points, MaskBatch* in_fov) const;
+
+  // Project many world points into the camera, returning the
+  // distorted pixels. A point is valid if it is in front of the
+  // camera and its undistorted pixel is within the undistorted
+  // image. Invalid points still get pixels, which must not be used.
+  void DistortedImageCoordinates(PointBatch const& points, PixelBatch* dist_pixels,
+                                 MaskBatch* valid) const;
+
   double GetFovX(void) const;
   double GetFovY(void) const;
 
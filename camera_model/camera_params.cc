@@ -18,6 +18,7 @@
 
 #include <camera_model/camera_params.h>
 #include <camera_model/rpc_distortion.h>
+#include <camera_model/distortion_models.h>
 
 #include <Eigen/Dense>
 #include <gflags/gflags.h>
@@ -107,6 +108,7 @@ camera::CameraParameters::CameraParameters(std::string const& calibration_file,
 void camera::CameraParameters::SetDistortedSize(Eigen::Vector2i const& image_size) {
   distorted_image_size_ = image_size;
   distorted_half_size_ = image_size.cast<double>() / 2.0;
+  ResetUndistortionGrid();
 }
 
 const Eigen::Vector2i& camera::CameraParameters::GetDistortedSize() const {
@@ -148,6 +150,7 @@ const Eigen::Vector2i& camera::CameraParameters::GetCropOffset() const {
 
 void camera::CameraParameters::SetOpticalOffset(Eigen::Vector2d const& offset) {
   optical_offset_ = offset;
+  ResetUndistortionGrid();
 }
 
 const Eigen::Vector2d& camera::CameraParameters::GetOpticalOffset() const {
@@ -156,6 +159,7 @@ const Eigen::Vector2d& camera::CameraParameters::GetOpticalOffset() const {
 
 void camera::CameraParameters::SetFocalLength(Eigen::Vector2d const& f) {
   focal_length_ = f;
+  ResetUndistortionGrid();
 }
 
 double camera::CameraParameters::GetFocalLength() const {
@@ -205,6 +209,8 @@ void camera::CameraParameters::SetDistortion(Eigen::VectorXd const& distortion)
                  << "Additional message: " << e.what() << "\n";
     }
   }
+
+  ResetUndistortionGrid();
 }
 
 // This must be called before a model having RPC distortion can be used
@@ -251,6 +257,48 @@ void camera::CameraParameters::updateRpcUndistortion(int num_threads) {
   // Copy back the updated values
   for (int it = 0; it < num_dist; it++)
     distortion_coeffs_[it + num_dist] = rpc_undist_coeffs[it];
+
+  ResetUndistortionGrid();
+}
+
+void camera::CameraParameters::SetUndistortionGridError(double max_error) {
+  undist_grid_error_ = max_error;
+  ResetUndistortionGrid();
+}
+
+double camera::CameraParameters::GetUndistortionGridError() const {
+  return undist_grid_error_;
+}
+
+void camera::CameraParameters::ResetUndistortionGrid() {
+  undist_grid_.reset();
+  if (undist_grid_error_ > 0.0)
+    undist_grid_ = std::make_shared<UndistortionGridHolder>();
+}
+
+camera::UndistortionGrid const* camera::CameraParameters::GetUndistortionGrid() const {
+  UndistortionGridHolder* holder = undist_grid_.get();
+  if (holder == NULL)
+    return NULL;
+
+  // Build the grid only once, even if many threads need it at the same time
+  std::call_once(holder->built, [this, holder]() {
+      // Cover the distorted image, in the DISTORTED_C frame, with a margin
+      Eigen::Vector2d margin(32.0, 32.0);
+      holder->grid.Build(-distorted_half_size_ - margin, distorted_half_size_ + margin,
+                         undist_grid_error_,
+                         [this](Eigen::Vector2d const& distorted_c,
+                                Eigen::Vector2d* undistorted_c) {
+                           UndistortCenteredExact(distorted_c, undistorted_c);
+                         });
+      if (!holder->grid.IsValid())
+        LOG(WARNING) << "Could not build an undistortion grid with an error of at most "
+                     << undist_grid_error_ << " pixels. Will undistort exactly.\n";
+    });
+
+  if (!holder->grid.IsValid())
+    return NULL;
+  return &holder->grid;
 }
 
 const Eigen::VectorXd& camera::CameraParameters::GetDistortion() const {
@@ -263,94 +311,186 @@ void camera::CameraParameters::DistortCentered(Eigen::Vector2d const& undistorte
   // undistorted_len_x/2.0 and undistorted_len_y/2.0 subtracted from
   // them. The outputs will have distorted_len_x/2.0 and
   // distorted_len_y/2.0 subtracted from them.
-  if (distortion_coeffs_.size() == 0) {
-    // There is no distortion
-    *distorted_c = undistorted_c + optical_offset_ - distorted_half_size_;
-  } else if (distortion_coeffs_.size() == 1) {
-    // This is the FOV model
-    Eigen::Vector2d norm = undistorted_c.cwiseQuotient(focal_length_);
-    double ru = norm.norm();
-    double rd = atan(ru * distortion_precalc2_) * distortion_precalc1_;
-    double conv;
-    if (ru > 1e-5) {
-      conv = rd / ru;
-    } else {
-      conv = 1;
-    }
-    *distorted_c = (optical_offset_ - distorted_half_size_) +
-      conv * norm.cwiseProduct(focal_length_);
-  } else if (distortion_coeffs_.size() == 4 ||
-             distortion_coeffs_.size() == 5) {
-    // Tsai lens distortion
-    double k1 = distortion_coeffs_[0];
-    double k2 = distortion_coeffs_[1];
-    double p1 = distortion_coeffs_[2];
-    double p2 = distortion_coeffs_[3];
-    double k3 = 0;
-    if (distortion_coeffs_.size() == 5)
-      k3 = distortion_coeffs_[4];
-
-    // To relative coordinates
-    Eigen::Vector2d norm = undistorted_c.cwiseQuotient(focal_length_);
-    double r2 = norm.squaredNorm();
-
-    // Radial distortion
-    double radial_dist = 1 + k1 * r2 + k2 * r2 * r2 + k3 * r2 * r2 * r2;
-    *distorted_c = radial_dist * norm;
-
-    // Tangential distortion
-    *distorted_c +=
-      Eigen::Vector2d(2 * p1 * norm[0] * norm[1] + p2 * (r2 + 2 * norm[0] * norm[0]),
-                      p1 * (r2 + 2 * norm[1] * norm[1]) + 2 * p2 * norm[0] * norm[1]);
-
-    // Back to absolute coordinates.
-    *distorted_c = distorted_c->cwiseProduct(focal_length_) +
-      (optical_offset_ - distorted_half_size_);
-  } else {
+  DistortionType dist_type = distortionType(distortion_coeffs_.size());
+  if (dist_type == RPC_DISTORTION) {
     // If we got so far, we validated that RPC distortion should work
     *distorted_c = m_rpc.distort_centered(undistorted_c);
-    //LOG(ERROR) << "Unknown distortion vector size.";
+    return;
   }
+
+  Eigen::Vector2d dist_pix;
+  switch (dist_type) {
+  case NO_DISTORTION:
+    NoDistortion::Distort(focal_length_.data(), distortion_coeffs_.data(),
+                          undistorted_c.data(), dist_pix.data());
+    break;
+  case FOV_DISTORTION:
+    FovDistortion::Distort(focal_length_.data(), distortion_coeffs_.data(),
+                           undistorted_c.data(), dist_pix.data());
+    break;
+  case TSAI4_DISTORTION:
+    Tsai4Distortion::Distort(focal_length_.data(), distortion_coeffs_.data(),
+                             undistorted_c.data(), dist_pix.data());
+    break;
+  default:
+    Tsai5Distortion::Distort(focal_length_.data(), distortion_coeffs_.data(),
+                             undistorted_c.data(), dist_pix.data());
+    break;
+  }
+
+  // The distortion models work relative to the optical center
+  *distorted_c = dist_pix + (optical_offset_ - distorted_half_size_);
 }
 
 void camera::CameraParameters::UndistortCentered(Eigen::Vector2d const& distorted_c,
                                                  Eigen::Vector2d *undistorted_c) const {
+  // Use the lookup grid only when undistortion is expensive
+  DistortionType dist_type = distortionType(distortion_coeffs_.size());
+  if (dist_type == TSAI4_DISTORTION || dist_type == TSAI5_DISTORTION ||
+      dist_type == RPC_DISTORTION) {
+    UndistortionGrid const* grid = GetUndistortionGrid();
+    if (grid != NULL && grid->Undistort(distorted_c, undistorted_c))
+      return;
+  }
+
+  UndistortCenteredExact(distorted_c, undistorted_c);
+}
+
+void camera::CameraParameters::UndistortCenteredExact(Eigen::Vector2d const& distorted_c,
+                                                      Eigen::Vector2d *undistorted_c) const {
   // We assume that input x and y are pixel values that have
   // distorted_len_x and distorted_len_y subtracted from them. The
   // outputs will have undistorted_len_x and undistorted_len_y
   // subtracted from them.
-  if (distortion_coeffs_.size() == 0) {
-    // No lens distortion
-    *undistorted_c = distorted_c - (optical_offset_ - distorted_half_size_);
-  } else if (distortion_coeffs_.size() == 1) {
-    // FOV lens distortion
-    Eigen::Vector2d norm =
-      (distorted_c - (optical_offset_ - distorted_half_size_)).cwiseQuotient(focal_length_);
-    double rd = norm.norm();
-    double ru = tan(rd * distortion_coeffs_[0]) / distortion_precalc2_;
-    double conv = 1.0;
-    if (rd > 1e-5)
-      conv = ru / rd;
-    *undistorted_c = conv * norm.cwiseProduct(focal_length_);
-  } else if (distortion_coeffs_.size() == 4 ||
-             distortion_coeffs_.size() == 5) {
-    // Tsai lens distortion
-    cv::Mat src(1, 1, CV_64FC2);
-    cv::Mat dst(1, 1, CV_64FC2);
-    Eigen::Map<Eigen::Vector2d> src_map(src.ptr<double>()), dst_map(dst.ptr<double>());
-    cv::Mat dist_int_mat(3, 3, cv::DataType<double>::type),
-      undist_int_mat(3, 3, cv::DataType<double>::type);
-    cv::Mat cvdist;
-    cv::eigen2cv(distortion_coeffs_, cvdist);
-    cv::eigen2cv(GetIntrinsicMatrix<DISTORTED>(), dist_int_mat);
-    cv::eigen2cv(GetIntrinsicMatrix<UNDISTORTED>(), undist_int_mat);
-    src_map = distorted_c + distorted_half_size_;
-    cv::undistortPoints(src, dst, dist_int_mat, cvdist, cv::Mat(), undist_int_mat);
-    *undistorted_c = dst_map - undistorted_half_size_;
-  } else {
+  DistortionType dist_type = distortionType(distortion_coeffs_.size());
+  switch (dist_type) {
+  case NO_DISTORTION:
+    UndistortPixelsForModel<NoDistortion>(&distorted_c, 1, undistorted_c);
+    break;
+  case FOV_DISTORTION:
+    UndistortPixelsForModel<FovDistortion>(&distorted_c, 1, undistorted_c);
+    break;
+  case TSAI4_DISTORTION:
+    UndistortPixelsForModel<Tsai4Distortion>(&distorted_c, 1, undistorted_c);
+    break;
+  case TSAI5_DISTORTION:
+    UndistortPixelsForModel<Tsai5Distortion>(&distorted_c, 1, undistorted_c);
+    break;
+  default:
     // If we got so far, we validated that RPC distortion should work
     *undistorted_c = m_rpc.undistort_centered(distorted_c);
-    //LOG(ERROR) << "Unknown distortion vector size.";
+    break;
+  }
+}
+
+// Convert from DISTORTED_C to UNDISTORTED_C with a given distortion
+// model, which must agree with the distortion coefficients.
+template <class DistModel>
+void camera::CameraParameters::UndistortPixelsForModel(Eigen::Vector2d const* distorted_c,
+                                                       size_t num_pixels,
+                                                       Eigen::Vector2d* undistorted_c) const {
+  Eigen::Vector2d shift = optical_offset_ - distorted_half_size_;
+  const double* focal_length = focal_length_.data();
+  const double* distortion = distortion_coeffs_.data();
+  for (size_t it = 0; it < num_pixels; it++) {
+    Eigen::Vector2d dist_pix = distorted_c[it] - shift;
+    DistModel::Undistort(focal_length, distortion, dist_pix.data(), undistorted_c[it].data());
+  }
+}
+
+void camera::CameraParameters::UndistortPixels(std::vector<Eigen::Vector2d> const& distorted,
+                                               std::vector<Eigen::Vector2d>* undistorted_c)
+  const {
+  size_t num_pixels = distorted.size();
+  undistorted_c->resize(num_pixels);
+  if (num_pixels == 0)
+    return;
+
+  // Switch from the DISTORTED to the DISTORTED_C frame
+  std::vector<Eigen::Vector2d> distorted_c(num_pixels);
+  for (size_t it = 0; it < num_pixels; it++)
+    distorted_c[it] = distorted[it] - distorted_half_size_;
+
+  const Eigen::Vector2d* in = &distorted_c[0];
+  Eigen::Vector2d* out = &(*undistorted_c)[0];
+  DistortionType dist_type = distortionType(distortion_coeffs_.size());
+
+  // See UndistortCentered() for when the lookup grid is used
+  UndistortionGrid const* grid = NULL;
+  if (dist_type == TSAI4_DISTORTION || dist_type == TSAI5_DISTORTION ||
+      dist_type == RPC_DISTORTION)
+    grid = GetUndistortionGrid();
+  if (grid != NULL) {
+    for (size_t it = 0; it < num_pixels; it++) {
+      if (!grid->Undistort(in[it], &out[it]))
+        UndistortCenteredExact(in[it], &out[it]);
+    }
+    return;
+  }
+
+  switch (dist_type) {
+  case NO_DISTORTION:
+    UndistortPixelsForModel<NoDistortion>(in, num_pixels, out);
+    break;
+  case FOV_DISTORTION:
+    UndistortPixelsForModel<FovDistortion>(in, num_pixels, out);
+    break;
+  case TSAI4_DISTORTION:
+    UndistortPixelsForModel<Tsai4Distortion>(in, num_pixels, out);
+    break;
+  case TSAI5_DISTORTION:
+    UndistortPixelsForModel<Tsai5Distortion>(in, num_pixels, out);
+    break;
+  default:
+    for (size_t it = 0; it < num_pixels; it++)
+      out[it] = m_rpc.undistort_centered(in[it]);
+    break;
+  }
+}
+
+template <class DistModel>
+void camera::CameraParameters::DistortPixelsForModel
+(Eigen::Matrix<double, Eigen::Dynamic, 2> const& undistorted_c,
+ Eigen::Matrix<double, Eigen::Dynamic, 2>* distorted) const {
+  // The distortion models work relative to the optical center, while
+  // DISTORTED has the origin at the image corner.
+  const double* focal_length = focal_length_.data();
+  const double* distortion = distortion_coeffs_.data();
+  Eigen::Index num_pixels = undistorted_c.rows();
+  for (Eigen::Index it = 0; it < num_pixels; it++) {
+    double undist_pix[2] = {undistorted_c(it, 0), undistorted_c(it, 1)};
+    double dist_pix[2];
+    DistModel::Distort(focal_length, distortion, undist_pix, dist_pix);
+    (*distorted)(it, 0) = dist_pix[0] + optical_offset_[0];
+    (*distorted)(it, 1) = dist_pix[1] + optical_offset_[1];
+  }
+}
+
+void camera::CameraParameters::DistortPixels
+(Eigen::Matrix<double, Eigen::Dynamic, 2> const& undistorted_c,
+ Eigen::Matrix<double, Eigen::Dynamic, 2>* distorted) const {
+  distorted->resize(undistorted_c.rows(), 2);
+
+  switch (distortionType(distortion_coeffs_.size())) {
+  case NO_DISTORTION:
+    DistortPixelsForModel<NoDistortion>(undistorted_c, distorted);
+    break;
+  case FOV_DISTORTION:
+    DistortPixelsForModel<FovDistortion>(undistorted_c, distorted);
+    break;
+  case TSAI4_DISTORTION:
+    DistortPixelsForModel<Tsai4Distortion>(undistorted_c, distorted);
+    break;
+  case TSAI5_DISTORTION:
+    DistortPixelsForModel<Tsai5Distortion>(undistorted_c, distorted);
+    break;
+  default:
+    for (Eigen::Index it = 0; it < undistorted_c.rows(); it++) {
+      Eigen::Vector2d dist_pix;
+      Convert<UNDISTORTED_C, DISTORTED>(undistorted_c.row(it).transpose(), &dist_pix);
+      distorted->row(it) = dist_pix.transpose();
+    }
+    break;
   }
 }
 
@@ -20,9 +20,12 @@
 #define RIG_CALIBRATOR_CAMERA_PARAMS_H
 
 #include <camera_model/rpc_distortion.h>
+#include <camera_model/undistortion_grid.h>
 
 #include <Eigen/Core>
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -131,6 +134,26 @@ namespace camera {
     // of distortion_coeffs_ is up-to-date, and its undistortion component
     // must be updated.
     void updateRpcUndistortion(int num_threads);
+
+    // Convert many pixels from the DISTORTED to the UNDISTORTED_C
+    // frame. This is the same as calling Convert() for each, but the
+    // distortion model is looked up only once.
+    void UndistortPixels(std::vector<Eigen::Vector2d> const& distorted,
+                         std::vector<Eigen::Vector2d>* undistorted_c) const;
+
+    // Convert many pixels from the UNDISTORTED_C to the DISTORTED
+    // frame. The pixels are stored one per row.
+    void DistortPixels(Eigen::Matrix<double, Eigen::Dynamic, 2> const& undistorted_c,
+                       Eigen::Matrix<double, Eigen::Dynamic, 2>* distorted) const;
+
+    // Undistort pixels by interpolating in a lookup grid rather than
+    // exactly, with an interpolation error of at most the given value,
+    // in pixels. A non-positive value disables this, which is the
+    // default. The grid is built when first needed, and is rebuilt
+    // when the intrinsics change. It is used only with the Tsai and
+    // RPC distortion models, as the others are fast already.
+    void SetUndistortionGridError(double max_error);
+    double GetUndistortionGridError() const;
     
     // Comparison operator
     friend bool operator== (CameraParameters const& A, CameraParameters const& B) {
@@ -154,6 +177,28 @@ namespace camera {
     // Converts DISTORTED_C to UNDISTORTED_C
     void UndistortCentered(Eigen::Vector2d const& distorted_c,
                            Eigen::Vector2d* undistorted_c) const;
+    // Converts DISTORTED_C to UNDISTORTED_C for many pixels, with a
+    // distortion model from distortion_models.h
+    template <class DistModel>
+    void UndistortPixelsForModel(Eigen::Vector2d const* distorted_c, size_t num_pixels,
+                                 Eigen::Vector2d* undistorted_c) const;
+    // Converts UNDISTORTED_C to DISTORTED for many pixels, with a
+    // distortion model from distortion_models.h
+    template <class DistModel>
+    void DistortPixelsForModel(Eigen::Matrix<double, Eigen::Dynamic, 2> const& undistorted_c,
+                               Eigen::Matrix<double, Eigen::Dynamic, 2>* distorted) const;
+
+    // Undistort exactly, without using the lookup grid
+    void UndistortCenteredExact(Eigen::Vector2d const& distorted_c,
+                                Eigen::Vector2d* undistorted_c) const;
+
+    // The lookup grid for undistortion, built on first use. Return
+    // NULL if it is not enabled, or the desired accuracy could not
+    // be achieved.
+    UndistortionGrid const* GetUndistortionGrid() const;
+
+    // Must be called when anything affecting undistortion changes
+    void ResetUndistortionGrid();
 
     // Members
     Eigen::Vector2i
@@ -179,6 +224,15 @@ namespace camera {
     // or 5 = TSAI/OpenCV model.
     Eigen::VectorXd distortion_coeffs_;
     double distortion_precalc1_, distortion_precalc2_, distortion_precalc3_;
+
+    // The lookup grid for undistortion. It is shared among copies of
+    // this object, until the intrinsics of a copy change.
+    struct UndistortionGridHolder {
+      std::once_flag built;
+      UndistortionGrid grid;
+    };
+    double undist_grid_error_ = 0.0;
+    std::shared_ptr<UndistortionGridHolder> undist_grid_;
   };
 
 #define DECLARE_CONVERSION(TYPEA, TYPEB) \
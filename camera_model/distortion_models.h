@@ -0,0 +1,192 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef RIG_CALIBRATOR_DISTORTION_MODELS_H
+#define RIG_CALIBRATOR_DISTORTION_MODELS_H
+
+#include <cmath>
+
+// The lens distortion models supported by CameraParameters, each as
+// its own type, so that code which works with many pixels can pick
+// the model once and then have no branching per pixel. Distort() is
+// templated to work with ceres::Jet, for automatic differentiation.
+//
+// The inputs and outputs of Distort() and Undistort() are pixels
+// relative to the optical center. The focal length has two values,
+// in x and y. RPC distortion does not have such a model, and must
+// be handled via CameraParameters::Convert().
+namespace camera {
+
+  // The distortion models, in terms of the number of distortion
+  // coefficients, as used by CameraParameters::SetDistortion().
+  enum DistortionType {
+    NO_DISTORTION,
+    FOV_DISTORTION,
+    TSAI4_DISTORTION,
+    TSAI5_DISTORTION,
+    RPC_DISTORTION
+  };
+
+  inline DistortionType distortionType(int num_distortion_coeffs) {
+    switch (num_distortion_coeffs) {
+    case 0:
+      return NO_DISTORTION;
+    case 1:
+      return FOV_DISTORTION;
+    case 4:
+      return TSAI4_DISTORTION;
+    case 5:
+      return TSAI5_DISTORTION;
+    default:
+      return RPC_DISTORTION;
+    }
+  }
+
+  struct NoDistortion {
+    static const int kNumParams = 0;
+
+    template <typename T>
+    static void Distort(const T* focal_length, const T* distortion,
+                        const T* undist_pix, T* dist_pix) {
+      dist_pix[0] = undist_pix[0];
+      dist_pix[1] = undist_pix[1];
+    }
+
+    static void Undistort(const double* focal_length, const double* distortion,
+                          const double* dist_pix, double* undist_pix) {
+      undist_pix[0] = dist_pix[0];
+      undist_pix[1] = dist_pix[1];
+    }
+  };
+
+  // The FOV model. The only coefficient is the field of view.
+  struct FovDistortion {
+    static const int kNumParams = 1;
+
+    template <typename T>
+    static void Distort(const T* focal_length, const T* distortion,
+                        const T* undist_pix, T* dist_pix) {
+      using std::atan;
+      using std::sqrt;
+      using std::tan;
+
+      T x = undist_pix[0] / focal_length[0];
+      T y = undist_pix[1] / focal_length[1];
+      T r2 = x * x + y * y;
+      T conv(1.0);
+      if (r2 > T(1e-10)) {
+        T ru = sqrt(r2);
+        T rd = atan(ru * T(2.0) * tan(distortion[0] / T(2.0))) / distortion[0];
+        conv = rd / ru;
+      }
+      dist_pix[0] = conv * undist_pix[0];
+      dist_pix[1] = conv * undist_pix[1];
+    }
+
+    static void Undistort(const double* focal_length, const double* distortion,
+                          const double* dist_pix, double* undist_pix) {
+      double x = dist_pix[0] / focal_length[0];
+      double y = dist_pix[1] / focal_length[1];
+      double rd = std::sqrt(x * x + y * y);
+      double conv = 1.0;
+      if (rd > 1e-5) {
+        double ru = std::tan(rd * distortion[0]) / (2.0 * std::tan(distortion[0] / 2.0));
+        conv = ru / rd;
+      }
+      undist_pix[0] = conv * dist_pix[0];
+      undist_pix[1] = conv * dist_pix[1];
+    }
+  };
+
+  // The Tsai (OpenCV radial-tangential) model, with coefficients
+  // k1, k2, p1, p2, and optionally k3.
+  template <int NumParams>
+  struct TsaiDistortion {
+    static_assert(NumParams == 4 || NumParams == 5,
+                  "The Tsai model has 4 or 5 distortion coefficients.");
+    static const int kNumParams = NumParams;
+
+    // Distort a point in normalized coordinates
+    template <typename T>
+    static void DistortNormalized(const T* distortion, T const& x, T const& y,
+                                  T* xd, T* yd) {
+      T k1 = distortion[0];
+      T k2 = distortion[1];
+      T p1 = distortion[2];
+      T p2 = distortion[3];
+      T k3(0.0);
+      if (NumParams == 5)
+        k3 = distortion[4];
+
+      T r2 = x * x + y * y;
+      T radial_dist = T(1.0) + k1 * r2 + k2 * r2 * r2 + k3 * r2 * r2 * r2;
+      *xd = radial_dist * x + T(2.0) * p1 * x * y + p2 * (r2 + T(2.0) * x * x);
+      *yd = radial_dist * y + p1 * (r2 + T(2.0) * y * y) + T(2.0) * p2 * x * y;
+    }
+
+    template <typename T>
+    static void Distort(const T* focal_length, const T* distortion,
+                        const T* undist_pix, T* dist_pix) {
+      T xd, yd;
+      DistortNormalized(distortion, undist_pix[0] / focal_length[0],
+                        undist_pix[1] / focal_length[1], &xd, &yd);
+      dist_pix[0] = xd * focal_length[0];
+      dist_pix[1] = yd * focal_length[1];
+    }
+
+    // The fixed-point iteration used by cv::undistortPoints(), with
+    // the same number of iterations, so the results agree with it.
+    static void Undistort(const double* focal_length, const double* distortion,
+                          const double* dist_pix, double* undist_pix) {
+      double k1 = distortion[0];
+      double k2 = distortion[1];
+      double p1 = distortion[2];
+      double p2 = distortion[3];
+      double k3 = 0.0;
+      if (NumParams == 5)
+        k3 = distortion[4];
+
+      double x0 = dist_pix[0] / focal_length[0];
+      double y0 = dist_pix[1] / focal_length[1];
+      double x = x0, y = y0;
+      for (int it = 0; it < 5; it++) {
+        double r2 = x * x + y * y;
+        double icdist = 1.0 / (1.0 + ((k3 * r2 + k2) * r2 + k1) * r2);
+        if (icdist < 0) {
+          x = x0;
+          y = y0;
+          break;
+        }
+        double delta_x = 2.0 * p1 * x * y + p2 * (r2 + 2.0 * x * x);
+        double delta_y = p1 * (r2 + 2.0 * y * y) + 2.0 * p2 * x * y;
+        x = (x0 - delta_x) * icdist;
+        y = (y0 - delta_y) * icdist;
+      }
+
+      undist_pix[0] = x * focal_length[0];
+      undist_pix[1] = y * focal_length[1];
+    }
+  };
+
+  typedef TsaiDistortion<4> Tsai4Distortion;
+  typedef TsaiDistortion<5> Tsai5Distortion;
+
+}  // namespace camera
+
+#endif  // RIG_CALIBRATOR_DISTORTION_MODELS_H
@@ -25,7 +25,6 @@
 #include <ceres/solver.h>
 #include <ceres/cost_function.h>
 #include <ceres/loss_function.h>
-#include <ceres/dynamic_numeric_diff_cost_function.h>
 #include <ceres/numeric_diff_cost_function.h>
 #include <ceres/autodiff_cost_function.h>
 
@@ -33,6 +32,7 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
@@ -111,12 +111,17 @@ void set_subvector(Eigen::VectorXd & vec, int start, int len, Eigen::VectorXd co
   for (int it = 0; it < len; it++) vec[start + it] = subvec[it];
 }
 
-// Compute the RPC model with given coefficients at the given point.
-// Recall that RPC is ratio of two polynomials in x and y.
-Eigen::Vector2d compute_rpc(Eigen::Vector2d const& p, Eigen::VectorXd const& coeffs)  {
-  validate_distortion_params(coeffs.size());
+// The number of monomials x^(deg-i) * y^i with 0 <= i <= deg <= rpc_deg.
+// This is the length of each numerator. Each denominator has one less
+// coefficient, as its constant term is always 1.
+int num_monomials(int rpc_deg) {
+  return (rpc_deg + 1) * (rpc_deg + 2) / 2;
+}
 
-  int rpc_deg = rpc_degree(coeffs.size());
+// Evaluate the monomials at the given point, in increasing order of
+// degree, and for each degree in increasing power of y. That is the
+// order of the RPC coefficients.
+void rpc_monomials(Eigen::Vector2d const& p, int rpc_deg, double* monomials) {
   double x = p[0];
   double y = p[1];
 
@@ -130,31 +135,49 @@ Eigen::Vector2d compute_rpc(Eigen::Vector2d const& p, Eigen::VectorXd const& coe
     valy *= y;
   }
 
-  // Evaluate the RPC expression. The denominator always has a 1 as
-  // the 0th coefficient.
-  int coeff_index = 0;
-
-  // Loop four times, for output first coordinate numerator and
-  // denominator, then for output second coordinate numerator and
-  // denominator.
+  int index = 0;
+  for (int deg = 0; deg <= rpc_deg; deg++) {
+    for (int i = 0; i <= deg; i++) {
+      monomials[index] = powx[deg - i] * powy[i];
+      index++;
+    }
+  }
+}
 
-  double vals[] = {0.0, 1.0, 0.0, 1.0};
+// Given the monomials at a point, evaluate the numerator and
+// denominator for the first output coordinate, and then for the
+// second one. The coefficients are as in pack_params().
+void eval_rpc(double const* monomials, int num_len, double const* coeffs, double* vals) {
+  int den_len = num_len - 1;
+  double const* num_x = coeffs;
+  double const* den_x = num_x + num_len;
+  double const* num_y = den_x + den_len;
+  double const* den_y = num_y + num_len;
+
+  // The denominator always has a 1 as the 0th coefficient
+  vals[0] = 0.0; vals[1] = 1.0; vals[2] = 0.0; vals[3] = 1.0;
+  for (int k = 0; k < num_len; k++) {
+    vals[0] += num_x[k] * monomials[k];
+    vals[2] += num_y[k] * monomials[k];
+  }
+  for (int k = 0; k < den_len; k++) {
+    vals[1] += den_x[k] * monomials[k + 1];
+    vals[3] += den_y[k] * monomials[k + 1];
+  }
+}
 
-  for (int count = 0; count < 4; count++) {
-    int start = 0;                            // starting degree for numerator
-    if (count == 1 || count == 3) start = 1;  // starting degree for denominator
+// Compute the RPC model with given coefficients at the given point.
+// Recall that RPC is ratio of two polynomials in x and y.
+Eigen::Vector2d compute_rpc(Eigen::Vector2d const& p, Eigen::VectorXd const& coeffs)  {
+  validate_distortion_params(coeffs.size());
 
-    for (int deg = start; deg <= rpc_deg; deg++) {
-      for (int i = 0; i <= deg; i++) {
-        // Add coeff * x^(deg-i) * y^i
-        vals[count] += coeffs[coeff_index] * powx[deg - i] * powy[i];
-        coeff_index++;
-      }
-    }
-  }
+  int rpc_deg = rpc_degree(coeffs.size());
+  int num_len = num_monomials(rpc_deg);
+  std::vector<double> monomials(num_len);
+  rpc_monomials(p, rpc_deg, &monomials[0]);
 
-  if (coeff_index != static_cast<int>(coeffs.size()))
-    throw "Book-keeping failure in RPCLensDistortion.";
+  double vals[4];
+  eval_rpc(&monomials[0], num_len, coeffs.data(), vals);
 
   return Eigen::Vector2d(vals[0]/vals[1], vals[2]/vals[3]);
 }
@@ -366,53 +389,82 @@ Eigen::Vector2d RPCLensDistortion::undistort_centered(Eigen::Vector2d const& p)
 }
 
 // An error function minimizing the fit of an RPC model, that is,
-// minimizing norm of dist_pix - RPC_model(undist_pix).
-struct RpcFitError {
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-  RpcFitError(Eigen::Vector2d const& undist_pix, Eigen::Vector2d const& dist_pix,
-              std::vector<int> const& block_sizes):
-    m_undist_pix(undist_pix), m_dist_pix(dist_pix), m_block_sizes(block_sizes) {
-    // Sanity check
-    if (block_sizes.size() != 1)
-      throw "RpcFitError: The block sizes were not set up properly.\n";
-    validate_distortion_params(block_sizes[0]);
-  }
-
-  // Call to work with ceres::DynamicNumericDiffCostFunction.
-  bool operator()(double const* const* parameters, double* residuals) const {
-    int num_coeffs = m_block_sizes[0];
-    Eigen::VectorXd coeffs(num_coeffs);
-    for (int it = 0; it < num_coeffs; it++) coeffs[it] = parameters[0][it];
+// minimizing norm of dist_pix - RPC_model(undist_pix), for a batch of
+// pixels. The monomials at each pixel are computed once, and the
+// Jacobian is analytic, which is much faster than numerical
+// differentiation. The solver evaluates the batches in parallel.
+class RpcFitBatchError: public ceres::CostFunction {
+ public:
+  // Use the pixels with indices in [beg, end)
+  RpcFitBatchError(std::vector<Eigen::Vector2d> const& undist_pixels,
+                   std::vector<Eigen::Vector2d> const& dist_pixels,
+                   size_t beg, size_t end, int num_coeffs):
+    m_num_coeffs(num_coeffs) {
+    validate_distortion_params(num_coeffs);
+    int rpc_deg = rpc_degree(num_coeffs);
+    m_num_len = num_monomials(rpc_deg);
+
+    int num = end - beg;
+    m_monomials.resize(num * m_num_len);
+    m_dist_pix.resize(PIXEL_SIZE * num);
+    for (int it = 0; it < num; it++) {
+      rpc_monomials(undist_pixels[beg + it], rpc_deg, &m_monomials[it * m_num_len]);
+      for (int coord = 0; coord < PIXEL_SIZE; coord++)
+        m_dist_pix[PIXEL_SIZE * it + coord] = dist_pixels[beg + it][coord];
+    }
 
-    // distort
-    Eigen::Vector2d rpc_dist = compute_rpc(m_undist_pix, coeffs);
+    set_num_residuals(PIXEL_SIZE * num);
+    mutable_parameter_block_sizes()->push_back(num_coeffs);
+  }
 
-    for (int it = 0; it < PIXEL_SIZE; it++) residuals[it] = rpc_dist[it] - m_dist_pix[it];
+  bool Evaluate(double const* const* parameters, double* residuals,
+                double** jacobians) const override {
+    double const* coeffs = parameters[0];
+    int num = m_dist_pix.size() / PIXEL_SIZE;
+    int den_len = m_num_len - 1;
+    bool need_jacobian = (jacobians != NULL && jacobians[0] != NULL);
 
-    return true;
-  }
+    for (int it = 0; it < num; it++) {
+      double const* monomials = &m_monomials[it * m_num_len];
+      double vals[4];
+      eval_rpc(monomials, m_num_len, coeffs, vals);
 
-  // Factory to hide the construction of the CostFunction object from the client code.
-  // TODO(oalexan1): Use analytical diff cost function
-  static ceres::CostFunction*
-  Create(Eigen::Vector2d const& undist_pix, Eigen::Vector2d const& dist_pix,
-         std::vector<int> const& block_sizes) {
-    ceres::DynamicNumericDiffCostFunction<RpcFitError>* cost_function =
-      new ceres::DynamicNumericDiffCostFunction<RpcFitError>
-      (new RpcFitError(undist_pix, dist_pix, block_sizes));
+      residuals[PIXEL_SIZE * it + 0] = vals[0] / vals[1] - m_dist_pix[PIXEL_SIZE * it + 0];
+      residuals[PIXEL_SIZE * it + 1] = vals[2] / vals[3] - m_dist_pix[PIXEL_SIZE * it + 1];
 
-    cost_function->SetNumResiduals(PIXEL_SIZE);
+      if (!need_jacobian)
+        continue;
 
-    for (size_t i = 0; i < block_sizes.size(); i++)
-      cost_function->AddParameterBlock(block_sizes[i]);
+      // The rows for this pixel. Each output coordinate depends only
+      // on its numerator and denominator, with the derivative of N/D
+      // being m_k / D for numerator terms and -N * m_k / D^2 for
+      // denominator terms.
+      double* jac_x = jacobians[0] + (PIXEL_SIZE * it + 0) * m_num_coeffs;
+      double* jac_y = jacobians[0] + (PIXEL_SIZE * it + 1) * m_num_coeffs;
+      std::fill(jac_x, jac_x + m_num_coeffs, 0.0);
+      std::fill(jac_y, jac_y + m_num_coeffs, 0.0);
+      double inv_den_x = 1.0 / vals[1], inv_den_y = 1.0 / vals[3];
+      double ratio_x = vals[0] * inv_den_x * inv_den_x;
+      double ratio_y = vals[2] * inv_den_y * inv_den_y;
+      int num_y_start = m_num_len + den_len, den_y_start = 2 * m_num_len + den_len;
+      for (int k = 0; k < m_num_len; k++) {
+        jac_x[k] = monomials[k] * inv_den_x;
+        jac_y[num_y_start + k] = monomials[k] * inv_den_y;
+      }
+      for (int k = 0; k < den_len; k++) {
+        jac_x[m_num_len + k] = -ratio_x * monomials[k + 1];
+        jac_y[den_y_start + k] = -ratio_y * monomials[k + 1];
+      }
+    }
 
-    return cost_function;
+    return true;
   }
 
  private:
-  Eigen::Vector2d m_undist_pix, m_dist_pix;
-  std::vector<int> m_block_sizes;
-};  // End class RpcFitError
+  int m_num_coeffs, m_num_len;
+  std::vector<double> m_monomials;  // m_num_len values for each pixel
+  std::vector<double> m_dist_pix;
+};  // End class RpcFitBatchError
 
 // TODO(oalexan1): Move this to utils and factor out of camera_refiner.cc as well.
 // Calculate the rmse residual for each residual type.
@@ -560,22 +612,24 @@ void fitCurrDegRPC(std::vector<Eigen::Vector2d> const& undist_centered_pixels,
                    std::vector<Eigen::Vector2d> const& dist_centered_pixels,
                    int num_opt_threads, int num_iterations, double parameter_tolerance,
                    bool verbose, Eigen::VectorXd & rpc_coeffs) {
-  std::vector<int> block_sizes;
-  block_sizes.push_back(rpc_coeffs.size());
-
-  // Form the problem
+  // Form the problem. Many pixels go into each residual block, so
+  // there are fewer blocks to set up and evaluate.
+  size_t batch_size = 256;
   ceres::Problem problem;
   std::vector<std::string> residual_names;
-  for (size_t it = 0; it < undist_centered_pixels.size(); it++) {
+  for (size_t beg = 0; beg < undist_centered_pixels.size(); beg += batch_size) {
+    size_t end = std::min(beg + batch_size, undist_centered_pixels.size());
     ceres::CostFunction* rpc_cost_fun =
-      RpcFitError::Create(undist_centered_pixels[it], dist_centered_pixels[it],
-                          block_sizes);
+      new RpcFitBatchError(undist_centered_pixels, dist_centered_pixels, beg, end,
+                           rpc_coeffs.size());
     // Note that we do not use a robust threshold, so we want the RPC
     // to work on the entire domain.
     ceres::LossFunction* rpc_loss_fun = NULL;
 
-    residual_names.push_back("pix_x");
-    residual_names.push_back("pix_y");
+    for (size_t it = beg; it < end; it++) {
+      residual_names.push_back("pix_x");
+      residual_names.push_back("pix_y");
+    }
     problem.AddResidualBlock(rpc_cost_fun, rpc_loss_fun, &rpc_coeffs[0]);
   }
 
@@ -591,10 +645,11 @@ void fitCurrDegRPC(std::vector<Eigen::Vector2d> const& undist_centered_pixels,
   std::vector<double> residuals;
   evalResiduals("before opt", residual_names, problem, residuals);
 
-  // Solve the problem
+  // Solve the problem. There is only one parameter block, with at most
+  // a few hundred values, so the normal equations are small and dense.
   ceres::Solver::Options options;
   ceres::Solver::Summary summary;
-  options.linear_solver_type = ceres::ITERATIVE_SCHUR;
+  options.linear_solver_type = ceres::DENSE_NORMAL_CHOLESKY;
   options.num_threads = num_opt_threads;  // The result is more predictable with one thread
   options.max_num_iterations = num_iterations;
   options.minimizer_progress_to_stdout = true;
@@ -0,0 +1,82 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <camera_model/undistortion_grid.h>
+
+#include <cmath>
+
+namespace camera {
+
+UndistortionGrid::UndistortionGrid(): m_valid(false), m_min_corner(0, 0), m_spacing(0),
+                                      m_max_error(0), m_num_cols(0), m_num_rows(0) {}
+
+void UndistortionGrid::Build(Eigen::Vector2d const& min_corner,
+                             Eigen::Vector2d const& max_corner,
+                             double max_error,
+                             std::function<void(Eigen::Vector2d const&, Eigen::Vector2d*)>
+                             const& undistort,
+                             double init_spacing, double min_spacing) {
+  m_valid = false;
+  m_min_corner = min_corner;
+  m_values.clear();
+
+  Eigen::Vector2d extent = max_corner - min_corner;
+  if (!(extent[0] > 0 && extent[1] > 0) || max_error <= 0)
+    return;
+
+  for (m_spacing = init_spacing; m_spacing >= min_spacing; m_spacing /= 2.0) {
+    // The grid must cover the whole box
+    m_num_cols = static_cast<int>(std::ceil(extent[0] / m_spacing)) + 1;
+    m_num_rows = static_cast<int>(std::ceil(extent[1] / m_spacing)) + 1;
+    m_values.resize(static_cast<size_t>(m_num_cols) * m_num_rows);
+    for (int row = 0; row < m_num_rows; row++) {
+      for (int col = 0; col < m_num_cols; col++) {
+        Eigen::Vector2d pix = min_corner + m_spacing * Eigen::Vector2d(col, row);
+        undistort(pix, &m_values[row * m_num_cols + col]);
+      }
+    }
+
+    // Find the interpolation error where it is expected to be largest,
+    // at the centers of cells and of their edges.
+    m_valid = true;
+    m_max_error = 0.0;
+    Eigen::Vector2d offsets[3] = {Eigen::Vector2d(0.5, 0.5), Eigen::Vector2d(0.5, 0.0),
+                                  Eigen::Vector2d(0.0, 0.5)};
+    for (int row = 0; row + 1 < m_num_rows && m_max_error <= max_error; row++) {
+      for (int col = 0; col + 1 < m_num_cols; col++) {
+        for (int it = 0; it < 3; it++) {
+          Eigen::Vector2d pix = min_corner + m_spacing * (Eigen::Vector2d(col, row) + offsets[it]);
+          Eigen::Vector2d exact, interp;
+          undistort(pix, &exact);
+          Undistort(pix, &interp);
+          m_max_error = std::max(m_max_error, (exact - interp).norm());
+        }
+      }
+    }
+
+    if (m_max_error <= max_error)
+      return;
+  }
+
+  // Could not achieve the desired accuracy
+  m_valid = false;
+  m_values.clear();
+}
+
+}  // namespace camera
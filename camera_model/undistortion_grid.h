@@ -0,0 +1,89 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef RIG_CALIBRATOR_UNDISTORTION_GRID_H
+#define RIG_CALIBRATOR_UNDISTORTION_GRID_H
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace camera {
+
+  // A lookup table for undistorting pixels. The undistorted values
+  // are computed exactly at the nodes of a regular grid over the
+  // distorted image, and are found by bilinear interpolation
+  // elsewhere. The grid spacing is refined until the interpolation
+  // error is under a given bound. This is much faster than
+  // undistortion which needs to solve for each pixel.
+  class UndistortionGrid {
+   public:
+    UndistortionGrid();
+
+    // Build the grid for the box with given corners, in the frame of
+    // the distorted pixels, given the exact undistortion function.
+    // The grid spacing is halved until the interpolation error, as
+    // measured at cell and edge centers, is no more than max_error.
+    // If that cannot be achieved with a spacing of min_spacing, the
+    // grid is left invalid.
+    void Build(Eigen::Vector2d const& min_corner, Eigen::Vector2d const& max_corner,
+               double max_error,
+               std::function<void(Eigen::Vector2d const&, Eigen::Vector2d*)> const& undistort,
+               double init_spacing = 64.0, double min_spacing = 2.0);
+
+    bool IsValid() const { return m_valid; }
+
+    // The spacing and the largest interpolation error found when building
+    double Spacing() const { return m_spacing; }
+    double MaxError() const { return m_max_error; }
+
+    // Undistort a pixel by interpolation. Return false if the grid is
+    // not valid or the pixel is outside of it.
+    bool Undistort(Eigen::Vector2d const& distorted, Eigen::Vector2d* undistorted) const {
+      if (!m_valid)
+        return false;
+
+      double x = (distorted[0] - m_min_corner[0]) / m_spacing;
+      double y = (distorted[1] - m_min_corner[1]) / m_spacing;
+      if (!(x >= 0.0 && y >= 0.0 && x <= m_num_cols - 1 && y <= m_num_rows - 1))
+        return false;
+
+      int col = std::min(static_cast<int>(x), m_num_cols - 2);
+      int row = std::min(static_cast<int>(y), m_num_rows - 2);
+      double wx = x - col, wy = y - row;
+
+      Eigen::Vector2d const* p = &m_values[row * m_num_cols + col];
+      *undistorted = (1.0 - wy) * ((1.0 - wx) * p[0] + wx * p[1]) +
+        wy * ((1.0 - wx) * p[m_num_cols] + wx * p[m_num_cols + 1]);
+      return true;
+    }
+
+   private:
+    bool m_valid;
+    Eigen::Vector2d m_min_corner;
+    double m_spacing, m_max_error;
+    int m_num_cols, m_num_rows;
+    std::vector<Eigen::Vector2d> m_values;  // row-major
+  };
+
+}  // namespace camera
+
+#endif  // RIG_CALIBRATOR_UNDISTORTION_GRID_H
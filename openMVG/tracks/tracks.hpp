@@ -68,8 +68,13 @@ struct TracksBuilder
   {
     // 1. We need to know how much single set we will have.
     //   i.e each set is made of a tuple : (imageIndex, featureIndex)
-    using SetIndexedPair = std::set<indexedFeaturePair>;
-    SetIndexedPair allFeatures;
+    // Use a flat array which is sorted and made unique, rather than
+    // a std::set, as that is much faster and uses less memory.
+    size_t numFeatures = 0;
+    for ( const auto & iter : map_pair_wise_matches )
+      numFeatures += 2 * iter.second.size();
+    std::vector<indexedFeaturePair> allFeatures;
+    allFeatures.reserve(numFeatures);
     // For each couple of images list the used features
     for ( const auto & iter : map_pair_wise_matches )
     {
@@ -77,13 +82,16 @@ struct TracksBuilder
       const auto & J = iter.first.second;
       const std::vector<IndMatch> & vec_FilteredMatches = iter.second;
 
-      // Retrieve all shared features and add them to a set
+      // Retrieve all shared features and add them to the array
       for ( const auto & cur_filtered_match : vec_FilteredMatches )
       {
-        allFeatures.emplace(I,cur_filtered_match.i_);
-        allFeatures.emplace(J,cur_filtered_match.j_);
+        allFeatures.emplace_back(I,cur_filtered_match.i_);
+        allFeatures.emplace_back(J,cur_filtered_match.j_);
       }
     }
+    std::sort(allFeatures.begin(), allFeatures.end());
+    allFeatures.erase(std::unique(allFeatures.begin(), allFeatures.end()),
+                      allFeatures.end());
 
     // 2. Build the 'flat' representation where a tuple (the node)
     //  is attached to a unique index.
@@ -97,7 +105,7 @@ struct TracksBuilder
     // Sort the flat_pair_map
     map_node_to_index.sort();
     // Clean some memory
-    allFeatures.clear();
+    allFeatures = std::vector<indexedFeaturePair>();
 
     // 3. Add the node and the pairwise correpondences in the UF tree.
     uf_tree.InitSets(map_node_to_index.size());
@@ -0,0 +1,291 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Create a synthetic rig and scene, to be able to run and time
+// rig_calibrator at any scale without real data. The rig moves inside
+// a box-shaped room whose walls have a pseudo-random texture. Each
+// sensor takes an image at every rig time, and the last few sensors
+// also take depth clouds. The output directory gets a subdirectory of
+// images (and depth clouds) for each sensor, rig_config.txt, and
+// cameras.txt with the true camera poses, which can be passed to
+// rig_calibrator as --rig_config and --camera_poses.
+
+#include <rig_calibrator/dense_map_utils.h>
+#include <rig_calibrator/interest_point.h>
+#include <rig_calibrator/camera_image.h>
+#include <rig_calibrator/system_utils.h>
+#include <rig_calibrator/thread.h>
+#include <camera_model/camera_params.h>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <Eigen/Geometry>
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+DEFINE_string(out_dir, "", "Write the synthetic rig and data in this directory.");
+
+DEFINE_int32(num_sensors, 3, "The number of sensors on the rig. The first is the reference sensor.");
+
+DEFINE_int32(num_depth_sensors, 1,
+             "The number of sensors which also produce depth clouds. These are the last ones.");
+
+DEFINE_int32(num_frames, 20, "The number of times at which the reference sensor takes an image.");
+
+DEFINE_int32(image_width, 640, "The width of each image, in pixels.");
+
+DEFINE_int32(image_height, 480, "The height of each image, in pixels.");
+
+DEFINE_double(focal_length, 500.0, "The focal length of each sensor, in pixels.");
+
+DEFINE_string(distortion_type, "radtan",
+              "The lens distortion of each sensor. Options: no_distortion, fisheye, radtan.");
+
+DEFINE_int32(seed, 0, "The seed for the texture of the scene.");
+
+namespace {
+
+// The room the rig moves in, as its bounds along each axis, in meters
+const Eigen::Vector3d g_room_min(-8.0, -4.0, -6.0);
+const Eigen::Vector3d g_room_max(14.0, 3.0, 10.0);
+
+// A pseudo-random value in [0, 1) for each lattice point
+double latticeValue(int64_t x, int64_t y, uint32_t seed) {
+  uint64_t h = static_cast<uint64_t>(x) * 0x9E3779B97F4A7C15ULL
+    ^ static_cast<uint64_t>(y) * 0xC2B2AE3D27D4EB4FULL ^ (static_cast<uint64_t>(seed) << 32);
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Smoothly interpolated lattice values
+double valueNoise(double x, double y, uint32_t seed) {
+  double fx = std::floor(x), fy = std::floor(y);
+  int64_t ix = static_cast<int64_t>(fx), iy = static_cast<int64_t>(fy);
+  double tx = x - fx, ty = y - fy;
+  tx = tx * tx * (3.0 - 2.0 * tx);
+  ty = ty * ty * (3.0 - 2.0 * ty);
+  double v00 = latticeValue(ix, iy, seed), v10 = latticeValue(ix + 1, iy, seed);
+  double v01 = latticeValue(ix, iy + 1, seed), v11 = latticeValue(ix + 1, iy + 1, seed);
+  return (1.0 - ty) * ((1.0 - tx) * v00 + tx * v10) + ty * ((1.0 - tx) * v01 + tx * v11);
+}
+
+// The texture of a wall, with detail at several scales, so that
+// features are found at any distance. The wall index changes the
+// pattern from wall to wall.
+unsigned char wallIntensity(int wall, double u, double v, uint32_t seed) {
+  double val = 0.0, amplitude = 0.5, frequency = 2.0;
+  for (int octave = 0; octave < 5; octave++) {
+    val += amplitude * valueNoise(frequency * u, frequency * v, seed + 7919 * wall + octave);
+    amplitude *= 0.5;
+    frequency *= 2.0;
+  }
+  // Stretch the contrast, as sums of noise cluster around the middle
+  val = 0.5 + 2.0 * (val - 0.5);
+  return static_cast<unsigned char>(255.0 * std::min(1.0, std::max(0.0, val)));
+}
+
+// Intersect a ray starting inside the room with its walls. Return the
+// distance along the ray and the intensity at the intersection.
+double castRay(Eigen::Vector3d const& origin, Eigen::Vector3d const& dir, uint32_t seed,
+               unsigned char & intensity) {
+  double t = std::numeric_limits<double>::max();
+  int axis = 0, wall = 0;
+  for (int it = 0; it < 3; it++) {
+    if (dir[it] == 0.0)
+      continue;
+    bool positive = (dir[it] > 0);
+    double bound = positive ? g_room_max[it] : g_room_min[it];
+    double t_it = (bound - origin[it]) / dir[it];
+    if (t_it < t) {
+      t = t_it;
+      axis = it;
+      wall = 2 * it + positive;
+    }
+  }
+
+  Eigen::Vector3d P = origin + t * dir;
+  intensity = wallIntensity(wall, P[(axis + 1) % 3], P[(axis + 2) % 3], seed);
+  return t;
+}
+
+// The transform from the world to the reference sensor at a given rig
+// time. The rig moves along a circle while turning, so it stays inside
+// the room no matter how many frames there are, with a small bobbing motion.
+Eigen::Affine3d worldToRef(double rig_time) {
+  double angle = 0.1 * rig_time;
+  Eigen::Affine3d cam_to_world;
+  cam_to_world.linear() = Eigen::AngleAxisd(angle, Eigen::Vector3d::UnitY()).toRotationMatrix();
+  cam_to_world.translation() = Eigen::Vector3d(3.0 * std::sin(angle), 0.2 * std::sin(rig_time),
+                                               3.0 * (1.0 - std::cos(angle)));
+  return cam_to_world.inverse();
+}
+
+// Render the image, and optionally the depth cloud, seen by a sensor.
+// The depth cloud has for each pixel the point seen there, in sensor
+// coordinates, so its depth_to_image transform is the identity.
+void renderView(camera::CameraParameters const& cam_params, Eigen::Affine3d const& world_to_cam,
+                uint32_t seed, std::string const& image_file, std::string const& depth_file) {
+  Eigen::Vector2i size = cam_params.GetDistortedSize();
+  double focal_length = cam_params.GetFocalLength();
+  Eigen::Affine3d cam_to_world = world_to_cam.inverse();
+  Eigen::Vector3d ctr = cam_to_world.translation();
+
+  cv::Mat image(size[1], size[0], CV_8UC1);
+  cv::Mat depth_cloud;
+  if (!depth_file.empty())
+    depth_cloud = cv::Mat(size[1], size[0], CV_32FC3);
+
+  for (int row = 0; row < size[1]; row++) {
+    for (int col = 0; col < size[0]; col++) {
+      Eigen::Vector2d undist_c;
+      cam_params.Convert<camera::DISTORTED, camera::UNDISTORTED_C>
+        (Eigen::Vector2d(col, row), &undist_c);
+
+      // With the third coordinate being 1, the point at distance t
+      // along the ray is t * cam_dir in sensor coordinates.
+      Eigen::Vector3d cam_dir(undist_c[0] / focal_length, undist_c[1] / focal_length, 1.0);
+      unsigned char intensity = 0;
+      double t = castRay(ctr, cam_to_world.linear() * cam_dir, seed, intensity);
+      image.at<unsigned char>(row, col) = intensity;
+
+      if (!depth_cloud.empty()) {
+        Eigen::Vector3d P = t * cam_dir;
+        depth_cloud.at<cv::Vec3f>(row, col) = cv::Vec3f(P[0], P[1], P[2]);
+      }
+    }
+  }
+
+  if (!cv::imwrite(image_file, image))
+    LOG(FATAL) << "Could not write: " << image_file << "\n";
+  if (!depth_cloud.empty())
+    dense_map::saveXyzImage(depth_file, depth_cloud);
+}
+
+}  // end anonymous namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_out_dir.empty())
+    LOG(FATAL) << "The output directory was not specified.\n";
+  if (FLAGS_num_sensors <= 0 || FLAGS_num_frames < 2)
+    LOG(FATAL) << "Must have at least one sensor and two frames.\n";
+  if (FLAGS_num_depth_sensors < 0 || FLAGS_num_depth_sensors > FLAGS_num_sensors)
+    LOG(FATAL) << "The number of depth sensors must be between 0 and the number of sensors.\n";
+  if (FLAGS_image_width <= 0 || FLAGS_image_height <= 0 || FLAGS_focal_length <= 0)
+    LOG(FATAL) << "The image dimensions and focal length must be positive.\n";
+
+  Eigen::VectorXd distortion;
+  if (FLAGS_distortion_type == dense_map::FISHEYE_DISTORTION) {
+    distortion.resize(1);
+    distortion << 0.9;
+  } else if (FLAGS_distortion_type == dense_map::RADTAN_DISTORTION) {
+    distortion.resize(4);
+    distortion << -0.2, 0.05, 0.001, -0.001;
+  } else if (FLAGS_distortion_type != dense_map::NO_DISTORION) {
+    LOG(FATAL) << "Unknown distortion type: " << FLAGS_distortion_type << "\n";
+  }
+
+  // The sensors are offset from each other and look in slightly
+  // different directions
+  int num_sensors = FLAGS_num_sensors;
+  int ref_cam_type = 0;
+  Eigen::Vector2i image_size(FLAGS_image_width, FLAGS_image_height);
+  std::vector<std::string> cam_names;
+  std::vector<camera::CameraParameters> cam_params;
+  std::vector<Eigen::Affine3d> ref_to_cam_trans, depth_to_image;
+  std::vector<double> ref_to_cam_timestamp_offsets;
+  for (int cam_type = 0; cam_type < num_sensors; cam_type++) {
+    cam_names.push_back("cam" + std::to_string(cam_type));
+    cam_params.push_back(camera::CameraParameters(image_size,
+                                                  Eigen::Vector2d(FLAGS_focal_length,
+                                                                  FLAGS_focal_length),
+                                                  Eigen::Vector2d(image_size[0] / 2.0,
+                                                                  image_size[1] / 2.0),
+                                                  distortion));
+
+    Eigen::Affine3d ref_to_cam;
+    ref_to_cam.linear() = Eigen::AngleAxisd(0.08 * cam_type, Eigen::Vector3d::UnitY())
+      .toRotationMatrix();
+    ref_to_cam.translation() = Eigen::Vector3d(-0.1 * cam_type, 0.02 * cam_type, 0.0);
+    ref_to_cam_trans.push_back(ref_to_cam);
+    depth_to_image.push_back(Eigen::Affine3d::Identity());
+    ref_to_cam_timestamp_offsets.push_back(0.0);
+  }
+
+  dense_map::createDir(FLAGS_out_dir);
+  for (int cam_type = 0; cam_type < num_sensors; cam_type++)
+    dense_map::createDir(FLAGS_out_dir + "/" + cam_names[cam_type]);
+
+  // The reference sensor takes an image at each rig time. The other
+  // sensors take theirs a little later, so within the bracket of
+  // reference times, hence not after the last reference time.
+  double start_time = 1000.0, time_step = 0.5;
+  std::vector<dense_map::cameraImage> cams;
+  std::vector<Eigen::Affine3d> world_to_cam;
+  dense_map::ThreadPool thread_pool;
+  for (int frame = 0; frame < FLAGS_num_frames; frame++) {
+    for (int cam_type = 0; cam_type < num_sensors; cam_type++) {
+      if (cam_type != ref_cam_type && frame + 1 == FLAGS_num_frames)
+        continue;
+
+      double rig_time = frame * time_step + 0.05 * cam_type;
+      char timestamp_buffer[1000];
+      snprintf(timestamp_buffer, sizeof(timestamp_buffer), "%10.7f", start_time + rig_time);
+
+      std::string base = FLAGS_out_dir + "/" + cam_names[cam_type] + "/" + timestamp_buffer;
+      dense_map::cameraImage cam;
+      cam.camera_type = cam_type;
+      cam.timestamp = start_time + rig_time;
+      cam.image_name = base + ".jpg";
+      if (cam_type >= num_sensors - FLAGS_num_depth_sensors)
+        cam.depth_name = base + ".pc";
+      cams.push_back(cam);
+      world_to_cam.push_back(ref_to_cam_trans[cam_type] * worldToRef(rig_time));
+
+      std::cout << "Writing: " << cam.image_name << std::endl;
+      thread_pool.AddTask(&renderView, std::cref(cam_params[cam_type]), world_to_cam.back(),
+                          static_cast<uint32_t>(FLAGS_seed), cam.image_name, cam.depth_name);
+    }
+  }
+  thread_pool.Join();
+
+  bool model_rig = true;
+  dense_map::writeRigConfig(FLAGS_out_dir, model_rig, ref_cam_type, cam_names, cam_params,
+                            ref_to_cam_trans, depth_to_image, ref_to_cam_timestamp_offsets);
+  dense_map::saveCameraPoses(FLAGS_out_dir, cams, world_to_cam);
+
+  return 0;
+}
@@ -0,0 +1,426 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Time the inner kernels of rig_calibrator and texturing on synthetic
+// inputs, to catch speed regressions in them without having to run
+// the full tool on real data. Each benchmark is run repeatedly until
+// at least --min_time seconds pass, and the time per item is printed.
+// Use gen_synthetic_rig to time the full pipeline.
+
+#include <camera_model/camera_params.h>
+#include <camera_model/camera_model.h>
+#include <camera_model/rpc_distortion.h>
+#include <rig_calibrator/interest_point.h>
+#include <rig_calibrator/matching.h>
+#include <rig_calibrator/track_store.h>
+#include <rig_calibrator/texture_processing.h>
+
+#include <openMVG/tracks/tracks.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <Eigen/Geometry>
+#include <Eigen/Core>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+DEFINE_string(benchmark_filter, "",
+              "Run only the benchmarks whose name contains this string. By default run all.");
+
+DEFINE_double(min_time, 0.5, "Run each benchmark for at least this many seconds.");
+
+namespace {
+
+// Results are accumulated here, so the compiler cannot skip the work being timed
+double g_sink = 0.0;
+
+struct Benchmark {
+  std::string name;
+  int64_t num_items;  // how many items one call of the timed function processes
+
+  // Prepare the inputs and return the function to time. The
+  // preparation is not timed, and is done only if the benchmark is run.
+  std::function<std::function<void()>()> setup;
+};
+
+// Pixels spread over the image, including close to the corners, where
+// distortion is largest
+std::vector<Eigen::Vector2d> samplePixels(Eigen::Vector2i const& image_size, int num) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<double> x(0.0, image_size[0] - 1.0), y(0.0, image_size[1] - 1.0);
+  std::vector<Eigen::Vector2d> pixels(num);
+  for (int it = 0; it < num; it++)
+    pixels[it] = Eigen::Vector2d(x(gen), y(gen));
+  return pixels;
+}
+
+camera::CameraParameters makeCamera(std::string const& distortion_type) {
+  Eigen::Vector2i image_size(1280, 960);
+  Eigen::VectorXd distortion;
+  if (distortion_type == dense_map::FISHEYE_DISTORTION) {
+    distortion.resize(1);
+    distortion << 0.9;
+  } else if (distortion_type == dense_map::RADTAN_DISTORTION ||
+             distortion_type == dense_map::RPC_DISTORTION) {
+    distortion.resize(4);
+    distortion << -0.2, 0.05, 0.001, -0.001;
+  }
+
+  camera::CameraParameters cam_params(image_size, Eigen::Vector2d(1000.0, 1000.0),
+                                      Eigen::Vector2d(image_size[0] / 2.0, image_size[1] / 2.0),
+                                      distortion);
+
+  if (distortion_type == dense_map::RPC_DISTORTION) {
+    // Fit an RPC model to the radtan distortion, as fit_rpc does
+    int rpc_degree = 3, num_samples = 40, num_opt_threads = 1, num_iterations = 20;
+    double parameter_tolerance = 1e-12;
+    bool verbose = false;
+    Eigen::VectorXd rpc_dist_coeffs, rpc_undist_coeffs;
+    dense_map::fitRpcDist(rpc_degree, num_samples, cam_params, num_opt_threads, num_iterations,
+                          parameter_tolerance, verbose, rpc_dist_coeffs);
+    dense_map::fitRpcUndist(rpc_dist_coeffs, num_samples, cam_params, num_opt_threads,
+                            num_iterations, parameter_tolerance, verbose, rpc_undist_coeffs);
+    dense_map::RPCLensDistortion rpc;
+    rpc.set_distortion_parameters(rpc_dist_coeffs);
+    rpc.set_undistortion_parameters(rpc_undist_coeffs);
+    cam_params.SetDistortion(rpc.dist_undist_params());
+  }
+
+  return cam_params;
+}
+
+const int g_num_pixels = 10000;
+
+std::function<void()> setupUndistort(std::string const& distortion_type) {
+  std::shared_ptr<camera::CameraParameters> cam_params
+    (new camera::CameraParameters(makeCamera(distortion_type)));
+  std::vector<Eigen::Vector2d> pixels = samplePixels(cam_params->GetDistortedSize(), g_num_pixels);
+  return [cam_params, pixels]() {
+    Eigen::Vector2d out;
+    for (size_t it = 0; it < pixels.size(); it++) {
+      cam_params->Convert<camera::DISTORTED, camera::UNDISTORTED_C>(pixels[it], &out);
+      g_sink += out[0];
+    }
+  };
+}
+
+std::function<void()> setupDistort(std::string const& distortion_type) {
+  std::shared_ptr<camera::CameraParameters> cam_params
+    (new camera::CameraParameters(makeCamera(distortion_type)));
+  std::vector<Eigen::Vector2d> pixels = samplePixels(cam_params->GetDistortedSize(), g_num_pixels);
+  for (size_t it = 0; it < pixels.size(); it++) {
+    Eigen::Vector2d undist_c;
+    cam_params->Convert<camera::DISTORTED, camera::UNDISTORTED_C>(pixels[it], &undist_c);
+    pixels[it] = undist_c;
+  }
+  return [cam_params, pixels]() {
+    Eigen::Vector2d out;
+    for (size_t it = 0; it < pixels.size(); it++) {
+      cam_params->Convert<camera::UNDISTORTED_C, camera::DISTORTED>(pixels[it], &out);
+      g_sink += out[0];
+    }
+  };
+}
+
+// Evaluate the RPC polynomials directly, without the conversions
+// between pixels and centered normalized coordinates
+std::function<void()> setupRpcPolynomial() {
+  camera::CameraParameters cam_params = makeCamera(dense_map::RPC_DISTORTION);
+  std::shared_ptr<dense_map::RPCLensDistortion> rpc
+    (new dense_map::RPCLensDistortion(cam_params.GetDistortion()));
+  std::vector<Eigen::Vector2d> pixels = samplePixels(cam_params.GetDistortedSize(), g_num_pixels);
+  for (size_t it = 0; it < pixels.size(); it++)
+    pixels[it] = (pixels[it] - cam_params.GetOpticalOffset()).array()
+      / cam_params.GetFocalVector().array();
+  return [rpc, pixels]() {
+    for (size_t it = 0; it < pixels.size(); it++)
+      g_sink += rpc->distort_centered(pixels[it])[0];
+  };
+}
+
+// Triangulate points seen by several cameras on a circle around them
+const int g_num_points = 1000;
+std::function<void()> setupTriangulate(int num_cams) {
+  double focal_length = 1000.0;
+  std::vector<double> focal_length_vec(num_cams, focal_length);
+  std::vector<Eigen::Affine3d> world_to_cam_vec(num_cams);
+  for (int cid = 0; cid < num_cams; cid++) {
+    Eigen::Affine3d cam_to_world;
+    cam_to_world.linear() = Eigen::AngleAxisd(-0.3 + 0.6 * cid / num_cams,
+                                              Eigen::Vector3d::UnitY()).toRotationMatrix();
+    cam_to_world.translation() = Eigen::Vector3d(cid * 0.5, 0.1 * cid, 0.0);
+    world_to_cam_vec[cid] = cam_to_world.inverse();
+  }
+
+  std::mt19937 gen(2);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  std::vector<std::vector<Eigen::Vector2d>> pix_vecs(g_num_points);
+  for (int pid = 0; pid < g_num_points; pid++) {
+    Eigen::Vector3d X(dist(gen), dist(gen), 10.0 + dist(gen));
+    for (int cid = 0; cid < num_cams; cid++) {
+      Eigen::Vector3d P = world_to_cam_vec[cid] * X;
+      pix_vecs[pid].push_back(focal_length * Eigen::Vector2d(P[0] / P[2], P[1] / P[2]));
+    }
+  }
+
+  return [focal_length_vec, world_to_cam_vec, pix_vecs]() {
+    for (size_t pid = 0; pid < pix_vecs.size(); pid++)
+      g_sink += dense_map::Triangulate(focal_length_vec, world_to_cam_vec, pix_vecs[pid])[2];
+  };
+}
+
+// Random descriptors for two images, where those in the second image
+// are perturbed copies of those in the first one, so that most have a
+// good match
+const int g_num_descriptors = 2000;
+void makeDescriptors(cv::Mat & desc1, cv::Mat & desc2) {
+  int len = 64;  // as for SURF
+  desc1 = cv::Mat(g_num_descriptors, len, CV_32F);
+  desc2 = cv::Mat(g_num_descriptors, len, CV_32F);
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<float> value(0.0f, 1.0f), noise(-0.02f, 0.02f);
+  for (int row = 0; row < g_num_descriptors; row++) {
+    for (int col = 0; col < len; col++) {
+      desc1.at<float>(row, col) = value(gen);
+      desc2.at<float>(row, col) = desc1.at<float>(row, col) + noise(gen);
+    }
+  }
+}
+
+std::function<void()> setupFindMatches() {
+  cv::Mat desc1, desc2;
+  makeDescriptors(desc1, desc2);
+  return [desc1, desc2]() {
+    std::vector<cv::DMatch> matches;
+    interest_point::FindMatches(desc1, desc2, &matches);
+    g_sink += matches.size();
+  };
+}
+
+std::function<void()> setupDescriptorIndexQuery() {
+  cv::Mat desc1, desc2;
+  makeDescriptors(desc1, desc2);
+  std::shared_ptr<interest_point::DescriptorIndex> index
+    (new interest_point::DescriptorIndex(desc2));
+  return [desc1, index]() {
+    std::vector<cv::DMatch> matches;
+    index->FindMatches(desc1, &matches);
+    g_sink += matches.size();
+  };
+}
+
+// Matches among consecutive images, where each feature is seen
+// in several images in a row
+const int g_num_track_images = 20, g_num_track_features = 5000;
+openMVG::matching::PairWiseMatches makeMatchMap() {
+  int span = 4;
+  openMVG::matching::PairWiseMatches match_map;
+  for (int left = 0; left < g_num_track_images; left++) {
+    for (int right = left + 1; right < std::min(left + span, g_num_track_images); right++) {
+      std::vector<openMVG::matching::IndMatch> mvg_matches;
+      for (int fid = 0; fid < g_num_track_features; fid++) {
+        // The index of a feature changes from image to image
+        int left_fid = (fid * 7 + left) % g_num_track_features;
+        int right_fid = (fid * 7 + right) % g_num_track_features;
+        mvg_matches.push_back(openMVG::matching::IndMatch(left_fid, right_fid));
+      }
+      match_map[std::make_pair(left, right)].swap(mvg_matches);
+    }
+  }
+  return match_map;
+}
+
+std::function<void()> setupBuildTracks() {
+  openMVG::matching::PairWiseMatches match_map = makeMatchMap();
+  return [match_map]() {
+    openMVG::tracks::TracksBuilder trackBuilder;
+    trackBuilder.Build(match_map);
+    trackBuilder.Filter();
+    openMVG::tracks::STLMAPTracks map_tracks;
+    trackBuilder.ExportToSTL(map_tracks);
+    g_sink += map_tracks.size();
+  };
+}
+
+std::function<void()> setupTrackStore() {
+  openMVG::tracks::TracksBuilder trackBuilder;
+  trackBuilder.Build(makeMatchMap());
+  trackBuilder.Filter();
+  openMVG::tracks::STLMAPTracks map_tracks;
+  trackBuilder.ExportToSTL(map_tracks);
+
+  std::vector<std::map<int, int>> pid_to_cid_fid;
+  for (auto const& track : map_tracks) {
+    std::map<int, int> cid_fid;
+    for (auto const& obs : track.second)
+      cid_fid[obs.first] = obs.second;
+    pid_to_cid_fid.push_back(cid_fid);
+  }
+
+  return [pid_to_cid_fid]() {
+    dense_map::TrackStore tracks(pid_to_cid_fid);
+    g_sink += tracks.numObs();
+  };
+}
+
+// A planar grid mesh facing a camera at the origin, covering its view
+const int g_grid_size = 300;
+mve::TriangleMesh::Ptr makeGridMesh() {
+  mve::TriangleMesh::Ptr mesh = mve::TriangleMesh::create();
+  mve::TriangleMesh::VertexList& vertices = mesh->get_vertices();
+  mve::TriangleMesh::FaceList& faces = mesh->get_faces();
+
+  double half_width = 4.0, depth = 5.0;
+  for (int row = 0; row <= g_grid_size; row++) {
+    for (int col = 0; col <= g_grid_size; col++) {
+      double x = -half_width + 2.0 * half_width * col / g_grid_size;
+      double y = -half_width + 2.0 * half_width * row / g_grid_size;
+      vertices.push_back(math::Vec3f(x, y, depth));
+    }
+  }
+
+  // Order the vertices so that the face normals point to the camera
+  for (int row = 0; row < g_grid_size; row++) {
+    for (int col = 0; col < g_grid_size; col++) {
+      unsigned int v00 = row * (g_grid_size + 1) + col, v01 = v00 + 1;
+      unsigned int v10 = v00 + g_grid_size + 1, v11 = v10 + 1;
+      unsigned int tri[6] = {v00, v10, v01, v01, v10, v11};
+      faces.insert(faces.end(), tri, tri + 6);
+    }
+  }
+
+  mesh->ensure_normals();
+  return mesh;
+}
+
+std::function<void()> setupProjectTexture() {
+  mve::TriangleMesh::Ptr mesh = makeGridMesh();
+  std::shared_ptr<BVHTree> bvh_tree(new BVHTree(mesh->get_faces(), mesh->get_vertices()));
+  std::shared_ptr<dense_map::FaceGeometry> face_geom(new dense_map::FaceGeometry);
+  dense_map::computeFaceGeometry(mesh, *face_geom);
+
+  camera::CameraParameters cam_params = makeCamera(dense_map::RADTAN_DISTORTION);
+  camera::CameraModel cam(Eigen::Affine3d::Identity(), cam_params);
+  Eigen::Vector2i image_size = cam_params.GetDistortedSize();
+  cv::Mat image(image_size[1], image_size[0], CV_8UC3, cv::Scalar(128, 128, 128));
+  // The cost vector is sized as the face index list, as for the callers in the tool
+  size_t num_costs = mesh->get_faces().size();
+
+  return [mesh, bvh_tree, face_geom, image, cam, num_costs]() {
+    std::vector<double> smallest_cost_per_face(num_costs, 1.0e+100);
+    std::vector<Eigen::Vector3i> face_vec;
+    std::vector<Eigen::Vector2d> vertex_uv;
+    dense_map::projectTexture(mesh, bvh_tree, *face_geom, image, cam, smallest_cost_per_face,
+                              face_vec, vertex_uv);
+    g_sink += face_vec.size();
+  };
+}
+
+std::vector<Benchmark> allBenchmarks() {
+  std::vector<Benchmark> benchmarks;
+  std::string types[] = {dense_map::NO_DISTORION, dense_map::FISHEYE_DISTORTION,
+                         dense_map::RADTAN_DISTORTION, dense_map::RPC_DISTORTION};
+  for (std::string const& type : types) {
+    benchmarks.push_back(Benchmark{"undistort_pixel/" + type, g_num_pixels,
+                                   [type]() { return setupUndistort(type); }});
+    benchmarks.push_back(Benchmark{"distort_pixel/" + type, g_num_pixels,
+                                   [type]() { return setupDistort(type); }});
+  }
+  benchmarks.push_back(Benchmark{"rpc_polynomial", g_num_pixels, setupRpcPolynomial});
+  for (int num_cams : {2, 5, 10})
+    benchmarks.push_back(Benchmark{"triangulate/" + std::to_string(num_cams) + "_cams",
+                                   g_num_points, [num_cams]() {
+                                     return setupTriangulate(num_cams);
+                                   }});
+  benchmarks.push_back(Benchmark{"find_matches", g_num_descriptors, setupFindMatches});
+  benchmarks.push_back(Benchmark{"descriptor_index_query", g_num_descriptors,
+                                 setupDescriptorIndexQuery});
+  benchmarks.push_back(Benchmark{"build_tracks", g_num_track_features, setupBuildTracks});
+  benchmarks.push_back(Benchmark{"track_store", g_num_track_features, setupTrackStore});
+  benchmarks.push_back(Benchmark{"project_texture", 2 * g_grid_size * g_grid_size,
+                                 setupProjectTexture});
+  return benchmarks;
+}
+
+// Run the function with more and more iterations, until it takes
+// at least the given time. Return the time per call, in seconds.
+double timeFunction(std::function<void()> const& func, double min_time, int64_t & num_iters) {
+  typedef std::chrono::steady_clock Clock;
+  func();  // warm up the caches
+  num_iters = 1;
+  while (1) {
+    Clock::time_point start = Clock::now();
+    for (int64_t it = 0; it < num_iters; it++)
+      func();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    if (elapsed >= min_time || num_iters >= (int64_t(1) << 40))
+      return elapsed / num_iters;
+    num_iters *= 2;
+  }
+  return 0.0;  // not reached
+}
+
+}  // end anonymous namespace
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_min_time <= 0.0)
+    LOG(FATAL) << "The minimum time must be positive.\n";
+
+  std::vector<Benchmark> benchmarks = allBenchmarks();
+  int num_run = 0;
+  char line[1000];
+  snprintf(line, sizeof(line), "%-32s %14s %14s %10s", "Benchmark", "Time/call (ms)",
+           "Time/item (ns)", "Calls");
+  std::cout << line << std::endl;
+  for (size_t it = 0; it < benchmarks.size(); it++) {
+    Benchmark const& b = benchmarks[it];
+    if (b.name.find(FLAGS_benchmark_filter) == std::string::npos)
+      continue;
+
+    std::function<void()> func = b.setup();
+    int64_t num_iters = 0;
+    double seconds = timeFunction(func, FLAGS_min_time, num_iters);
+    snprintf(line, sizeof(line), "%-32s %14.4f %14.2f %10lld", b.name.c_str(), 1.0e+3 * seconds,
+             1.0e+9 * seconds / b.num_items, static_cast<long long>(num_iters));
+    std::cout << line << std::endl;
+    num_run++;
+  }
+
+  if (num_run == 0)
+    LOG(FATAL) << "No benchmarks match: " << FLAGS_benchmark_filter << "\n";
+
+  // Printing this keeps the results from being optimized out
+  VLOG(1) << "Checksum: " << g_sink;
+
+  return 0;
+}
@@ -114,7 +114,14 @@
 #include <rig_calibrator/transform_utils.h>
 #include <rig_calibrator/interest_point.h>
 #include <rig_calibrator/texture_processing.h>
+#include <rig_calibrator/track_store.h>
 #include <rig_calibrator/camera_image.h>
+#include <rig_calibrator/image_cache.h>
+#include <rig_calibrator/profiler.h>
+#include <rig_calibrator/partition.h>
+#include <rig_calibrator/thread.h>
+
+#include <camera_model/distortion_models.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -124,11 +131,17 @@
 
 #include <oneapi/tbb/task_arena.h>
 #include <boost/filesystem.hpp>
+#include <util/timer.h>
 
+#include <algorithm>
 #include <string>
 #include <map>
 #include <iostream>
+#include <iomanip>
 #include <fstream>
+#include <memory>
+#include <cstdint>
+#include <cstring>
 
 namespace fs = boost::filesystem;
 
@@ -233,6 +246,9 @@ DEFINE_string(out_texture_dir, "", "If non-empty and if an input mesh was provid
               "project the camera images using the optimized poses onto the mesh "
               "and write the obtained .obj files in the given directory.");
 
+DEFINE_bool(out_texture_ply, false, "With --out_texture_dir, also save each textured mesh "
+            "as a binary .ply file with per-vertex texture coordinates.");
+
 DEFINE_double(min_ray_dist, 0.0, "The minimum search distance from a starting point along a ray "
               "when intersecting the ray with a mesh, in meters (if applicable).");
 
@@ -253,8 +269,49 @@ DEFINE_string(xyz_file, "", "The path to the xyz file used for registration.");
 DEFINE_double(parameter_tolerance, 1e-12, "Stop when the optimization variables change by "
               "less than this.");
 
+DEFINE_string(linear_solver, "ITERATIVE_SCHUR",
+              "The linear solver used in the optimization. Options: ITERATIVE_SCHUR, "
+              "SPARSE_SCHUR, DENSE_SCHUR, SPARSE_NORMAL_CHOLESKY, CGNR. The Schur solvers "
+              "eliminate the triangulated points first. DENSE_SCHUR is fastest for few "
+              "cameras, SPARSE_SCHUR for up to a few hundred, and ITERATIVE_SCHUR for more.");
+
+DEFINE_string(preconditioner, "JACOBI",
+              "The preconditioner for ITERATIVE_SCHUR and CGNR. Options: IDENTITY, JACOBI, "
+              "SCHUR_JACOBI, CLUSTER_JACOBI, CLUSTER_TRIDIAGONAL. The last three apply to "
+              "ITERATIVE_SCHUR only. The cluster ones need fewer iterations on large rigs, "
+              "at a higher cost per iteration.");
+
+DEFINE_bool(use_inner_iterations, false,
+            "In each solver iteration, also optimize each group of variables on its own. "
+            "This may need fewer iterations, at a higher cost per iteration.");
+
+DEFINE_string(parameter_ordering, "auto",
+              "How to order the variables for elimination with the Schur solvers. Options: "
+              "auto (found by the solver), points_first (the triangulated points are "
+              "eliminated first, then the cameras and all else). The latter makes the "
+              "solver skip the search for an ordering.");
+
+DEFINE_double(undistortion_grid_error, 0.0,
+              "If positive, undistort pixels by interpolating in a precomputed grid "
+              "rather than exactly, with the interpolation error at most this many "
+              "pixels. Used for Tsai and RPC distortion. This is faster when there are "
+              "very many interest points.");
+
 DEFINE_int32(num_opt_threads, 16, "How many threads to use in the optimization.");
 
+DEFINE_int32(num_partitions, 1,
+             "Optimize in each pass the cameras in this many clusters of consecutive "
+             "reference images (or of images, with --no_rig), one cluster after another "
+             "in this process, with the other cameras fixed. This is sequential "
+             "block-coordinate descent. It does not save wall time, and all the data "
+             "stays in memory. The intrinsics, extrinsics, and other sensor parameters "
+             "are averaged over the clusters.");
+
+DEFINE_int32(partition_overlap, 2,
+             "With --num_partitions, extend each cluster by this many reference images "
+             "(or images, with --no_rig) on each side, so that the cameras near cluster "
+             "boundaries are optimized with the features on both sides.");
+
 DEFINE_int32(num_match_threads, 8, "How many threads to use in feature detection/matching. "
              "A large number can use a lot of memory.");
 
@@ -290,6 +347,27 @@ DEFINE_int32(num_overlaps, 0, "Match an image with this many images (of all came
              "nvm file. Not suggested by default. For advanced controls, "
              "run: rig_calibrator --help | grep -i sift.");
 
+DEFINE_int32(num_nearby_cameras, 0,
+             "In addition to the images matched per --num_overlaps, match each image with "
+             "this many images beyond that window whose camera centers, per the input poses, "
+             "are closest to its own. This finds loop closures when several sequences are "
+             "merged, without a large --num_overlaps. See also --max_nearby_view_angle.");
+
+DEFINE_double(max_nearby_view_angle, 60.0,
+              "With --num_nearby_cameras, consider only cameras whose viewing directions "
+              "differ from the current one by at most this angle, in degrees.");
+
+DEFINE_string(prev_nvm, "",
+              "Incremental mode. Read the nvm file saved with --save_nvm by a previous run on "
+              "some of the images. Their matches are read from it, and only the image pairs "
+              "with at least one image not in it are matched, per --num_overlaps and "
+              "--num_nearby_cameras. The resulting tracks are merged. The poses of the images "
+              "in it are initialized from it, so the optimization starts from the previous "
+              "solution. All images and the initial poses of the new ones are still read via "
+              "--nvm or --camera_poses. Use the same --out_dir as before to reuse the cached "
+              "features, and the rig configuration saved by the previous run with "
+              "--use_initial_rig_transforms.");
+
 DEFINE_bool(use_initial_rig_transforms, false,
             "Use the transforms among the sensors of the rig specified via --rig_config. "
             "Otherwise derive it from the poses of individual cameras.");
@@ -315,6 +393,11 @@ DEFINE_bool(save_transformed_depth_clouds, false,
 DEFINE_bool(verbose, false,
             "Print a lot of verbose information about how matching goes.");
 
+DEFINE_string(profile_report, "",
+              "If non-empty, save in this JSON file the wall time and memory use of each "
+              "major stage of the program, such as feature detection, matching, and each "
+              "optimization pass.");
+
 namespace dense_map {
 
 // TODO(oalexan1): Move to transform_utils.cc.
@@ -389,6 +472,235 @@ Eigen::Affine3d calc_world_to_cam_trans(const double* beg_world_to_ref_t,
   return interp_world_to_cam_aff;
 }
 
+// The residuals of each image share the same bracketing poses, rig
+// transform, and timestamps, so the same world_to_cam transform is
+// found for each of them by calc_world_to_cam_trans(). Keep these in
+// a cache instead. Each thread has its own cache, so no locking is
+// needed. An entry is used only if all its inputs are the same as the
+// ones asked for, so it is never stale, even when the solver perturbs
+// the parameters to find numerical derivatives or moves to a new point.
+
+namespace {
+
+// The inputs of calc_world_to_cam_trans(), as the three rigid
+// transforms followed by the four timestamps and offset
+const int kNumPoseCacheInputs = 3 * NUM_RIGID_PARAMS + 4;
+
+// The number of entries in the cache of each thread. An entry is
+// picked by the hash of the inputs, and is overwritten on collision.
+const size_t kPoseCacheSize = 1 << 12;
+
+struct PoseCacheEntry {
+  PoseCacheEntry(): valid(false) {}
+  bool valid;  // false until the entry is first filled in
+  double inputs[kNumPoseCacheInputs];
+  Eigen::Transform<double, 3, Eigen::Affine, Eigen::DontAlign> world_to_cam;
+};
+
+thread_local std::vector<PoseCacheEntry> t_pose_cache;
+
+}  // end anonymous namespace
+
+// Same as calc_world_to_cam_trans(), but look up the result in the
+// cache of the current thread first
+Eigen::Affine3d calc_world_to_cam_trans_cached(const double* beg_world_to_ref_t,
+                                               const double* end_world_to_ref_t,
+                                               const double* ref_to_cam_trans,
+                                               double beg_ref_stamp,
+                                               double end_ref_stamp,
+                                               double ref_to_cam_offset,
+                                               double cam_stamp) {
+  double inputs[kNumPoseCacheInputs];
+  std::memset(inputs, 0, sizeof(inputs));
+  std::memcpy(inputs, beg_world_to_ref_t, NUM_RIGID_PARAMS * sizeof(double));
+  // For the reference camera the other transform and the offset are not used
+  if (beg_ref_stamp != end_ref_stamp) {
+    std::memcpy(inputs + NUM_RIGID_PARAMS, end_world_to_ref_t,
+                NUM_RIGID_PARAMS * sizeof(double));
+    std::memcpy(inputs + 2 * NUM_RIGID_PARAMS, ref_to_cam_trans,
+                NUM_RIGID_PARAMS * sizeof(double));
+    inputs[3 * NUM_RIGID_PARAMS + 2] = ref_to_cam_offset;
+  }
+  inputs[3 * NUM_RIGID_PARAMS + 0] = beg_ref_stamp;
+  inputs[3 * NUM_RIGID_PARAMS + 1] = end_ref_stamp;
+  inputs[3 * NUM_RIGID_PARAMS + 3] = cam_stamp;
+
+  // Hash the inputs a word at a time
+  uint64_t hash = 0;
+  for (int it = 0; it < kNumPoseCacheInputs; it++) {
+    uint64_t word = 0;
+    std::memcpy(&word, &inputs[it], sizeof(word));
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+  }
+
+  if (t_pose_cache.empty())
+    t_pose_cache.resize(kPoseCacheSize);
+  PoseCacheEntry & entry = t_pose_cache[hash % kPoseCacheSize];  // alias
+  if (entry.valid && std::memcmp(entry.inputs, inputs, sizeof(inputs)) == 0)
+    return Eigen::Affine3d(entry.world_to_cam.matrix());
+
+  Eigen::Affine3d world_to_cam
+    = calc_world_to_cam_trans(beg_world_to_ref_t, end_world_to_ref_t, ref_to_cam_trans,
+                              beg_ref_stamp, end_ref_stamp, ref_to_cam_offset, cam_stamp);
+  entry.valid = true;
+  std::memcpy(entry.inputs, inputs, sizeof(inputs));
+  entry.world_to_cam.matrix() = world_to_cam.matrix();
+
+  return world_to_cam;
+}
+
+// Templated versions of the above, to be used with automatic
+// differentiation. A rigid transform is returned as a rotation
+// matrix R and translation t, and is applied as R * X + t.
+
+// Convert an array of length NUM_RIGID_PARAMS to a rigid transform.
+// Note that the quaternion is stored as x, y, z, w.
+template <typename T>
+void array_to_rigid_transform(const T* arr, Eigen::Matrix<T, 3, 3>* R,
+                              Eigen::Matrix<T, 3, 1>* t) {
+  // This expects w, x, y, z, and normalizes the quaternion
+  T quat[4] = {arr[6], arr[3], arr[4], arr[5]};
+  T rot[9];  // row-major
+  ceres::QuaternionToRotation(quat, rot);
+
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 3; col++) (*R)(row, col) = rot[3 * row + col];
+    (*t)[row] = arr[row];
+  }
+}
+
+// Spherical linear interpolation of two rotations given as
+// quaternions in the order x, y, z, w. The output is unit-length and
+// in the order w, x, y, z. This mirrors Eigen's slerp(), except that
+// for very close rotations normalized linear interpolation is used,
+// as the derivative of acos() blows up near 1.
+template <typename T>
+void quat_slerp(T const& alpha, const T* beg_quat, const T* end_quat, T* interp_quat) {
+  using std::abs;
+  using std::acos;
+  using std::sin;
+  using std::sqrt;
+
+  T q0[4] = {beg_quat[3], beg_quat[0], beg_quat[1], beg_quat[2]};
+  T q1[4] = {end_quat[3], end_quat[0], end_quat[1], end_quat[2]};
+  T n0 = sqrt(q0[0] * q0[0] + q0[1] * q0[1] + q0[2] * q0[2] + q0[3] * q0[3]);
+  T n1 = sqrt(q1[0] * q1[0] + q1[1] * q1[1] + q1[2] * q1[2] + q1[3] * q1[3]);
+  T d(0.0);
+  for (int it = 0; it < 4; it++) {
+    q0[it] /= n0;
+    q1[it] /= n1;
+    d += q0[it] * q1[it];
+  }
+
+  T abs_d = abs(d);
+  T scale0, scale1;
+  if (abs_d >= T(1.0 - 1.0e-8)) {
+    scale0 = T(1.0) - alpha;
+    scale1 = alpha;
+  } else {
+    T theta = acos(abs_d);
+    T sin_theta = sin(theta);
+    scale0 = sin((T(1.0) - alpha) * theta) / sin_theta;
+    scale1 = sin(alpha * theta) / sin_theta;
+  }
+  if (d < T(0.0)) scale1 = -scale1;
+
+  T norm(0.0);
+  for (int it = 0; it < 4; it++) {
+    interp_quat[it] = scale0 * q0[it] + scale1 * q1[it];
+    norm += interp_quat[it] * interp_quat[it];
+  }
+  norm = sqrt(norm);
+  for (int it = 0; it < 4; it++) interp_quat[it] /= norm;
+}
+
+// Templated version of calc_world_to_cam_trans(), with the same conventions
+template <typename T>
+void calc_world_to_cam_trans(const T* beg_world_to_ref_t,
+                             const T* end_world_to_ref_t,
+                             const T* ref_to_cam_trans,
+                             double beg_ref_stamp,
+                             double end_ref_stamp,
+                             T const& ref_to_cam_offset,
+                             double cam_stamp,
+                             // Outputs
+                             Eigen::Matrix<T, 3, 3>* R, Eigen::Matrix<T, 3, 1>* t) {
+  if (beg_ref_stamp == end_ref_stamp) {
+    array_to_rigid_transform(beg_world_to_ref_t, R, t);
+    return;
+  }
+
+  // See calc_interp_world_to_ref() for why the timestamps are
+  // subtracted first.
+  T alpha = (T(cam_stamp - beg_ref_stamp) - ref_to_cam_offset)
+    / T(end_ref_stamp - beg_ref_stamp);
+
+  if (alpha < T(0.0) || alpha > T(1.0)) LOG(FATAL) << "Out of bounds in interpolation.\n";
+
+  // Interpolate the rotations and translations of the ref camera
+  T interp_quat[4];
+  quat_slerp(alpha, beg_world_to_ref_t + 3, end_world_to_ref_t + 3, interp_quat);
+  T interp_rot[9];  // row-major
+  ceres::QuaternionToRotation(interp_quat, interp_rot);
+
+  Eigen::Matrix<T, 3, 3> interp_R;
+  Eigen::Matrix<T, 3, 1> interp_t;
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 3; col++) interp_R(row, col) = interp_rot[3 * row + col];
+    interp_t[row] = (T(1.0) - alpha) * beg_world_to_ref_t[row] + alpha * end_world_to_ref_t[row];
+  }
+
+  // Apply the ref to cam transform
+  Eigen::Matrix<T, 3, 3> ref_to_cam_R;
+  Eigen::Matrix<T, 3, 1> ref_to_cam_t;
+  array_to_rigid_transform(ref_to_cam_trans, &ref_to_cam_R, &ref_to_cam_t);
+
+  *R = ref_to_cam_R * interp_R;
+  *t = ref_to_cam_R * interp_t + ref_to_cam_t;
+}
+
+// Templated version of array_to_affine_transform()
+template <typename T>
+void array_to_affine_transform(const T* arr, Eigen::Matrix<T, 3, 3>* A,
+                               Eigen::Matrix<T, 3, 1>* b) {
+  // The array has the 3x4 matrix [A b], stored row-major
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 3; col++) (*A)(row, col) = arr[4 * row + col];
+    (*b)[row] = arr[4 * row + 3];
+  }
+}
+
+// Transform a measured depth point to world coordinates, given the
+// depth to image transform, which is rigid or affine depending on
+// num_depth_params, its scale, and the world to camera transform.
+template <typename T>
+void depth_to_world(int num_depth_params, const T* depth_to_image_t,
+                    T const& depth_to_image_scale,
+                    Eigen::Matrix<T, 3, 3> const& world_to_cam_R,
+                    Eigen::Matrix<T, 3, 1> const& world_to_cam_t,
+                    Eigen::Vector3d const& meas_depth_xyz,
+                    // Output
+                    Eigen::Matrix<T, 3, 1>* world_xyz) {
+  // The current transform from the depth point cloud to the camera image
+  Eigen::Matrix<T, 3, 3> A;
+  Eigen::Matrix<T, 3, 1> b;
+  if (num_depth_params == NUM_AFFINE_PARAMS)
+    array_to_affine_transform(depth_to_image_t, &A, &b);
+  else
+    array_to_rigid_transform(depth_to_image_t, &A, &b);
+
+  // Apply the scale
+  A *= depth_to_image_scale;
+
+  // Convert from depth cloud coordinates to cam coordinates
+  Eigen::Matrix<T, 3, 1> M = A * meas_depth_xyz.cast<T>() + b;
+
+  // Convert to world coordinates. The world to camera transform is
+  // rigid, so its inverse is found by transposing the rotation.
+  *world_xyz = world_to_cam_R.transpose() * (M - world_to_cam_t);
+}
+
 // TODO(oalexan1): Move to a separate file named costFunctions.h
 
 ceres::LossFunction* GetLossFunction(std::string cost_fun, double th) {
@@ -410,6 +722,76 @@ ceres::LossFunction* GetLossFunction(std::string cost_fun, double th) {
   return loss_function;
 }
 
+// The same error as BracketedCamError below, for a given lens
+// distortion model from distortion_models.h, to be used with
+// ceres::AutoDiffCostFunction. When there is no distortion, the
+// distortion block is a placeholder of size 1 which is not used.
+template <class DistModel>
+struct BracketedCamAutoError {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  static const int kNumDistParams = (DistModel::kNumParams > 0) ? DistModel::kNumParams : 1;
+
+  BracketedCamAutoError(Eigen::Vector2d const& meas_dist_pix,
+                        double left_ref_stamp, double right_ref_stamp, double cam_stamp):
+    m_meas_dist_pix(meas_dist_pix),
+    m_left_ref_stamp(left_ref_stamp),
+    m_right_ref_stamp(right_ref_stamp),
+    m_cam_stamp(cam_stamp) {}
+
+  template <typename T>
+  bool operator()(const T* beg_world_to_ref_t, const T* end_world_to_ref_t,
+                  const T* ref_to_cam_trans, const T* xyz, const T* ref_to_cam_offset,
+                  const T* focal_length, const T* optical_center, const T* distortion,
+                  T* residuals) const {
+    Eigen::Matrix<T, 3, 3> world_to_cam_R;
+    Eigen::Matrix<T, 3, 1> world_to_cam_t;
+    calc_world_to_cam_trans(beg_world_to_ref_t, end_world_to_ref_t, ref_to_cam_trans,
+                            m_left_ref_stamp, m_right_ref_stamp, ref_to_cam_offset[0],
+                            m_cam_stamp,
+                            &world_to_cam_R, &world_to_cam_t);
+
+    // Convert world point to given cam coordinates
+    Eigen::Matrix<T, 3, 1> X(xyz[0], xyz[1], xyz[2]);
+    X = world_to_cam_R * X + world_to_cam_t;
+
+    // Project into the image
+    T focal_vector[2] = {focal_length[0], focal_length[0]};
+    T undist_pix[2] = {focal_length[0] * X[0] / X[2], focal_length[0] * X[1] / X[2]};
+    T dist_pix[2];
+    DistModel::Distort(focal_vector, distortion, undist_pix, dist_pix);
+
+    // Compute the residuals
+    residuals[0] = dist_pix[0] + optical_center[0] - T(m_meas_dist_pix[0]);
+    residuals[1] = dist_pix[1] + optical_center[1] - T(m_meas_dist_pix[1]);
+
+    return true;
+  }
+
+  // Factory to hide the construction of the CostFunction object from the client code.
+  static ceres::CostFunction*
+  Create(Eigen::Vector2d const& meas_dist_pix, double left_ref_stamp, double right_ref_stamp,
+         double cam_stamp, std::vector<int> const& block_sizes,
+         camera::CameraParameters const& cam_params) {
+    // Sanity check
+    if (block_sizes.size() != 8 || block_sizes[0] != NUM_RIGID_PARAMS ||
+        block_sizes[1] != NUM_RIGID_PARAMS || block_sizes[2] != NUM_RIGID_PARAMS ||
+        block_sizes[3] != NUM_XYZ_PARAMS || block_sizes[4] != NUM_SCALAR_PARAMS ||
+        block_sizes[5] != 1 || block_sizes[6] != NUM_OPT_CTR_PARAMS ||
+        cam_params.GetDistortion().size() != DistModel::kNumParams)
+      LOG(FATAL) << "BracketedCamAutoError: The block sizes were not set up properly.\n";
+
+    return new ceres::AutoDiffCostFunction<BracketedCamAutoError, NUM_PIX_PARAMS,
+      NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_XYZ_PARAMS,
+      NUM_SCALAR_PARAMS, 1, NUM_OPT_CTR_PARAMS, kNumDistParams>
+      (new BracketedCamAutoError(meas_dist_pix, left_ref_stamp, right_ref_stamp, cam_stamp));
+  }
+
+ private:
+  Eigen::Vector2d m_meas_dist_pix;             // Measured distorted current camera pixel
+  double m_left_ref_stamp, m_right_ref_stamp;  // left and right ref cam timestamps
+  double m_cam_stamp;                          // Current cam timestamp
+};  // End class BracketedCamAutoError
+
 // TODO(oalexan1): Move to a separate file named costFunctions.h
   
 // An error function minimizing the error of projecting
@@ -441,17 +823,22 @@ struct BracketedCamError {
 
     // Set the correct distortion size. This cannot be done in the interface for now.
     m_block_sizes[7] = m_cam_params.GetDistortion().size();
+
+    // This is copied and modified at each evaluation, and only
+    // distortion is used, so the undistortion grid is not needed.
+    m_cam_params.SetUndistortionGridError(0.0);
   }
 
-  // Call to work with ceres::DynamicNumericDiffCostFunction.
+  // Call to work with ceres::DynamicNumericDiffCostFunction. Used
+  // for RPC distortion.
   bool operator()(double const* const* parameters, double* residuals) const {
     Eigen::Affine3d world_to_cam_trans =
-      calc_world_to_cam_trans(parameters[0],  // beg_world_to_ref_t
-                              parameters[1],  // end_world_to_ref_t
-                              parameters[2],  // ref_to_cam_trans
-                              m_left_ref_stamp, m_right_ref_stamp,
-                              parameters[4][0],  // ref_to_cam_offset
-                              m_cam_stamp);
+      calc_world_to_cam_trans_cached(parameters[0],  // beg_world_to_ref_t
+                                     parameters[1],  // end_world_to_ref_t
+                                     parameters[2],  // ref_to_cam_trans
+                                     m_left_ref_stamp, m_right_ref_stamp,
+                                     parameters[4][0],  // ref_to_cam_offset
+                                     m_cam_stamp);
 
     // World point
     Eigen::Vector3d X(parameters[3][0], parameters[3][1], parameters[3][2]);
@@ -486,6 +873,28 @@ struct BracketedCamError {
   Create(Eigen::Vector2d const& meas_dist_pix, double left_ref_stamp, double right_ref_stamp,
          double cam_stamp, std::vector<int> const& block_sizes,
          camera::CameraParameters const& cam_params) {
+    // Use automatic differentiation when possible, which is much
+    // faster than numerical differentiation. The distortion model
+    // is picked here, so it need not be looked up when the cost
+    // function is evaluated.
+    switch (camera::distortionType(cam_params.GetDistortion().size())) {
+    case camera::NO_DISTORTION:
+      return BracketedCamAutoError<camera::NoDistortion>::Create
+        (meas_dist_pix, left_ref_stamp, right_ref_stamp, cam_stamp, block_sizes, cam_params);
+    case camera::FOV_DISTORTION:
+      return BracketedCamAutoError<camera::FovDistortion>::Create
+        (meas_dist_pix, left_ref_stamp, right_ref_stamp, cam_stamp, block_sizes, cam_params);
+    case camera::TSAI4_DISTORTION:
+      return BracketedCamAutoError<camera::Tsai4Distortion>::Create
+        (meas_dist_pix, left_ref_stamp, right_ref_stamp, cam_stamp, block_sizes, cam_params);
+    case camera::TSAI5_DISTORTION:
+      return BracketedCamAutoError<camera::Tsai5Distortion>::Create
+        (meas_dist_pix, left_ref_stamp, right_ref_stamp, cam_stamp, block_sizes, cam_params);
+    default:
+      break;
+    }
+
+    // RPC distortion
     ceres::DynamicNumericDiffCostFunction<BracketedCamError>* cost_function =
       new ceres::DynamicNumericDiffCostFunction<BracketedCamError>
       (new BracketedCamError(meas_dist_pix, left_ref_stamp, right_ref_stamp,
@@ -543,40 +952,28 @@ struct BracketedDepthError {
     }
   }
 
-  // Call to work with ceres::DynamicNumericDiffCostFunction.
-  bool operator()(double const* const* parameters, double* residuals) const {
+  // Call to work with ceres::AutoDiffCostFunction.
+  template <typename T>
+  bool operator()(const T* beg_world_to_ref_t, const T* end_world_to_ref_t,
+                  const T* ref_to_cam_trans, const T* depth_to_image_t,
+                  const T* depth_to_image_scale, const T* xyz, const T* ref_to_cam_offset,
+                  T* residuals) const {
     // Current world to camera transform
-    Eigen::Affine3d world_to_cam_trans =
-      calc_world_to_cam_trans(parameters[0],  // beg_world_to_ref_t
-                              parameters[1],  // end_world_to_ref_t
-                              parameters[2],  // ref_to_cam_trans
-                              m_left_ref_stamp, m_right_ref_stamp,
-                              parameters[6][0],  // ref_to_cam_offset
-                              m_cam_stamp);
-
-    // The current transform from the depth point cloud to the camera image
-    Eigen::Affine3d depth_to_image;
-    if (m_block_sizes[3] == NUM_AFFINE_PARAMS)
-      array_to_affine_transform(depth_to_image, parameters[3]);
-    else
-      array_to_rigid_transform(depth_to_image, parameters[3]);
-
-    // Apply the scale
-    double depth_to_image_scale = parameters[4][0];
-    depth_to_image.linear() *= depth_to_image_scale;
-
-    // Convert from depth cloud coordinates to cam coordinates
-    Eigen::Vector3d M = depth_to_image * m_meas_depth_xyz;
-
-    // Convert to world coordinates
-    M = world_to_cam_trans.inverse() * M;
-
-    // Triangulated world point
-    Eigen::Vector3d X(parameters[5][0], parameters[5][1], parameters[5][2]);
+    Eigen::Matrix<T, 3, 3> world_to_cam_R;
+    Eigen::Matrix<T, 3, 1> world_to_cam_t;
+    calc_world_to_cam_trans(beg_world_to_ref_t, end_world_to_ref_t, ref_to_cam_trans,
+                            m_left_ref_stamp, m_right_ref_stamp, ref_to_cam_offset[0],
+                            m_cam_stamp,
+                            &world_to_cam_R, &world_to_cam_t);
+
+    // Depth point in world coordinates
+    Eigen::Matrix<T, 3, 1> M;
+    depth_to_world(m_block_sizes[3], depth_to_image_t, depth_to_image_scale[0],
+                   world_to_cam_R, world_to_cam_t, m_meas_depth_xyz, &M);
 
     // Compute the residuals
     for (size_t it = 0; it < NUM_XYZ_PARAMS; it++) {
-      residuals[it] = m_weight * (X[it] - M[it]);
+      residuals[it] = T(m_weight) * (xyz[it] - M[it]);
     }
 
     return true;
@@ -586,18 +983,19 @@ struct BracketedDepthError {
   static ceres::CostFunction* Create(double weight, Eigen::Vector3d const& meas_depth_xyz,
                                      double left_ref_stamp, double right_ref_stamp,
                                      double cam_stamp, std::vector<int> const& block_sizes) {
-    ceres::DynamicNumericDiffCostFunction<BracketedDepthError>* cost_function =
-      new ceres::DynamicNumericDiffCostFunction<BracketedDepthError>
-      (new BracketedDepthError(weight, meas_depth_xyz, left_ref_stamp, right_ref_stamp,
-                             cam_stamp, block_sizes));
-
-    // The residual size is always the same.
-    cost_function->SetNumResiduals(NUM_XYZ_PARAMS);
-
-    for (size_t i = 0; i < block_sizes.size(); i++)
-      cost_function->AddParameterBlock(block_sizes[i]);
-
-    return cost_function;
+    BracketedDepthError* functor
+      = new BracketedDepthError(weight, meas_depth_xyz, left_ref_stamp, right_ref_stamp,
+                                cam_stamp, block_sizes);
+
+    // The depth to image transform is either rigid or affine
+    if (block_sizes[3] == NUM_AFFINE_PARAMS)
+      return new ceres::AutoDiffCostFunction<BracketedDepthError, NUM_XYZ_PARAMS,
+        NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_AFFINE_PARAMS,
+        NUM_SCALAR_PARAMS, NUM_XYZ_PARAMS, NUM_SCALAR_PARAMS>(functor);
+
+    return new ceres::AutoDiffCostFunction<BracketedDepthError, NUM_XYZ_PARAMS,
+      NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS,
+      NUM_SCALAR_PARAMS, NUM_XYZ_PARAMS, NUM_SCALAR_PARAMS>(functor);
   }
 
  private:
@@ -638,37 +1036,28 @@ struct BracketedDepthMeshError {
     }
   }
 
-  // Call to work with ceres::DynamicNumericDiffCostFunction.
-  bool operator()(double const* const* parameters, double* residuals) const {
+  // Call to work with ceres::AutoDiffCostFunction.
+  template <typename T>
+  bool operator()(const T* beg_world_to_ref_t, const T* end_world_to_ref_t,
+                  const T* ref_to_cam_trans, const T* depth_to_image_t,
+                  const T* depth_to_image_scale, const T* ref_to_cam_offset,
+                  T* residuals) const {
     // Current world to camera transform
-    Eigen::Affine3d world_to_cam_trans =
-      calc_world_to_cam_trans(parameters[0],  // beg_world_to_ref_t
-                              parameters[1],  // end_world_to_ref_t
-                              parameters[2],  // ref_to_cam_trans
-                              m_left_ref_stamp, m_right_ref_stamp,
-                              parameters[5][0],  // ref_to_cam_offset
-                              m_cam_stamp);
-
-    // The current transform from the depth point cloud to the camera image
-    Eigen::Affine3d depth_to_image;
-    if (m_block_sizes[3] == NUM_AFFINE_PARAMS)
-      array_to_affine_transform(depth_to_image, parameters[3]);
-    else
-      array_to_rigid_transform(depth_to_image, parameters[3]);
-
-    // Apply the scale
-    double depth_to_image_scale = parameters[4][0];
-    depth_to_image.linear() *= depth_to_image_scale;
-
-    // Convert from depth cloud coordinates to cam coordinates
-    Eigen::Vector3d M = depth_to_image * m_meas_depth_xyz;
-
-    // Convert to world coordinates
-    M = world_to_cam_trans.inverse() * M;
+    Eigen::Matrix<T, 3, 3> world_to_cam_R;
+    Eigen::Matrix<T, 3, 1> world_to_cam_t;
+    calc_world_to_cam_trans(beg_world_to_ref_t, end_world_to_ref_t, ref_to_cam_trans,
+                            m_left_ref_stamp, m_right_ref_stamp, ref_to_cam_offset[0],
+                            m_cam_stamp,
+                            &world_to_cam_R, &world_to_cam_t);
+
+    // Depth point in world coordinates
+    Eigen::Matrix<T, 3, 1> M;
+    depth_to_world(m_block_sizes[3], depth_to_image_t, depth_to_image_scale[0],
+                   world_to_cam_R, world_to_cam_t, m_meas_depth_xyz, &M);
 
     // Compute the residuals
     for (size_t it = 0; it < NUM_XYZ_PARAMS; it++) {
-      residuals[it] = m_weight * (m_mesh_xyz[it] - M[it]);
+      residuals[it] = T(m_weight) * (T(m_mesh_xyz[it]) - M[it]);
     }
 
     return true;
@@ -680,19 +1069,20 @@ struct BracketedDepthMeshError {
                                      Eigen::Vector3d const& mesh_xyz,
                                      double left_ref_stamp, double right_ref_stamp,
                                      double cam_stamp, std::vector<int> const& block_sizes) {
-    ceres::DynamicNumericDiffCostFunction<BracketedDepthMeshError>* cost_function =
-      new ceres::DynamicNumericDiffCostFunction<BracketedDepthMeshError>
-      (new BracketedDepthMeshError(weight, meas_depth_xyz, mesh_xyz,
-                                   left_ref_stamp, right_ref_stamp,
-                                   cam_stamp, block_sizes));
-
-    // The residual size is always the same.
-    cost_function->SetNumResiduals(NUM_XYZ_PARAMS);
-
-    for (size_t i = 0; i < block_sizes.size(); i++)
-      cost_function->AddParameterBlock(block_sizes[i]);
-
-    return cost_function;
+    BracketedDepthMeshError* functor
+      = new BracketedDepthMeshError(weight, meas_depth_xyz, mesh_xyz,
+                                    left_ref_stamp, right_ref_stamp,
+                                    cam_stamp, block_sizes);
+
+    // The depth to image transform is either rigid or affine
+    if (block_sizes[3] == NUM_AFFINE_PARAMS)
+      return new ceres::AutoDiffCostFunction<BracketedDepthMeshError, NUM_XYZ_PARAMS,
+        NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_AFFINE_PARAMS,
+        NUM_SCALAR_PARAMS, NUM_SCALAR_PARAMS>(functor);
+
+    return new ceres::AutoDiffCostFunction<BracketedDepthMeshError, NUM_XYZ_PARAMS,
+      NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS, NUM_RIGID_PARAMS,
+      NUM_SCALAR_PARAMS, NUM_SCALAR_PARAMS>(functor);
   }
 
  private:
@@ -715,13 +1105,12 @@ struct XYZError {
       LOG(FATAL) << "XYZError: The block sizes were not set up properly.\n";
   }
 
-  // Call to work with ceres::DynamicNumericDiffCostFunction.
-  // Takes array of arrays as parameters.
-  // TODO(oalexan1): May want to use the analytical Ceres cost function
-  bool operator()(double const* const* parameters, double* residuals) const {
+  // Call to work with ceres::AutoDiffCostFunction.
+  template <typename T>
+  bool operator()(const T* xyz, T* residuals) const {
     // Compute the residuals
     for (int it = 0; it < NUM_XYZ_PARAMS; it++)
-      residuals[it] = m_weight * (parameters[0][it] - m_ref_xyz[it]);
+      residuals[it] = T(m_weight) * (xyz[it] - T(m_ref_xyz[it]));
 
     return true;
   }
@@ -730,18 +1119,8 @@ struct XYZError {
   static ceres::CostFunction* Create(Eigen::Vector3d const& ref_xyz,
                                      std::vector<int> const& block_sizes,
                                      double weight) {
-    ceres::DynamicNumericDiffCostFunction<XYZError>* cost_function =
-      new ceres::DynamicNumericDiffCostFunction<XYZError>
+    return new ceres::AutoDiffCostFunction<XYZError, NUM_XYZ_PARAMS, NUM_XYZ_PARAMS>
       (new XYZError(ref_xyz, block_sizes, weight));
-
-    // The residual size is always the same
-    cost_function->SetNumResiduals(NUM_XYZ_PARAMS);
-
-    // The camera wrapper knows all of the block sizes to add.
-    for (size_t i = 0; i < block_sizes.size(); i++) {
-      cost_function->AddParameterBlock(block_sizes[i]);
-    }
-    return cost_function;
   }
 
  private:
@@ -750,41 +1129,65 @@ struct XYZError {
   double m_weight;
 };  // End class XYZError
 
+// Print percentiles of the absolute residuals of each kind. Residuals
+// of the same kind come in runs, so they are grouped by comparing each
+// name only with the previous one. Each percentile is then found by
+// selection rather than by sorting, with the kinds done in parallel.
 void calc_residuals_stats(std::vector<double> const& residuals,
                           std::vector<std::string> const& residual_names,
-                          std::string const& tag) {
+                          std::string const& tag, int num_threads) {
   size_t num = residuals.size();
 
   if (num != residual_names.size())
     LOG(FATAL) << "There must be as many residuals as residual names.";
 
-  std::map<std::string, std::vector<double>> stats;
-  for (size_t it = 0; it < residuals.size(); it++)
-    stats[residual_names[it]] = std::vector<double>();  // initialize
-
-  for (size_t it = 0; it < residuals.size(); it++)
-    stats[residual_names[it]].push_back(std::abs(residuals[it]));
-
-  std::cout << "The 25, 50, 75, and 100th percentile residual stats " << tag << std::endl;
-  for (auto it = stats.begin(); it != stats.end(); it++) {
-    std::string const& name = it->first;
-    std::vector<double> vals = stats[name];  // make a copy
-    std::sort(vals.begin(), vals.end());
+  std::map<std::string, int> name_to_index;
+  std::vector<std::vector<double>> stats;
+  int index = -1;
+  for (size_t it = 0; it < residuals.size(); it++) {
+    if (it == 0 || residual_names[it] != residual_names[it - 1]) {
+      auto pos = name_to_index.find(residual_names[it]);
+      if (pos == name_to_index.end()) {
+        pos = name_to_index.insert(std::make_pair(residual_names[it],
+                                                  static_cast<int>(stats.size()))).first;
+        stats.push_back(std::vector<double>());
+      }
+      index = pos->second;
+    }
+    stats[index].push_back(std::abs(residuals[it]));
+  }
 
+  // The 25, 50, 75, and 100th percentiles of each kind
+  int num_kinds = stats.size();
+  std::vector<std::vector<double>> percentiles(num_kinds);
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+  for (int kind = 0; kind < num_kinds; kind++) {
+    std::vector<double> & vals = stats[kind];  // alias
     int len = vals.size();
 
     int it1 = static_cast<int>(0.25 * len);
     int it2 = static_cast<int>(0.50 * len);
     int it3 = static_cast<int>(0.75 * len);
-    int it4 = static_cast<int>(len - 1);
 
-    if (len == 0)
-      std::cout << name << ": " << "none";
-    else
-      std::cout << std::setprecision(5)
-                << name << ": " << vals[it1] << ' ' << vals[it2] << ' '
-                << vals[it3] << ' ' << vals[it4];
-    std::cout << " (" << len << " residuals)" << std::endl;
+    // After selecting the median, the smaller values precede it and
+    // the larger ones follow it, so the other percentiles are found in
+    // the two halves only, leaving the median in place
+    std::nth_element(vals.begin(), vals.begin() + it2, vals.end());
+    std::nth_element(vals.begin(), vals.begin() + it1, vals.begin() + it2);
+    if (it3 > it2)
+      std::nth_element(vals.begin() + it2 + 1, vals.begin() + it3, vals.end());
+    double max_val = *std::max_element(vals.begin() + it3, vals.end());
+    percentiles[kind] = {vals[it1], vals[it2], vals[it3], max_val};
+  }
+
+  std::cout << "The 25, 50, 75, and 100th percentile residual stats " << tag << std::endl;
+  for (auto it = name_to_index.begin(); it != name_to_index.end(); it++) {
+    std::string const& name = it->first;
+    std::vector<double> const& vals = percentiles[it->second];  // alias
+    std::cout << std::setprecision(5)
+              << name << ": " << vals[0] << ' ' << vals[1] << ' '
+              << vals[2] << ' ' << vals[3]
+              << " (" << stats[it->second].size() << " residuals)" << std::endl;
   }
 }
 
@@ -891,15 +1294,39 @@ void calc_world_to_cam_rig_or_not(// Inputs
 }
 
 void parameterValidation() {
+  ceres::LinearSolverType linear_solver_type;
+  if (!ceres::StringToLinearSolverType(FLAGS_linear_solver, &linear_solver_type))
+    LOG(FATAL) << "Unknown value for --linear_solver: " << FLAGS_linear_solver << "\n";
+
+  ceres::PreconditionerType preconditioner_type;
+  if (!ceres::StringToPreconditionerType(FLAGS_preconditioner, &preconditioner_type))
+    LOG(FATAL) << "Unknown value for --preconditioner: " << FLAGS_preconditioner << "\n";
+
+  if (FLAGS_parameter_ordering != "auto" && FLAGS_parameter_ordering != "points_first")
+    LOG(FATAL) << "Unknown value for --parameter_ordering: " << FLAGS_parameter_ordering
+               << "\n";
     
   if (FLAGS_robust_threshold <= 0.0)
     LOG(FATAL) << "The robust threshold must be positive.\n";
 
   if (FLAGS_bracket_len <= 0.0) LOG(FATAL) << "Bracket length must be positive.";
 
-  if (FLAGS_num_overlaps < 1 && (FLAGS_nvm == "" || FLAGS_no_nvm_matches))
+  if (FLAGS_num_overlaps < 1 && FLAGS_num_nearby_cameras < 1 &&
+      (FLAGS_nvm == "" || FLAGS_no_nvm_matches))
     LOG(FATAL) << "No nvm file was specified or it is not desired to read its matches. "
-      "Then must set a positive --num_overlaps to be able to find new interest point matches.";
+      "Then must set a positive --num_overlaps or --num_nearby_cameras to be able to find "
+      "new interest point matches.";
+
+  if (FLAGS_prev_nvm != "" && FLAGS_num_overlaps < 1 && FLAGS_num_nearby_cameras < 1)
+    LOG(FATAL) << "With --prev_nvm, must set a positive --num_overlaps or "
+               << "--num_nearby_cameras to match the new images.\n";
+
+  if (FLAGS_num_overlaps < 0 || FLAGS_num_nearby_cameras < 0)
+    LOG(FATAL) << "The values of --num_overlaps and --num_nearby_cameras must be "
+               << "non-negative.\n";
+
+  if (FLAGS_max_nearby_view_angle <= 0.0 || FLAGS_max_nearby_view_angle > 180.0)
+    LOG(FATAL) << "The value of --max_nearby_view_angle must be in (0, 180].\n";
 
   if (FLAGS_timestamp_offsets_max_change < 0)
     LOG(FATAL) << "The timestamp offsets must be non-negative.";
@@ -907,6 +1334,12 @@ void parameterValidation() {
   if (FLAGS_min_triangulation_angle <= 0.0)
     LOG(FATAL) << "The min triangulation angle must be positive.\n";
 
+  if (FLAGS_num_partitions < 1)
+    LOG(FATAL) << "The number of partitions must be positive.\n";
+
+  if (FLAGS_partition_overlap < 0)
+    LOG(FATAL) << "The partition overlap must be non-negative.\n";
+
   if (FLAGS_depth_tri_weight < 0.0)
     LOG(FATAL) << "The depth weight must non-negative.\n";
 
@@ -1004,25 +1437,20 @@ void flagOutlierByExclusionDist(// Inputs
                                 int ref_cam_type,
                                 std::vector<camera::CameraParameters> const& cam_params,
                                 std::vector<dense_map::cameraImage> const& cams,
-                                std::vector<std::map<int, int>> const& pid_to_cid_fid,
                                 std::vector<std::vector<std::pair<float, float>>>
                                 const& keypoint_vec,
-                                // Outputs
-  std::vector<std::map<int, std::map<int, int>>>& pid_cid_fid_inlier) {
-
-  // Initialize the output
-  pid_cid_fid_inlier.resize(pid_to_cid_fid.size());
+                                // Outputs (the inlier flags get set)
+                                dense_map::TrackStore& tracks) {
 
   // Iterate though interest point matches
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-    for (auto cid_fid = pid_to_cid_fid[pid].begin(); cid_fid != pid_to_cid_fid[pid].end();
-         cid_fid++) {
-      int cid = cid_fid->first;
-      int fid = cid_fid->second;
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
+    for (auto& obs : tracks[pid]) {
+      int cid = obs.cid;
+      int fid = obs.fid;
       int cam_type = cams[cid].camera_type;
 
       // Initially there are inliers only
-      pid_cid_fid_inlier[pid][cid][fid] = 1;
+      obs.inlier = 1;
 
       // Flag as outliers pixels at the image boundary.
       Eigen::Vector2d dist_pix(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
@@ -1032,64 +1460,102 @@ void flagOutlierByExclusionDist(// Inputs
       // size, no outliers are flagged
       if (std::abs(dist_pix[0] - dist_size[0] / 2.0) > dist_crop_size[0] / 2.0  ||
           std::abs(dist_pix[1] - dist_size[1] / 2.0) > dist_crop_size[1] / 2.0) 
-        dense_map::setMapValue(pid_cid_fid_inlier, pid, cid, fid, 0);
+        obs.inlier = 0;
     }
   }
   return;
 }
 
+// Look up the depth measurement for each feature, if it has one. The
+// result for each feature is stored at the index of that feature in
+// the tracks, and equals bad_xyz if there is no valid measurement.
+// The features are visited image by image, so that each depth cloud
+// is read only once, and need not stay in memory afterwards. The
+// depth clouds are read ahead in parallel.
+void lookupDepthValues(// Inputs
+                       std::vector<dense_map::cameraImage> const& cams,
+                       std::vector<std::vector<std::pair<float, float>>>
+                       const& keypoint_vec,
+                       dense_map::TrackStore const& tracks,
+                       Eigen::Vector3d const& bad_xyz,
+                       // Outputs
+                       std::vector<Eigen::Vector3d>& obs_depth_xyz) {
+  obs_depth_xyz.assign(tracks.numObs(), bad_xyz);
+
+  // For each image, the index in the tracks of each of its features,
+  // and its fid
+  std::vector<std::vector<std::pair<size_t, int>>> cid_to_obs(cams.size());
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
+    for (auto const& obs : tracks[pid])
+      cid_to_obs[obs.cid].push_back(std::make_pair(tracks.obsIndex(obs), obs.fid));
+  }
+
+  std::vector<int> cids;
+  for (size_t cid = 0; cid < cams.size(); cid++) {
+    if (!cid_to_obs[cid].empty() && cams[cid].hasDepthCloud())
+      cids.push_back(cid);
+  }
+
+  dense_map::visitCameraData
+    (cams, cids, false, true, FLAGS_num_threads,  // depth clouds only
+     [&](int cid, cv::Mat const& image, cv::Mat const& depth_cloud) {
+      for (auto const& index_fid : cid_to_obs[cid]) {
+        int fid = index_fid.second;
+        Eigen::Vector2d dist_ip(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
+        Eigen::Vector3d depth_xyz(0, 0, 0);
+        if (dense_map::depthValue(depth_cloud, dist_ip, depth_xyz))
+          obs_depth_xyz[index_fid.first] = depth_xyz;
+      }
+    });
+}
+
 // Flag outliers by triangulation angle and reprojection error.  It is
 // assumed that the cameras in world_to_cam are up-to-date given the
 // current state of optimization, and that the residuals (including
 // the reprojection errors) have also been updated beforehand.
 void flagOutliersByTriAngleAndReprojErr(  // Inputs
   double min_triangulation_angle, double max_reprojection_error,
-  std::vector<std::map<int, int>> const& pid_to_cid_fid,
   std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
   std::vector<Eigen::Affine3d> const& world_to_cam, std::vector<Eigen::Vector3d> const& xyz_vec,
-  std::vector<std::map<int, std::map<int, int>>> const& pid_cid_fid_to_residual_index,
-  std::vector<double> const& residuals,
-  // Outputs
-  std::vector<std::map<int, std::map<int, int>>>& pid_cid_fid_inlier) {
+  std::vector<double> const& residuals, int num_threads,
+  // Outputs (the inlier flags get updated)
+  dense_map::TrackStore& tracks) {
+  // The camera centers, computed once rather than for each pair of rays
+  std::vector<Eigen::Vector3d> cam_ctrs(world_to_cam.size());
+  for (size_t cid = 0; cid < world_to_cam.size(); cid++)
+    cam_ctrs[cid] = world_to_cam[cid].inverse().translation();
+
+  // The tracks are independent of each other, so are processed in
+  // parallel.
+  int num_tracks = tracks.size();
+
   // Must deal with outliers by triangulation angle before
   // removing outliers by reprojection error, as the latter will
   // exclude some rays which form the given triangulated points.
   int num_outliers_by_angle = 0, num_total_features = 0;
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-    // Find the largest angle among any two intersecting rays
-    double max_rays_angle = 0.0;
-
-    for (auto cid_fid1 = pid_to_cid_fid[pid].begin();
-         cid_fid1 != pid_to_cid_fid[pid].end(); cid_fid1++) {
-      int cid1 = cid_fid1->first;
-      int fid1 = cid_fid1->second;
-
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1024) \
+  reduction(+:num_outliers_by_angle, num_total_features)
+  for (int pid = 0; pid < num_tracks; pid++) {
+    // The rays from the inlier features to the triangulated point. The
+    // features in a track are in increasing order of cid, so each
+    // pair of rays is considered once below.
+    std::vector<Eigen::Vector3d> rays;
+    for (auto const& obs : tracks[pid]) {
       // Deal with inliers only
-      if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid1, fid1)) continue;
+      if (!obs.inlier) continue;
 
       num_total_features++;
 
-      Eigen::Vector3d cam_ctr1 = (world_to_cam[cid1].inverse()) * Eigen::Vector3d(0, 0, 0);
-      Eigen::Vector3d ray1 = xyz_vec[pid] - cam_ctr1;
-      ray1.normalize();
-
-      for (auto cid_fid2 = pid_to_cid_fid[pid].begin();
-           cid_fid2 != pid_to_cid_fid[pid].end(); cid_fid2++) {
-        int cid2 = cid_fid2->first;
-        int fid2 = cid_fid2->second;
-
-        // Look at each cid and next cids
-        if (cid2 <= cid1)
-          continue;
-
-        // Deal with inliers only
-        if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid2, fid2)) continue;
-
-        Eigen::Vector3d cam_ctr2 = (world_to_cam[cid2].inverse()) * Eigen::Vector3d(0, 0, 0);
-        Eigen::Vector3d ray2 = xyz_vec[pid] - cam_ctr2;
-        ray2.normalize();
+      Eigen::Vector3d ray = xyz_vec[pid] - cam_ctrs[obs.cid];
+      ray.normalize();
+      rays.push_back(ray);
+    }
 
-        double curr_angle = (180.0 / M_PI) * acos(ray1.dot(ray2));
+    // Find the largest angle among any two intersecting rays
+    double max_rays_angle = 0.0;
+    for (size_t it1 = 0; it1 < rays.size(); it1++) {
+      for (size_t it2 = it1 + 1; it2 < rays.size(); it2++) {
+        double curr_angle = (180.0 / M_PI) * acos(rays[it1].dot(rays[it2]));
 
         if (std::isnan(curr_angle) || std::isinf(curr_angle)) continue;
 
@@ -1101,16 +1567,12 @@ void flagOutliersByTriAngleAndReprojErr(  // Inputs
       continue;  // This is a good triangulated point, with large angle of convergence
 
     // Flag as outliers all the features for this cid
-    for (auto cid_fid = pid_to_cid_fid[pid].begin();
-         cid_fid != pid_to_cid_fid[pid].end(); cid_fid++) {
-      int cid = cid_fid->first;
-      int fid = cid_fid->second;
-
+    for (auto& obs : tracks[pid]) {
       // Deal with inliers only
-      if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid)) continue;
+      if (!obs.inlier) continue;
 
       num_outliers_by_angle++;
-      dense_map::setMapValue(pid_cid_fid_inlier, pid, cid, fid, 0);
+      obs.inlier = 0;
     }
   }
   std::cout << std::setprecision(4) << "Removed " << num_outliers_by_angle
@@ -1120,19 +1582,18 @@ void flagOutliersByTriAngleAndReprojErr(  // Inputs
 
   int num_outliers_reproj = 0;
   num_total_features = 0;  // reusing this variable
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-    for (auto cid_fid = pid_to_cid_fid[pid].begin();
-         cid_fid != pid_to_cid_fid[pid].end(); cid_fid++) {
-      int cid = cid_fid->first;
-      int fid = cid_fid->second;
-
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1024) \
+  reduction(+:num_outliers_reproj, num_total_features)
+  for (int pid = 0; pid < num_tracks; pid++) {
+    for (auto& obs : tracks[pid]) {
       // Deal with inliers only
-      if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid)) continue;
+      if (!obs.inlier) continue;
 
       num_total_features++;
 
       // Find the pixel residuals
-      size_t residual_index = dense_map::getMapValue(pid_cid_fid_to_residual_index, pid, cid, fid);
+      if (obs.residual_index < 0) LOG(FATAL) << "Missing residual index for an inlier.\n";
+      size_t residual_index = obs.residual_index;
       if (residuals.size() <= residual_index + 1) LOG(FATAL) << "Too few residuals.\n";
 
       double res_x = residuals[residual_index + 0];
@@ -1141,7 +1602,7 @@ void flagOutliersByTriAngleAndReprojErr(  // Inputs
       bool is_good = (Eigen::Vector2d(res_x, res_y).norm() <= max_reprojection_error);
       if (!is_good) {
         num_outliers_reproj++;
-        dense_map::setMapValue(pid_cid_fid_inlier, pid, cid, fid, 0);
+        obs.inlier = 0;
       }
     }
   }
@@ -1157,12 +1618,15 @@ void flagOutliersByTriAngleAndReprojErr(  // Inputs
 void evalResiduals(  // Inputs
   std::string const& tag, std::vector<std::string> const& residual_names,
   std::vector<double> const& residual_scales,
+  std::vector<ceres::ResidualBlockId> const& residual_blocks, int num_threads,
   // Outputs
   ceres::Problem& problem, std::vector<double>& residuals) {
   double total_cost = 0.0;
   ceres::Problem::EvaluateOptions eval_options;
-  eval_options.num_threads = 1;
+  eval_options.num_threads = num_threads;
   eval_options.apply_loss_function = false;  // want raw residuals
+  // Evaluate the residuals in the given order, which the names follow
+  eval_options.residual_blocks = residual_blocks;
   problem.Evaluate(eval_options, &total_cost, &residuals, NULL, NULL);
 
   // Sanity checks, after the residuals are created
@@ -1172,10 +1636,12 @@ void evalResiduals(  // Inputs
     LOG(FATAL) << "There must be as many residual values as residual scales.";
 
   // Compensate for the scale
-  for (size_t it = 0; it < residuals.size(); it++)
+  int num_residuals = residuals.size();
+#pragma omp parallel for num_threads(num_threads) schedule(static)
+  for (int it = 0; it < num_residuals; it++)
     residuals[it] /= residual_scales[it];
 
-  dense_map::calc_residuals_stats(residuals, residual_names, tag);
+  dense_map::calc_residuals_stats(residuals, residual_names, tag, num_threads);
   return;
 }
 
@@ -1266,6 +1732,63 @@ void calc_rig_using_word_to_cam(int ref_cam_type, int num_cam_types,
 
 } // end namespace dense_map
 
+// Set the solver options from the command line. The triangulated
+// points are needed to be eliminated first with --parameter_ordering
+// points_first.
+void setSolverOptions(ceres::Problem & problem, std::vector<Eigen::Vector3d> & xyz_vec,
+                      ceres::Solver::Options & options) {
+  // These were validated already
+  ceres::StringToLinearSolverType(FLAGS_linear_solver, &options.linear_solver_type);
+  ceres::StringToPreconditionerType(FLAGS_preconditioner, &options.preconditioner_type);
+
+  options.use_inner_iterations = FLAGS_use_inner_iterations;
+  options.num_threads = FLAGS_num_opt_threads;  // The result is more predictable with one thread
+  options.max_num_iterations = FLAGS_num_iterations;
+  options.minimizer_progress_to_stdout = true;
+  options.gradient_tolerance = 1e-16;
+  options.function_tolerance = 1e-16;
+  options.parameter_tolerance = FLAGS_parameter_tolerance;
+
+  if (FLAGS_parameter_ordering == "points_first" && !xyz_vec.empty()) {
+    // Every parameter block of the problem must be in the ordering
+    double const* beg_xyz = &xyz_vec[0][0];
+    double const* end_xyz = beg_xyz + dense_map::NUM_XYZ_PARAMS * xyz_vec.size();
+    std::vector<double*> blocks;
+    problem.GetParameterBlocks(&blocks);
+    auto * ordering = new ceres::ParameterBlockOrdering;
+    for (size_t it = 0; it < blocks.size(); it++) {
+      bool is_xyz = (blocks[it] >= beg_xyz && blocks[it] < end_xyz);
+      ordering->AddElementToGroup(blocks[it], is_xyz ? 0 : 1);
+    }
+    options.linear_solver_ordering.reset(ordering);
+  }
+}
+
+// The time taken by an optimization pass, and how it went
+struct PassReport {
+  double setup_time, solve_time, linear_solver_time;
+  int num_iterations;
+  double initial_cost, final_cost;
+};
+
+// Print the timing and progress of all optimization passes together
+void printPassReports(std::vector<PassReport> const& reports) {
+  std::cout << "\nOptimization summary (times in seconds)\n";
+  std::cout << std::setw(6) << "pass" << std::setw(10) << "setup" << std::setw(10) << "solve"
+            << std::setw(14) << "linear_solver" << std::setw(12) << "iterations"
+            << std::setw(16) << "initial_cost" << std::setw(16) << "final_cost" << "\n";
+  for (size_t pass = 0; pass < reports.size(); pass++) {
+    PassReport const& r = reports[pass];  // alias
+    std::cout << std::setw(6) << pass + 1 << std::fixed << std::setprecision(2)
+              << std::setw(10) << r.setup_time << std::setw(10) << r.solve_time
+              << std::setw(14) << r.linear_solver_time << std::setw(12) << r.num_iterations
+              << std::scientific << std::setprecision(6)
+              << std::setw(16) << r.initial_cost << std::setw(16) << r.final_cost << "\n";
+  }
+  std::cout.unsetf(std::ios_base::floatfield);
+  std::cout << std::endl;
+}
+
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   google::ParseCommandLineFlags(&argc, &argv, true);
@@ -1283,20 +1806,30 @@ int main(int argc, char** argv) {
   std::vector<Eigen::Affine3d>          ref_to_cam_trans;
   std::vector<double>                   ref_to_cam_timestamp_offsets;
 
+  // Measure the whole run, with each major stage measured within it
+  dense_map::StageTimer all_timer("rig_calibrator");
+
   bool use_initial_rig_transforms = FLAGS_use_initial_rig_transforms; // this may change
+  dense_map::StageTimer config_timer("read_rig_config");
   dense_map::readRigConfig(FLAGS_rig_config, use_initial_rig_transforms, ref_cam_type, cam_names,
                            cam_params, ref_to_cam_trans, depth_to_image,
                            ref_to_cam_timestamp_offsets);
+  config_timer.stop();
 
   int num_cam_types = cam_params.size();
 
+  for (int cam_type = 0; cam_type < num_cam_types; cam_type++)
+    cam_params[cam_type].SetUndistortionGridError(FLAGS_undistortion_grid_error);
+
   // Optionally load the mesh
   mve::TriangleMesh::Ptr mesh;
   std::shared_ptr<mve::MeshInfo> mesh_info;
   std::shared_ptr<tex::Graph> graph;
   std::shared_ptr<BVHTree> bvh_tree;
-  if (FLAGS_mesh != "")
+  if (FLAGS_mesh != "") {
+    dense_map::StageTimer mesh_timer("load_mesh");
     dense_map::loadMeshBuildTree(FLAGS_mesh, mesh, mesh_info, graph, bvh_tree);
+  }
 
   // world_to_ref has the transforms from the ref cameras to the world,
   // while world_to_cam has the transforms from the world to all cameras,
@@ -1313,6 +1846,7 @@ int main(int argc, char** argv) {
   std::vector<std::string> ref_image_files;
   dense_map::nvmData nvm;
 
+  dense_map::StageTimer read_timer("read_cameras");
   if (FLAGS_camera_poses != "")
     dense_map::readCameraPoses(FLAGS_camera_poses, ref_cam_type, cam_names, // in
                                nvm, ref_timestamps, world_to_ref, ref_image_files,
@@ -1321,7 +1855,19 @@ int main(int argc, char** argv) {
     dense_map::readNvm(FLAGS_nvm, ref_cam_type, cam_names, // in
                        nvm, ref_timestamps, world_to_ref, ref_image_files,
                        image_data, depth_data); // out
+
+  // Start from the previous solution for the images processed before
+  dense_map::nvmData prev_nvm;
+  if (FLAGS_prev_nvm != "") {
+    dense_map::ReadNVM(FLAGS_prev_nvm, &prev_nvm.cid_to_keypoint_map,
+                       &prev_nvm.cid_to_filename, &prev_nvm.pid_to_cid_fid,
+                       &prev_nvm.pid_to_xyz, &prev_nvm.cid_to_cam_t_global);
+    dense_map::setPosesFromNvm(prev_nvm, ref_image_files, // in
+                               world_to_ref, image_data); // out
+  }
   
+  read_timer.stop();
+
   // Keep here the images, timestamps, and bracketing information
   std::vector<dense_map::cameraImage> cams;
   //  The range of ref_to_cam_timestamp_offsets[cam_type] before
@@ -1329,6 +1875,7 @@ int main(int argc, char** argv) {
   std::vector<double> min_timestamp_offset, max_timestamp_offset;
   // Select the images to use. If the rig is used, keep non-ref images
   // only within the bracket.
+  dense_map::StageTimer lookup_timer("lookup_images");
   dense_map::lookupImages(// Inputs
                           ref_cam_type, FLAGS_no_rig, FLAGS_bracket_len,
                           FLAGS_timestamp_offsets_max_change,
@@ -1337,6 +1884,7 @@ int main(int argc, char** argv) {
                           ref_to_cam_timestamp_offsets,
                           // Outputs
                           cams, min_timestamp_offset, max_timestamp_offset);
+  lookup_timer.stop();
   
   // If we have initial rig transforms, compute the transform from the
   // world to every camera based on the rig transforms and ref_to_cam
@@ -1491,30 +2039,60 @@ int main(int argc, char** argv) {
                                           &world_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cid]);
   }
 
-  // Detect and match features if the user chooses to, so if --num_overlaps > 0. Normally,
-  // these are read from the nvm file only, as below.
+  // Detect and match features if the user chooses to, so if --num_overlaps > 0
+  // or --num_nearby_cameras > 0. Normally, these are read from the nvm file only,
+  // as below.
   std::vector<std::vector<std::pair<float, float>>> keypoint_vec;
   std::vector<std::map<int, int>> pid_to_cid_fid;
-  if (FLAGS_num_overlaps > 0)
+  std::vector<std::pair<int, int>> image_pairs;
+  dense_map::StageTimer features_timer("detect_match_features");
+  if (FLAGS_num_overlaps > 0 || FLAGS_num_nearby_cameras > 0)
+    dense_map::selectImagePairs(world_to_cam, FLAGS_num_overlaps, FLAGS_num_nearby_cameras,
+                                FLAGS_max_nearby_view_angle,
+                                image_pairs);  // output
+  if (FLAGS_prev_nvm != "")
+    dense_map::removeProcessedPairs(cams, prev_nvm, image_pairs);
+  if (!image_pairs.empty())
     dense_map::detectMatchFeatures(// Inputs
                                    cams, cam_params, FLAGS_out_dir, FLAGS_save_matches,
-                                   world_to_cam,
-                                   FLAGS_num_overlaps, FLAGS_initial_max_reprojection_error,
+                                   world_to_cam, image_pairs,
+                                   FLAGS_initial_max_reprojection_error,
                                    FLAGS_num_match_threads,
                                    FLAGS_verbose,
                                    // Outputs
                                    keypoint_vec, pid_to_cid_fid);
+  features_timer.stop();
 
   // Append the interest point matches from the nvm file
   if (!FLAGS_no_nvm_matches && FLAGS_nvm != "")
     dense_map::appendMatchesFromNvm(// Inputs
-                                    cam_params, cams, nvm,  
+                                    cam_params, cams, nvm, false,
+                                    // Outputs (these get appended to)
+                                    pid_to_cid_fid, keypoint_vec);
+
+  // Append the matches from the previous run, and merge them with the
+  // new ones, so that the observations of old features in new images
+  // extend the existing tracks
+  dense_map::StageTimer tracks_timer("store_tracks");
+  if (FLAGS_prev_nvm != "") {
+    dense_map::appendMatchesFromNvm(// Inputs
+                                    cam_params, cams, prev_nvm, true,
                                     // Outputs (these get appended to)
                                     pid_to_cid_fid, keypoint_vec);
+    dense_map::mergeTracks(keypoint_vec, pid_to_cid_fid);
+  }
 
   if (pid_to_cid_fid.empty())
     LOG(FATAL) << "No interest points were found. Must specify either "
                << "--nvm or positive --num_overlaps.\n";
+
+  // Store the tracks contiguously, together with the inlier flag and
+  // residual index for each feature, and wipe the original maps.
+  // Originally all features are inliers. Once an inlier becomes an
+  // outlier, it never becomes an inlier again.
+  dense_map::TrackStore tracks(pid_to_cid_fid);
+  pid_to_cid_fid = std::vector<std::map<int, int>>();
+  tracks_timer.stop();
   
   // Set up the block sizes
   std::vector<int> bracketed_cam_block_sizes;
@@ -1525,31 +2103,112 @@ int main(int argc, char** argv) {
                                 bracketed_cam_block_sizes, bracketed_depth_block_sizes,
                                 bracketed_depth_mesh_block_sizes, xyz_block_sizes);
 
-  // For a given fid = pid_to_cid_fid[pid][cid], the value
-  // pid_cid_fid_inlier[pid][cid][fid] will be non-zero only if this
-  // pixel is an inlier. Originally all pixels are inliers. Once an
-  // inlier becomes an outlier, it never becomes an inlier again.
-  std::vector<std::map<int, std::map<int, int>>> pid_cid_fid_inlier;
   std::vector<Eigen::Vector3d> xyz_vec; // triangulated points go here
   
   // TODO(oalexan1): Must initialize all points as inliers outside this function,
   // as now this function resets those.
   dense_map::flagOutlierByExclusionDist(// Inputs
-                                        ref_cam_type, cam_params, cams, pid_to_cid_fid,
-                                        keypoint_vec,
+                                        ref_cam_type, cam_params, cams, keypoint_vec,
                                         // Outputs
-                                        pid_cid_fid_inlier);
+                                        tracks);
 
-  // Structures needed to intersect rays with the mesh
-  std::vector<std::map<int, std::map<int, Eigen::Vector3d>>> pid_cid_fid_mesh_xyz;
+  // Structures needed to intersect rays with the mesh. The intersection
+  // for each feature is at the index of that feature in the tracks.
+  std::vector<Eigen::Vector3d> obs_mesh_xyz;
   std::vector<Eigen::Vector3d> pid_mesh_xyz;
   Eigen::Vector3d bad_xyz(1.0e+100, 1.0e+100, 1.0e+100);  // use this to flag invalid xyz
 
+  // The depth measurement for each feature, at the index of that
+  // feature in the tracks. These do not change from pass to pass.
+  std::vector<Eigen::Vector3d> obs_depth_xyz;
+  if (FLAGS_depth_tri_weight > 0 || (FLAGS_mesh != "" && FLAGS_depth_mesh_weight > 0)) {
+    dense_map::StageTimer depth_timer("lookup_depth_values");
+    dense_map::lookupDepthValues(cams, keypoint_vec, tracks, bad_xyz,
+                                 obs_depth_xyz);  // output
+  }
+
+  // The problem is formed in the first pass and kept for later passes,
+  // as forming it with millions of residuals takes as long as solving
+  // it. Fast removal is needed to drop the residuals of outliers.
+  ceres::Problem::Options problem_options;
+  problem_options.enable_fast_removal = true;
+
+  // With several clusters of cameras, a problem is formed for each
+  // cluster instead, and this one is not used.
+  ceres::Problem full_problem(problem_options);
+
+  // The pixel and depth-to-triangulated residual blocks for each
+  // feature, at the index of that feature in the tracks. These do not
+  // change from pass to pass, other than being removed when the
+  // feature becomes an outlier.
+  std::vector<ceres::ResidualBlockId> full_pix_blocks, full_depth_blocks;
+
+  // The residual blocks which depend on the triangulated points or
+  // mesh intersections at the start of a pass. These are redone at
+  // each pass.
+  std::vector<ceres::ResidualBlockId> full_pass_blocks;
+
+  // The clusters of cameras to optimize in turn. All cameras are in
+  // one cluster by default.
+  std::vector<int> cam_keys;
+  dense_map::partitionKeys(cams, FLAGS_no_rig, cam_keys);
+  int num_keys = FLAGS_no_rig ? static_cast<int>(cams.size()) : num_ref_cams;
+  std::vector<dense_map::Partition> partitions;
+  dense_map::formPartitions(num_keys, FLAGS_num_partitions, FLAGS_partition_overlap,
+                            partitions);
+  bool partitioned = (partitions.size() > 1);
+  if (partitioned) {
+    std::cout << "Optimizing " << partitions.size() << " clusters of cameras in turn.\n";
+  } else {
+    full_pix_blocks.resize(tracks.numObs(), NULL);
+    full_depth_blocks.resize(tracks.numObs(), NULL);
+  }
+
+  // The parameters of a sensor which are shared by all clusters, in
+  // one array, in the order: ref_to_cam, focal length, optical center,
+  // distortion, timestamp offset, depth_to_image, its scale.
+  auto packSensorParams = [&](int cam_type, std::vector<double> & vals) {
+    vals.clear();
+    double const* ref_to_cam_ptr = &ref_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cam_type];
+    vals.insert(vals.end(), ref_to_cam_ptr, ref_to_cam_ptr + dense_map::NUM_RIGID_PARAMS);
+    vals.push_back(focal_lengths[cam_type]);
+    vals.push_back(optical_centers[cam_type][0]);
+    vals.push_back(optical_centers[cam_type][1]);
+    for (int it = 0; it < distortions[cam_type].size(); it++)
+      vals.push_back(distortions[cam_type][it]);
+    vals.push_back(ref_to_cam_timestamp_offsets[cam_type]);
+    double const* depth_ptr = &depth_to_image_vec[num_depth_params * cam_type];
+    vals.insert(vals.end(), depth_ptr, depth_ptr + num_depth_params);
+    vals.push_back(depth_to_image_scales[cam_type]);
+  };
+  auto unpackSensorParams = [&](int cam_type, std::vector<double> const& vals) {
+    int count = 0;
+    for (int it = 0; it < dense_map::NUM_RIGID_PARAMS; it++)
+      ref_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cam_type + it] = vals[count++];
+    focal_lengths[cam_type] = vals[count++];
+    optical_centers[cam_type][0] = vals[count++];
+    optical_centers[cam_type][1] = vals[count++];
+    for (int it = 0; it < distortions[cam_type].size(); it++)
+      distortions[cam_type][it] = vals[count++];
+    ref_to_cam_timestamp_offsets[cam_type] = vals[count++];
+    for (int it = 0; it < num_depth_params; it++)
+      depth_to_image_vec[num_depth_params * cam_type + it] = vals[count++];
+    depth_to_image_scales[cam_type] = vals[count++];
+  };
+
+  // For when we don't have distortion but must get a pointer to distortion for the interface.
+  // This is a parameter block of the problem, so it must persist across passes.
+  double distortion_placeholder = 0.0;
+
+  std::vector<PassReport> pass_reports;
+
   // TODO(oalexan1): All the logic for one pass should be its own function,
   // as the block below is too big.
   for (int pass = 0; pass < FLAGS_calibrator_num_passes; pass++) {
     std::cout << "\nOptimization pass "
               << pass + 1 << " / " << FLAGS_calibrator_num_passes << "\n";
+    dense_map::StageTimer pass_timer("pass_" + std::to_string(pass + 1));
+    dense_map::StageTimer tri_timer("triangulation");
 
     // The transforms from the world to all cameras must be updated
     // given the current state of optimization
@@ -1561,10 +2220,16 @@ int main(int argc, char** argv) {
       // Output
       world_to_cam);
 
+    // The problem refers to the points in xyz_vec, so these must not
+    // move in memory. They are overwritten with same size.
+    Eigen::Vector3d const* prev_xyz_ptr = xyz_vec.data();
     dense_map::multiViewTriangulation(// Inputs
-                                      cam_params, cams, world_to_cam, pid_to_cid_fid, keypoint_vec,
+                                      cam_params, cams, world_to_cam, keypoint_vec,
+                                      FLAGS_num_opt_threads,
                                       // Outputs
-                                      pid_cid_fid_inlier, xyz_vec);
+                                      tracks, xyz_vec);
+    if (pass > 0 && xyz_vec.data() != prev_xyz_ptr)
+      LOG(FATAL) << "The triangulated points moved in memory.\n";
 
     // This is a copy which won't change
     std::vector<Eigen::Vector3d> xyz_vec_orig;
@@ -1581,18 +2246,17 @@ int main(int argc, char** argv) {
     // Compute where each ray intersects the mesh
     if (FLAGS_mesh != "")
       dense_map::meshTriangulations(  // Inputs
-                                    cam_params, cams, world_to_cam, pid_to_cid_fid,
-        pid_cid_fid_inlier, keypoint_vec, bad_xyz, FLAGS_min_ray_dist, FLAGS_max_ray_dist, mesh,
+                                    cam_params, cams, world_to_cam, tracks,
+        keypoint_vec, bad_xyz, FLAGS_min_ray_dist, FLAGS_max_ray_dist, mesh,
         bvh_tree,
         // Outputs
-        pid_cid_fid_mesh_xyz, pid_mesh_xyz);
+        obs_mesh_xyz, pid_mesh_xyz);
+    tri_timer.stop();
 
-    // For a given fid = pid_to_cid_fid[pid][cid],
-    // the value pid_cid_fid_to_residual_index[pid][cid][fid] will be the index in the array
-    // of residuals (look only at pixel residuals). This structure is populated only for
-    // inliers, so its total number of elements changes at each pass.
-    std::vector<std::map<int, std::map<int, int>>> pid_cid_fid_to_residual_index;
-    pid_cid_fid_to_residual_index.resize(pid_to_cid_fid.size());
+    // For each feature, its residual_index will be the index in the array
+    // of residuals (look only at pixel residuals). This is set only for
+    // inliers, and must be redone at each pass.
+    tracks.resetResidualIndices();
 
     // If distortion can be floated, and the RPC distortion model is
     // used, must forbid undistortion until its updated value is
@@ -1604,319 +2268,460 @@ int main(int argc, char** argv) {
         cam_params[cam_type].m_rpc.set_can_undistort(false);
     }
     
-    // For when we don't have distortion but must get a pointer to distortion for the interface
-    double distortion_placeholder = 0.0;
-    
-    // Form the problem
-    ceres::Problem problem;
+    // Optimize the cameras one cluster at a time, if there is more
+    // than one, as a sequential block-coordinate descent. Then the
+    // points seen in several clusters are optimized with each in turn,
+    // while the sensor parameters start from the same values for each
+    // cluster, and are averaged at the end.
+    std::vector<std::vector<double>> pass_start_params(num_cam_types);
+    std::vector<std::vector<std::vector<double>>> part_params(num_cam_types);
+    std::vector<std::vector<double>> part_weights(num_cam_types);
+    if (partitioned) {
+      for (int cam_type = 0; cam_type < num_cam_types; cam_type++)
+        packSensorParams(cam_type, pass_start_params[cam_type]);
+    }
+
+    PassReport report = PassReport();  // sums over the clusters
+    std::vector<ceres::ResidualBlockId> residual_blocks;
     std::vector<std::string> residual_names;
     std::vector<double> residual_scales;
-    for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-      for (auto cid_fid = pid_to_cid_fid[pid].begin();
-           cid_fid != pid_to_cid_fid[pid].end(); cid_fid++) {
-        int cid = cid_fid->first;
-        int fid = cid_fid->second;
-
-        // Deal with inliers only
-        if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid))
-          continue;
-
-        int cam_type = cams[cid].camera_type;
-        double beg_ref_timestamp = -1.0, end_ref_timestamp = -1.0, cam_timestamp = -1.0;
-
-        // Pointers to bracketing cameras and ref to cam transform. Their precise
-        // definition is spelled out below.
-        double *beg_cam_ptr = NULL, *end_cam_ptr = NULL, *ref_to_cam_ptr = NULL;
-
-        if (!FLAGS_no_rig) {
-          // Model the rig, use timestamps
-          int beg_ref_index = cams[cid].beg_ref_index;
-          int end_ref_index = cams[cid].end_ref_index;
-
-          // Left bracketing ref cam for a given cam. For a ref cam, this is itself.
-          beg_cam_ptr = &world_to_ref_vec[dense_map::NUM_RIGID_PARAMS * beg_ref_index];
-
-          // Right bracketing camera. When the cam is the ref type,
-          // this is nominal and not used. Also when the current cam
-          // is the last one and has exactly same timestamp as the ref cam
-          if (cam_type == ref_cam_type || beg_ref_index == end_ref_index)
+    std::vector<double> residuals;
+    for (size_t part = 0; part < partitions.size(); part++) {
+      dense_map::Partition const& partition = partitions[part];  // alias
+
+      // A cluster is optimized on its own, with all threads. Its
+      // problem is formed from scratch.
+      std::string part_tag;
+      std::vector<char> in_partition;
+      std::unique_ptr<ceres::Problem> part_problem;
+      std::vector<ceres::ResidualBlockId> part_pix_blocks, part_depth_blocks, part_pass_blocks;
+      if (partitioned) {
+        part_tag = " (cluster " + std::to_string(part + 1) + " / "
+          + std::to_string(partitions.size()) + ")";
+        std::cout << "\nOptimizing cluster " << part + 1 << " / " << partitions.size()
+                  << ", with keys " << partition.beg << " to " << partition.end - 1 << "\n";
+
+        std::vector<int> pids;
+        dense_map::selectPartitionTracks(tracks, cam_keys, partition, pids);
+        in_partition.assign(tracks.size(), 0);
+        for (size_t it = 0; it < pids.size(); it++)
+          in_partition[pids[it]] = 1;
+
+        part_problem.reset(new ceres::Problem(problem_options));
+        part_pix_blocks.resize(tracks.numObs(), NULL);
+        part_depth_blocks.resize(tracks.numObs(), NULL);
+
+        for (int cam_type = 0; cam_type < num_cam_types; cam_type++)
+          unpackSensorParams(cam_type, pass_start_params[cam_type]);
+      }
+      ceres::Problem & problem = partitioned ? *part_problem : full_problem;
+      std::vector<ceres::ResidualBlockId> & obs_pix_blocks
+        = partitioned ? part_pix_blocks : full_pix_blocks;
+      std::vector<ceres::ResidualBlockId> & obs_depth_blocks
+        = partitioned ? part_depth_blocks : full_depth_blocks;
+      std::vector<ceres::ResidualBlockId> & pass_blocks
+        = partitioned ? part_pass_blocks : full_pass_blocks;
+
+      // Time updating the problem, which is done by the time the solver starts
+      util::WallTimer setup_timer;
+      dense_map::StageTimer setup_stage_timer("problem_setup");
+
+      // Remove the residuals which depend on the state at the start of
+      // the previous pass
+      for (size_t it = 0; it < pass_blocks.size(); it++)
+        problem.RemoveResidualBlock(pass_blocks[it]);
+      pass_blocks.clear();
+
+      // Update the problem. The residuals of features which became
+      // outliers are removed, and the ones of inliers are created only
+      // in the first pass. Since outliers never become inliers again,
+      // this is the same as forming the problem from scratch.
+      residual_blocks.clear();
+      residual_names.clear();
+      residual_scales.clear();
+      for (size_t pid = 0; pid < tracks.size(); pid++) {
+        if (partitioned && !in_partition[pid]) continue;
+
+        for (auto& obs : tracks[pid]) {
+          int cid = obs.cid;
+          int fid = obs.fid;
+
+          // Deal with inliers only
+          size_t obs_index = tracks.obsIndex(obs);
+          if (!obs.inlier) {
+            if (obs_pix_blocks[obs_index] != NULL)
+              problem.RemoveResidualBlock(obs_pix_blocks[obs_index]);
+            if (obs_depth_blocks[obs_index] != NULL)
+              problem.RemoveResidualBlock(obs_depth_blocks[obs_index]);
+            obs_pix_blocks[obs_index] = NULL;
+            obs_depth_blocks[obs_index] = NULL;
+            continue;
+          }
+
+          int cam_type = cams[cid].camera_type;
+          double beg_ref_timestamp = -1.0, end_ref_timestamp = -1.0, cam_timestamp = -1.0;
+
+          // Pointers to bracketing cameras and ref to cam transform. Their precise
+          // definition is spelled out below.
+          double *beg_cam_ptr = NULL, *end_cam_ptr = NULL, *ref_to_cam_ptr = NULL;
+
+          if (!FLAGS_no_rig) {
+            // Model the rig, use timestamps
+            int beg_ref_index = cams[cid].beg_ref_index;
+            int end_ref_index = cams[cid].end_ref_index;
+
+            // Left bracketing ref cam for a given cam. For a ref cam, this is itself.
+            beg_cam_ptr = &world_to_ref_vec[dense_map::NUM_RIGID_PARAMS * beg_ref_index];
+
+            // Right bracketing camera. When the cam is the ref type,
+            // this is nominal and not used. Also when the current cam
+            // is the last one and has exactly same timestamp as the ref cam
+            if (cam_type == ref_cam_type || beg_ref_index == end_ref_index)
+              end_cam_ptr = &identity_vec[0];
+            else
+              end_cam_ptr = &world_to_ref_vec[dense_map::NUM_RIGID_PARAMS * end_ref_index];
+
+            // The beg and end timestamps will be the same only for the
+            // ref cam
+            beg_ref_timestamp = ref_timestamps[beg_ref_index];
+            end_ref_timestamp = ref_timestamps[end_ref_index];
+            cam_timestamp = cams[cid].timestamp;  // uses current camera's clock
+
+          } else {
+            // No rig. Then, beg_cam_ptr is just current camera,
+            // not the ref bracket, end_cam_ptr is the identity and
+            // fixed. The beg and end timestamps are declared to be
+            // same, which will be used in calc_world_to_cam_trans() to
+            // ignore the rig transform and end_cam_ptr.
+            cam_timestamp     = cams[cid].timestamp;
+            beg_ref_timestamp = cam_timestamp;
+            end_ref_timestamp = cam_timestamp;
+
+            // Note how we use world_to_cam_vec and not world_to_ref_vec
+            beg_cam_ptr  = &world_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cid];
             end_cam_ptr = &identity_vec[0];
-          else
-            end_cam_ptr = &world_to_ref_vec[dense_map::NUM_RIGID_PARAMS * end_ref_index];
-
-          // The beg and end timestamps will be the same only for the
-          // ref cam
-          beg_ref_timestamp = ref_timestamps[beg_ref_index];
-          end_ref_timestamp = ref_timestamps[end_ref_index];
-          cam_timestamp = cams[cid].timestamp;  // uses current camera's clock
-
-        } else {
-          // No rig. Then, beg_cam_ptr is just current camera,
-          // not the ref bracket, end_cam_ptr is the identity and
-          // fixed. The beg and end timestamps are declared to be
-          // same, which will be used in calc_world_to_cam_trans() to
-          // ignore the rig transform and end_cam_ptr.
-          cam_timestamp     = cams[cid].timestamp;
-          beg_ref_timestamp = cam_timestamp;
-          end_ref_timestamp = cam_timestamp;
-
-          // Note how we use world_to_cam_vec and not world_to_ref_vec
-          beg_cam_ptr  = &world_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cid];
-          end_cam_ptr = &identity_vec[0];
-        }
+          }
 
-        // Transform from reference camera to given camera. Won't be used when
-        // FLAGS_no_rig is true or when the cam is of ref type.
-        ref_to_cam_ptr = &ref_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cam_type];
+          // Transform from reference camera to given camera. Won't be used when
+          // FLAGS_no_rig is true or when the cam is of ref type.
+          ref_to_cam_ptr = &ref_to_cam_vec[dense_map::NUM_RIGID_PARAMS * cam_type];
 
-        Eigen::Vector2d dist_ip(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
-
-        ceres::CostFunction* bracketed_cost_function =
-          dense_map::BracketedCamError::Create(dist_ip, beg_ref_timestamp, end_ref_timestamp,
-                                               cam_timestamp, bracketed_cam_block_sizes,
-                                               cam_params[cam_type]);
-        ceres::LossFunction* bracketed_loss_function
-          = dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
-
-        // Remember the index of the residuals about to create
-        pid_cid_fid_to_residual_index[pid][cid][fid] = residual_names.size();
-
-        // Handle the case of no distortion
-        double * distortion_ptr = NULL;
-        if (distortions[cam_type].size() > 0) 
-          distortion_ptr = &distortions[cam_type][0];
-        else
-          distortion_ptr = &distortion_placeholder;
+          // Handle the case of no distortion
+          double * distortion_ptr = NULL;
+          if (distortions[cam_type].size() > 0) 
+            distortion_ptr = &distortions[cam_type][0];
+          else
+            distortion_ptr = &distortion_placeholder;
+
+          // Remember the index of the residuals about to create
+          obs.residual_index = residual_names.size();
+          residual_names.push_back(cam_names[cam_type] + "_pix_x");
+          residual_names.push_back(cam_names[cam_type] + "_pix_y");
+          residual_scales.push_back(1.0);
+          residual_scales.push_back(1.0);
+
+          if (obs_pix_blocks[obs_index] == NULL) {
+            Eigen::Vector2d dist_ip(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
+
+            ceres::CostFunction* bracketed_cost_function =
+              dense_map::BracketedCamError::Create(dist_ip, beg_ref_timestamp, end_ref_timestamp,
+                                                   cam_timestamp, bracketed_cam_block_sizes,
+                                                   cam_params[cam_type]);
+            ceres::LossFunction* bracketed_loss_function
+              = dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
+
+            obs_pix_blocks[obs_index] = problem.AddResidualBlock
+              (bracketed_cost_function, bracketed_loss_function,
+               beg_cam_ptr, end_cam_ptr, ref_to_cam_ptr, &xyz_vec[pid][0],
+               &ref_to_cam_timestamp_offsets[cam_type],
+               &focal_lengths[cam_type], &optical_centers[cam_type][0], distortion_ptr);
+
+            // See which intrinsics to float
+            if (intrinsics_to_float[cam_type].find("focal_length") ==
+                intrinsics_to_float[cam_type].end())
+              problem.SetParameterBlockConstant(&focal_lengths[cam_type]);
+            if (intrinsics_to_float[cam_type].find("optical_center") ==
+                intrinsics_to_float[cam_type].end())
+              problem.SetParameterBlockConstant(&optical_centers[cam_type][0]);
+            if (intrinsics_to_float[cam_type].find("distortion")
+                == intrinsics_to_float[cam_type].end() || distortions[cam_type].size() == 0)
+              problem.SetParameterBlockConstant(distortion_ptr);
+
+            // When the camera is the ref type, the right bracketing
+            // camera is just a placeholder which is not used, hence
+            // should not be optimized. Same for the ref_to_cam_vec and
+            // ref_to_cam_timestamp_offsets, etc., as can be seen further
+            // down.
+            if (!FLAGS_no_rig) {
+              // See if to float the ref cameras
+              if (camera_poses_to_float.find(cam_names[ref_cam_type]) == camera_poses_to_float.end())
+                problem.SetParameterBlockConstant(beg_cam_ptr);
+            } else {
+              // There is no rig. Then beg_cam_ptr refers to camera
+              // for cams[cid], and not to its ref bracketing cam.
+              // See if the user wants it floated.
+              if (camera_poses_to_float.find(cam_names[cam_type]) == camera_poses_to_float.end()) {
+                problem.SetParameterBlockConstant(beg_cam_ptr);
+              }
+            }
+
+            // The end cam floats only if told to, and if it brackets
+            // a given non-ref cam.
+            if (camera_poses_to_float.find(cam_names[ref_cam_type]) == camera_poses_to_float.end() ||
+                cam_type == ref_cam_type || FLAGS_no_rig) {
+              problem.SetParameterBlockConstant(end_cam_ptr);
+            }
         
-        residual_names.push_back(cam_names[cam_type] + "_pix_x");
-        residual_names.push_back(cam_names[cam_type] + "_pix_y");
-        residual_scales.push_back(1.0);
-        residual_scales.push_back(1.0);
-        problem.AddResidualBlock
-          (bracketed_cost_function, bracketed_loss_function,
-           beg_cam_ptr, end_cam_ptr, ref_to_cam_ptr, &xyz_vec[pid][0],
-           &ref_to_cam_timestamp_offsets[cam_type],
-           &focal_lengths[cam_type], &optical_centers[cam_type][0], distortion_ptr);
-
-        // See which intrinsics to float
-        if (intrinsics_to_float[cam_type].find("focal_length") ==
-            intrinsics_to_float[cam_type].end())
-          problem.SetParameterBlockConstant(&focal_lengths[cam_type]);
-        if (intrinsics_to_float[cam_type].find("optical_center") ==
-            intrinsics_to_float[cam_type].end())
-          problem.SetParameterBlockConstant(&optical_centers[cam_type][0]);
-        if (intrinsics_to_float[cam_type].find("distortion")
-            == intrinsics_to_float[cam_type].end() || distortions[cam_type].size() == 0)
-          problem.SetParameterBlockConstant(distortion_ptr);
-
-        // When the camera is the ref type, the right bracketing
-        // camera is just a placeholder which is not used, hence
-        // should not be optimized. Same for the ref_to_cam_vec and
-        // ref_to_cam_timestamp_offsets, etc., as can be seen further
-        // down.
-        if (!FLAGS_no_rig) {
-          // See if to float the ref cameras
-          if (camera_poses_to_float.find(cam_names[ref_cam_type]) == camera_poses_to_float.end())
-            problem.SetParameterBlockConstant(beg_cam_ptr);
-        } else {
-          // There is no rig. Then beg_cam_ptr refers to camera
-          // for cams[cid], and not to its ref bracketing cam.
-          // See if the user wants it floated.
-          if (camera_poses_to_float.find(cam_names[cam_type]) == camera_poses_to_float.end()) {
-            problem.SetParameterBlockConstant(beg_cam_ptr);
+            if (!FLAGS_float_timestamp_offsets || cam_type == ref_cam_type || FLAGS_no_rig) {
+              // Either we don't float timestamp offsets at all, or the cam is the ref type,
+              // or with no extrinsics, when it can't float anyway.
+              problem.SetParameterBlockConstant(&ref_to_cam_timestamp_offsets[cam_type]);
+            } else {
+              problem.SetParameterLowerBound(&ref_to_cam_timestamp_offsets[cam_type], 0,
+                                             min_timestamp_offset[cam_type]);
+              problem.SetParameterUpperBound(&ref_to_cam_timestamp_offsets[cam_type], 0,
+                                             max_timestamp_offset[cam_type]);
+            }
+            // ref_to_cam is kept fixed at the identity if the cam is the ref type or
+            // no rig
+            if (rig_transforms_to_float.find(cam_names[cam_type]) == rig_transforms_to_float.end() ||
+                cam_type == ref_cam_type || FLAGS_no_rig) {
+              problem.SetParameterBlockConstant(ref_to_cam_ptr);
+            }
           }
-        }
+          residual_blocks.push_back(obs_pix_blocks[obs_index]);
 
-        // The end cam floats only if told to, and if it brackets
-        // a given non-ref cam.
-        if (camera_poses_to_float.find(cam_names[ref_cam_type]) == camera_poses_to_float.end() ||
-            cam_type == ref_cam_type || FLAGS_no_rig) {
-          problem.SetParameterBlockConstant(end_cam_ptr);
-        }
-        
-        if (!FLAGS_float_timestamp_offsets || cam_type == ref_cam_type || FLAGS_no_rig) {
-          // Either we don't float timestamp offsets at all, or the cam is the ref type,
-          // or with no extrinsics, when it can't float anyway.
-          problem.SetParameterBlockConstant(&ref_to_cam_timestamp_offsets[cam_type]);
-        } else {
-          problem.SetParameterLowerBound(&ref_to_cam_timestamp_offsets[cam_type], 0,
-                                         min_timestamp_offset[cam_type]);
-          problem.SetParameterUpperBound(&ref_to_cam_timestamp_offsets[cam_type], 0,
-                                         max_timestamp_offset[cam_type]);
-        }
-        // ref_to_cam is kept fixed at the identity if the cam is the ref type or
-        // no rig
-        if (rig_transforms_to_float.find(cam_names[cam_type]) == rig_transforms_to_float.end() ||
-            cam_type == ref_cam_type || FLAGS_no_rig) {
-          problem.SetParameterBlockConstant(ref_to_cam_ptr);
-        }
+          Eigen::Vector3d depth_xyz(0, 0, 0);
+          bool have_depth_tri_constraint = false;
+          if (FLAGS_depth_tri_weight > 0) {
+            depth_xyz = obs_depth_xyz.at(obs_index);
+            have_depth_tri_constraint = (depth_xyz != bad_xyz);
+          }
 
-        Eigen::Vector3d depth_xyz(0, 0, 0);
-        bool have_depth_tri_constraint
-          = (FLAGS_depth_tri_weight > 0 &&
-             dense_map::depthValue(cams[cid].depth_cloud, dist_ip, depth_xyz));
-
-        if (have_depth_tri_constraint) {
-          // Ensure that the depth points agree with triangulated points
-          ceres::CostFunction* bracketed_depth_cost_function
-            = dense_map::BracketedDepthError::Create(FLAGS_depth_tri_weight, depth_xyz,
-                                                     beg_ref_timestamp, end_ref_timestamp,
-                                                     cam_timestamp, bracketed_depth_block_sizes);
-
-          ceres::LossFunction* bracketed_depth_loss_function
-            = dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
-
-          residual_names.push_back("depth_tri_x_m");
-          residual_names.push_back("depth_tri_y_m");
-          residual_names.push_back("depth_tri_z_m");
-          residual_scales.push_back(FLAGS_depth_tri_weight);
-          residual_scales.push_back(FLAGS_depth_tri_weight);
-          residual_scales.push_back(FLAGS_depth_tri_weight);
-          problem.AddResidualBlock
-            (bracketed_depth_cost_function, bracketed_depth_loss_function,
-             beg_cam_ptr, end_cam_ptr, ref_to_cam_ptr,
-             &depth_to_image_vec[num_depth_params * cam_type],
-             &depth_to_image_scales[cam_type],
-             &xyz_vec[pid][0],
-             &ref_to_cam_timestamp_offsets[cam_type]);
-
-          // Note that above we already considered fixing some params.
-          // We won't repeat that code here.
-          // If we model an affine depth to image, fix its scale here,
-          // it will change anyway as part of depth_to_image_vec.
-          if (!FLAGS_float_scale || FLAGS_affine_depth_to_image) {
-            problem.SetParameterBlockConstant(&depth_to_image_scales[cam_type]);
+          if (have_depth_tri_constraint) {
+            residual_names.push_back("depth_tri_x_m");
+            residual_names.push_back("depth_tri_y_m");
+            residual_names.push_back("depth_tri_z_m");
+            residual_scales.push_back(FLAGS_depth_tri_weight);
+            residual_scales.push_back(FLAGS_depth_tri_weight);
+            residual_scales.push_back(FLAGS_depth_tri_weight);
+
+            if (obs_depth_blocks[obs_index] == NULL) {
+              // Ensure that the depth points agree with triangulated points
+              ceres::CostFunction* bracketed_depth_cost_function
+                = dense_map::BracketedDepthError::Create(FLAGS_depth_tri_weight, depth_xyz,
+                                                         beg_ref_timestamp, end_ref_timestamp,
+                                                         cam_timestamp, bracketed_depth_block_sizes);
+
+              ceres::LossFunction* bracketed_depth_loss_function
+                = dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
+              obs_depth_blocks[obs_index] = problem.AddResidualBlock
+                (bracketed_depth_cost_function, bracketed_depth_loss_function,
+                 beg_cam_ptr, end_cam_ptr, ref_to_cam_ptr,
+                 &depth_to_image_vec[num_depth_params * cam_type],
+                 &depth_to_image_scales[cam_type],
+                 &xyz_vec[pid][0],
+                 &ref_to_cam_timestamp_offsets[cam_type]);
+
+              // Note that above we already considered fixing some params.
+              // We won't repeat that code here.
+              // If we model an affine depth to image, fix its scale here,
+              // it will change anyway as part of depth_to_image_vec.
+              if (!FLAGS_float_scale || FLAGS_affine_depth_to_image) {
+                problem.SetParameterBlockConstant(&depth_to_image_scales[cam_type]);
+              }
+
+              if (depth_to_image_transforms_to_float.find(cam_names[cam_type])
+                  == depth_to_image_transforms_to_float.end())
+                problem.SetParameterBlockConstant(&depth_to_image_vec[num_depth_params * cam_type]);
+            }
+            residual_blocks.push_back(obs_depth_blocks[obs_index]);
           }
 
-          if (depth_to_image_transforms_to_float.find(cam_names[cam_type])
-              == depth_to_image_transforms_to_float.end())
-            problem.SetParameterBlockConstant(&depth_to_image_vec[num_depth_params * cam_type]);
-        }
+          // Add the depth to mesh constraint
+          bool have_depth_mesh_constraint = false;
+          depth_xyz = Eigen::Vector3d(0, 0, 0);
+          Eigen::Vector3d mesh_xyz(0, 0, 0);
+          if (FLAGS_mesh != "") {
+            mesh_xyz = obs_mesh_xyz.at(obs_index);
+            if (FLAGS_depth_mesh_weight > 0) {
+              depth_xyz = obs_depth_xyz.at(obs_index);
+              have_depth_mesh_constraint = (mesh_xyz != bad_xyz && depth_xyz != bad_xyz);
+            }
+          }
 
-        // Add the depth to mesh constraint
-        bool have_depth_mesh_constraint = false;
-        depth_xyz = Eigen::Vector3d(0, 0, 0);
-        Eigen::Vector3d mesh_xyz(0, 0, 0);
-        if (FLAGS_mesh != "") {
-          mesh_xyz = dense_map::getMapValue(pid_cid_fid_mesh_xyz, pid, cid, fid);
-          have_depth_mesh_constraint
-            = (FLAGS_depth_mesh_weight > 0 && mesh_xyz != bad_xyz &&
-               dense_map::depthValue(cams[cid].depth_cloud, dist_ip, depth_xyz));
+          if (have_depth_mesh_constraint) {
+            // Try to make each mesh intersection agree with corresponding depth measurement,
+            // if it exists
+            ceres::CostFunction* bracketed_depth_mesh_cost_function
+              = dense_map::BracketedDepthMeshError::Create
+              (FLAGS_depth_mesh_weight, depth_xyz, mesh_xyz, beg_ref_timestamp,
+               end_ref_timestamp, cam_timestamp, bracketed_depth_mesh_block_sizes);
+
+            ceres::LossFunction* bracketed_depth_mesh_loss_function
+              = dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
+
+            residual_names.push_back("depth_mesh_x_m");
+            residual_names.push_back("depth_mesh_y_m");
+            residual_names.push_back("depth_mesh_z_m");
+            residual_scales.push_back(FLAGS_depth_mesh_weight);
+            residual_scales.push_back(FLAGS_depth_mesh_weight);
+            residual_scales.push_back(FLAGS_depth_mesh_weight);
+            ceres::ResidualBlockId depth_mesh_block = problem.AddResidualBlock
+              (bracketed_depth_mesh_cost_function, bracketed_depth_mesh_loss_function,
+               beg_cam_ptr, end_cam_ptr, ref_to_cam_ptr,
+               &depth_to_image_vec[num_depth_params * cam_type],
+               &depth_to_image_scales[cam_type],
+               &ref_to_cam_timestamp_offsets[cam_type]);
+            residual_blocks.push_back(depth_mesh_block);
+            pass_blocks.push_back(depth_mesh_block);
+
+            // Note that above we already fixed some of these variables.
+            // Repeat the fixing of depth variables, however, as the previous block
+            // may not take place.
+            if (!FLAGS_float_scale || FLAGS_affine_depth_to_image)
+              problem.SetParameterBlockConstant(&depth_to_image_scales[cam_type]);
+
+            if (depth_to_image_transforms_to_float.find(cam_names[cam_type])
+                == depth_to_image_transforms_to_float.end())
+              problem.SetParameterBlockConstant(&depth_to_image_vec[num_depth_params * cam_type]);
+          }
+        }  // end iterating over all cid for given pid
+
+        // The constraints below will be for each triangulated point. Skip such a point
+        // if all rays converging to it come from outliers.
+        bool isTriInlier = false;
+        for (auto const& obs : tracks[pid]) {
+          if (obs.inlier) {
+            isTriInlier = true;
+            break; // found it to be an inlier, no need to do further checking
+          }
         }
 
-        if (have_depth_mesh_constraint) {
-          // Try to make each mesh intersection agree with corresponding depth measurement,
-          // if it exists
-          ceres::CostFunction* bracketed_depth_mesh_cost_function
-            = dense_map::BracketedDepthMeshError::Create
-            (FLAGS_depth_mesh_weight, depth_xyz, mesh_xyz, beg_ref_timestamp,
-             end_ref_timestamp, cam_timestamp, bracketed_depth_mesh_block_sizes);
-
-          ceres::LossFunction* bracketed_depth_mesh_loss_function
-            = dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
-
-          residual_names.push_back("depth_mesh_x_m");
-          residual_names.push_back("depth_mesh_y_m");
-          residual_names.push_back("depth_mesh_z_m");
-          residual_scales.push_back(FLAGS_depth_mesh_weight);
-          residual_scales.push_back(FLAGS_depth_mesh_weight);
-          residual_scales.push_back(FLAGS_depth_mesh_weight);
-          problem.AddResidualBlock
-            (bracketed_depth_mesh_cost_function, bracketed_depth_mesh_loss_function,
-             beg_cam_ptr, end_cam_ptr, ref_to_cam_ptr,
-             &depth_to_image_vec[num_depth_params * cam_type],
-             &depth_to_image_scales[cam_type],
-             &ref_to_cam_timestamp_offsets[cam_type]);
-
-          // Note that above we already fixed some of these variables.
-          // Repeat the fixing of depth variables, however, as the previous block
-          // may not take place.
-          if (!FLAGS_float_scale || FLAGS_affine_depth_to_image)
-            problem.SetParameterBlockConstant(&depth_to_image_scales[cam_type]);
-
-          if (depth_to_image_transforms_to_float.find(cam_names[cam_type])
-              == depth_to_image_transforms_to_float.end())
-            problem.SetParameterBlockConstant(&depth_to_image_vec[num_depth_params * cam_type]);
+        // Add mesh-to-triangulated point constraint
+        bool have_mesh_tri_constraint = false;
+        Eigen::Vector3d avg_mesh_xyz(0, 0, 0);
+        if (FLAGS_mesh != "" && isTriInlier) {
+          avg_mesh_xyz = pid_mesh_xyz.at(pid);
+          if (FLAGS_mesh_tri_weight > 0 && avg_mesh_xyz != bad_xyz)
+            have_mesh_tri_constraint = true;
         }
-      }  // end iterating over all cid for given pid
-
-      // The constraints below will be for each triangulated point. Skip such a point
-      // if all rays converging to it come from outliers.
-      bool isTriInlier = false;
-      for (auto cid_fid = pid_to_cid_fid[pid].begin();
-           cid_fid != pid_to_cid_fid[pid].end(); cid_fid++) {
-        int cid = cid_fid->first;
-        int fid = cid_fid->second;
-        
-        if (dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid)) {
-          isTriInlier = true;
-          break; // found it to be an inlier, no need to do further checking
+        if (have_mesh_tri_constraint) {
+          // Try to make the triangulated point agree with the mesh intersection
+
+          ceres::CostFunction* mesh_cost_function =
+            dense_map::XYZError::Create(avg_mesh_xyz, xyz_block_sizes, FLAGS_mesh_tri_weight);
+
+          ceres::LossFunction* mesh_loss_function =
+            dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
+
+          ceres::ResidualBlockId mesh_block
+            = problem.AddResidualBlock(mesh_cost_function, mesh_loss_function, &xyz_vec[pid][0]);
+          residual_blocks.push_back(mesh_block);
+          pass_blocks.push_back(mesh_block);
+
+          residual_names.push_back("mesh_tri_x_m");
+          residual_names.push_back("mesh_tri_y_m");
+          residual_names.push_back("mesh_tri_z_m");
+          residual_scales.push_back(FLAGS_mesh_tri_weight);
+          residual_scales.push_back(FLAGS_mesh_tri_weight);
+          residual_scales.push_back(FLAGS_mesh_tri_weight);
         }
-      }
 
-      // Add mesh-to-triangulated point constraint
-      bool have_mesh_tri_constraint = false;
-      Eigen::Vector3d avg_mesh_xyz(0, 0, 0);
-      if (FLAGS_mesh != "" && isTriInlier) {
-        avg_mesh_xyz = pid_mesh_xyz.at(pid);
-        if (FLAGS_mesh_tri_weight > 0 && avg_mesh_xyz != bad_xyz)
-          have_mesh_tri_constraint = true;
+        // Add the constraint that the triangulated point does not go too far
+        if (FLAGS_tri_weight > 0.0 && isTriInlier) {
+          // Try to make the triangulated points (and hence cameras) not move too far
+          ceres::CostFunction* tri_cost_function =
+            dense_map::XYZError::Create(xyz_vec_orig[pid], xyz_block_sizes, FLAGS_tri_weight);
+          ceres::LossFunction* tri_loss_function =
+            dense_map::GetLossFunction("cauchy", FLAGS_tri_robust_threshold);
+          ceres::ResidualBlockId tri_block
+            = problem.AddResidualBlock(tri_cost_function, tri_loss_function, &xyz_vec[pid][0]);
+          residual_blocks.push_back(tri_block);
+          pass_blocks.push_back(tri_block);
+
+          residual_names.push_back("tri_x_m");
+          residual_names.push_back("tri_y_m");
+          residual_names.push_back("tri_z_m");
+          residual_scales.push_back(FLAGS_tri_weight);
+          residual_scales.push_back(FLAGS_tri_weight);
+          residual_scales.push_back(FLAGS_tri_weight);
+        }
+      
+      }  // end iterating over pid
+
+      // Only the cameras in this cluster float. The other cameras seen
+      // by its tracks are kept fixed.
+      if (partitioned) {
+        for (int key = 0; key < num_keys; key++) {
+          if (key >= partition.beg && key < partition.end) continue;
+          double * pose_ptr = FLAGS_no_rig ?
+            &world_to_cam_vec[dense_map::NUM_RIGID_PARAMS * key] :
+            &world_to_ref_vec[dense_map::NUM_RIGID_PARAMS * key];
+          if (problem.HasParameterBlock(pose_ptr))
+            problem.SetParameterBlockConstant(pose_ptr);
+        }
       }
-      if (have_mesh_tri_constraint) {
-        // Try to make the triangulated point agree with the mesh intersection
-
-        ceres::CostFunction* mesh_cost_function =
-          dense_map::XYZError::Create(avg_mesh_xyz, xyz_block_sizes, FLAGS_mesh_tri_weight);
-
-        ceres::LossFunction* mesh_loss_function =
-          dense_map::GetLossFunction("cauchy", FLAGS_robust_threshold);
-
-        problem.AddResidualBlock(mesh_cost_function, mesh_loss_function,
-                                 &xyz_vec[pid][0]);
 
-        residual_names.push_back("mesh_tri_x_m");
-        residual_names.push_back("mesh_tri_y_m");
-        residual_names.push_back("mesh_tri_z_m");
-        residual_scales.push_back(FLAGS_mesh_tri_weight);
-        residual_scales.push_back(FLAGS_mesh_tri_weight);
-        residual_scales.push_back(FLAGS_mesh_tri_weight);
+      // Evaluate the residuals before optimization
+      dense_map::evalResiduals("before opt" + part_tag, residual_names, residual_scales,
+                               residual_blocks, FLAGS_num_opt_threads, problem, residuals);
+
+      // Solve the problem
+      ceres::Solver::Options options;
+      ceres::Solver::Summary summary;
+      setSolverOptions(problem, xyz_vec, options);
+      report.setup_time += setup_timer.get_elapsed() / 1000.0;
+      setup_stage_timer.stop();
+      dense_map::StageTimer solve_timer("solve");
+      ceres::Solve(options, &problem, &summary);
+      solve_timer.stop();
+      report.solve_time += summary.total_time_in_seconds;
+      report.linear_solver_time += summary.linear_solver_time_in_seconds;
+      report.num_iterations += summary.iterations.size();
+      report.initial_cost += summary.initial_cost;
+      report.final_cost += summary.final_cost;
+
+      if (partitioned) {
+        dense_map::evalResiduals("after opt" + part_tag, residual_names, residual_scales,
+                                 residual_blocks, FLAGS_num_opt_threads, problem, residuals);
+
+        // Keep the sensor parameters found with this cluster, weighed by
+        // how many pixel residuals constrained them
+        std::vector<double> num_pix(num_cam_types, 0.0);
+        for (size_t pid = 0; pid < tracks.size(); pid++) {
+          if (!in_partition[pid]) continue;
+          for (auto const& obs : tracks[pid]) {
+            if (obs.inlier) num_pix[cams[obs.cid].camera_type]++;
+          }
+        }
+        for (int cam_type = 0; cam_type < num_cam_types; cam_type++) {
+          std::vector<double> vals;
+          packSensorParams(cam_type, vals);
+          part_params[cam_type].push_back(vals);
+          part_weights[cam_type].push_back(num_pix[cam_type]);
+        }
       }
-
-      // Add the constraint that the triangulated point does not go too far
-      if (FLAGS_tri_weight > 0.0 && isTriInlier) {
-        // Try to make the triangulated points (and hence cameras) not move too far
-        ceres::CostFunction* tri_cost_function =
-          dense_map::XYZError::Create(xyz_vec_orig[pid], xyz_block_sizes, FLAGS_tri_weight);
-        ceres::LossFunction* tri_loss_function =
-          dense_map::GetLossFunction("cauchy", FLAGS_tri_robust_threshold);
-        problem.AddResidualBlock(tri_cost_function, tri_loss_function,
-                                 &xyz_vec[pid][0]);
-
-        residual_names.push_back("tri_x_m");
-        residual_names.push_back("tri_y_m");
-        residual_names.push_back("tri_z_m");
-        residual_scales.push_back(FLAGS_tri_weight);
-        residual_scales.push_back(FLAGS_tri_weight);
-        residual_scales.push_back(FLAGS_tri_weight);
+    }  // end iterating over clusters
+
+    // Reconcile the sensor parameters found with each cluster
+    if (partitioned) {
+      for (int cam_type = 0; cam_type < num_cam_types; cam_type++) {
+        std::vector<int> quat_offsets;
+        quat_offsets.push_back(3);  // the rotation of ref_to_cam
+        if (!FLAGS_affine_depth_to_image) {
+          // The rotation of depth_to_image, see packSensorParams()
+          int depth_offset = dense_map::NUM_RIGID_PARAMS + 4
+            + static_cast<int>(distortions[cam_type].size());
+          quat_offsets.push_back(depth_offset + 3);
+        }
+        std::vector<double> avg = pass_start_params[cam_type];
+        dense_map::averageSensorParams(part_params[cam_type], part_weights[cam_type],
+                                       quat_offsets, avg);
+        unpackSensorParams(cam_type, avg);
       }
-      
-    }  // end iterating over pid
-
-    // Evaluate the residuals before optimization
-    std::vector<double> residuals;
-    dense_map::evalResiduals("before opt", residual_names, residual_scales, problem, residuals);
-
-    // Solve the problem
-    ceres::Solver::Options options;
-    ceres::Solver::Summary summary;
-    options.linear_solver_type = ceres::ITERATIVE_SCHUR;
-    options.num_threads = FLAGS_num_opt_threads;  // The result is more predictable with one thread
-    options.max_num_iterations = FLAGS_num_iterations;
-    options.minimizer_progress_to_stdout = true;
-    options.gradient_tolerance = 1e-16;
-    options.function_tolerance = 1e-16;
-    options.parameter_tolerance = FLAGS_parameter_tolerance;
-    ceres::Solve(options, &problem, &summary);
+    }
+    pass_reports.push_back(report);
 
     // The optimization is done. Right away copy the optimized states
     // to where they belong to keep all data in sync.
@@ -1967,7 +2772,10 @@ int main(int argc, char** argv) {
     }
 
     // Evaluate the residuals after optimization
-    dense_map::evalResiduals("after opt", residual_names, residual_scales, problem, residuals);
+    dense_map::StageTimer outlier_timer("outlier_filtering");
+    if (!partitioned)
+      dense_map::evalResiduals("after opt", residual_names, residual_scales, residual_blocks,
+                               FLAGS_num_opt_threads, full_problem, residuals);
 
     // Must have up-to-date world_to_cam and residuals to flag the outliers
     dense_map::calc_world_to_cam_rig_or_not(  // Inputs
@@ -1976,21 +2784,32 @@ int main(int argc, char** argv) {
       // Output
       world_to_cam);
 
+    // The clusters share features, and their cameras and points
+    // changed after each was optimized, so find the pixel residuals
+    // of all features at once for the final state.
+    if (partitioned)
+      dense_map::calcPixelResiduals(cam_params, cams, world_to_cam, keypoint_vec, xyz_vec,
+                                    FLAGS_num_opt_threads,
+                                    // Outputs
+                                    tracks, residuals);
+
     // Flag outliers after this pass
     dense_map::flagOutliersByTriAngleAndReprojErr(  // Inputs
-        FLAGS_min_triangulation_angle, FLAGS_max_reprojection_error, pid_to_cid_fid, keypoint_vec,
-        world_to_cam, xyz_vec, pid_cid_fid_to_residual_index, residuals,
+        FLAGS_min_triangulation_angle, FLAGS_max_reprojection_error, keypoint_vec,
+        world_to_cam, xyz_vec, residuals, FLAGS_num_opt_threads,
         // Outputs
-        pid_cid_fid_inlier);
+        tracks);
   }  // End optimization passes
 
+  printPassReports(pass_reports);
+
   // Put back the scale in depth_to_image
   for (int cam_type = 0; cam_type < num_cam_types; cam_type++)
     depth_to_image[cam_type].linear() *= depth_to_image_scales[cam_type];
 
   if (FLAGS_save_matches)
-    dense_map::saveInlinerMatchPairs(cams, FLAGS_num_overlaps, pid_to_cid_fid,
-                                     keypoint_vec, pid_cid_fid_inlier, FLAGS_out_dir);
+    dense_map::saveInlinerMatchPairs(cams, image_pairs, tracks,
+                                     keypoint_vec, FLAGS_out_dir);
 
 
   // Update the transforms from the world to every camera
@@ -2003,29 +2822,63 @@ int main(int argc, char** argv) {
   // TODO(oalexan1): Why the call below works without dense_map:: prepended to it?
   // TODO(oalexan1): This call to calc_world_to_cam_rig_or_not is likely not
   // necessary since world_to_cam has been updated by now.
-  if (FLAGS_out_texture_dir != "")
-    dense_map::meshProjectCameras(cam_names, cam_params, cams, world_to_cam, mesh, bvh_tree,
-                                  FLAGS_out_texture_dir);
 
-  dense_map::saveCameraPoses(FLAGS_out_dir, cams, world_to_cam);
-  
+  // The outputs do not depend on each other, so they are written
+  // concurrently. The writers which go over the cameras read and
+  // write their data on pools of threads of their own, so the
+  // threads are split among them. Texturing uses all the threads,
+  // including in OpenMP loops, so it is done last, by itself.
+  dense_map::StageTimer output_timer("save_outputs");
   bool model_rig = (!FLAGS_no_rig);
-  dense_map::writeRigConfig(FLAGS_out_dir, model_rig, ref_cam_type, cam_names,
-                            cam_params, ref_to_cam_trans, depth_to_image,
-                            ref_to_cam_timestamp_offsets);
+  int num_camera_writers = static_cast<int>(FLAGS_export_to_voxblox)
+    + static_cast<int>(FLAGS_save_transformed_depth_clouds);
+  int writer_threads = std::max(FLAGS_num_threads / std::max(num_camera_writers, 1), 1);
+  dense_map::ThreadPool output_pool(2 + num_camera_writers);
+  output_pool.AddTask([&]() {
+    dense_map::StageTimer save_timer("save_camera_poses");
+    dense_map::saveCameraPoses(FLAGS_out_dir, cams, world_to_cam);
+    dense_map::writeRigConfig(FLAGS_out_dir, model_rig, ref_cam_type, cam_names,
+                              cam_params, ref_to_cam_trans, depth_to_image,
+                              ref_to_cam_timestamp_offsets);
+  });
 
   if (FLAGS_save_nvm) {
-    std::string nvm_file = FLAGS_out_dir + "/cameras.nvm";
-    dense_map::writeNvm(nvm_file, cam_params, cams, world_to_cam, keypoint_vec,
-                        pid_to_cid_fid, pid_cid_fid_inlier, xyz_vec);
+    output_pool.AddTask([&]() {
+      dense_map::StageTimer nvm_timer("write_nvm");
+      std::string nvm_file = FLAGS_out_dir + "/cameras.nvm";
+      dense_map::writeNvm(nvm_file, cam_params, cams, world_to_cam, keypoint_vec,
+                          tracks, xyz_vec);
+    });
   }
-  
-  if (FLAGS_export_to_voxblox)
-    dense_map::exportToVoxblox(cam_names, cams, depth_to_image, world_to_cam, FLAGS_out_dir);
 
-  if (FLAGS_save_transformed_depth_clouds)
-    dense_map::saveTransformedDepthClouds(cam_names, cams, depth_to_image,
-                                          world_to_cam, FLAGS_out_dir);
+  if (FLAGS_export_to_voxblox) {
+    output_pool.AddTask([&]() {
+      dense_map::StageTimer voxblox_timer("export_to_voxblox");
+      dense_map::exportToVoxblox(cam_names, cams, depth_to_image, world_to_cam, FLAGS_out_dir,
+                                 writer_threads);
+    });
+  }
+
+  if (FLAGS_save_transformed_depth_clouds) {
+    output_pool.AddTask([&]() {
+      dense_map::StageTimer clouds_timer("save_transformed_depth_clouds");
+      dense_map::saveTransformedDepthClouds(cam_names, cams, depth_to_image,
+                                            world_to_cam, FLAGS_out_dir, writer_threads);
+    });
+  }
+  output_pool.Join();
+
+  if (FLAGS_out_texture_dir != "") {
+    dense_map::StageTimer texture_timer("texturing");
+    dense_map::meshProjectCameras(cam_names, cam_params, cams, world_to_cam, mesh, bvh_tree,
+                                  FLAGS_out_texture_dir, FLAGS_num_threads,
+                                  FLAGS_out_texture_ply);
+  }
+  output_timer.stop();
+
+  all_timer.stop();
+  if (FLAGS_profile_report != "")
+    dense_map::writeProfileReport(FLAGS_profile_report);
 
   return 0;
 } // NOLINT // TODO(oalexan1): Remove this, after making the code more modular
@@ -1,6 +1,6 @@
 #!/usr/bin/python
 
-import sys, os, re, subprocess, shutil, subprocess, glob
+import sys, os, re, subprocess, shutil, subprocess, glob, hashlib, threading
 import numpy as np
 
 if sys.version_info < (3, 0, 0):
@@ -73,7 +73,8 @@ def run_cmd(cmd, quit_on_failure = True):
         # Print the line but wipe the extra whitespace
         print(out.rstrip())
 
-    status = p.poll()
+    # Wait for the process to exit, as its output may end before that
+    status = p.wait()
 
     if status != 0 and quit_on_failure:
         print("Failed execution of: " + " ".join(cmd) + " with status " + str(status))
@@ -81,6 +82,157 @@ def run_cmd(cmd, quit_on_failure = True):
 
     return status
 
+def files_signature(files):
+    """
+    Return a string which changes when any of the given files
+    changes. Small files are identified by their contents, so
+    rewriting them with the same data does not count as a change, and
+    large ones by their size and modification time.
+    """
+
+    h = hashlib.sha1()
+    for path in files:
+        h.update(path.encode())
+        if not os.path.exists(path):
+            h.update(b" missing\n")
+            continue
+        size = os.path.getsize(path)
+        if size < (1 << 20):
+            with open(path, 'rb') as fh:
+                h.update(fh.read())
+        else:
+            h.update((" %d %0.17g\n" % (size, os.path.getmtime(path))).encode())
+
+    return h.hexdigest()
+
+def read_stamp(stamp_file):
+    """
+    Return the signature saved in a stamp file, or an empty string if
+    the file is missing.
+    """
+    if not os.path.exists(stamp_file):
+        return ""
+    with open(stamp_file, 'r') as fh:
+        return fh.read()
+
+def write_stamp(stamp_file, signature):
+    """
+    Save a signature in a stamp file. Write to a temporary file and
+    rename it, so an interrupted run does not leave a partial stamp.
+    """
+    mkdir_p(os.path.dirname(stamp_file))
+    tmp_file = stamp_file + ".tmp"
+    with open(tmp_file, 'w') as fh:
+        fh.write(signature)
+    os.replace(tmp_file, stamp_file)
+
+class JobScheduler:
+    """
+    Run jobs on up to a given number of threads, with each job started
+    only after the jobs it depends on finished successfully. A job is
+    a function, which normally runs external programs with run_cmd(),
+    and fails if it raises an exception.
+
+    A job may have a stamp file and a signature, which identifies the
+    commands the job runs and the state of its inputs. The signature
+    can be a function, which is then called only when the jobs the job
+    depends on are done, so it can look at their outputs. When a job
+    succeeds its signature is saved to its stamp file, and on later
+    runs the job is skipped if the signature did not change and all the
+    outputs of the job, if given, still exist.
+    """
+
+    def __init__(self, num_threads, ignore_stamps = False):
+        self.num_threads = max(1, num_threads)
+        self.ignore_stamps = ignore_stamps
+        self.jobs = {}
+        self.order = []
+
+    def add(self, name, func, args = (), deps = [], stamp_file = "", signature = "",
+            outputs = []):
+        """
+        Add a job. The jobs it depends on must be added before it.
+        """
+        if name in self.jobs:
+            raise Exception("Duplicate job: " + name)
+        for dep in deps:
+            if dep not in self.jobs:
+                raise Exception("Job " + name + " depends on unknown job: " + dep)
+
+        self.jobs[name] = {"func": func, "args": args, "deps": list(deps),
+                           "stamp_file": stamp_file, "signature": signature,
+                           "outputs": list(outputs)}
+        self.order.append(name)
+
+    def run(self):
+        """
+        Run the jobs. Return the names of the jobs which failed or were
+        not run because a job they depend on failed.
+        """
+
+        status = {}  # each job is done or failed once it is no longer pending
+        pending = list(self.order)
+        num_running = [0]
+        cond = threading.Condition()
+
+        def run_job(name, signature):
+            job = self.jobs[name]
+            success = True
+            try:
+                # A stale stamp must not outlive a job which is run again
+                if job["stamp_file"] != "" and os.path.exists(job["stamp_file"]):
+                    os.remove(job["stamp_file"])
+                job["func"](*job["args"])
+                if job["stamp_file"] != "":
+                    write_stamp(job["stamp_file"], signature)
+            except BaseException as e:
+                # run_cmd() calls sys.exit() on failure, so catch that as well
+                print("Job " + name + " failed: " + str(e))
+                success = False
+
+            with cond:
+                status[name] = "done" if success else "failed"
+                num_running[0] -= 1
+                cond.notify_all()
+
+        with cond:
+            while len(pending) > 0 or num_running[0] > 0:
+                # Go over the pending jobs in order, which puts each after
+                # the jobs it depends on
+                for name in list(pending):
+                    deps = self.jobs[name]["deps"]
+                    if any(status.get(dep) == "failed" for dep in deps):
+                        print("Skipping job " + name + " as a job it depends on failed.")
+                        status[name] = "failed"
+                        pending.remove(name)
+                        continue
+                    if not all(status.get(dep) == "done" for dep in deps):
+                        continue
+                    if num_running[0] >= self.num_threads:
+                        break
+
+                    pending.remove(name)
+                    job = self.jobs[name]
+                    signature = job["signature"]
+                    if callable(signature):
+                        signature = signature()
+                    if (not self.ignore_stamps) and job["stamp_file"] != "" and \
+                       read_stamp(job["stamp_file"]) == signature and \
+                       all(os.path.exists(f) for f in job["outputs"]):
+                        print("Skipping job " + name + " as it was done before.")
+                        status[name] = "done"
+                        continue
+
+                    num_running[0] += 1
+                    threading.Thread(target = run_job, args = (name, signature)).start()
+
+                # Jobs can only be started once running ones finish. If none
+                # are running, the pass above handled all pending jobs.
+                if num_running[0] > 0:
+                    cond.wait()
+
+        return [name for name in self.order if status.get(name) != "done"]
+
 def readConfigVals(handle, tag, num_vals):
     """
     Read a tag and vals. If num_vals > 0, expecting to read this many vals.
@@ -257,25 +409,15 @@ def undistort_images(args, images, tools_base_dir, extension, extra_opts, suff):
 
     # Form the list of unundistorted images
     undist_dir = args.out_dir + "/" + args.rig_sensor + "/undistorted" + suff
-
-    if os.path.isdir(undist_dir):
-        # Wipe the existing directory, as it may have stray files
-        print("Removing recursively old directory: " + undist_dir)
-        shutil.rmtree(undist_dir)
-    
     undist_image_list = undist_dir + "/index.txt"
-    mkdir_p(undist_dir)
-    print("Writing: " + undist_image_list)
     undistorted_images = []
-    with open(undist_image_list, 'w') as f:
-        for image in dist_images:
-            image = undist_dir + "/" + os.path.basename(image)
-            # Use desired extension. For example, texrecon seems to want .jpg. In stereo
-            # one prefers .tif, as that one is lossless.
-            path, ext = os.path.splitext(image)
-            image = path + extension
-            undistorted_images.append(image)
-            f.write(image + "\n")
+    for image in dist_images:
+        image = undist_dir + "/" + os.path.basename(image)
+        # Use desired extension. For example, texrecon seems to want .jpg. In stereo
+        # one prefers .tif, as that one is lossless.
+        path, ext = os.path.splitext(image)
+        image = path + extension
+        undistorted_images.append(image)
 
     undist_intrinsics = undist_dir + "/undistorted_intrinsics.txt"
     cmd = [tools_base_dir + "/bin/undistort_image_texrecon",
@@ -284,11 +426,36 @@ def undistort_images(args, images, tools_base_dir, extension, extra_opts, suff):
            "--rig_config", args.rig_config,
            "--rig_sensor", args.rig_sensor,
            "--undistorted_crop_win", args.undistorted_crop_win,
-           "--undistorted_intrinsics", undist_intrinsics] + \
+           "--undistorted_intrinsics", undist_intrinsics,
+           # Outside undist_dir, which is wiped above, so later runs can reuse it
+           "--remap_cache_dir", args.out_dir + "/remap_cache"] + \
            extra_opts
-    
+
+    # If the same images were undistorted the same way before, reuse them.
+    # The stamp is kept outside undist_dir, which is wiped below.
+    stamp_file = undist_dir + "_stamp.txt"
+    signature = " ".join(cmd) + "\n" + files_signature([args.rig_config] + dist_images)
+    outputs = undistorted_images + [undist_image_list, undist_intrinsics]
+    if read_stamp(stamp_file) == signature and all(os.path.exists(f) for f in outputs):
+        print("Reusing the undistorted " + args.rig_sensor + " images in: " + undist_dir)
+        return (undist_intrinsics, undistorted_images, undist_dir)
+
+    if os.path.exists(stamp_file):
+        os.remove(stamp_file)
+    if os.path.isdir(undist_dir):
+        # Wipe the existing directory, as it may have stray files
+        print("Removing recursively old directory: " + undist_dir)
+        shutil.rmtree(undist_dir)
+
+    mkdir_p(undist_dir)
+    print("Writing: " + undist_image_list)
+    with open(undist_image_list, 'w') as f:
+        for image in undistorted_images:
+            f.write(image + "\n")
+
     print("Undistorting " + args.rig_sensor + " images.")
     run_cmd(cmd)
+    write_stamp(stamp_file, signature)
 
     return (undist_intrinsics, undistorted_images, undist_dir)
 
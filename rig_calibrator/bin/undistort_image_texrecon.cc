@@ -19,6 +19,7 @@
 #include <camera_model/camera_params.h>
 #include <rig_calibrator/dense_map_utils.h>
 #include <rig_calibrator/system_utils.h>
+#include <rig_calibrator/thread.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -27,6 +28,13 @@
 #include <opencv2/core/types.hpp>
 
 #include <boost/filesystem.hpp>
+
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <iostream>
 
@@ -81,6 +89,169 @@ DEFINE_string(rig_sensor, "",
               "Which rig sensor to use to undistort the images. Must be among the "
               "sensors specified via --rig_config.");
 
+DEFINE_string(remap_cache_dir, "",
+              "If specified, save the undistortion maps in this directory, in a file whose "
+              "name depends on the camera intrinsics and --scale, and reuse them on later "
+              "runs with the same values. The maps are recomputed if this is not set.");
+
+// Serializes the writing to the screen from multiple threads
+std::mutex g_print_mutex;
+
+// Fill in rows [beg_row, end_row) of the undistortion map. Each row
+// is distorted in one batch. Tame the map as explained below.
+void genRemapRows(camera::CameraParameters const& cam, double scale, float max_extra,
+                  int img_cols, int img_rows, int beg_row, int end_row,
+                  cv::Mat * floating_remap) {
+  int cols = floating_remap->cols;
+  Eigen::Vector2d undist_half_size = cam.GetUndistortedHalfSize();
+  Eigen::Matrix<double, Eigen::Dynamic, 2> undist_c(cols, 2), dist;
+  for (int row = beg_row; row < end_row; row++) {
+    for (int col = 0; col < cols; col++) {
+      undist_c(col, 0) = col / scale - undist_half_size[0];
+      undist_c(col, 1) = row / scale - undist_half_size[1];
+    }
+    cam.DistortPixels(undist_c, &dist);
+
+    for (int col = 0; col < cols; col++) {
+      cv::Vec2f pix(scale * dist(col, 0), scale * dist(col, 1));
+      pix[0] = std::max(pix[0], -max_extra);
+      pix[0] = std::min(pix[0], img_cols + max_extra);
+      pix[1] = std::max(pix[1], -max_extra);
+      pix[1] = std::min(pix[1], img_rows + max_extra);
+      floating_remap->at<cv::Vec2f>(row, col) = pix;
+    }
+  }
+}
+
+// A string uniquely identifying the undistortion maps. These depend
+// on the intrinsics and the scale only.
+std::string remapKey(camera::CameraParameters const& cam, double scale, float max_extra) {
+  std::ostringstream os;
+  os.precision(17);
+  os << "distorted_size "   << cam.GetDistortedSize().transpose()   << " "
+     << "undistorted_size " << cam.GetUndistortedSize().transpose() << " "
+     << "focal_length "     << cam.GetFocalVector().transpose()     << " "
+     << "optical_offset "   << cam.GetOpticalOffset().transpose()   << " "
+     << "distortion "       << cam.GetDistortion().transpose()      << " "
+     << "scale " << scale << " max_extra " << max_extra;
+  return os.str();
+}
+
+// Read the undistortion maps and the image borders saved by
+// writeRemapMaps(). Return false if the file does not exist or it is
+// for a different key.
+bool readRemapMaps(std::string const& file, std::string const& key,
+                   int borders[4], cv::Mat & fixed_map, cv::Mat & interp_map) {
+  std::ifstream ifs(file.c_str(), std::ios::binary);
+  if (!ifs.good())
+    return false;
+
+  std::string file_key;
+  std::getline(ifs, file_key);
+  if (file_key != key)
+    return false;
+
+  int rows = 0, cols = 0;
+  ifs.read(reinterpret_cast<char*>(borders), 4 * sizeof(int));
+  ifs.read(reinterpret_cast<char*>(&rows), sizeof(rows));
+  ifs.read(reinterpret_cast<char*>(&cols), sizeof(cols));
+  if (!ifs.good() || rows <= 0 || cols <= 0)
+    return false;
+
+  fixed_map.create(rows, cols, CV_16SC2);
+  interp_map.create(rows, cols, CV_16UC1);
+  ifs.read(reinterpret_cast<char*>(fixed_map.data), fixed_map.total() * fixed_map.elemSize());
+  ifs.read(reinterpret_cast<char*>(interp_map.data), interp_map.total() * interp_map.elemSize());
+  return ifs.good();
+}
+
+// Save the undistortion maps. Write to a temporary file first, so
+// another process never reads a partially written file.
+void writeRemapMaps(std::string const& file, std::string const& key,
+                    int const borders[4], cv::Mat const& fixed_map, cv::Mat const& interp_map) {
+  dense_map::createDir(fs::path(file).parent_path().string());
+  std::string tmp_file = file + ".tmp" + std::to_string(::getpid());
+  {
+    std::ofstream ofs(tmp_file.c_str(), std::ios::binary);
+    ofs << key << "\n";
+    int rows = fixed_map.rows, cols = fixed_map.cols;
+    ofs.write(reinterpret_cast<char const*>(borders), 4 * sizeof(int));
+    ofs.write(reinterpret_cast<char const*>(&rows), sizeof(rows));
+    ofs.write(reinterpret_cast<char const*>(&cols), sizeof(cols));
+    ofs.write(reinterpret_cast<char const*>(fixed_map.data),
+              fixed_map.total() * fixed_map.elemSize());
+    ofs.write(reinterpret_cast<char const*>(interp_map.data),
+              interp_map.total() * interp_map.elemSize());
+    if (!ofs.good())
+      LOG(FATAL) << "Could not write: " << tmp_file << "\n";
+  }
+  fs::rename(tmp_file, file);
+}
+
+// Read, undistort, and write one image
+void undistortImage(std::string const& filename, std::string const& undist_file,
+                    int img_cols, int img_rows, int const borders[4],
+                    cv::Mat const& fixed_map, cv::Mat const& interp_map,
+                    cv::Rect const& cropROI) {
+  cv::Mat image = cv::imread(filename, cv::IMREAD_UNCHANGED);
+
+  if (FLAGS_histogram_equalization) {
+    cv::Mat tmp_image;
+    cv::equalizeHist(image, tmp_image);
+    image = tmp_image;
+  }
+
+  // Ensure that image dimensions are as expected
+  if (image.rows != img_rows || image.cols != img_cols)
+    LOG(FATAL) << "The input image " << filename << " has wrong dimensions.";
+
+  // Expand the image before interpolating into it
+  cv::Scalar paddingColor = 0;
+  cv::Mat expanded_image;
+  cv::copyMakeBorder(image, expanded_image, borders[0], borders[1],
+                     borders[2], borders[3],
+                     cv::BORDER_CONSTANT, paddingColor);
+
+  // Undistort it
+  cv::Mat undist_image;
+  cv::remap(expanded_image, undist_image, fixed_map, interp_map, cv::INTER_LINEAR);
+
+  // Crop, if desired
+  if (cropROI.width > 0 && cropROI.height > 0) {
+    cv::Mat cropped_image;
+    undist_image(cropROI).copyTo(cropped_image);  // without copyTo it is a shallow copy
+    undist_image = cropped_image;  // this makes a shallow copy
+  }
+
+  // Save to disk the undistorted image
+  {
+    std::lock_guard<std::mutex> lock(g_print_mutex);
+    std::cout << "Writing: " << undist_file << std::endl;
+  }
+  cv::Mat bgr_image;
+  if (FLAGS_save_bgr && undist_image.channels() == 1) {
+    // Convert from grayscale to color if needed
+    #if (CV_VERSION_MAJOR >= 4)
+      cvtColor(undist_image, bgr_image, cv::COLOR_GRAY2BGR);
+    #else
+      cvtColor(undist_image, bgr_image, CV_GRAY2BGR);
+    #endif
+    undist_image = bgr_image;
+  }
+
+  cv::Mat gray_image;
+  if (!FLAGS_save_bgr && undist_image.channels() > 1) {
+    #if (CV_VERSION_MAJOR >= 4)
+      cvtColor(undist_image, gray_image, cv::COLOR_BGR2GRAY);
+    #else
+      cvtColor(undist_image, gray_image, CV_BGR2GRAY);
+    #endif
+    undist_image = gray_image;
+  }
+
+  cv::imwrite(undist_file, undist_image);
+}
+
 int main(int argc, char ** argv) {
 
   google::InitGoogleLogging(argv[0]);
@@ -146,13 +317,6 @@ int main(int argc, char ** argv) {
   //                                    Eigen::Vector2d::Constant(610.502),
   //                                    Eigen::Vector2d(776/2.0, 517/2.0));
 
-  // Create the undistortion map
-  cv::Mat floating_remap, fixed_map, interp_map;
-  cam_ptr->GenerateRemapMaps(&floating_remap, FLAGS_scale);
-
-  // Make adjustments to floating_remap.
-  // TODO(oalexan1): This must be a function.
-
   // We have to conform to the OpenCV API, which says:
   // undist_image(x, y) = dist_image(floating_remap(x, y)).
 
@@ -176,72 +340,78 @@ int main(int argc, char ** argv) {
                        round(FLAGS_scale*cam_ptr->GetDistortedSize()[1]));
   int img_cols = dims[0], img_rows = dims[1];
 
-  cv::Vec2f start = floating_remap.at<cv::Vec2f>(0, 0);
-  double min_x = 0.0, max_x = 0.0, min_y = 0.0, max_y = 0.0;  // will change very soon
-  for (int col = 0; col < floating_remap.cols; col++) {
-    for (int row = 0; row < floating_remap.rows; row++) {
-      cv::Vec2f pix = floating_remap.at<cv::Vec2f>(row, col);
+  // The undistortion maps, and the borders by which to expand an
+  // image before undistorting it: top, bottom, left, right
+  cv::Mat fixed_map, interp_map;
+  int borders[4] = {0, 0, 0, 0};
+
+  // See if the maps were computed before
+  std::string remap_key = remapKey(*cam_ptr, FLAGS_scale, max_extra);
+  std::string remap_file;
+  if (FLAGS_remap_cache_dir != "") {
+    std::ostringstream os;
+    os << std::hex << std::hash<std::string>()(remap_key);
+    remap_file = FLAGS_remap_cache_dir + "/remap_" + os.str() + ".bin";
+  }
 
-      // Tame floating_remap
-      pix[0] = std::max(pix[0], -max_extra);
-      pix[0] = std::min(pix[0], img_cols + max_extra);
-      pix[1] = std::max(pix[1], -max_extra);
-      pix[1] = std::min(pix[1], img_rows + max_extra);
-      floating_remap.at<cv::Vec2f>(row, col) = pix;
-
-      if (col == 0 && row == 0) {
-        // initialize with the potentially adjusted value of pix.
-        min_x = pix[0];
-        max_x = pix[0];
-        min_y = pix[1];
-        max_y = pix[1];
+  if (remap_file != "" &&
+      readRemapMaps(remap_file, remap_key, borders, fixed_map, interp_map)) {
+    std::cout << "Read undistortion maps: " << remap_file << std::endl;
+  } else {
+    // Create the undistortion map, in parallel, with blocks of rows
+    cv::Mat floating_remap;
+    floating_remap.create(FLAGS_scale*cam_ptr->GetUndistortedSize()[1],
+                          FLAGS_scale*cam_ptr->GetUndistortedSize()[0], CV_32FC2);
+    {
+      int block_size = 16;
+      dense_map::ThreadPool thread_pool;
+      for (int beg = 0; beg < floating_remap.rows; beg += block_size) {
+        int end = std::min(beg + block_size, floating_remap.rows);
+        thread_pool.AddTask(&genRemapRows, std::cref(*cam_ptr), FLAGS_scale, max_extra,
+                            img_cols, img_rows, beg, end, &floating_remap);
       }
-
-      // Find the expanded (but tamed) image bounds
-      if (pix[0] < min_x)
-        min_x = pix[0];
-      if (pix[0] > max_x)
-        max_x = pix[0];
-      if (pix[1] < min_y)
-        min_y = pix[1];
-      if (pix[1] > max_y)
-        max_y = pix[1];
+      thread_pool.Join();
     }
-  }
 
-  // Convert the bounds to int
-  min_x = floor(min_x); max_x = ceil(max_x);
-  min_y = floor(min_y); max_y = ceil(max_y);
-
-  // Ensure that the expanded image is not smaller than the old one,
-  // to make the logic simpler
-  if (min_x > 0)
-    min_x = 0;
-  if (max_x < img_cols)
-    max_x = img_cols;
-  if (min_y > 0)
-    min_y = 0;
-  if (max_y < img_rows)
-    max_y = img_rows;
-
-  // Convert the bounds to what cv::copyMakeBorder() will expect
-  int border_top  = -min_y, border_bottom = max_y - img_rows;
-  int border_left = -min_x, border_right  = max_x - img_cols;
-
-  // Adjust the remapping function to the expanded image.
-  // Now all its values will be within bounds of that image.
-  for (int col = 0; col < floating_remap.cols; col++) {
-    for (int row = 0; row < floating_remap.rows; row++) {
-      cv::Vec2f pix = floating_remap.at<cv::Vec2f>(row, col);
-      pix[0] += border_left;
-      pix[1] += border_top;
-      floating_remap.at<cv::Vec2f>(row, col) = pix;
+    // Find the expanded (but tamed) image bounds
+    double min_x = 0.0, max_x = 0.0, min_y = 0.0, max_y = 0.0;
+    std::vector<cv::Mat> channels;
+    cv::split(floating_remap, channels);
+    cv::minMaxLoc(channels[0], &min_x, &max_x);
+    cv::minMaxLoc(channels[1], &min_y, &max_y);
+
+    // Convert the bounds to int
+    min_x = floor(min_x); max_x = ceil(max_x);
+    min_y = floor(min_y); max_y = ceil(max_y);
+
+    // Ensure that the expanded image is not smaller than the old one,
+    // to make the logic simpler
+    if (min_x > 0)
+      min_x = 0;
+    if (max_x < img_cols)
+      max_x = img_cols;
+    if (min_y > 0)
+      min_y = 0;
+    if (max_y < img_rows)
+      max_y = img_rows;
+
+    // Convert the bounds to what cv::copyMakeBorder() will expect
+    borders[0] = -min_y; borders[1] = max_y - img_rows;
+    borders[2] = -min_x; borders[3] = max_x - img_cols;
+
+    // Adjust the remapping function to the expanded image.
+    // Now all its values will be within bounds of that image.
+    floating_remap += cv::Scalar(borders[2], borders[0]);
+
+    // Convert the map for speed
+    cv::convertMaps(floating_remap, cv::Mat(), fixed_map, interp_map, CV_16SC2);
+
+    if (remap_file != "") {
+      std::cout << "Writing: " << remap_file << std::endl;
+      writeRemapMaps(remap_file, remap_key, borders, fixed_map, interp_map);
     }
   }
 
-  // Convert the map for speed
-  cv::convertMaps(floating_remap, cv::Mat(), fixed_map, interp_map, CV_16SC2);
-
   Eigen::Vector2i dist_size(round(FLAGS_scale*cam_ptr->GetDistortedSize()[0]),
                             round(FLAGS_scale*cam_ptr->GetDistortedSize()[1]));
   Eigen::Vector2i undist_size(round(FLAGS_scale*cam_ptr->GetUndistortedSize()[0]),
@@ -284,67 +454,16 @@ int main(int argc, char ** argv) {
     std::cout << "Undistorted crop region: " << cropROI << std::endl;
   }
 
-  for (size_t i = 0; i < images.size(); i++) {
-    std::string filename(images[i]);
-
-    cv::Mat image = cv::imread(filename, cv::IMREAD_UNCHANGED);
-
-    if (FLAGS_histogram_equalization) {
-      cv::Mat tmp_image;
-      cv::equalizeHist(image, tmp_image);
-      image = tmp_image;
-    }
-
-    // Ensure that image dimensions are as expected
-    if (image.rows != img_rows || image.cols != img_cols)
-      LOG(FATAL) << "The input image " << filename << " has wrong dimensions.";
-
-    // Expand the image before interpolating into it
-    cv::Scalar paddingColor = 0;
-    cv::Mat expanded_image;
-    cv::copyMakeBorder(image, expanded_image, border_top, border_bottom,
-                       border_left, border_right,
-                       cv::BORDER_CONSTANT, paddingColor);
-
-    // Undistort it
-    cv::Mat undist_image;
-    cv::remap(expanded_image, undist_image, fixed_map, interp_map, cv::INTER_LINEAR);
-
-    // Crop, if desired
-    if (cropROI.width > 0 && cropROI.height > 0) {
-      cv::Mat cropped_image;
-      undist_image(cropROI).copyTo(cropped_image);  // without copyTo it is a shallow copy
-      undist_image = cropped_image;  // this makes a shallow copy
-    }
-
-    // The output file name
-    std::string undist_file = undist_images[i];
-
-    // Save to disk the undistorted image
-    std::cout << "Writing: " << undist_file << std::endl;
-    cv::Mat bgr_image;
-    if (FLAGS_save_bgr && undist_image.channels() == 1) {
-      // Convert from grayscale to color if needed
-      #if (CV_VERSION_MAJOR >= 4)
-        cvtColor(undist_image, bgr_image, cv::COLOR_GRAY2BGR);
-      #else
-        cvtColor(undist_image, bgr_image, CV_GRAY2BGR);
-      #endif
-      undist_image = bgr_image;
-    }
-
-    cv::Mat gray_image;
-    if (!FLAGS_save_bgr && undist_image.channels() > 1) {
-      #if (CV_VERSION_MAJOR >= 4)
-        cvtColor(undist_image, gray_image, cv::COLOR_BGR2GRAY);
-      #else
-        cvtColor(undist_image, gray_image, CV_BGR2GRAY);
-      #endif
-      undist_image = gray_image;
-    }
-
-    cv::imwrite(undist_file, undist_image);
-  } // end iterating over images
+  // Undistort the images in parallel. Each task does its own reading
+  // and writing, so the disk and processor are busy at the same time.
+  {
+    dense_map::ThreadPool thread_pool;
+    for (size_t i = 0; i < images.size(); i++)
+      thread_pool.AddTask(&undistortImage, std::cref(images[i]), std::cref(undist_images[i]),
+                          img_cols, img_rows, borders, std::cref(fixed_map),
+                          std::cref(interp_map), std::cref(cropROI));
+    thread_pool.Join();
+  }
   
   // Write some very useful info
   std::cout << "Distorted image size:       " << dist_size.transpose()      << "\n";
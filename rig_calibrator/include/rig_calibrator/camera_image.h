@@ -22,6 +22,11 @@
 
 #include <opencv2/imgproc.hpp>
 
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <string>
+
 namespace dense_map {
 
 // A class to encompass all known information about a camera
@@ -49,21 +54,28 @@ struct cameraImage {
   int beg_ref_index;
   int end_ref_index;
 
-  // The image for this camera, in grayscale
-  cv::Mat image;
+  // The image size in the camera calibration. The image is resized
+  // to it when read, if needed.
+  Eigen::Vector2i calib_image_size = Eigen::Vector2i(0, 0);
 
-  // The corresponding depth cloud, for an image + depth camera.
-  // Will be empty and uninitialized for a camera lacking depth.
-  cv::Mat depth_cloud;
-
-  // These will be populated automatically if missing
+  // These will be populated automatically if missing. The depth name
+  // is empty for a camera lacking depth.
   std::string image_name, depth_name;
+
+  // The image for this camera, in grayscale, and the corresponding
+  // depth cloud, for an image + depth camera. These are read from
+  // disk on demand and kept in memory subject to
+  // --max_image_cache_mb, so a copy should not be held longer than
+  // needed. The depth cloud is empty for a camera lacking depth.
+  cv::Mat getImage() const;
+  cv::Mat getDepthCloud() const;
+  bool hasDepthCloud() const { return !depth_name.empty(); }
 };
 
 // A struct to collect together some attributes of an image or depth cloud
-// (stored as an image with 3 channels)
+// (stored as an image with 3 channels). The data itself is read
+// only when needed, see cameraImage.
 struct ImageMessage {
-  cv::Mat image;
   double timestamp;
   std::string name;
   Eigen::Affine3d world_to_cam;
@@ -128,11 +128,9 @@ bool findInterpPose(double desired_time, std::map<double, Eigen::Affine3d> const
 double maxRotationAngle(Eigen::Affine3d const& T);
 
 // A class to store timestamped poses, implementing O(log(n)) linear
-// interpolation at a desired timestamp. For fast access, keep the
-// poses in bins obtained by flooring the timestamp, which is measured
-// in seconds. It is assumed that there are a handful of poses
-// measured every second, so in each bin. When bins get large, or too
-// many bins are empty, the efficiency of this algorithm goes down.
+// interpolation at a desired timestamp. The poses are kept in a flat
+// array sorted by timestamp, which is searched by bisection. Adding
+// poses in increasing order of time is fastest.
 class StampedPoseStorage {
  public:
   void addPose(Eigen::Affine3d const& pose, double timestamp);
@@ -148,7 +146,8 @@ class StampedPoseStorage {
   bool empty() const;
 
  private:
-  std::map<int, std::map<double, Eigen::Affine3d>> m_poses;
+  std::vector<double> m_timestamps;
+  std::vector<Eigen::Affine3d> m_poses;
 };
 
 // Compute the azimuth and elevation for a (normal) vector
@@ -214,6 +213,20 @@ void pickTimestampsInBounds(std::vector<double> const& timestamps, double left_b
                             double right_bound, double offset,
                             std::vector<double>& out_timestamps);
 
+// Find the index of the first of the given timestamps, sorted in
+// increasing order, which is no less than the given timestamp, or the
+// number of timestamps if there is none. The search starts at
+// start_pos and gallops forward, so it is fast when the result is
+// close to it.
+int timestampLowerBound(std::vector<double> const& timestamps, double timestamp,
+                        int start_pos = 0);
+
+// The same as timestampLowerBound() for each of many queries. This is
+// fastest when the queries are in increasing order.
+void timestampLowerBounds(std::vector<double> const& timestamps,
+                          std::vector<double> const& queries,
+                          std::vector<int> & positions);
+
 // Must always have NUM_EXIF the last.
 enum ExifData { TIMESTAMP = 0, EXPOSURE_TIME, ISO, APERTURE, FOCAL_LENGTH, NUM_EXIF };
 
@@ -231,6 +244,10 @@ bool depthValue(// Inputs
                 // Output
                 Eigen::Vector3d& depth_xyz);
   
+// Images may need to be resized to be the same size as in the
+// calibration file. The two sizes must agree up to an integer factor.
+void adjustImageSize(Eigen::Vector2i const& calib_image_size, cv::Mat & image);
+
 // Forward declaration
 struct cameraImage;
 
@@ -244,9 +261,10 @@ void genImageAndDepthFileNames(  // Inputs
 // Find an image at the given timestamp or right after it. We assume
 // that during repeated calls to this function we always travel
 // forward in time, and we keep track of where we are in the vector using
-// the variable beg_pos that we update as we go.
+// the variable beg_pos that we update as we go. The messages must be
+// in chronological order.
 bool lookupImage(double desired_time, std::vector<ImageMessage> const& msgs,
-                 cv::Mat& image, std::string & image_name, int& beg_pos, double& found_time);
+                 std::string & image_name, int& beg_pos, double& found_time);
 
 // Look up images, with or without the rig constraint. See individual functions
 // below for more details.
@@ -290,18 +308,18 @@ void readRigConfig(std::string const& rig_config, bool have_rig_transforms, int
                    std::vector<double> & ref_to_cam_timestamp_offsets);
 
 // Save the depth clouds and optimized transforms needed to create a mesh with voxblox
-// (if depth clouds exist).
+// (if depth clouds exist). Use num_threads threads in total for reading and writing.
 void exportToVoxblox(std::vector<std::string> const& cam_names,
                      std::vector<dense_map::cameraImage> const& cam_images,
                      std::vector<Eigen::Affine3d> const& depth_to_image,
                      std::vector<Eigen::Affine3d> const& world_to_cam,
-                     std::string const& out_dir);
+                     std::string const& out_dir, int num_threads);
 
 void saveTransformedDepthClouds(std::vector<std::string> const& cam_names,
                                 std::vector<dense_map::cameraImage> const& cam_images,
                                 std::vector<Eigen::Affine3d> const& depth_to_image,
                                 std::vector<Eigen::Affine3d> const& world_to_cam,
-                                std::string const& out_dir);
+                                std::string const& out_dir, int num_threads);
   
 }  // namespace dense_map
 
@@ -0,0 +1,103 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef FEATURE_CACHE_H_
+#define FEATURE_CACHE_H_
+
+#include <opencv2/core/core.hpp>
+#include <gflags/gflags.h>
+
+#include <Eigen/Core>
+
+#include <memory>
+#include <string>
+
+DECLARE_bool(feature_cache);
+
+namespace dense_map {
+
+struct cameraImage;
+
+// A read-only memory-mapped file. The mapping is released when
+// this object goes out of scope, so any data pointing into it,
+// such as descriptors loaded from the feature cache, must not
+// outlive it.
+class MappedFile {
+ public:
+  MappedFile();
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Return false if the file could not be opened or mapped
+  bool open(std::string const& file);
+  void close();
+
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+ private:
+  const char* m_data;
+  size_t m_size;
+};
+
+// The directory in which the features for images are cached, given the
+// output directory of the tool.
+std::string featureCacheDir(std::string const& out_dir);
+
+// A string uniquely identifying the features of the given image. It
+// depends on the image path, its modification time and size, and on
+// the feature detector options. Return the empty string if the image
+// is not on disk, in which case caching is not possible.
+std::string featureCacheKey(std::string const& image_file);
+
+// The cache file for a given key
+std::string featureCacheFile(std::string const& cache_dir, std::string const& key);
+
+// Read the features from the cache. The keypoints are copied, while the
+// descriptors point into the memory-mapped file, which must be kept
+// alive while they are in use. Return false if the cache file is
+// missing, is stale, or is invalid.
+bool readFeatureCache(std::string const& cache_file, std::string const& key,
+                      // Outputs
+                      cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints,
+                      std::shared_ptr<MappedFile>* mapped_file);
+
+// Save the features to the cache. Write to a temporary file and
+// rename it, so an interrupted or concurrent run does not leave a
+// partially written cache file behind.
+void writeFeatureCache(std::string const& cache_file, std::string const& key,
+                       cv::Mat const& descriptors, Eigen::Matrix2Xd const& keypoints);
+
+// Load the features of an image from the cache if available and
+// valid, otherwise detect them and save them to the cache. If
+// cache_dir is empty, just detect the features. The image is read
+// only if the features must be detected. If pyramid_level is
+// positive, the features are for the image reduced by a factor of
+// 2^pyramid_level, as in detectFeaturesAtLevel(), and are cached
+// separately.
+void detectFeaturesWithCache(cameraImage const& cam,
+                             std::string const& cache_dir, bool verbose, int pyramid_level,
+                             // Outputs
+                             cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints,
+                             std::shared_ptr<MappedFile>* mapped_file);
+
+}  // namespace dense_map
+
+#endif  // FEATURE_CACHE_H_
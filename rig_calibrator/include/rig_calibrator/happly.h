@@ -39,6 +39,8 @@ SOFTWARE.
 
   Significant changes to the file recorded here.
 
+  - Local changes                 Read binary data in bulk from a memory-mapped file, write fixed-size elements in
+                                  blocks, copy list properties on several threads.
   - Version 5 (Aug 22, 2020)      Minor: skip blank lines before properties in ASCII files
   - Version 4 (Sep 11, 2019)      Change internal list format to be flat. Other small perf fixes and cleanup.
   - Version 3 (Aug 1, 2019)       Add support for big endian and obj_info
@@ -48,18 +50,31 @@ SOFTWARE.
 */
 // clang-format on
 
+#include <algorithm>
 #include <array>
 #include <cctype>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <vector>
 #include <climits>
 
+// Binary data is read from a memory-mapped file where the platform supports it
+#if defined(__unix__) || defined(__APPLE__)
+#define HAPPLY_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // General namespace wrapping all Happly things.
 namespace happly {
 
@@ -162,6 +177,48 @@ public:
    */
   virtual void readNextBigEndian(std::istream& stream) = 0;
 
+  /**
+   * @brief (binary reading) Size in bytes of one value of this property, or 0 for list properties, whose entries do
+   * not have a fixed size.
+   *
+   * @return
+   */
+  virtual size_t fixedBinarySize() = 0;
+
+  /**
+   * @brief (binary reading) Copy the values of this property from a block of fixed-size records in memory.
+   *
+   * @param buf Pointer to the bytes of this property in the first record.
+   * @param stride Size of each record in bytes.
+   * @param count Number of records.
+   * @param bigEndian If true, swap the byte order of the values after copying them.
+   */
+  virtual void readStrided(const char* buf, size_t stride, size_t count, bool bigEndian) = 0;
+
+  /**
+   * @brief (binary reading) Copy the next value of this property from memory, advancing the pointer past it.
+   *
+   * @param ptr Pointer to read from, updated after this property is read.
+   * @param end End of the available data.
+   * @param bigEndian If true, the data is big endian.
+   */
+  virtual void readNextFromBuffer(const char*& ptr, const char* end, bool bigEndian) = 0;
+
+  /**
+   * @brief (binary reading) Copy count consecutive values of this property from memory, for an element which has
+   * no other properties.
+   *
+   * @param ptr Pointer to read from, updated after the values are read.
+   * @param end End of the available data.
+   * @param count Number of values to read.
+   * @param bigEndian If true, the data is big endian.
+   */
+  virtual void readAllFromBuffer(const char*& ptr, const char* end, size_t count, bool bigEndian) {
+    for (size_t i = 0; i < count; i++) {
+      readNextFromBuffer(ptr, end, bigEndian);
+    }
+  }
+
   /**
    * @brief (reading) Write a header entry for this property.
    *
@@ -193,6 +250,16 @@ public:
    */
   virtual void writeDataBinaryBigEndian(std::ostream& outStream, size_t iElement) = 0;
 
+  /**
+   * @brief (binary writing) copy the bits of this property for a range of elements into fixed-size records in memory
+   *
+   * @param buf Pointer to the bytes of this property in the first record.
+   * @param stride Size of each record in bytes.
+   * @param iStart Index of the first element to write.
+   * @param count Number of elements to write.
+   */
+  virtual void writeStrided(char* buf, size_t stride, size_t iStart, size_t count) = 0;
+
   /**
    * @brief Number of element entries for this property
    *
@@ -238,6 +305,98 @@ T swapEndian(T val) {
   return val;
 }
 
+/**
+ * Swap endianness of consecutive values in place.
+ *
+ * @param vals Values to swap.
+ * @param count Number of values.
+ */
+template <typename T>
+void swapEndianArray(T* vals, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    vals[i] = swapEndian(vals[i]);
+  }
+}
+
+/**
+ * Throw if fewer than numBytes bytes remain in a block of binary data.
+ *
+ * @param ptr Current position.
+ * @param end End of the data.
+ * @param numBytes Number of bytes about to be read.
+ */
+void checkBufferSize(const char* ptr, const char* end, size_t numBytes) {
+  if (static_cast<size_t>(end - ptr) < numBytes) {
+    throw std::runtime_error("PLY parser: unexpected end of binary data");
+  }
+}
+
+/**
+ * Read the count of a list property, stored in countBytes bytes.
+ *
+ * @param ptr Where the count is stored.
+ * @param countBytes Size of the count.
+ * @param bigEndian If true, the count is big endian.
+ *
+ * @return The count.
+ */
+size_t readListCount(const char* ptr, int countBytes, bool bigEndian) {
+  if (countBytes == 1) {
+    return static_cast<uint8_t>(ptr[0]);
+  } else if (countBytes == 2) {
+    uint16_t count;
+    std::memcpy(&count, ptr, sizeof(count));
+    return bigEndian ? swapEndian(count) : count;
+  } else if (countBytes == 4) {
+    uint32_t count;
+    std::memcpy(&count, ptr, sizeof(count));
+    return bigEndian ? swapEndian(count) : count;
+  }
+  uint64_t count;
+  std::memcpy(&count, ptr, sizeof(count));
+  return bigEndian ? swapEndian(count) : count;
+}
+
+/**
+ * Call func(begin, end) on contiguous chunks covering [0, count), on several threads when count is large enough for
+ * that to pay off.
+ *
+ * @param count Number of items.
+ * @param func Function processing a chunk of items.
+ */
+template <typename Func>
+void parallelChunks(size_t count, Func func) {
+  const size_t minChunk = 1 << 16;
+  size_t numThreads = std::thread::hardware_concurrency();
+  numThreads = std::min(std::max(numThreads, size_t(1)), (count + minChunk - 1) / minChunk);
+  if (numThreads <= 1) {
+    func(size_t(0), count);
+    return;
+  }
+
+  size_t chunk = (count + numThreads - 1) / numThreads;
+  std::vector<std::thread> threads;
+  for (size_t begin = 0; begin < count; begin += chunk) {
+    threads.emplace_back(func, begin, std::min(count, begin + chunk));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+/**
+ * The same integer type with the other signedness, used to avoid per-list copies when converting list properties.
+ */
+template <typename T, bool = std::is_integral<T>::value>
+struct OtherSign {
+  typedef T type;
+};
+template <typename T>
+struct OtherSign<T, true> {
+  typedef typename std::conditional<std::is_signed<T>::value, typename std::make_unsigned<T>::type,
+                                    typename std::make_signed<T>::type>::type type;
+};
+
 
 // Unpack flattened list from the convention used in TypedListProperty
 template <typename T>
@@ -341,6 +500,57 @@ public:
     data.back() = swapEndian(data.back());
   }
 
+  /**
+   * @brief (binary reading) Size in bytes of one value of this property.
+   *
+   * @return
+   */
+  virtual size_t fixedBinarySize() override { return sizeof(T); }
+
+  /**
+   * @brief (binary reading) Copy the values of this property from a block of fixed-size records in memory.
+   *
+   * @param buf Pointer to the bytes of this property in the first record.
+   * @param stride Size of each record in bytes.
+   * @param count Number of records.
+   * @param bigEndian If true, swap the byte order of the values after copying them.
+   */
+  virtual void readStrided(const char* buf, size_t stride, size_t count, bool bigEndian) override {
+    if (count == 0) {
+      return;
+    }
+    size_t currSize = data.size();
+    data.resize(currSize + count);
+    T* out = data.data() + currSize;
+    if (stride == sizeof(T)) {
+      std::memcpy(out, buf, count * sizeof(T));
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        std::memcpy(out + i, buf + i * stride, sizeof(T));
+      }
+    }
+    if (bigEndian) {
+      swapEndianArray(out, count);
+    }
+  }
+
+  /**
+   * @brief (binary reading) Copy the next value of this property from memory, advancing the pointer past it.
+   *
+   * @param ptr Pointer to read from, updated after this property is read.
+   * @param end End of the available data.
+   * @param bigEndian If true, the data is big endian.
+   */
+  virtual void readNextFromBuffer(const char*& ptr, const char* end, bool bigEndian) override {
+    checkBufferSize(ptr, end, sizeof(T));
+    data.emplace_back();
+    std::memcpy(&data.back(), ptr, sizeof(T));
+    ptr += sizeof(T);
+    if (bigEndian) {
+      data.back() = swapEndian(data.back());
+    }
+  }
+
   /**
    * @brief (reading) Write a header entry for this property.
    *
@@ -382,6 +592,20 @@ public:
     outStream.write((char*)&value, sizeof(T));
   }
 
+  /**
+   * @brief (binary writing) copy the bits of this property for a range of elements into fixed-size records in memory
+   *
+   * @param buf Pointer to the bytes of this property in the first record.
+   * @param stride Size of each record in bytes.
+   * @param iStart Index of the first element to write.
+   * @param count Number of elements to write.
+   */
+  virtual void writeStrided(char* buf, size_t stride, size_t iStart, size_t count) override {
+    for (size_t i = 0; i < count; i++) {
+      std::memcpy(buf + i * stride, &data[iStart + i], sizeof(T));
+    }
+  }
+
   /**
    * @brief Number of element entries for this property
    *
@@ -537,6 +761,87 @@ public:
     }
   }
 
+  /**
+   * @brief (binary reading) Size in bytes of one value of this property, which is 0 since lists vary in length.
+   *
+   * @return
+   */
+  virtual size_t fixedBinarySize() override { return 0; }
+
+  /**
+   * @brief (binary reading) Not available for list properties, which do not have a fixed size.
+   */
+  virtual void readStrided(const char* /*buf*/, size_t /*stride*/, size_t /*count*/, bool /*bigEndian*/) override {
+    throw std::runtime_error("PLY parser: list property " + name + " does not have a fixed size");
+  }
+
+  /**
+   * @brief (binary reading) Copy the next value of this property from memory, advancing the pointer past it.
+   *
+   * @param ptr Pointer to read from, updated after this property is read.
+   * @param end End of the available data.
+   * @param bigEndian If true, the data is big endian.
+   */
+  virtual void readNextFromBuffer(const char*& ptr, const char* end, bool bigEndian) override {
+    checkBufferSize(ptr, end, listCountBytes);
+    size_t count = readListCount(ptr, listCountBytes, bigEndian);
+    ptr += listCountBytes;
+    checkBufferSize(ptr, end, count * sizeof(T));
+
+    size_t currSize = flattenedData.size();
+    flattenedData.resize(currSize + count);
+    if (count > 0) {
+      std::memcpy(&flattenedData[currSize], ptr, count * sizeof(T));
+    }
+    ptr += count * sizeof(T);
+    if (bigEndian) {
+      swapEndianArray(flattenedData.data() + currSize, count);
+    }
+    flattenedIndexStart.emplace_back(currSize + count);
+  }
+
+  /**
+   * @brief (binary reading) Copy count consecutive lists from memory, for an element which has no other properties
+   * (such as the faces of a mesh). A first pass over the list counts finds where each list goes, then the lists are
+   * copied on several threads.
+   *
+   * @param ptr Pointer to read from, updated after the lists are read.
+   * @param end End of the available data.
+   * @param count Number of lists to read.
+   * @param bigEndian If true, the data is big endian.
+   */
+  virtual void readAllFromBuffer(const char*& ptr, const char* end, size_t count, bool bigEndian) override {
+
+    const char* begin = ptr;
+    size_t flatStart = flattenedData.size();
+    size_t iStart = flattenedIndexStart.size() - 1;
+    flattenedIndexStart.reserve(flattenedIndexStart.size() + count);
+    for (size_t i = 0; i < count; i++) {
+      checkBufferSize(ptr, end, listCountBytes);
+      size_t listSize = readListCount(ptr, listCountBytes, bigEndian);
+      ptr += listCountBytes;
+      checkBufferSize(ptr, end, listSize * sizeof(T));
+      ptr += listSize * sizeof(T);
+      flattenedIndexStart.push_back(flattenedIndexStart.back() + listSize);
+    }
+
+    flattenedData.resize(flattenedIndexStart.back());
+    const size_t* starts = flattenedIndexStart.data() + iStart;
+    T* out = flattenedData.data();
+    size_t countBytes = listCountBytes;
+    parallelChunks(count, [=](size_t b, size_t e) {
+      for (size_t i = b; i < e; i++) {
+        // List i comes after i + 1 counts and the values of the lists before it
+        size_t listSize = starts[i + 1] - starts[i];
+        const char* src = begin + (i + 1) * countBytes + (starts[i] - flatStart) * sizeof(T);
+        std::memcpy(out + starts[i], src, listSize * sizeof(T));
+        if (bigEndian) {
+          swapEndianArray(out + starts[i], listSize);
+        }
+      }
+    });
+  }
+
   /**
    * @brief (reading) Write a header entry for this property. Note that we already use "uchar" for the list count type.
    *
@@ -618,6 +923,13 @@ public:
     }
   }
 
+  /**
+   * @brief (binary writing) Not available for list properties, which do not have a fixed size.
+   */
+  virtual void writeStrided(char* /*buf*/, size_t /*stride*/, size_t /*iStart*/, size_t /*count*/) override {
+    throw std::runtime_error("PLY writer: list property " + name + " does not have a fixed size");
+  }
+
   /**
    * @brief Number of element entries for this property
    *
@@ -1043,6 +1355,48 @@ public:
     }
   }
 
+  /**
+   * @brief Get a list property for this element in flattened form: the concatenation of all lists, and the start of
+   * each list in it, plus one entry for the end. Unlike getListPropertyAnySign(), this does not make a vector per list
+   * when the stored type matches T up to sign.
+   *
+   * @tparam T The type of data requested
+   * @param propertyName The name of the property to get.
+   * @param flatData The values of all lists.
+   * @param flatStarts Where each list starts in flatData.
+   */
+  template <class T>
+  void getListPropertyFlat(const std::string& propertyName, std::vector<T>& flatData, std::vector<size_t>& flatStarts) {
+
+    // Find the property
+    std::unique_ptr<Property>& prop = getPropertyPtr(propertyName);
+
+    typedef typename CanonicalName<T>::type Tcan;
+    TypedListProperty<Tcan>* castedProp = dynamic_cast<TypedListProperty<Tcan>*>(prop.get());
+    if (castedProp) {
+      flatData.assign(castedProp->flattenedData.begin(), castedProp->flattenedData.end());
+      flatStarts = castedProp->flattenedIndexStart;
+      return;
+    }
+
+    typedef typename OtherSign<Tcan>::type Topp;
+    TypedListProperty<Topp>* castedOppProp = dynamic_cast<TypedListProperty<Topp>*>(prop.get());
+    if (castedOppProp) {
+      flatData.assign(castedOppProp->flattenedData.begin(), castedOppProp->flattenedData.end());
+      flatStarts = castedOppProp->flattenedIndexStart;
+      return;
+    }
+
+    // Any other type goes through the general conversion
+    std::vector<std::vector<T>> lists = getListPropertyAnySign<T>(propertyName);
+    flatData.clear();
+    flatStarts.assign(1, 0);
+    for (const std::vector<T>& list : lists) {
+      flatData.insert(flatData.end(), list.begin(), list.end());
+      flatStarts.push_back(flatData.size());
+    }
+  }
+
 
   /**
    * @brief Performs sanity checks on the element, throwing if any fail.
@@ -1107,6 +1461,24 @@ public:
   }
 
 
+  /**
+   * @brief Size in bytes of one entry of this element in a binary file, or 0 if it has list properties or no
+   * properties at all.
+   *
+   * @return
+   */
+  size_t fixedRecordSize() {
+    size_t recordSize = 0;
+    for (std::unique_ptr<Property>& prop : properties) {
+      size_t propSize = prop->fixedBinarySize();
+      if (propSize == 0) {
+        return 0;
+      }
+      recordSize += propSize;
+    }
+    return recordSize;
+  }
+
   /**
    * @brief (binary writing) Writes out all of the data for every element of this element type to the stream, including
    * all contained properties.
@@ -1114,6 +1486,24 @@ public:
    * @param outStream The stream to write to.
    */
   void writeDataBinary(std::ostream& outStream) {
+
+    // Elements made of fixed-size properties only are written in large blocks rather than value by value
+    size_t recordSize = fixedRecordSize();
+    if (recordSize > 0) {
+      const size_t blockCount = 1 << 16;
+      std::vector<char> block(std::min(count, blockCount) * recordSize);
+      for (size_t iStart = 0; iStart < count; iStart += blockCount) {
+        size_t numInBlock = std::min(blockCount, count - iStart);
+        size_t offset = 0;
+        for (size_t iP = 0; iP < properties.size(); iP++) {
+          properties[iP]->writeStrided(block.data() + offset, recordSize, iStart, numInBlock);
+          offset += properties[iP]->fixedBinarySize();
+        }
+        outStream.write(block.data(), numInBlock * recordSize);
+      }
+      return;
+    }
+
     for (size_t iE = 0; iE < count; iE++) {
       for (size_t iP = 0; iP < properties.size(); iP++) {
         properties[iP]->writeDataBinary(outStream, iE);
@@ -1297,7 +1687,24 @@ public:
       throw std::runtime_error("PLY parser: Could not open file " + filename);
     }
 
+#ifdef HAPPLY_HAVE_MMAP
+    // Binary data is parsed straight from a memory map of the file
+    parseHeader(inStream, verbose);
+    if (inputDataFormat == DataFormat::ASCII) {
+      parseASCII(inStream, verbose);
+    } else {
+      std::streamoff dataStart = inStream.tellg();
+      if (!parseBinaryMapped(filename, dataStart, verbose)) {
+        if (inputDataFormat == DataFormat::Binary) {
+          parseBinary(inStream, verbose);
+        } else {
+          parseBinaryBigEndian(inStream, verbose);
+        }
+      }
+    }
+#else
     parsePLY(inStream, verbose);
+#endif
 
     if (verbose) {
       cout << "  - Finished parsing file." << endl;
@@ -1865,69 +2272,160 @@ private:
   }
 
   /**
-   * @brief Read the actual data for a file, in binary.
+   * @brief Read all data left in a stream with one bulk read when the stream can tell its size.
    *
    * @param inStream
-   * @param verbose
-   */
-  void parseBinary(std::istream& inStream, bool verbose) {
-
-    if (!isLittleEndian()) {
-      throw std::runtime_error("binary reading assumes little endian system");
+   * @param buffer Where to put the data.
+   */
+  void readRemainingData(std::istream& inStream, std::vector<char>& buffer) {
+    std::streampos start = inStream.tellg();
+    if (start != std::streampos(-1) && inStream.seekg(0, std::ios::end)) {
+      std::streampos end = inStream.tellg();
+      inStream.seekg(start);
+      if (end != std::streampos(-1) && end >= start) {
+        buffer.resize(static_cast<size_t>(end - start));
+        inStream.read(buffer.data(), buffer.size());
+        buffer.resize(static_cast<size_t>(inStream.gcount()));
+        return;
+      }
     }
+    inStream.clear();
+    buffer.assign(std::istreambuf_iterator<char>(inStream), std::istreambuf_iterator<char>());
+  }
 
-    using std::string;
-    using std::vector;
+  /**
+   * @brief Read the actual data for a file, in binary, from memory. Elements made of fixed-size properties only, such
+   * as vertices, are copied one property at a time over the whole block. An element made of a single list, such as
+   * faces, has its lists copied on several threads. Other elements are read entry by entry.
+   *
+   * @param begin Start of the data, right after the header.
+   * @param end End of the data.
+   * @param bigEndian If true, the data is big endian.
+   * @param verbose
+   */
+  void parseBinaryBuffer(const char* begin, const char* end, bool bigEndian, bool verbose) {
 
-    // Read all elements
+    const char* ptr = begin;
     for (Element& elem : elements) {
 
       if (verbose) {
         std::cout << "  - Processing element: " << elem.name << std::endl;
       }
 
-      for (size_t iP = 0; iP < elem.properties.size(); iP++) {
-        elem.properties[iP]->reserve(elem.count);
-      }
-      for (size_t iEntry = 0; iEntry < elem.count; iEntry++) {
+      size_t recordSize = elem.fixedRecordSize();
+      if (recordSize > 0) {
+        checkBufferSize(ptr, end, elem.count * recordSize);
+        size_t offset = 0;
         for (size_t iP = 0; iP < elem.properties.size(); iP++) {
-          elem.properties[iP]->readNext(inStream);
+          elem.properties[iP]->readStrided(ptr + offset, recordSize, elem.count, bigEndian);
+          offset += elem.properties[iP]->fixedBinarySize();
+        }
+        ptr += elem.count * recordSize;
+      } else if (elem.properties.size() == 1) {
+        elem.properties[0]->readAllFromBuffer(ptr, end, elem.count, bigEndian);
+      } else {
+        for (size_t iP = 0; iP < elem.properties.size(); iP++) {
+          elem.properties[iP]->reserve(elem.count);
+        }
+        for (size_t iEntry = 0; iEntry < elem.count; iEntry++) {
+          for (size_t iP = 0; iP < elem.properties.size(); iP++) {
+            elem.properties[iP]->readNextFromBuffer(ptr, end, bigEndian);
+          }
         }
       }
     }
   }
 
+#ifdef HAPPLY_HAVE_MMAP
+  /**
+   * @brief Read the actual data for a file, in binary, from a memory map of the file, without copying the file into a
+   * buffer first.
+   *
+   * @param filename The file to read from.
+   * @param dataStart Where the data starts, right after the header.
+   * @param verbose
+   *
+   * @return False if the file could not be mapped, in which case nothing was read.
+   */
+  bool parseBinaryMapped(const std::string& filename, std::streamoff dataStart, bool verbose) {
+
+    if (!isLittleEndian()) {
+      throw std::runtime_error("binary reading assumes little endian system");
+    }
+    if (dataStart < 0) {
+      return false;
+    }
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < dataStart) {
+      ::close(fd);
+      return false;
+    }
+
+    size_t fileSize = static_cast<size_t>(fileStat.st_size);
+    if (fileSize == static_cast<size_t>(dataStart)) {
+      // No data to map. This is fine only if all elements are empty.
+      ::close(fd);
+      parseBinaryBuffer(nullptr, nullptr, inputDataFormat == DataFormat::BinaryBigEndian, verbose);
+      return true;
+    }
+
+    void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+
+    // Unmap on the way out, including when parsing throws
+    struct Unmapper {
+      void* addr;
+      size_t len;
+      ~Unmapper() { munmap(addr, len); }
+    } unmapper{mapped, fileSize};
+
+    const char* data = static_cast<const char*>(mapped);
+    parseBinaryBuffer(data + dataStart, data + fileSize, inputDataFormat == DataFormat::BinaryBigEndian, verbose);
+    return true;
+  }
+#endif
+
   /**
    * @brief Read the actual data for a file, in binary.
    *
    * @param inStream
    * @param verbose
    */
-  void parseBinaryBigEndian(std::istream& inStream, bool verbose) {
+  void parseBinary(std::istream& inStream, bool verbose) {
 
     if (!isLittleEndian()) {
       throw std::runtime_error("binary reading assumes little endian system");
     }
 
-    using std::string;
-    using std::vector;
-
-    // Read all elements
-    for (Element& elem : elements) {
+    std::vector<char> buffer;
+    readRemainingData(inStream, buffer);
+    parseBinaryBuffer(buffer.data(), buffer.data() + buffer.size(), false, verbose);
+  }
 
-      if (verbose) {
-        std::cout << "  - Processing element: " << elem.name << std::endl;
-      }
+  /**
+   * @brief Read the actual data for a file, in binary.
+   *
+   * @param inStream
+   * @param verbose
+   */
+  void parseBinaryBigEndian(std::istream& inStream, bool verbose) {
 
-      for (size_t iP = 0; iP < elem.properties.size(); iP++) {
-        elem.properties[iP]->reserve(elem.count);
-      }
-      for (size_t iEntry = 0; iEntry < elem.count; iEntry++) {
-        for (size_t iP = 0; iP < elem.properties.size(); iP++) {
-          elem.properties[iP]->readNextBigEndian(inStream);
-        }
-      }
+    if (!isLittleEndian()) {
+      throw std::runtime_error("binary reading assumes little endian system");
     }
+
+    std::vector<char> buffer;
+    readRemainingData(inStream, buffer);
+    parseBinaryBuffer(buffer.data(), buffer.data() + buffer.size(), true, verbose);
   }
 
   // === Writing ===
@@ -0,0 +1,99 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef IMAGE_CACHE_H_
+#define IMAGE_CACHE_H_
+
+#include <opencv2/core/core.hpp>
+#include <gflags/gflags.h>
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+DECLARE_double(max_image_cache_mb);
+
+namespace dense_map {
+
+// Images and depth clouds which are read from disk on demand, and
+// kept in memory up to a given budget. When that is exceeded, the
+// least recently used ones are dropped. A cv::Mat is reference
+// counted, so a dropped entry still in use by a caller stays valid
+// until the caller is done with it.
+class ImageCache {
+ public:
+  // A budget of zero means no limit
+  explicit ImageCache(size_t max_bytes = 0);
+
+  void setMaxBytes(size_t max_bytes);
+  size_t maxBytes() const;
+
+  // The memory used by the entries currently in the cache
+  size_t usedBytes() const;
+
+  // Fetch the entry with given key. If not in the cache, create it
+  // with the given function. That is invoked outside of the lock,
+  // so entries can be loaded by several threads at the same time.
+  cv::Mat get(std::string const& key, std::function<void(cv::Mat&)> const& load);
+
+  // Drop all entries
+  void clear();
+
+ private:
+  typedef std::list<std::pair<std::string, cv::Mat>> EntryList;
+
+  // Drop least recently used entries until within budget. The lock
+  // must be held.
+  void shrink();
+
+  mutable std::mutex m_mutex;
+  size_t m_max_bytes;
+  size_t m_used_bytes;
+  EntryList m_entries;  // most recently used first
+  std::map<std::string, EntryList::iterator> m_key_to_entry;
+};
+
+// The cache used by cameraImage::getImage() and
+// cameraImage::getDepthCloud(). Its budget is set by
+// --max_image_cache_mb.
+ImageCache & imageCache();
+
+struct cameraImage;
+
+// Visit the cameras with given indices, in that order, passing to the
+// given function the image and/or the depth cloud of each (an empty
+// cv::Mat is passed for data which is not asked for or is missing).
+// The data is read ahead on a pool of num_threads threads, with a
+// bounded number of cameras in flight, so reading overlaps with
+// processing and the memory use stays bounded. The function is
+// called in the current thread.
+void visitCameraData(std::vector<cameraImage> const& cams,
+                     std::vector<int> const& cids,
+                     bool with_image, bool with_depth, int num_threads,
+                     std::function<void(int cid, cv::Mat const& image,
+                                        cv::Mat const& depth_cloud)> const& visit);
+
+}  // namespace dense_map
+
+#endif  // IMAGE_CACHE_H_
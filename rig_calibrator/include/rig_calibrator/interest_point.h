@@ -26,6 +26,8 @@
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include <rig_calibrator/track_store.h>
+
 #include <string>
 #include <vector>
 #include <map>
@@ -139,9 +141,13 @@ struct InterestPoint {
     if (cv_descriptor.rows != 1 || cv_descriptor.cols < 2)
       LOG(FATAL) << "The descriptors must be in one row, and have at least two columns.";
 
+    // Binary descriptors are stored one byte per value
     descriptor.resize(cv_descriptor.cols);
     for (size_t it = 0; it < descriptor.size(); it++) {
-      descriptor[it] = cv_descriptor.at<float>(0, it);
+      if (cv_descriptor.depth() == CV_8U)
+        descriptor[it] = cv_descriptor.at<uchar>(0, it);
+      else
+        descriptor[it] = cv_descriptor.at<float>(0, it);
     }
   }
 };  // End class InterestPoint
@@ -150,15 +156,26 @@ struct InterestPoint {
 typedef std::pair<std::vector<InterestPoint>, std::vector<InterestPoint> > MATCH_PAIR;
 typedef std::map<std::pair<int, int>, dense_map::MATCH_PAIR> MATCH_MAP;
 
+// Matches between two images, as pairs of indices into the
+// keypoints detected in the left and right image
+typedef std::vector<std::pair<int, int>> MATCH_INDICES;
+
 void detectFeatures(const cv::Mat& image, bool verbose,
                     // Outputs
                     cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints);
 
-// This really likes haz cam first and nav cam second
-void matchFeatures(std::mutex* match_mutex, int left_image_index, int right_image_index,
-                   cv::Mat const& left_descriptors, cv::Mat const& right_descriptors,
+// Detect features in the image reduced by a factor of 2^level with
+// an image pyramid. The keypoints are in the pixels of the full image.
+void detectFeaturesAtLevel(const cv::Mat& image, int level, bool verbose,
+                           // Outputs
+                           cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints);
+
+// This really likes haz cam first and nav cam second. Each
+// concurrent call must be given its own output, then no locking
+// is needed.
+void matchFeatures(cv::Mat const& left_descriptors, cv::Mat const& right_descriptors,
                    Eigen::Matrix2Xd const& left_keypoints,
-                   Eigen::Matrix2Xd const& right_keypoints, bool verbose,
+                   Eigen::Matrix2Xd const& right_keypoints,
                    // Output
                    MATCH_PAIR* matches);
 
@@ -216,41 +233,60 @@ Eigen::Affine3d registrationTransform(std::string const& hugin_file, std::string
   
 struct cameraImage;
 
+// Select the image pairs to match. Each image is paired with the
+// num_overlaps images following it in the list. In addition, if
+// num_nearby is positive, each image is paired with the num_nearby
+// images beyond that window whose camera centers, per the given
+// poses, are closest to its own, among those whose viewing directions
+// differ from its own by at most max_view_angle degrees. The camera
+// centers are looked up in a kd-tree, so the cost is proportional to
+// the number of images. This finds loop closures when several
+// sequences are merged. The pairs are sorted and have the first index
+// smaller than the second.
+void selectImagePairs(// Inputs
+                      std::vector<Eigen::Affine3d> const& world_to_cam,
+                      int num_overlaps, int num_nearby, double max_view_angle,
+                      // Outputs
+                      std::vector<std::pair<int, int>> & image_pairs);
+
 void detectMatchFeatures(// Inputs
                          std::vector<dense_map::cameraImage> const& cams,
                          std::vector<camera::CameraParameters> const& cam_params,
                          std::string const& out_dir, bool save_matches,
-                         std::vector<Eigen::Affine3d> const& world_to_cam, int num_overlaps,
+                         std::vector<Eigen::Affine3d> const& world_to_cam,
+                         std::vector<std::pair<int, int>> const& image_pairs,
                          int initial_max_reprojection_error, int num_match_threads,
                          bool verbose,
                          // Outputs
                          std::vector<std::vector<std::pair<float, float>>>& keypoint_vec,
                          std::vector<std::map<int, int>>& pid_to_cid_fid);
 
+// Triangulate each track using its inlier features. The tracks are
+// processed in parallel using the given number of threads.
 void multiViewTriangulation(// Inputs
                             std::vector<camera::CameraParameters>  const& cam_params,
                             std::vector<dense_map::cameraImage>    const& cams,
                             std::vector<Eigen::Affine3d>           const& world_to_cam,
-                            std::vector<std::map<int, int>>        const& pid_to_cid_fid,
                             std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
-                            // Outputs
-                            std::vector<std::map<int, std::map<int, int>>>& pid_cid_fid_inlier,
+                            int num_threads,
+                            // Outputs (the inlier flags get updated)
+                            dense_map::TrackStore& tracks,
                             std::vector<Eigen::Vector3d>& xyz_vec);
 
-// Given all the merged and filtered tracks in pid_cid_fid, for each
-// image pair cid1 and cid2 with cid1 < cid2 < cid1 + num_overlaps + 1,
-// save the matches of this pair which occur in the set of tracks.
+// Given all the merged and filtered tracks, for each of the given
+// image pairs, save the matches of this pair which occur in the set
+// of tracks. If no pairs are given, so no new matches were made, save
+// the matches for all pairs.
 void saveInlinerMatchPairs(// Inputs
                            std::vector<dense_map::cameraImage> const& cams,
-                           int num_overlaps,
-                           std::vector<std::map<int, int>> const& pid_to_cid_fid,
+                           std::vector<std::pair<int, int>> const& image_pairs,
+                           dense_map::TrackStore const& tracks,
                            std::vector<std::vector<std::pair<float, float>>>
                            const& keypoint_vec,
-                           std::vector<std::map<int, std::map<int, int>>>
-                           const& pid_cid_fid_inlier,
                            std::string const& out_dir);
 
-// Read cameras and interest points from an nvm file  
+// Read cameras and interest points from an nvm file, or from its
+// binary sidecar if that is up-to-date (see nvm_sidecar.h)
 void ReadNVM(std::string const& input_filename,
              std::vector<Eigen::Matrix2Xd> * cid_to_keypoint_map,
              std::vector<std::string> * cid_to_filename,
@@ -266,12 +302,12 @@ void writeNvm(std::string                                       const& nvm_file,
               std::vector<dense_map::cameraImage>               const& cams,
               std::vector<Eigen::Affine3d>                      const& world_to_cam,
               std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
-              std::vector<std::map<int, int>>                   const& pid_to_cid_fid,
-              std::vector<std::map<int, std::map<int, int>>>    const& pid_cid_fid_inlier,
+              dense_map::TrackStore                             const& tracks,
               std::vector<Eigen::Vector3d>                      const& xyz_vec);
   
 // Write an nvm file. Note that a single focal length is assumed and no distortion.
 // Those are ignored, and only camera poses, matches, and keypoints are used.
+// The binary sidecar is written as well, if --nvm_sidecar is set.
 void WriteNVM(std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
               std::vector<std::string> const& cid_to_filename,
               std::vector<double> const& focal_lengths,
@@ -289,12 +325,12 @@ struct nvmData {
 };
 
 // Write an image with 3 floats per pixel. OpenCV's imwrite() cannot do that.
-void saveXyzImage(std::string const& filename, cv::Mat const& img);
-
-// Save images and depth clouds to disk
-void saveImagesAndDepthClouds(std::vector<cameraImage> const& cams);
+// The values can be stored as float16, which halves the file size.
+void saveXyzImage(std::string const& filename, cv::Mat const& img,
+                  bool use_float16 = false);
 
 // Read an image with 3 floats per pixel. OpenCV's imread() cannot do that.
+// Both the current format, with a header, and the legacy one can be read.
 void readXyzImage(std::string const& filename, cv::Mat & img);
 
 void readCameraPoses(// Inputs
@@ -326,13 +362,42 @@ void readNvm(// Inputs
 // in different order than in the 'cams' vector, and may have more such images,
 // as later we may have used bracketing to thin them out. So, some book-keeping is
 // necessary.
+// If allow_missing_images is true, images not in the nvm file are
+// skipped, rather than this being an error.
 void appendMatchesFromNvm(// Inputs
                           std::vector<camera::CameraParameters> const& cam_params,
                           std::vector<dense_map::cameraImage>   const& cams,
-                          nvmData const& nvm,
+                          nvmData const& nvm, bool allow_missing_images,
                           // Outputs (these get appended to)
                           std::vector<std::map<int, int>> & pid_to_cid_fid,
                           std::vector<std::vector<std::pair<float, float>>> & keypoint_vec);
+
+// For incremental calibration. Replace the poses of the images which
+// are in the given nvm file, as saved by a previous run, with the
+// poses from it, so that the optimization starts from the previous
+// solution.
+void setPosesFromNvm(// Inputs
+                     nvmData const& nvm,
+                     std::vector<std::string> const& ref_image_files,
+                     // Outputs
+                     std::vector<Eigen::Affine3d>& world_to_ref,
+                     std::vector<std::vector<ImageMessage>>& image_data);
+
+// For incremental calibration. Remove the pairs having both images in
+// the given nvm file, as those were matched by a previous run.
+void removeProcessedPairs(// Inputs
+                          std::vector<dense_map::cameraImage> const& cams,
+                          nvmData const& nvm,
+                          // Outputs
+                          std::vector<std::pair<int, int>> & image_pairs);
+
+// Merge the tracks which have a feature in common, such as the tracks
+// read from a previous run and the ones from matching new images
+// against the images in that run.
+void mergeTracks(// Inputs
+                 std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
+                 // Outputs
+                 std::vector<std::map<int, int>> & pid_to_cid_fid);
   
 }  // namespace dense_map
 
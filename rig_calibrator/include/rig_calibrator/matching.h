@@ -20,10 +20,15 @@
 
 #include <opencv2/features2d/features2d.hpp>
 #include <Eigen/Core>
+#include <gflags/gflags.h>
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <map>
+#include <utility>
+
+DECLARE_string(matcher);
 
 namespace interest_point {
 
@@ -91,6 +96,90 @@ namespace interest_point {
   void FindMatches(const cv::Mat & img1_descriptor_map,
                    const cv::Mat & img2_descriptor_map,
                    std::vector<cv::DMatch> * matches);
+
+  /**
+   * An index over the descriptors of one image, built once and then
+   * used to find the matches for the descriptors of any number of
+   * other images. The result is as for FindMatches(), with this image
+   * as the second one. Float descriptors use a FLANN index, and
+   * binary descriptors (of type CV_8U) use brute force with the
+   * Hamming distance. Not safe to use from several threads at the
+   * same time.
+   **/
+  class DescriptorIndex {
+   public:
+    explicit DescriptorIndex(const cv::Mat & descriptor_map);
+    void FindMatches(const cv::Mat & query_descriptor_map,
+                     std::vector<cv::DMatch> * matches);
+
+   private:
+    cv::Mat descriptor_map_;
+    cv::FlannBasedMatcher matcher_;
+
+    // Binary descriptors, each padded to a whole number of 64-bit words
+    int num_words_;
+    std::vector<uint64_t> binary_descriptors_;
+  };
+
+  /**
+   * Keep the best of the two nearest neighbors of each descriptor
+   * only if it is sufficiently better than the second best, as set
+   * by --goodness_ratio.
+   **/
+  void FilterByGoodnessRatio(std::vector<std::vector<cv::DMatch>> const& possible_matches,
+                             std::vector<cv::DMatch> * matches);
+
+  /**
+   * Find the matches of the query descriptors among the train
+   * descriptors, when the matches of query descriptor i can only be
+   * the train descriptors with indices in candidates[i]. This is
+   * brute force over the candidates, with the L2 distance for float
+   * descriptors and the Hamming distance for binary ones, and the
+   * matches are then filtered by FilterByGoodnessRatio().
+   **/
+  void FindCandidateMatches(const cv::Mat & query_descriptor_map,
+                            const cv::Mat & train_descriptor_map,
+                            std::vector<std::vector<int>> const& candidates,
+                            std::vector<cv::DMatch> * matches);
+
+  /**
+   * A grid of square cells of given size over the keypoints of an
+   * image, to quickly find the keypoints in a region. The keypoints
+   * are copied, so the grid does not depend on them after it is made.
+   **/
+  class KeypointGrid {
+   public:
+    KeypointGrid(Eigen::Matrix2Xd const& keypoints, double cell_size);
+
+    // Set indices to the keypoints in the box [min_x, max_x] x [min_y, max_y]
+    void FindInBox(double min_x, double min_y, double max_x, double max_y,
+                   std::vector<int> & indices) const;
+
+    // Set indices to the keypoints within given distance of the segment from p to q
+    void FindNearSegment(Eigen::Vector2d const& p, Eigen::Vector2d const& q, double dist,
+                         std::vector<int> & indices) const;
+
+   protected:
+    Eigen::Matrix2Xd keypoints_;
+    double cell_size_, min_x_, min_y_;
+    int num_cols_, num_rows_;
+
+    // The keypoints in cell c are cell_keypoints_[cell_start_[c]],
+    // ..., cell_keypoints_[cell_start_[c + 1] - 1], with the cells
+    // stored row after row
+    std::vector<int> cell_start_, cell_keypoints_;
+  };
+
+  /**
+   * Find the matches for many pairs of images with brute force on the
+   * GPU. The descriptors of each image are uploaded once and all
+   * pairs are submitted before waiting for the results. The matches
+   * for pairs[i] go to (*matches)[i]. This needs OpenCV built with
+   * the CUDA modules.
+   **/
+  void FindMatchesCuda(std::vector<cv::Mat> const& descriptors,
+                       std::vector<std::pair<int, int>> const& pairs,
+                       std::vector<std::vector<cv::DMatch>> * matches);
 }  // namespace interest_point
 
 #endif  // INTEREST_POINT_MATCHING_H_
@@ -0,0 +1,72 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef NVM_SIDECAR_H_
+#define NVM_SIDECAR_H_
+
+#include <gflags/gflags.h>
+
+#include <Eigen/Geometry>
+#include <Eigen/Core>
+
+#include <map>
+#include <string>
+#include <vector>
+
+DECLARE_bool(nvm_sidecar);
+
+namespace dense_map {
+
+// An nvm file is text, which is slow to parse when large. Its
+// cameras, keypoints and tracks can be saved as well in a binary
+// file next to it, the sidecar, which is loaded instead of the nvm
+// file as long as the nvm file did not change since. The sidecar
+// records the size and modification time of the nvm file for that.
+// It is only meant to be read on the machine that wrote it, so native
+// byte order is used.
+
+// The sidecar for the given nvm file
+std::string nvmSidecarFile(std::string const& nvm_file);
+
+// Read the data of an nvm file from its sidecar. The result is the
+// same as when parsing the nvm file. Return false if the sidecar is
+// missing, is older than the nvm file, or is invalid.
+bool readNvmSidecar(std::string const& nvm_file,
+                    // Outputs
+                    std::vector<Eigen::Matrix2Xd> * cid_to_keypoint_map,
+                    std::vector<std::string> * cid_to_filename,
+                    std::vector<std::map<int, int>> * pid_to_cid_fid,
+                    std::vector<Eigen::Vector3d> * pid_to_xyz,
+                    std::vector<Eigen::Affine3d> * cid_to_cam_t_global);
+
+// Save the sidecar for an nvm file which was just written or read.
+// Only the keypoints which are part of tracks are saved. Write to a
+// temporary file and rename it, so an interrupted run does not leave
+// a partially written sidecar behind. Failures are not fatal, as the
+// nvm file can still be used.
+void writeNvmSidecar(std::string const& nvm_file,
+                     std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
+                     std::vector<std::string> const& cid_to_filename,
+                     std::vector<std::map<int, int>> const& pid_to_cid_fid,
+                     std::vector<Eigen::Vector3d> const& pid_to_xyz,
+                     std::vector<Eigen::Affine3d> const& cid_to_cam_t_global);
+
+}  // namespace dense_map
+
+#endif  // NVM_SIDECAR_H_
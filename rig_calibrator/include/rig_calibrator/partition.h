@@ -0,0 +1,92 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef PARTITION_H_
+#define PARTITION_H_
+
+#include <rig_calibrator/track_store.h>
+
+#include <Eigen/Geometry>
+#include <Eigen/Core>
+
+#include <utility>
+#include <vector>
+
+namespace camera {
+  // forward declaration
+  class CameraParameters;
+}
+
+namespace dense_map {
+
+struct cameraImage;
+
+// For very large datasets the optimization can be done one cluster
+// of cameras at a time. The cameras are ordered by a key, which is
+// the index of the left bracketing reference image when modeling the
+// rig, and the camera index otherwise. A cluster is a range of
+// consecutive keys. Neighboring clusters share some keys, so that the
+// cameras near cluster boundaries are constrained from both sides.
+struct Partition {
+  int core_beg, core_end;  // the keys in this cluster only, as [beg, end)
+  int beg, end;            // the keys in this cluster, including the shared ones
+};
+
+// Split the keys 0, ..., num_keys - 1 into about equal clusters of
+// consecutive keys, and extend each by the overlap at either end.
+// There are at most num_keys clusters.
+void formPartitions(int num_keys, int num_partitions, int overlap,
+                    std::vector<Partition> & partitions);
+
+// The key of each camera, as above
+void partitionKeys(std::vector<cameraImage> const& cams, bool no_rig,
+                   std::vector<int> & cam_keys);
+
+// Find the tracks to optimize in a cluster. These are the tracks with
+// an inlier feature in a camera of the cluster. Their features in
+// other cameras are used as well, with those cameras kept fixed.
+void selectPartitionTracks(TrackStore const& tracks, std::vector<int> const& cam_keys,
+                           Partition const& partition, std::vector<int> & pids);
+
+// Average the values of the parameters of a sensor found in each
+// cluster, with the given weights. The quaternions, stored as x, y,
+// z, w, starting at the given offsets, are made to have the same sign
+// before averaging, and are normalized after. If all weights are
+// zero, the average is not changed.
+void averageSensorParams(std::vector<std::vector<double>> const& values,
+                         std::vector<double> const& weights,
+                         std::vector<int> const& quat_offsets,
+                         std::vector<double> & average);
+
+// Find the pixel residuals of all inlier features for the current
+// cameras and triangulated points, without forming an optimization
+// problem. This is the same as what the pixel cost functions
+// compute, without the robust loss. The residual index of each inlier
+// feature is set to where its residuals are.
+void calcPixelResiduals(std::vector<camera::CameraParameters> const& cam_params,
+                        std::vector<cameraImage> const& cams,
+                        std::vector<Eigen::Affine3d> const& world_to_cam,
+                        std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
+                        std::vector<Eigen::Vector3d> const& xyz_vec, int num_threads,
+                        // Outputs
+                        TrackStore & tracks, std::vector<double> & residuals);
+
+}  // namespace dense_map
+
+#endif  // PARTITION_H_
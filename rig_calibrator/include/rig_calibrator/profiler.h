@@ -0,0 +1,66 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <cstddef>
+#include <string>
+
+namespace dense_map {
+
+// Measures a stage of the program, from construction until stop() is
+// called or the timer goes out of scope. The wall time is recorded,
+// and so are the resident memory at the start and end of the stage
+// and the peak resident memory of the process by its end. Stages
+// started while another one is running in the same thread are
+// recorded as its children. The records are kept until the program
+// exits, and can be saved with writeProfileReport().
+class StageTimer {
+ public:
+  explicit StageTimer(std::string const& name);
+  ~StageTimer();
+
+  // End the stage before the timer goes out of scope. Later calls do nothing.
+  void stop();
+
+ private:
+  StageTimer(StageTimer const&) = delete;
+  StageTimer& operator=(StageTimer const&) = delete;
+
+  size_t m_index;  // index of the record of this stage
+  bool m_stopped;
+};
+
+// The current resident memory of this process, in MB, or 0 if not known
+double currentRssMb();
+
+// The peak resident memory of this process so far, in MB, or 0 if not known
+double peakRssMb();
+
+// Save the records of all stages measured so far as a JSON file. Each
+// stage has its name, its path (the names of its parents and itself,
+// separated by slashes), its start time since the program started, its
+// duration in seconds, and the memory use, in MB. Stages which have not
+// ended yet are saved with the time and memory at the moment of writing.
+void writeProfileReport(std::string const& report_file);
+
+}  // namespace dense_map
+
+#endif  // PROFILER_H_
@@ -48,6 +48,7 @@
 // Astrobee and isaac
 #include <camera_model/camera_model.h>
 #include <rig_calibrator/dense_map_utils.h>
+#include <rig_calibrator/track_store.h>
 
 #include <vector>
 #include <map>
@@ -114,6 +115,36 @@ struct FaceInfo {
 Eigen::Vector3d vec3f_to_eigen(math::Vec3f const& v);
 math::Vec3f eigen_to_vec3f(Eigen::Vector3d const& V);
 
+// A node in a hierarchy of bounding boxes over the mesh faces. It
+// holds the faces face_order[beg], ..., face_order[end - 1] from
+// FaceGeometry, and bounds all their vertices.
+struct FaceTreeNode {
+  Eigen::Vector3d box_min, box_max;
+  int64_t beg, end;
+  int64_t left, right;  // children indices, or -1 for a leaf
+};
+
+// Per-face quantities which depend only on the mesh. These are found
+// once per mesh rather than once for each camera projected onto it.
+struct FaceGeometry {
+  std::vector<Eigen::Vector3d> centers, normals;
+
+  // The faces reordered so that each tree node has a contiguous range
+  // of them. The root is tree[0].
+  std::vector<int64_t> face_order;
+  std::vector<FaceTreeNode> tree;
+};
+
+// Find the center and normal of each mesh face, and the hierarchy of
+// bounding boxes used for culling
+void computeFaceGeometry(mve::TriangleMesh::ConstPtr mesh, FaceGeometry& face_geom);
+
+// Find the faces in tree nodes which are not fully outside the
+// camera view frustum, in increasing order. Only these may project
+// into the undistorted image.
+void frustumCullFaces(FaceGeometry const& face_geom, camera::CameraModel const& cam,
+                      std::vector<int64_t>& candidates);
+
 // A texture patch without holding a buffer to the texture but only vertex and face info
 class IsaacTexturePatch {
  public:
@@ -242,6 +273,16 @@ class IsaacTextureAtlas {
 
   bool insert(IsaacTexturePatch::ConstPtr texture_patch);
 
+  // Find where the patch will go, without adding its faces and
+  // texcoords yet. Return false if it does not fit. The offset is the
+  // position of the patch texcoords in the atlas.
+  bool place(IsaacTexturePatch::ConstPtr texture_patch, Eigen::Vector2d& offset);
+
+  // Add the faces and texcoords of all the patches placed with
+  // place(), in the order they were placed. This is done in parallel.
+  void add_placed(std::vector<IsaacTexturePatch::ConstPtr> const& placed_patches,
+                  std::vector<Eigen::Vector2d> const& placed_offsets);
+
   void scale_texcoords(void);
 
   void merge_texcoords(void);
@@ -356,24 +397,48 @@ void formModel(mve::TriangleMesh::ConstPtr mesh, double pixel_size, int64_t num_
 // Put an textured mesh obj file in a string
 void formObj(IsaacObjModel& texture_model, std::string const& out_prefix, std::string& obj_str);
 
-// Put an textured mesh obj file in a string
+// The same as formObj(), but write to the given file as the text is
+// produced, which uses much less memory for large meshes
+void saveObj(IsaacObjModel& texture_model, std::string const& out_prefix,
+             std::string const& obj_file);
+
+// Put an textured mesh obj file in a string. Only the (u, v) values
+// of the vertices of the given faces are used.
 void formObjCustomUV(mve::TriangleMesh::ConstPtr mesh, std::vector<Eigen::Vector3i> const& face_vec,
-                     std::map<int, Eigen::Vector2d> const& uv_map,
+                     std::vector<Eigen::Vector2d> const& vertex_uv,
                      std::string const& out_prefix, std::string& obj_str);
 
+// The same as formObjCustomUV(), but write to the given file as the
+// text is produced
+void saveObjCustomUV(mve::TriangleMesh::ConstPtr mesh, std::vector<Eigen::Vector3i> const& face_vec,
+                     std::vector<Eigen::Vector2d> const& vertex_uv,
+                     std::string const& out_prefix, std::string const& obj_file);
+
+// Save a textured mesh as in formObjCustomUV() to a binary ply file,
+// with per-vertex texture_u and texture_v values, and with the
+// texture image name in a comment
+void saveTexturedPly(mve::TriangleMesh::ConstPtr mesh,
+                     std::vector<Eigen::Vector3i> const& face_vec,
+                     std::vector<Eigen::Vector2d> const& vertex_uv,
+                     std::string const& texture_file, std::string const& ply_file);
+
 void formMtl(std::string const& out_prefix, std::string& mtl_str);
 
-// Project texture and find the UV coordinates
+// Project texture and find the UV coordinates. The faces seen best
+// from this camera are returned in face_vec, in increasing order, and
+// vertex_uv has the (u, v) values for all vertices of the mesh.
 void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> bvh_tree,
+                    FaceGeometry const& face_geom,
                     cv::Mat const& image, camera::CameraModel const& cam,
                     // outputs
                     std::vector<double>& smallest_cost_per_face,
                     std::vector<Eigen::Vector3i>& face_vec,
-                    std::map<int, Eigen::Vector2d>& uv_map);
+                    std::vector<Eigen::Vector2d>& vertex_uv);
 
 // Project texture on a texture model that was pre-filled already, so
 // only the texture pixel values need to be computed
 void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> bvh_tree,
+                    FaceGeometry const& face_geom,
                     cv::Mat const& image, camera::CameraModel const& cam,
                     std::vector<double>& smallest_cost_per_face, double pixel_size,
                     int64_t num_threads, std::vector<FaceInfo> const& face_projection_info,
@@ -391,10 +456,24 @@ bool ray_mesh_intersect(Eigen::Vector2d const& dist_pix,
                         // Output
                         Eigen::Vector3d& intersection);
 
+// The same as above for many distorted pixels in the same camera. The
+// camera-to-world transform is found once, and the pixels are
+// undistorted together. Set have_intersection[i] to 1 if the ray
+// through dist_pixels[i] intersects the mesh, and 0 otherwise.
+void ray_mesh_intersect(std::vector<Eigen::Vector2d> const& dist_pixels,
+                        camera::CameraParameters const& cam_params,
+                        Eigen::Affine3d const& world_to_cam,
+                        mve::TriangleMesh::Ptr const& mesh,
+                        std::shared_ptr<BVHTree> const& bvh_tree,
+                        double min_ray_dist, double max_ray_dist,
+                        // Outputs
+                        std::vector<Eigen::Vector3d>& intersections,
+                        std::vector<char>& have_intersection);
+
 void meshProject(mve::TriangleMesh::Ptr const& mesh, std::shared_ptr<BVHTree> const& bvh_tree,
-                 cv::Mat const& image,
+                 FaceGeometry const& face_geom, cv::Mat const& image,
                  Eigen::Affine3d const& world_to_cam, camera::CameraParameters const& cam_params,
-                 std::string const& out_prefix);
+                 std::string const& out_prefix, bool save_ply = false);
 
 // Save a model
 void isaac_save_model(IsaacObjModel* obj_model, std::string const& prefix);
@@ -405,19 +484,19 @@ void meshProjectCameras(std::vector<std::string> const& cam_names,
                         std::vector<Eigen::Affine3d> const& world_to_cam,
                         mve::TriangleMesh::Ptr const& mesh,
                         std::shared_ptr<BVHTree> const& bvh_tree,
-                        std::string const& out_dir);
+                        std::string const& out_dir, int num_threads,
+                        bool save_ply = false);
 
 void meshTriangulations(// Inputs
   std::vector<camera::CameraParameters> const& cam_params,
   std::vector<dense_map::cameraImage> const& cams,
   std::vector<Eigen::Affine3d> const& world_to_cam,
-  std::vector<std::map<int, int>> const& pid_to_cid_fid,
-  std::vector<std::map<int, std::map<int, int>>> const& pid_cid_fid_inlier,
+  dense_map::TrackStore const& tracks,
   std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
   Eigen::Vector3d const& bad_xyz, double min_ray_dist, double max_ray_dist,
   mve::TriangleMesh::Ptr const& mesh, std::shared_ptr<BVHTree> const& bvh_tree,
   // Outputs
-  std::vector<std::map<int, std::map<int, Eigen::Vector3d>>>& pid_cid_fid_mesh_xyz,
+  std::vector<Eigen::Vector3d>& obs_mesh_xyz,
   std::vector<Eigen::Vector3d>& pid_mesh_xyz);
   
 }  // namespace dense_map
@@ -20,10 +20,17 @@
 #define RIG_CALIBRATOR_THREAD_H
 
 #include <gflags/gflags.h>
-#include <pthread.h>
 
-#include <list>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 DECLARE_int32(num_threads);
 
@@ -34,13 +41,14 @@ GOOGLE_ALLOW_RVALUE_REFERENCES_PUSH
 
 namespace dense_map {
 
-  void* HolderFunction(void* ptr);
-
+  // A pool of persistent worker threads, which take the tasks from
+  // one shared queue. The number of workers is given by
+  // --num_threads at the time the pool is constructed, unless
+  // specified explicitly.
   class ThreadPool {
    public:
-    typedef std::tuple<std::function<void(void)>, pthread_mutex_t*, pthread_cond_t*, bool> VarsTuple;
-
     ThreadPool();
+    explicit ThreadPool(int num_threads);
     ~ThreadPool();
     // The following identifies this thread as non copyable and non
     // moveable. Our threads are holding pointers to this exact
@@ -49,8 +57,13 @@ namespace dense_map {
     ThreadPool& operator=(const ThreadPool&) = delete;
 
     // This pushes back a function and it's arguments to be
-    // executed. This method will block if the number of threads is
-    // already maxed. You can also push back mixed types of functions.
+    // executed. This method will block if too many tasks are already
+    // waiting to be started, to keep bounded the memory used by the
+    // copies of the arguments. You can also push back mixed types of
+    // functions. The returned future can be used to get the result
+    // of the function, or it can be ignored. If the function throws
+    // an exception, the program is aborted with its message, as the
+    // future is normally ignored.
     //
     // Example:
     // void Monkey(std::vector const& input, int val, std::vector * output);
@@ -60,29 +73,53 @@ namespace dense_map {
     // If you don't use a std::ref as in the above example, the input
     // will be copied. Other alternatives are to use a pointer.
     template <typename Function, typename... Args>
-    void AddTask(Function&& f, Args&&... args) {
-      WaitTillJobOpening();
+    auto AddTask(Function&& f, Args&&... args)
+      -> std::future<decltype(std::bind(f, args...)())> {
+      typedef decltype(std::bind(f, args...)()) ResultType;
 
       // Bind up the function the user has given us
-      var_bindings_.emplace_back(std::bind(f, args...),
-                                 &cond_mutex_,
-                                 &cond_, false);
-
-      // Create the thread and start doing work
-      threads_.push_back(pthread_t());
-      pthread_create(&threads_.back(), NULL, HolderFunction, &var_bindings_.back());
+      auto bound = std::bind(f, args...);
+      std::shared_ptr<std::packaged_task<ResultType()>> task
+        (new std::packaged_task<ResultType()>([bound]() mutable {
+            return RunOrDie(bound);
+          }));
+      std::future<ResultType> result = task->get_future();
+
+      Enqueue([task]() { (*task)(); });
+      return result;
     }
 
+    // Wait until all tasks added so far are finished. The pool can be
+    // used again afterwards.
     void Join();
 
    private:
-    void WaitTillJobOpening();
+    // Run a task, and abort the program if it throws an exception
+    template <typename Task>
+    static auto RunOrDie(Task& task) -> decltype(task()) {
+      try {
+        return task();
+      } catch (std::exception const& e) {
+        ReportTaskFailure(e.what());
+      } catch (...) {
+        ReportTaskFailure("Unknown exception.");
+      }
+    }
+    [[noreturn]] static void ReportTaskFailure(std::string const& what);
+
+    void Enqueue(std::function<void(void)> const& task);
+    void WorkerLoop();
+
+    size_t max_queued_tasks_;
+    std::vector<std::thread> workers_;
 
-    size_t max_concurrent_jobs_;
-    std::list<pthread_t> threads_;
-    std::list<VarsTuple> var_bindings_;
-    pthread_mutex_t cond_mutex_;
-    pthread_cond_t cond_;
+    // The tasks not yet started, and the number of tasks which were
+    // added but did not finish yet, protected by state_mutex_
+    std::mutex state_mutex_;
+    std::condition_variable work_cond_, space_cond_, done_cond_;
+    std::deque<std::function<void(void)>> tasks_;
+    size_t num_unfinished_;
+    bool stop_;
   };
 
 }  // namespace dense_map
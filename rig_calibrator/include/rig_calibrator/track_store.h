@@ -0,0 +1,118 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef TRACK_STORE_H_
+#define TRACK_STORE_H_
+
+#include <glog/logging.h>
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace dense_map {
+
+// One feature in a track, that is, feature fid in image cid, together
+// with the per-feature state kept during optimization.
+struct TrackObs {
+  int cid;
+  int fid;
+  // Non-zero only if this feature is an inlier. Originally all
+  // features are inliers. Once an inlier becomes an outlier, it
+  // never becomes an inlier again.
+  int inlier;
+  // The index in the array of residuals of the pixel residuals for
+  // this feature. Set only for inliers, and valid only for the most
+  // recent optimization pass. Is -1 when not set.
+  int residual_index;
+};
+
+// A view of the features of one track, usable with range-based for
+// loops and with the algorithms in <algorithm>.
+template <class Obs>
+class TrackRange {
+ public:
+  typedef Obs* iterator;
+  TrackRange(Obs* begin, Obs* end): m_begin(begin), m_end(end) {}
+  Obs* begin() const { return m_begin; }
+  Obs* end() const { return m_end; }
+  size_t size() const { return m_end - m_begin; }
+  bool empty() const { return m_begin == m_end; }
+ private:
+  Obs* m_begin;
+  Obs* m_end;
+};
+
+// All tracks, stored contiguously. The features of track pid are at
+// positions m_offsets[pid], ..., m_offsets[pid + 1] - 1 of a single
+// array, in increasing order of cid, and each cid shows up at most
+// once in a track. This replaces the nested maps of the form
+// pid_to_cid_fid, pid_cid_fid_inlier, etc., which use a lot more
+// memory and are slow to traverse.
+//
+// Data which is kept for each feature elsewhere can be stored
+// in a vector of size numObs(), indexed by obsIndex().
+class TrackStore {
+ public:
+  TrackStore() {}
+
+  // Create from tracks in the form pid_to_cid_fid. All features
+  // are set as inliers.
+  explicit TrackStore(std::vector<std::map<int, int>> const& pid_to_cid_fid);
+
+  // The number of tracks
+  size_t size() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+  bool empty() const { return size() == 0; }
+
+  // The number of features in all tracks
+  size_t numObs() const { return m_obs.size(); }
+
+  TrackRange<TrackObs> operator[](size_t pid) {
+    return TrackRange<TrackObs>(m_obs.data() + m_offsets[pid],
+                                m_obs.data() + m_offsets[pid + 1]);
+  }
+  TrackRange<TrackObs const> operator[](size_t pid) const {
+    return TrackRange<TrackObs const>(m_obs.data() + m_offsets[pid],
+                                      m_obs.data() + m_offsets[pid + 1]);
+  }
+
+  // The position of a feature of a track in the array of all features
+  size_t obsIndex(TrackObs const& obs) const {
+    if (&obs < m_obs.data() || &obs >= m_obs.data() + m_obs.size())
+      LOG(FATAL) << "The feature is not part of this set of tracks.\n";
+    return &obs - m_obs.data();
+  }
+
+  // Set all features to be inliers or outliers
+  void setAllInliers(int inlier);
+
+  // Reset the residual indices, before a new problem is formed
+  void resetResidualIndices();
+
+  // Convert back to the form pid_to_cid_fid
+  void toMaps(std::vector<std::map<int, int>> & pid_to_cid_fid) const;
+
+ private:
+  std::vector<size_t> m_offsets;
+  std::vector<TrackObs> m_obs;
+};
+
+}  // namespace dense_map
+
+#endif  // TRACK_STORE_H_
@@ -22,7 +22,9 @@
 #include <rig_calibrator/system_utils.h>
 #include <rig_calibrator/dense_map_utils.h>
 #include <rig_calibrator/camera_image.h>
+#include <rig_calibrator/image_cache.h>
 #include <rig_calibrator/transform_utils.h>
+#include <rig_calibrator/thread.h>
 #include <rig_calibrator/happly.h> // for saving ply files as meshes
 #include <camera_model/camera_params.h>
 
@@ -31,6 +33,11 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <array>
 
 #include <pcl/io/ply_io.h>
 #include <pcl/io/pcd_io.h>
@@ -39,6 +46,42 @@
 
 namespace dense_map {
 
+namespace {
+
+// Find the first position in [beg, end) for which is_before() is
+// false, given that it is true for all positions before it and false
+// after. Search forward from beg with steps which double in size, then
+// bisect. This takes time logarithmic in the distance travelled, so a
+// sequence of lookups which move forward is fast at any scale.
+template <class Pred>
+int gallopForward(int beg, int end, Pred is_before) {
+  if (beg >= end || !is_before(beg))
+    return beg;
+
+  // The result is in (lo, hi]
+  int lo = beg;
+  int64_t step = 1;
+  int64_t hi = lo + step;
+  while (hi < end && is_before(hi)) {
+    lo = hi;
+    step *= 2;
+    hi = lo + step;
+  }
+  if (hi > end) hi = end;
+
+  int first = lo + 1, last = hi;
+  while (first < last) {
+    int mid = first + (last - first) / 2;
+    if (is_before(mid))
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return first;
+}
+
+}  // end anonymous namespace
+
 // A little function to replace separators with space. Note that the backslash
 // is a separator, in case, it used as a continuation line.
 void replace_separators_with_space(std::string & str) {
@@ -373,80 +416,58 @@ double maxRotationAngle(Eigen::Affine3d const& T) {
 }
 
 void StampedPoseStorage::addPose(Eigen::Affine3d const& pose, double timestamp) {
-  int bin_index = floor(timestamp);
-  m_poses[bin_index][timestamp] = pose;
-}
-
-bool StampedPoseStorage::interpPose(double input_timestamp, double max_gap, Eigen::Affine3d& out_pose) const {
-  bool is_success = false;
-
-  if (m_poses.empty()) return is_success;
-
-  // Look for the nearest pose with timestamp <= input_timestamp.
-  double low_timestamp = -1.0;
-  Eigen::Affine3d low_pose;
-  // Traverse the bins in decreasing order of bin key.
-  for (int bin_iter = floor(input_timestamp); bin_iter >= m_poses.begin()->first; bin_iter--) {
-    auto bin_ptr = m_poses.find(bin_iter);
-    if (bin_ptr == m_poses.end()) continue;  // empty bin
-
-    // Found a bin. Study it in decreasing order of timestamps.
-    auto& bin = bin_ptr->second;
-    for (auto it = bin.rbegin(); it != bin.rend(); it++) {
-      double timestamp = it->first;
-      if (timestamp <= input_timestamp) {
-        low_timestamp = timestamp;
-        low_pose = it->second;
-        is_success = true;
-        break;
-      }
-    }
-    if (is_success) break;
+  // Poses usually arrive in increasing order of time
+  if (m_timestamps.empty() || timestamp > m_timestamps.back()) {
+    m_timestamps.push_back(timestamp);
+    m_poses.push_back(pose);
+    return;
   }
 
-  if (!is_success) return false;  // Failed
-
-  // Found the lower bound. Now go forward in time. Here the logic is
-  // the reverse of the above.
-  is_success = false;
-  double high_timestamp = -1.0;
-  Eigen::Affine3d high_pose;
-  for (int bin_iter = floor(input_timestamp); bin_iter <= m_poses.rbegin()->first; bin_iter++) {
-    auto bin_ptr = m_poses.find(bin_iter);
-    if (bin_ptr == m_poses.end()) continue;  // empty bin
-
-    // Found a bin. Study it in increasing order of timestamps.
-    auto& bin = bin_ptr->second;
-    for (auto it = bin.begin(); it != bin.end(); it++) {
-      double timestamp = it->first;
-      if (timestamp >= input_timestamp) {
-        high_timestamp = timestamp;
-        high_pose = it->second;
-        is_success = true;
-        break;
-      }
-    }
-    if (is_success) break;
+  // A pose which was added before at this time is replaced
+  auto it = std::lower_bound(m_timestamps.begin(), m_timestamps.end(), timestamp);
+  size_t pos = it - m_timestamps.begin();
+  if (*it == timestamp) {
+    m_poses[pos] = pose;
+    return;
   }
+  m_timestamps.insert(it, timestamp);
+  m_poses.insert(m_poses.begin() + pos, pose);
+}
 
-  if (!is_success || high_timestamp - low_timestamp > max_gap) {
-    return false;  // Failed
+bool StampedPoseStorage::interpPose(double input_timestamp, double max_gap,
+                                    Eigen::Affine3d& out_pose) const {
+  if (m_timestamps.empty()) return false;
+
+  // The nearest poses with timestamp <= input_timestamp and >= input_timestamp
+  auto high_it = std::lower_bound(m_timestamps.begin(), m_timestamps.end(), input_timestamp);
+  if (high_it == m_timestamps.end()) return false;  // Failed
+  size_t high_pos = high_it - m_timestamps.begin();
+  size_t low_pos = high_pos;
+  if (m_timestamps[high_pos] != input_timestamp) {
+    if (high_pos == 0) return false;  // Failed
+    low_pos = high_pos - 1;
   }
 
-  if (!(low_timestamp <= input_timestamp && input_timestamp <= high_timestamp))
-    LOG(FATAL) << "Book-keeping failure in pose interpolation.";
+  double low_timestamp = m_timestamps[low_pos];
+  double high_timestamp = m_timestamps[high_pos];
+  if (high_timestamp - low_timestamp > max_gap)
+    return false;  // Failed
 
-  double alpha = (input_timestamp - low_timestamp) / (high_timestamp - low_timestamp);
-  if (high_timestamp == low_timestamp) alpha = 0.0;  // handle division by zero
+  double alpha = 0.0;  // handle division by zero
+  if (high_timestamp != low_timestamp)
+    alpha = (input_timestamp - low_timestamp) / (high_timestamp - low_timestamp);
 
-  out_pose = dense_map::linearInterp(alpha, low_pose, high_pose);
+  out_pose = dense_map::linearInterp(alpha, m_poses[low_pos], m_poses[high_pos]);
 
-  return is_success;
+  return true;
 }
 
-void StampedPoseStorage::clear() { m_poses.clear(); }
+void StampedPoseStorage::clear() {
+  m_timestamps.clear();
+  m_poses.clear();
+}
 
-bool StampedPoseStorage::empty() const { return m_poses.empty(); }
+bool StampedPoseStorage::empty() const { return m_timestamps.empty(); }
 
 // Compute the azimuth and elevation for a (normal) vector
 void normalToAzimuthAndElevation(Eigen::Vector3d const& normal, double& azimuth, double& elevation) {
@@ -636,35 +657,50 @@ void pickTimestampsInBounds(std::vector<double> const& timestamps,
                             std::vector<double>& out_timestamps) {
   out_timestamps.clear();
 
-  // Start by simply collecting all timestamps between the given
-  // bounds. Much easier to understand than if doing something more
-  // fancy.
-  std::vector<double> local_timestamps;
-  for (size_t it = 0; it < timestamps.size(); it++) {
-    double timestamp = timestamps[it];
-    if (timestamp + offset >= left_bound && timestamp + offset < right_bound) {
-      local_timestamps.push_back(timestamp);
-    }
-  }
+  // The range of timestamps between the given bounds. The offset is
+  // added the same way as when comparing each timestamp to the bounds.
+  int num = timestamps.size();
+  int beg = gallopForward(0, num, [&](int it) {
+    return timestamps[it] + offset < left_bound; });
+  int end = gallopForward(beg, num, [&](int it) {
+    return timestamps[it] + offset < right_bound; });
 
-  if (local_timestamps.size() < 1) {
+  if (beg >= end) {
     // Nothing to pick
     return;
   }
 
-  if (local_timestamps.size() == 1) {
-    // Only one is present
-    out_timestamps.push_back(local_timestamps[0]);
-    return;
-  }
-
-  // Add the ones at the ends
-  out_timestamps.push_back(local_timestamps[0]);
-  out_timestamps.push_back(local_timestamps.back());
+  // Add the ones at the ends, or just one if only one is present
+  out_timestamps.push_back(timestamps[beg]);
+  if (end - beg > 1)
+    out_timestamps.push_back(timestamps[end - 1]);
 
   return;
 }
 
+// Find the first of the sorted timestamps which is no less than the
+// given one, searching forward from start_pos.
+int timestampLowerBound(std::vector<double> const& timestamps, double timestamp,
+                        int start_pos) {
+  return gallopForward(std::max(start_pos, 0), timestamps.size(),
+                       [&](int it) { return timestamps[it] < timestamp; });
+}
+
+// Look up many timestamps at once. Each search starts where the
+// previous one ended if the queries are increasing.
+void timestampLowerBounds(std::vector<double> const& timestamps,
+                          std::vector<double> const& queries,
+                          std::vector<int> & positions) {
+  positions.resize(queries.size());
+  int start_pos = 0;
+  for (size_t it = 0; it < queries.size(); it++) {
+    if (it > 0 && queries[it] < queries[it - 1])
+      start_pos = 0;
+    positions[it] = timestampLowerBound(timestamps, queries[it], start_pos);
+    start_pos = positions[it];
+  }
+}
+
 // A debug utility for saving a camera in a format ASP understands.
 // Need to expose the sci cam intrinsics.
 void saveTsaiCamera(Eigen::MatrixXd const& desired_cam_to_world_trans,
@@ -698,44 +734,51 @@ void saveTsaiCamera(Eigen::MatrixXd const& desired_cam_to_world_trans,
 // Find an image at the given timestamp or right after it. We assume
 // that during repeated calls to this function we always travel
 // forward in time, and we keep track of where we are in the bag using
-// the variable start_pos that we update as we go.
+// the variable start_pos that we update as we go. The search gallops
+// forward from there. The messages must be in chronological order.
 bool lookupImage(// Inputs
                  double desired_time, std::vector<ImageMessage> const& msgs,
                  // Outputs
-                 cv::Mat& image, std::string & image_name,
+                 std::string & image_name,
                  int& start_pos, double& found_time) {
   // Initialize the outputs. Note that start_pos is passed in from outside.
-  image = cv::Mat();
   image_name = "";
   found_time = -1.0;
 
   int num_msgs = msgs.size();
-  double prev_image_time = -1.0;
-
-  for (int local_pos = start_pos; local_pos < num_msgs; local_pos++) {
-    start_pos = local_pos;  // save this for exporting
+  if (start_pos >= num_msgs)
+    return false;
 
-    found_time = msgs[local_pos].timestamp;
+  int pos = gallopForward(start_pos, num_msgs, [&](int it) {
+    return msgs[it].timestamp < desired_time; });
 
-    // Sanity check: We must always travel forward in time
-    if (found_time < prev_image_time) {
-      LOG(FATAL) << "Found images not in chronological order.\n"
-                 << std::fixed << std::setprecision(17)
-                 << "Times in wrong order: " << prev_image_time << ' ' << found_time << ".\n";
-      continue;
-    }
+  if (pos == num_msgs) {
+    // Not found. Stay on the last message.
+    start_pos = num_msgs - 1;
+    found_time = msgs[start_pos].timestamp;
+    return false;
+  }
 
-    prev_image_time = found_time;
+  // Found the desired data. The image itself is read later, when needed.
+  start_pos = pos;
+  found_time = msgs[pos].timestamp;
+  image_name = msgs[pos].name;
+  return true;
+}
 
-    if (found_time >= desired_time) {
-      // Found the desired data. Do a deep copy, to not depend on the
-      // original structure.
-      msgs[local_pos].image.copyTo(image);
-      image_name = msgs[local_pos].name;
-      return true;
+// The image lookups assume the messages of each sensor are in
+// chronological order
+void checkChronologicalOrder(std::vector<std::vector<ImageMessage>> const& data) {
+  for (size_t cam_type = 0; cam_type < data.size(); cam_type++) {
+    for (size_t it = 1; it < data[cam_type].size(); it++) {
+      double prev_time = data[cam_type][it - 1].timestamp;
+      double curr_time = data[cam_type][it].timestamp;
+      if (curr_time < prev_time)
+        LOG(FATAL) << "Found images not in chronological order.\n"
+                   << std::fixed << std::setprecision(17)
+                   << "Times in wrong order: " << prev_time << ' ' << curr_time << ".\n";
     }
   }
-  return false;
 }
 
 // Convert a string of space-separated numbers to a vector
@@ -1059,17 +1102,24 @@ void readRigConfig(std::string const& rig_config, bool have_rig_transforms, int
 // Check if first three coordinates of a vector are 0. That would make it invalid.
 bool invalidXyz(cv::Vec3f const& p) { return (p[0] == 0) && (p[1] == 0) && (p[2] == 0); }
 
-// Add a given vertex to the ply file unless already present
+// Marks a pixel whose vertex was not added yet
+const size_t invalid_vertex = std::numeric_limits<size_t>::max();
+
+// Add a given vertex to the ply file unless already present. The
+// vertex index of each pixel is kept in pix_to_vertex, which has an
+// entry per pixel, with invalid_vertex for pixels not added yet.
 void add_vertex(cv::Vec3f const& V, double intensity,
                 std::pair<int, int> const& pix,    // NOLINT
-                std::map<std::pair<int, int>, size_t>& pix_to_vertex,  // NOLINT
+                int num_cols,
+                std::vector<size_t>& pix_to_vertex,                     // NOLINT
                 size_t& vertex_count,                                  // NOLINT
                 std::vector<std::array<double, 3>>& vertices,          // NOLINT
                 std::vector<std::array<double, 3>>& colors) {          // NOLINT
   // Do not add the invalid zero vertex
   if (invalidXyz(V)) return;
 
-  if (pix_to_vertex.find(pix) != pix_to_vertex.end()) return;  // Vertex already exists
+  size_t& vertex_index = pix_to_vertex[size_t(pix.first) * num_cols + pix.second];
+  if (vertex_index != invalid_vertex) return;  // Vertex already exists
 
   std::array<double, 3> point = {V[0], V[1], V[2]};
   std::array<double, 3> color = {intensity/255.0, intensity/255.0, intensity/255.0};
@@ -1078,10 +1128,27 @@ void add_vertex(cv::Vec3f const& V, double intensity,
   colors.push_back(color);
 
   // Record the map from the pixel to its location
-  pix_to_vertex[pix] = vertex_count;
+  vertex_index = vertex_count;
   vertex_count++;
 }
 
+// Apply an affine transform to a row of points, leaving the invalid
+// (zero) points as they are. There is no branching on the point
+// values, so the compiler can vectorize this.
+void transformCloudRow(Eigen::Matrix3d const& R, Eigen::Vector3d const& T,
+                       cv::Vec3f const* in_row, int num_cols, cv::Vec3f* out_row) {
+  for (int col = 0; col < num_cols; col++) {
+    double x = in_row[col][0], y = in_row[col][1], z = in_row[col][2];
+    bool valid = (x != 0) || (y != 0) || (z != 0);
+    double px = R(0, 0) * x + R(0, 1) * y + R(0, 2) * z + T[0];
+    double py = R(1, 0) * x + R(1, 1) * y + R(1, 2) * z + T[1];
+    double pz = R(2, 0) * x + R(2, 1) * y + R(2, 2) * z + T[2];
+    out_row[col][0] = valid ? px : x;
+    out_row[col][1] = valid ? py : y;
+    out_row[col][2] = valid ? pz : z;
+  }
+}
+
 void applyTransformToCloud(cv::Mat const& in_cloud,
                            Eigen::Affine3d const& cam_to_world,
                            cv::Mat & out_cloud) {
@@ -1090,27 +1157,15 @@ void applyTransformToCloud(cv::Mat const& in_cloud,
     LOG(FATAL) << "Expecting an xyz point cloud.\n";
   
   out_cloud = cv::Mat::zeros(in_cloud.rows, in_cloud.cols, CV_32FC3);
-  for (int row = 0; row < in_cloud.rows; row++) {
-    for (int col = 0; col < in_cloud.cols; col++) {
-      cv::Vec3f xyz = in_cloud.at<cv::Vec3f>(row, col);
-      
-      if (invalidXyz(xyz)) {
-        // Invalid points stay invalid
-        out_cloud.at<cv::Vec3f>(row, col) = xyz;
-        continue;
-      }
-
-      // Transform to world coordinates
-      Eigen::Vector3d P(xyz[0], xyz[1], xyz[2]);
-      P = cam_to_world * P;
-      for (size_t c = 0; c < 3; c++)
-        out_cloud.at<cv::Vec3f>(row, col)[c] = P[c];
-    }
-  }
+  Eigen::Matrix3d R = cam_to_world.linear();
+  Eigen::Vector3d T = cam_to_world.translation();
+  for (int row = 0; row < in_cloud.rows; row++)
+    transformCloudRow(R, T, in_cloud.ptr<cv::Vec3f>(row), in_cloud.cols,
+                      out_cloud.ptr<cv::Vec3f>(row));
 }
   
 // Apply a transform to a point cloud to make it go from camera coordinates to world
-// coordinates and save it as a ply file.
+// coordinates and save it as a binary ply file.
 void saveTransformedMesh(cv::Mat const& depthMat, cv::Mat const& intensity,
                          Eigen::Affine3d const& depth_to_world,
                          std::string const& plyFileName) {
@@ -1124,11 +1179,13 @@ void saveTransformedMesh(cv::Mat const& depthMat, cv::Mat const& intensity,
   applyTransformToCloud(depthMat, depth_to_world, transMat);
 
   size_t vertex_count = 0;
-  std::map<std::pair<int, int>, size_t> pix_to_vertex;  // map from pixel to vertex indices
+  // Map from pixel to vertex indices
+  std::vector<size_t> pix_to_vertex(size_t(transMat.rows) * transMat.cols, invalid_vertex);
   std::vector<std::array<double, 3>> vertices;
   std::vector<std::array<double, 3>> colors;
   std::vector<std::vector<size_t>> faces;
 
+  int num_cols = transMat.cols;
   for (int row = 0; row < transMat.rows - 1; row++) {
     for (int col = 0; col < transMat.cols - 1; col++) {
       std::pair<int, int> pix_ul = std::make_pair(row, col);
@@ -1146,26 +1203,28 @@ void saveTransformedMesh(cv::Mat const& depthMat, cv::Mat const& intensity,
       double inten_LR = intensity.at<uchar>(pix_lr.first, pix_lr.second);
 
       // Add three vertices of a face
-      add_vertex(UL, inten_UL, pix_ul, pix_to_vertex, vertex_count, vertices, colors);
-      add_vertex(UR, inten_UR, pix_ur, pix_to_vertex, vertex_count, vertices, colors);
-      add_vertex(LL, inten_LL, pix_ll, pix_to_vertex, vertex_count, vertices, colors);
+      add_vertex(UL, inten_UL, pix_ul, num_cols, pix_to_vertex, vertex_count, vertices, colors);
+      add_vertex(UR, inten_UR, pix_ur, num_cols, pix_to_vertex, vertex_count, vertices, colors);
+      add_vertex(LL, inten_LL, pix_ll, num_cols, pix_to_vertex, vertex_count, vertices, colors);
 
       // Note how we add only valid faces, so all three vertices must be valid (non-zero)
       if (!invalidXyz(UL) && !invalidXyz(UR) && !invalidXyz(LL) &&
           inten_UL >= 0 && inten_UR >= 0 && inten_LL >= 0) {
-        std::vector<size_t> face = {pix_to_vertex[pix_ul], pix_to_vertex[pix_ur],
-                                    pix_to_vertex[pix_ll]};
+        std::vector<size_t> face = {pix_to_vertex[size_t(row) * num_cols + col],
+                                    pix_to_vertex[size_t(row + 1) * num_cols + col],
+                                    pix_to_vertex[size_t(row) * num_cols + col + 1]};
         faces.push_back(face);
       }
 
       // Add the other face, forming a full grid cell
-      add_vertex(UR, inten_UR, pix_ur, pix_to_vertex, vertex_count, vertices, colors);
-      add_vertex(LR, inten_LR, pix_lr, pix_to_vertex, vertex_count, vertices, colors);
-      add_vertex(LL, inten_LL, pix_ll, pix_to_vertex, vertex_count, vertices, colors);
+      add_vertex(UR, inten_UR, pix_ur, num_cols, pix_to_vertex, vertex_count, vertices, colors);
+      add_vertex(LR, inten_LR, pix_lr, num_cols, pix_to_vertex, vertex_count, vertices, colors);
+      add_vertex(LL, inten_LL, pix_ll, num_cols, pix_to_vertex, vertex_count, vertices, colors);
       if (!invalidXyz(UR) && !invalidXyz(LR) && !invalidXyz(LL) &&
           inten_UR >= 0 && inten_LR >= 0 && inten_LL >= 0) {
-        std::vector<size_t> face = {pix_to_vertex[pix_ur], pix_to_vertex[pix_lr],
-                                    pix_to_vertex[pix_ll]};
+        std::vector<size_t> face = {pix_to_vertex[size_t(row + 1) * num_cols + col],
+                                    pix_to_vertex[size_t(row + 1) * num_cols + col + 1],
+                                    pix_to_vertex[size_t(row) * num_cols + col + 1]};
         faces.push_back(face);
       }
     }
@@ -1176,8 +1235,83 @@ void saveTransformedMesh(cv::Mat const& depthMat, cv::Mat const& intensity,
   ply.addVertexPositions(vertices);
   ply.addVertexColors(colors);
   ply.addFaceIndices(faces);
-  std::cout << "Writing: " << plyFileName << std::endl;
-  ply.write(plyFileName, happly::DataFormat::ASCII);
+  ply.write(plyFileName, happly::DataFormat::Binary);
+}
+
+// The cameras having depth clouds, grouped by camera type, and in
+// increasing order within each type, so that all camera types can be
+// processed in one pass.
+std::vector<int> depthCamerasByType(size_t num_cam_types,
+                                    std::vector<dense_map::cameraImage> const& cam_images) {
+  std::vector<std::vector<int>> type_cids(num_cam_types);
+  for (size_t cid = 0; cid < cam_images.size(); cid++) {
+    int cam_type = cam_images[cid].camera_type;
+    if (cam_type < 0 || cam_type >= int(num_cam_types))
+      LOG(FATAL) << "Found a camera type out of range.\n";
+    if (cam_images[cid].hasDepthCloud())
+      type_cids[cam_type].push_back(cid);
+  }
+
+  std::vector<int> cids;
+  for (size_t cam_type = 0; cam_type < num_cam_types; cam_type++)
+    cids.insert(cids.end(), type_cids[cam_type].begin(), type_cids[cam_type].end());
+  return cids;
+}
+
+// Transform a depth cloud to camera coordinates, with the image intensity
+// and other fields as expected by voxblox, and save it as a binary pcd
+// file, together with the camera-to-world transform.
+void saveVoxbloxCloud(cv::Mat const& depth_cloud, cv::Mat const& image,
+                      Eigen::Affine3d const& depth_to_image,
+                      Eigen::Affine3d const& cam_to_world,
+                      std::string const& transform_file,
+                      std::string const& cloud_file) {
+  dense_map::writeMatrix(cam_to_world.matrix(), transform_file);
+
+  int depth_cols = depth_cloud.cols;
+  int depth_rows = depth_cloud.rows;
+
+  // Form a pcl point cloud. Add the first band of the image as an intensity
+  // Later will reduce its dimensions as we will skip invalid pixels.
+  pcl::PointCloud<pcl::PointNormal> pc;
+  pc.width = std::int64_t(depth_cols) * std::int64_t(depth_rows); // int64 to avoid overflow
+  pc.height = 1;
+  pc.points.resize(pc.width * pc.height);
+
+  // Transform from depth cloud coordinates to camera coordinates a row
+  // at a time (later voxblox will transform to world coordinates)
+  Eigen::Matrix3d R = depth_to_image.linear();
+  Eigen::Vector3d T = depth_to_image.translation();
+  std::vector<cv::Vec3f> trans_row(depth_cols);
+  int count = 0;
+  for (int row = 0; row < depth_rows; row++) {
+    cv::Vec3f const* xyz_row = depth_cloud.ptr<cv::Vec3f>(row);
+    uchar const* image_row = image.ptr<uchar>(row);
+    transformCloudRow(R, T, xyz_row, depth_cols, &trans_row[0]);
+    for (int col = 0; col < depth_cols; col++) {
+      if (xyz_row[col] == cv::Vec3f(0, 0, 0)) // skip invalid points
+        continue;
+
+      cv::Vec3f const& P = trans_row[col];
+      pc.points[count].x         = P[0];
+      pc.points[count].y         = P[1];
+      pc.points[count].z         = P[2];
+      pc.points[count].normal_x  = image_row[col]; // intensity
+      pc.points[count].normal_y  = 1.0; // weight
+      pc.points[count].normal_y  = 1.0; // intersection err
+      pc.points[count].normal_y  = 0.0; // ensure initialization
+
+      count++;
+    }
+  }
+  // Shrink the cloud as invalid data was skipped
+  if (count > pc.width) 
+    LOG(FATAL) << "Book-keeping error in processing point clouds.\n";
+  pc.width = count;
+  pc.height = 1;
+  pc.points.resize(pc.width * pc.height);
+
+  pcl::io::savePCDFileBinary(cloud_file, pc); // writing binary is much faster than ascii
 }
 
 // Save the depth clouds and optimized transforms needed to create a mesh with voxblox
@@ -1186,7 +1320,7 @@ void exportToVoxblox(std::vector<std::string> const& cam_names,
                      std::vector<dense_map::cameraImage> const& cam_images,
                      std::vector<Eigen::Affine3d> const& depth_to_image,
                      std::vector<Eigen::Affine3d> const& world_to_cam,
-                     std::string const& out_dir) {
+                     std::string const& out_dir, int num_threads) {
 
   if (cam_images.size() != world_to_cam.size())
     LOG(FATAL) << "There must be as many camera images as camera poses.\n";
@@ -1198,96 +1332,60 @@ void exportToVoxblox(std::vector<std::string> const& cam_names,
   std::string voxblox_dir = out_dir + "/voxblox";
   dense_map::createDir(voxblox_dir);
 
-  char timestamp_buffer[1000];
-
-  // Must take a pass for each camera type, and then visit
-  // all images while ignoring those of a different type. There are very
-  // few camera types, so this is not unreasonable.
+  // A subdirectory and index file for each camera type
+  std::vector<std::string> voxblox_subdirs(cam_names.size());
+  std::vector<std::ofstream> index_files(cam_names.size());
   for (size_t cam_type = 0; cam_type < cam_names.size(); cam_type++) {
+    voxblox_subdirs[cam_type] = voxblox_dir + "/" + cam_names[cam_type];
+    dense_map::createDir(voxblox_subdirs[cam_type]);
 
-    std::string voxblox_subdir = voxblox_dir + "/" + cam_names[cam_type];
-    dense_map::createDir(voxblox_subdir);
-
-    std::string index_file = voxblox_subdir + "/index.txt";
+    std::string index_file = voxblox_subdirs[cam_type] + "/index.txt";
     std::cout << "Writing: " << index_file << std::endl;
-    std::ofstream ofs(index_file.c_str());
-
-    for (size_t cid = 0; cid < cam_images.size(); cid++) {
+    index_files[cam_type].open(index_file.c_str());
+  }
 
-      if (cam_images[cid].camera_type != cam_type) 
-        continue;
+  // Visit the cameras of all types in one pass. Their data is read
+  // ahead in parallel, while the clouds already read are transformed
+  // and written on another pool of threads, to keep the disk busy.
+  // The threads are split between the two pools.
+  std::vector<int> cids = depthCamerasByType(cam_names.size(), cam_images);
+  int num_read_threads = std::max(num_threads / 2, 1);
+  dense_map::ThreadPool thread_pool(std::max(num_threads - num_read_threads, 1));
+  dense_map::visitCameraData
+    (cam_images, cids, true, true, num_read_threads,
+     [&](int cid, cv::Mat const& image, cv::Mat const& depth_cloud) {
+      int depth_cols = depth_cloud.cols;
+      int depth_rows = depth_cloud.rows;
 
-      int depth_cols = cam_images[cid].depth_cloud.cols;
-      int depth_rows = cam_images[cid].depth_cloud.rows;
-      
       if (depth_cols == 0 || depth_rows == 0)
-        continue; // skip empty clouds
+        return; // skip empty clouds
 
       // Sanity check
-      if (depth_cols != cam_images[cid].image.cols || 
-          depth_rows != cam_images[cid].image.rows)
+      if (depth_cols != image.cols || depth_rows != image.rows)
         LOG(FATAL) << "Found a depth cloud and corresponding image with mismatching dimensions.\n";
-        
+
+      // Sanity check
+      if (image.channels() != 1) 
+        LOG(FATAL) << "Expecting a grayscale input image.\n";
+
       // Must use the 10.7f format for the timestamp as everywhere else in the code,
       // as it is in double precision.
+      char timestamp_buffer[1000];
       double timestamp = cam_images[cid].timestamp;
       snprintf(timestamp_buffer, sizeof(timestamp_buffer), "%10.7f", timestamp);
 
-      // Sanity check
-      if (cam_images[cid].image.channels() != 1) 
-        LOG(FATAL) << "Expecting a grayscale input image.\n";
-      
-      // Form a pcl point cloud. Add the first band of the image as an intensity
-      // Later will reduce its dimensions as we will skip invalid pixels.
-      // Use fields as expected by voxblox.
-      // TODO(oalexan1): Make this a subroutine
-      pcl::PointCloud<pcl::PointNormal> pc;
-      pc.width = std::int64_t(depth_cols) * std::int64_t(depth_rows); // int64 to avoid overflow
-      pc.height = 1;
-      pc.points.resize(pc.width * pc.height);
-      int count = 0;
-      for (int row = 0; row < depth_rows; row++) {
-        for (int col = 0; col < depth_cols; col++) {
-          cv::Vec3f xyz = cam_images[cid].depth_cloud.at<cv::Vec3f>(row, col);
-          if (xyz == cv::Vec3f(0, 0, 0)) // skip invalid points
-            continue;
-
-          // Transform from depth cloud coordinates to camera coordinates
-          // (later voxblox will transform to world coordinates)
-          Eigen::Vector3d P(xyz[0], xyz[1], xyz[2]);
-          P = depth_to_image[cam_images[cid].camera_type] * P;
-          
-          pc.points[count].x         = P[0];
-          pc.points[count].y         = P[1];
-          pc.points[count].z         = P[2];
-          pc.points[count].normal_x  = cam_images[cid].image.at<uchar>(row, col); // intensity
-          pc.points[count].normal_y  = 1.0; // weight
-          pc.points[count].normal_y  = 1.0; // intersection err
-          pc.points[count].normal_y  = 0.0; // ensure initialization
-          
-          count++;
-        }
-      }
-      // Shrink the cloud as invalid data was skipped
-      if (count > pc.width) 
-        LOG(FATAL) << "Book-keeping error in processing point clouds.\n";
-      pc.width = count;
-      pc.height = 1;
-      pc.points.resize(pc.width * pc.height);
-
-      // Save the transform
-      std::string transform_file = voxblox_subdir + "/" + timestamp_buffer + "_cam2world.txt";
-      ofs << transform_file << "\n"; // save its name in the index
-      dense_map::writeMatrix(world_to_cam[cid].inverse().matrix(), transform_file);
-
-      // Save the pcd file
-      std::string cloud_file = voxblox_subdir + "/" + timestamp_buffer + ".pcd";
+      // Record the transform and cloud names in the index
+      int cam_type = cam_images[cid].camera_type;
+      std::string transform_file = voxblox_subdirs[cam_type] + "/" + timestamp_buffer
+        + "_cam2world.txt";
+      std::string cloud_file = voxblox_subdirs[cam_type] + "/" + timestamp_buffer + ".pcd";
+      index_files[cam_type] << transform_file << "\n" << cloud_file << "\n";
+
       std::cout << "Writing: " << cloud_file << std::endl;
-      ofs << cloud_file << "\n"; // save its name in the index
-      pcl::io::savePCDFileBinary(cloud_file, pc); // writing binary is much faster than ascii
-    }
-  }
-  
+      thread_pool.AddTask(&saveVoxbloxCloud, depth_cloud, image, depth_to_image[cam_type],
+                          world_to_cam[cid].inverse(), transform_file, cloud_file);
+    });
+  thread_pool.Join();
 }
   
 // Save the depth clouds and optimized transforms needed to create a mesh with voxblox
@@ -1296,7 +1394,7 @@ void saveTransformedDepthClouds(std::vector<std::string> const& cam_names,
                                 std::vector<dense_map::cameraImage> const& cam_images,
                                 std::vector<Eigen::Affine3d> const& depth_to_image,
                                 std::vector<Eigen::Affine3d> const& world_to_cam,
-                                std::string const& out_dir) {
+                                std::string const& out_dir, int num_threads) {
   if (cam_images.size() != world_to_cam.size())
     LOG(FATAL) << "There must be as many camera images as camera poses.\n";
   if (cam_names.size() != depth_to_image.size()) 
@@ -1308,55 +1406,52 @@ void saveTransformedDepthClouds(std::vector<std::string> const& cam_names,
   std::string trans_depth_dir = out_dir + "/trans_depth";
   dense_map::createDir(trans_depth_dir);
 
-  char timestamp_buffer[1000];
-
-  // Must take a pass for each camera type, and then visit
-  // all images while ignoring those of a different type. There are very
-  // few camera types, so this is not unreasonable.
-
+  std::vector<std::string> trans_depth_subdirs(cam_names.size());
   for (size_t cam_type = 0; cam_type < cam_names.size(); cam_type++) {
+    trans_depth_subdirs[cam_type] = trans_depth_dir + "/" + cam_names[cam_type];
+    dense_map::createDir(trans_depth_subdirs[cam_type]);
+  }
 
-    std::string trans_depth_subdir = trans_depth_dir + "/" + cam_names[cam_type];
-    dense_map::createDir(trans_depth_subdir);
-
-    for (size_t cid = 0; cid < cam_images.size(); cid++) {
-
-      if (cam_images[cid].camera_type != cam_type) 
-        continue;
+  // Visit the cameras of all types in one pass, and transform and
+  // write the clouds on a pool of threads while more are read. The
+  // threads are split between reading and writing.
+  std::vector<int> cids = depthCamerasByType(cam_names.size(), cam_images);
+  int num_read_threads = std::max(num_threads / 2, 1);
+  dense_map::ThreadPool thread_pool(std::max(num_threads - num_read_threads, 1));
+  dense_map::visitCameraData
+    (cam_images, cids, true, true, num_read_threads,
+     [&](int cid, cv::Mat const& image, cv::Mat const& depth_cloud) {
+      int depth_cols = depth_cloud.cols;
+      int depth_rows = depth_cloud.rows;
 
-      int depth_cols = cam_images[cid].depth_cloud.cols;
-      int depth_rows = cam_images[cid].depth_cloud.rows;
-      
       if (depth_cols == 0 || depth_rows == 0)
-        continue; // skip empty clouds
+        return; // skip empty clouds
 
       // Sanity check
-      if (depth_cols != cam_images[cid].image.cols || 
-          depth_rows != cam_images[cid].image.rows)
+      if (depth_cols != image.cols || depth_rows != image.rows)
         LOG(FATAL) << "Found a depth cloud and corresponding image with mismatching dimensions.\n";
-        
+
       // Must use the 10.7f format for the timestamp as everywhere else in the code,
       // as it is in double precision.
+      char timestamp_buffer[1000];
       double timestamp = cam_images[cid].timestamp;
       snprintf(timestamp_buffer, sizeof(timestamp_buffer), "%10.7f", timestamp);
 
       // Sanity check
-      if (cam_images[cid].image.channels() != 1) 
+      if (image.channels() != 1) 
         LOG(FATAL) << "Expecting a grayscale input image.\n";
 
-      // Save the pcd file
-      std::string cloud_file = trans_depth_subdir + "/" + timestamp_buffer + ".ply";
+      // Save the ply file
+      int cam_type = cam_images[cid].camera_type;
+      std::string cloud_file = trans_depth_subdirs[cam_type] + "/" + timestamp_buffer + ".ply";
 
       // To go from the depth cloud to world coordinates need to first to go from depth
       // to image coordinates, then from image to world. 
-      Eigen::Affine3d depth_to_world = (world_to_cam[cid].inverse())
-        * depth_to_image[cam_images[cid].camera_type];
-      saveTransformedMesh(cam_images[cid].depth_cloud, cam_images[cid].image,
-                          depth_to_world, cloud_file);
-      
-    }
-  }
-  
+      Eigen::Affine3d depth_to_world = (world_to_cam[cid].inverse()) * depth_to_image[cam_type];
+      std::cout << "Writing: " << cloud_file << std::endl;
+      thread_pool.AddTask(&saveTransformedMesh, depth_cloud, image, depth_to_world, cloud_file);
+    });
+  thread_pool.Join();
 }
 
 // Find the depth measurement. Use nearest neighbor interpolation
@@ -1401,11 +1496,11 @@ bool timestampLess(cameraImage i, cameraImage j) {
 // resizing.
 // Similar logic to deal with differences between image size and calibrated size
 // is used further down this code.
-void adjustImageSize(camera::CameraParameters const& cam_params, cv::Mat & image) {
+void adjustImageSize(Eigen::Vector2i const& calib_image_size, cv::Mat & image) {
   int64_t raw_image_cols = image.cols;
   int64_t raw_image_rows = image.rows;
-  int64_t calib_image_cols = cam_params.GetDistortedSize()[0];
-  int64_t calib_image_rows = cam_params.GetDistortedSize()[1];
+  int64_t calib_image_cols = calib_image_size[0];
+  int64_t calib_image_rows = calib_image_size[1];
 
   int64_t factor = raw_image_cols / calib_image_cols;
 
@@ -1465,12 +1560,30 @@ void lookupImagesAndBrackets(// Inputs
   min_timestamp_offset.resize(num_cam_types, -1.0e+100);
   max_timestamp_offset.resize(num_cam_types,  1.0e+100);
 
-  // A lot of care is needed with positions. This remembers how we travel in time
-  // for each camera type so we have fewer messages to search.
-  // But if a mistake is done below it will mess up this bookkeeping.
+  // This remembers how we travel in time for each camera type so
+  // the lookups below search forward from there.
   std::vector<int> image_start_positions(num_cam_types, 0);
   std::vector<int> cloud_start_positions(num_cam_types, 0);
 
+  // For each camera type other than the ref one, its image timestamps,
+  // and for each ref timestamp, converted to this camera's time, the
+  // position of the first image at or after it. These are all found
+  // at once.
+  std::vector<std::vector<double>> image_timestamps(num_cam_types);
+  std::vector<std::vector<int>> bracket_positions(num_cam_types);
+  for (int cam_type = ref_cam_type; cam_type < num_cam_types; cam_type++) {
+    if (cam_type == ref_cam_type) continue;
+    auto const& msgs = image_data[cam_type];  // alias
+    image_timestamps[cam_type].resize(msgs.size());
+    for (size_t it = 0; it < msgs.size(); it++)
+      image_timestamps[cam_type][it] = msgs[it].timestamp;
+    std::vector<double> queries(num_ref_cams);
+    for (int it = 0; it < num_ref_cams; it++)
+      queries[it] = ref_timestamps[it] + ref_to_cam_timestamp_offsets[cam_type];
+    dense_map::timestampLowerBounds(image_timestamps[cam_type], queries,
+                                    bracket_positions[cam_type]);
+  }
+
   // Populate the data for each camera image
   for (int beg_ref_it = 0; beg_ref_it < num_ref_cams; beg_ref_it++) {
 
@@ -1500,7 +1613,7 @@ void lookupImagesAndBrackets(// Inputs
         bool have_lookup =  
           dense_map::lookupImage(cam.timestamp, image_data[cam_type],
                                  // Outputs
-                                 cam.image, cam.image_name, 
+                                 cam.image_name, 
                                  image_start_positions[cam_type],  // this will move forward
                                  found_time);
         
@@ -1533,52 +1646,28 @@ void lookupImagesAndBrackets(// Inputs
         // more room to vary the timestamp later.
         double mid_timestamp = (beg_timestamp + end_timestamp)/2.0;
 
-        // Search forward in time from image_start_positions[cam_type].
-        // We will update that too later. One has to be very careful
-        // with it so it does not go too far forward in time
-        // so that at the next iteration we are passed what we
-        // search for.
-        int start_pos = image_start_positions[cam_type];  // care here
-        double curr_timestamp = beg_timestamp;            // start here
-        cv::Mat best_image;
+        // The images in the bracket are the ones in [beg_pos, end_pos)
+        std::vector<double> const& timestamps = image_timestamps[cam_type];  // alias
+        int beg_pos = bracket_positions[cam_type][beg_ref_it];
+        int end_pos = last_timestamp ?
+          dense_map::timestampLowerBound(timestamps, end_timestamp, beg_pos) :
+          bracket_positions[cam_type][end_ref_it];
+
+        // The closest to the midpoint is right before or right after
+        // it. Prefer the earlier one on a tie, and the first of several
+        // images with the same timestamp.
+        double best_time = -1.0;
         std::string best_image_name;
-        double best_dist = 1.0e+100;
-        double best_time = -1.0, found_time = -1.0;
-        while (1) {
-          if (found_time > end_timestamp) break;  // out of range
-
-          cv::Mat image;
-          std::string image_name;
-          bool have_lookup =
-            dense_map::lookupImage(curr_timestamp, image_data[cam_type],
-                                   // Outputs
-                                   image, image_name,
-                                   // care here, start_pos moves forward
-                                   start_pos,
-                                   // found_time will be updated now
-                                   found_time);
-
-          if (!have_lookup)
-            break;  // Need not succeed, but then there's no need to go on as we are at the end
-
-          // Check if the found time is in the bracket
-          bool is_in_bracket = (beg_timestamp <= found_time && found_time < end_timestamp);
-          double curr_dist = std::abs(found_time - mid_timestamp);
-
-          if (curr_dist < best_dist && is_in_bracket) {
-            best_dist = curr_dist;
-            best_time = found_time;
-            // Update the start position for the future only if this is a good
-            // solution. Otherwise we may have moved too far.
-            image_start_positions[cam_type] = start_pos;
-            image.copyTo(best_image);
-            best_image_name = image_name;
-          }
-
-          // Go forward in time. We count on the fact that
-          // lookupImage() looks forward from given guess.
-          // Careful here with the api of std::nextafter().
-          curr_timestamp = std::nextafter(found_time, found_time + 1.0);
+        if (beg_pos < end_pos) {
+          int pos = dense_map::timestampLowerBound(timestamps, mid_timestamp, beg_pos);
+          pos = std::min(pos, end_pos - 1);
+          if (pos > beg_pos && std::abs(timestamps[pos - 1] - mid_timestamp)
+              <= std::abs(timestamps[pos] - mid_timestamp))
+            pos--;
+          while (pos > beg_pos && timestamps[pos - 1] == timestamps[pos])
+            pos--;
+          best_time = timestamps[pos];
+          best_image_name = image_data[cam_type][pos].name;
         }
 
         if (best_time < 0.0) continue;  // bracketing failed
@@ -1595,7 +1684,6 @@ void lookupImagesAndBrackets(// Inputs
         cam.ref_timestamp = best_time - ref_to_cam_offset;
         cam.beg_ref_index = beg_ref_it;
         cam.end_ref_index = end_ref_it;
-        cam.image         = best_image;
         cam.image_name    = best_image_name;
 
         success = true;
@@ -1625,7 +1713,7 @@ void lookupImagesAndBrackets(// Inputs
         dense_map::lookupImage(cam.timestamp,  // start looking from this time forward
                                depth_data[cam_type],
                                // Outputs
-                               cam.depth_cloud, cam.depth_name, 
+                               cam.depth_name, 
                                cloud_start_positions[cam_type],  // this will move forward
                                cam.cloud_timestamp);             // found time
       
@@ -1710,7 +1798,7 @@ void lookupImagesNoBrackets(// Inputs
       bool have_lookup =  
         dense_map::lookupImage(cam.timestamp, image_data[cam_type],
                                // Outputs
-                               cam.image, cam.image_name, 
+                               cam.image_name, 
                                image_start_positions[cam_type],  // this will move forward
                                found_time);
       if (!have_lookup)
@@ -1729,7 +1817,7 @@ void lookupImagesNoBrackets(// Inputs
         dense_map::lookupImage(cam.timestamp,  // start looking from this time forward
                                depth_data[cam_type],
                                // Outputs
-                               cam.depth_cloud, cam.depth_name, 
+                               cam.depth_name, 
                                cloud_start_positions[cam_type],  // this will move forward
                                cam.cloud_timestamp);             // found time
 
@@ -1756,6 +1844,9 @@ void lookupImages(// Inputs
                   std::vector<double>& min_timestamp_offset,
                   std::vector<double>& max_timestamp_offset) {
 
+  checkChronologicalOrder(image_data);
+  checkChronologicalOrder(depth_data);
+
   if (!no_rig) 
     lookupImagesAndBrackets(// Inputs
                             ref_cam_type, bracket_len,  
@@ -1792,9 +1883,9 @@ void lookupImages(// Inputs
   // The images may need to be resized to be the same
   // size as in the calibration file. Sometimes the full-res images
   // can be so blurry that interest point matching fails, hence the
-  // resizing.
+  // resizing. That is done when an image is read.
   for (size_t it = 0; it < cams.size(); it++)
-    dense_map::adjustImageSize(cam_params[cams[it].camera_type], cams[it].image);
+    cams[it].calib_image_size = cam_params[cams[it].camera_type].GetDistortedSize();
 
   // Sort by the timestamp in reference camera time. This is essential
   // for matching each image to other images close in time. Note
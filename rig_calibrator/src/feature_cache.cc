@@ -0,0 +1,302 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <rig_calibrator/feature_cache.h>
+#include <rig_calibrator/interest_point.h>
+#include <rig_calibrator/camera_image.h>
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+DEFINE_bool(feature_cache, true,
+            "Save the detected features in <out_dir>/features and reuse them in "
+            "subsequent runs for images and feature detector options which did not change.");
+
+// The options which affect feature detection, defined elsewhere
+DECLARE_string(feature_detector);
+DECLARE_int32(sift_nFeatures);
+DECLARE_int32(sift_nOctaveLayers);
+DECLARE_double(sift_contrastThreshold);
+DECLARE_double(sift_edgeThreshold);
+DECLARE_double(sift_sigma);
+DECLARE_int32(orb_nFeatures);
+DECLARE_int32(detection_retries);
+DECLARE_int32(min_surf_features);
+DECLARE_int32(max_surf_features);
+DECLARE_double(min_surf_threshold);
+DECLARE_double(default_surf_threshold);
+DECLARE_double(max_surf_threshold);
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+// The layout of a cache file is: this header, the key, padding to a
+// multiple of kAlign, the keypoints as num_keypoints pairs of
+// doubles (which is how Eigen stores a Matrix2Xd), and the
+// descriptors, as a contiguous block of desc_rows x desc_cols values.
+// The file is only meant to be read on the machine that wrote it,
+// so native byte order is used.
+const char kMagic[8] = {'R', 'C', 'F', 'E', 'A', 'T', '0', '1'};
+const size_t kAlign = 16;
+
+struct FeatureCacheHeader {
+  char     magic[8];
+  uint64_t key_len;
+  uint64_t num_keypoints;
+  int32_t  desc_rows;
+  int32_t  desc_cols;
+  int32_t  desc_type;
+  int32_t  reserved;
+};
+
+size_t alignUp(size_t val) {
+  return kAlign * ((val + kAlign - 1) / kAlign);
+}
+
+// A fast and stable hash, so the cache file names do not change
+// among runs or builds.
+uint64_t fnv1aHash(std::string const& str) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t it = 0; it < str.size(); it++) {
+    hash ^= static_cast<unsigned char>(str[it]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // end anonymous namespace
+
+namespace dense_map {
+
+MappedFile::MappedFile(): m_data(NULL), m_size(0) {}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+bool MappedFile::open(std::string const& file) {
+  close();
+
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);  // The mapping stays valid after the descriptor is closed
+  if (ptr == MAP_FAILED) return false;
+
+  m_data = static_cast<const char*>(ptr);
+  m_size = st.st_size;
+  return true;
+}
+
+void MappedFile::close() {
+  if (m_data != NULL) munmap(const_cast<char*>(m_data), m_size);
+  m_data = NULL;
+  m_size = 0;
+}
+
+std::string featureCacheDir(std::string const& out_dir) {
+  if (out_dir.empty()) return "";
+  return out_dir + "/features";
+}
+
+std::string featureCacheKey(std::string const& image_file) {
+  boost::system::error_code ec;
+  fs::path path = fs::absolute(image_file);
+  if (!fs::is_regular_file(path, ec)) return "";
+
+  std::time_t mtime = fs::last_write_time(path, ec);
+  if (ec) return "";
+  uintmax_t file_size = fs::file_size(path, ec);
+  if (ec) return "";
+
+  std::ostringstream oss;
+  oss.precision(17);
+  oss << "image " << path.string() << "\n"
+      << "mtime " << mtime << "\n"
+      << "size " << file_size << "\n"
+      << "detector " << FLAGS_feature_detector << "\n";
+  if (FLAGS_feature_detector == "SIFT") {
+    oss << "sift " << FLAGS_sift_nFeatures << " " << FLAGS_sift_nOctaveLayers << " "
+        << FLAGS_sift_contrastThreshold << " " << FLAGS_sift_edgeThreshold << " "
+        << FLAGS_sift_sigma << "\n";
+  } else if (FLAGS_feature_detector == "ORB") {
+    oss << "orb " << FLAGS_orb_nFeatures << "\n";
+  } else {
+    oss << "surf " << FLAGS_detection_retries << " " << FLAGS_min_surf_features << " "
+        << FLAGS_max_surf_features << " " << FLAGS_min_surf_threshold << " "
+        << FLAGS_default_surf_threshold << " " << FLAGS_max_surf_threshold << "\n";
+  }
+
+  return oss.str();
+}
+
+std::string featureCacheFile(std::string const& cache_dir, std::string const& key) {
+  std::ostringstream oss;
+  oss << std::hex << std::setw(16) << std::setfill('0') << fnv1aHash(key);
+  return cache_dir + "/" + oss.str() + ".feat";
+}
+
+bool readFeatureCache(std::string const& cache_file, std::string const& key,
+                      // Outputs
+                      cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints,
+                      std::shared_ptr<MappedFile>* mapped_file) {
+  std::shared_ptr<MappedFile> mf(new MappedFile);
+  if (!mf->open(cache_file)) return false;
+
+  if (mf->size() < sizeof(FeatureCacheHeader)) return false;
+
+  FeatureCacheHeader header;
+  memcpy(&header, mf->data(), sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) return false;
+
+  // Guard against hash collisions and stale files
+  if (header.key_len != key.size()) return false;
+  size_t offset = sizeof(header);
+  if (mf->size() < offset + header.key_len) return false;
+  if (memcmp(mf->data() + offset, key.data(), key.size()) != 0) return false;
+  offset = alignUp(offset + header.key_len);
+
+  size_t keypoints_size = 2 * sizeof(double) * header.num_keypoints;
+  size_t desc_offset = alignUp(offset + keypoints_size);
+  size_t desc_size = 0;
+  if (header.desc_rows > 0) {
+    desc_size = static_cast<size_t>(header.desc_rows) * header.desc_cols
+      * CV_ELEM_SIZE(header.desc_type);
+  }
+  if (mf->size() != desc_offset + desc_size) return false;
+  if (header.desc_rows > 0 && static_cast<uint64_t>(header.desc_rows) != header.num_keypoints)
+    return false;
+
+  keypoints->resize(2, header.num_keypoints);
+  if (keypoints_size > 0) memcpy(keypoints->data(), mf->data() + offset, keypoints_size);
+
+  // The descriptors are not copied. They are paged in from disk as
+  // the matching needs them.
+  if (header.desc_rows > 0)
+    *descriptors = cv::Mat(header.desc_rows, header.desc_cols, header.desc_type,
+                           const_cast<char*>(mf->data() + desc_offset));
+  else
+    *descriptors = cv::Mat();
+
+  *mapped_file = mf;
+  return true;
+}
+
+void writeFeatureCache(std::string const& cache_file, std::string const& key,
+                       cv::Mat const& descriptors, Eigen::Matrix2Xd const& keypoints) {
+  cv::Mat desc = descriptors;
+  if (!desc.empty() && !desc.isContinuous()) desc = desc.clone();
+
+  FeatureCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.key_len = key.size();
+  header.num_keypoints = keypoints.cols();
+  header.desc_rows = desc.rows;
+  header.desc_cols = desc.cols;
+  header.desc_type = desc.type();
+
+  std::string tmp_file = cache_file + ".tmp" + std::to_string(getpid());
+  std::ofstream ofs(tmp_file.c_str(), std::ios::binary);
+  if (!ofs.is_open()) {
+    LOG(WARNING) << "Cannot write: " << tmp_file << "\n";
+    return;
+  }
+
+  const char zeros[kAlign] = {0};
+  size_t offset = sizeof(header);
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(key.data(), key.size());
+  offset += key.size();
+  ofs.write(zeros, alignUp(offset) - offset);
+  offset = alignUp(offset);
+
+  size_t keypoints_size = 2 * sizeof(double) * keypoints.cols();
+  ofs.write(reinterpret_cast<const char*>(keypoints.data()), keypoints_size);
+  offset += keypoints_size;
+  ofs.write(zeros, alignUp(offset) - offset);
+
+  if (!desc.empty())
+    ofs.write(reinterpret_cast<const char*>(desc.data), desc.total() * desc.elemSize());
+
+  ofs.close();
+  if (!ofs) {
+    LOG(WARNING) << "Failed writing: " << tmp_file << "\n";
+    std::remove(tmp_file.c_str());
+    return;
+  }
+
+  if (std::rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+    LOG(WARNING) << "Failed to rename " << tmp_file << " to " << cache_file << "\n";
+    std::remove(tmp_file.c_str());
+  }
+}
+
+void detectFeaturesWithCache(cameraImage const& cam,
+                             std::string const& cache_dir, bool verbose, int pyramid_level,
+                             // Outputs
+                             cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints,
+                             std::shared_ptr<MappedFile>* mapped_file) {
+  mapped_file->reset();
+
+  std::string key;
+  if (!cache_dir.empty()) key = featureCacheKey(cam.image_name);
+  if (!key.empty() && pyramid_level > 0)
+    key += "pyramid_level " + std::to_string(pyramid_level) + "\n";
+
+  if (key.empty()) {
+    dense_map::detectFeaturesAtLevel(cam.getImage(), pyramid_level, verbose,
+                                     descriptors, keypoints);
+    return;
+  }
+
+  std::string cache_file = featureCacheFile(cache_dir, key);
+  if (readFeatureCache(cache_file, key, descriptors, keypoints, mapped_file)) {
+    if (verbose) std::cout << "Features read from cache " << keypoints->cols() << std::endl;
+    return;
+  }
+
+  // The image is read only if the features are not in the cache
+  dense_map::detectFeaturesAtLevel(cam.getImage(), pyramid_level, verbose,
+                                   descriptors, keypoints);
+  writeFeatureCache(cache_file, key, *descriptors, *keypoints);
+}
+
+}  // end namespace dense_map
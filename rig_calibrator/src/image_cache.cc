@@ -0,0 +1,191 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <rig_calibrator/image_cache.h>
+#include <rig_calibrator/camera_image.h>
+#include <rig_calibrator/dense_map_utils.h>
+#include <rig_calibrator/interest_point.h>
+#include <rig_calibrator/thread.h>
+
+#include <opencv2/imgcodecs.hpp>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <iostream>
+
+DEFINE_double(max_image_cache_mb, 0.0,
+              "Keep in memory at most this many megabytes of images and depth clouds. "
+              "The rest are read from disk when needed. If 0, there is no limit.");
+
+namespace dense_map {
+
+namespace {
+
+size_t matBytes(cv::Mat const& mat) {
+  return mat.total() * mat.elemSize();
+}
+
+}  // namespace
+
+ImageCache::ImageCache(size_t max_bytes): m_max_bytes(max_bytes), m_used_bytes(0) {}
+
+void ImageCache::setMaxBytes(size_t max_bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_max_bytes = max_bytes;
+  shrink();
+}
+
+size_t ImageCache::maxBytes() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_max_bytes;
+}
+
+size_t ImageCache::usedBytes() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_used_bytes;
+}
+
+cv::Mat ImageCache::get(std::string const& key,
+                        std::function<void(cv::Mat&)> const& load) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_key_to_entry.find(key);
+    if (it != m_key_to_entry.end()) {
+      // Move to the front, as this is now the most recently used
+      m_entries.splice(m_entries.begin(), m_entries, it->second);
+      return it->second->second;
+    }
+  }
+
+  cv::Mat mat;
+  load(mat);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  // Another thread may have loaded this meanwhile. Then use its copy.
+  auto it = m_key_to_entry.find(key);
+  if (it != m_key_to_entry.end()) {
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return it->second->second;
+  }
+
+  m_entries.push_front(std::make_pair(key, mat));
+  m_key_to_entry[key] = m_entries.begin();
+  m_used_bytes += matBytes(mat);
+  shrink();
+
+  return mat;
+}
+
+void ImageCache::clear() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_entries.clear();
+  m_key_to_entry.clear();
+  m_used_bytes = 0;
+}
+
+void ImageCache::shrink() {
+  if (m_max_bytes == 0)
+    return;  // no limit
+
+  // Always keep the most recent entry, even if by itself it is over
+  // the budget, as it was just asked for.
+  while (m_used_bytes > m_max_bytes && m_entries.size() > 1) {
+    auto& entry = m_entries.back();
+    m_used_bytes -= matBytes(entry.second);
+    m_key_to_entry.erase(entry.first);
+    m_entries.pop_back();
+  }
+}
+
+ImageCache & imageCache() {
+  static ImageCache cache;
+
+  // Pick up the latest value of the budget, which may be set after
+  // the cache is created
+  size_t max_bytes = static_cast<size_t>(std::max(FLAGS_max_image_cache_mb, 0.0) * 1024.0 * 1024.0);
+  if (cache.maxBytes() != max_bytes)
+    cache.setMaxBytes(max_bytes);
+
+  return cache;
+}
+
+cv::Mat cameraImage::getImage() const {
+  Eigen::Vector2i calib_size = calib_image_size;
+  std::string const& name = image_name;  // alias
+  return imageCache().get("image:" + name, [&name, &calib_size](cv::Mat & image) {
+      // Read the image as grayscale, in order for feature matching to work
+      // For texturing, texrecon should use the original color images.
+      std::cout << "Reading: " << name << std::endl;
+      image = cv::imread(name, cv::IMREAD_GRAYSCALE);
+      if (image.empty())
+        LOG(FATAL) << "Cannot read image: " << name << "\n";
+      if (calib_size[0] > 0 && calib_size[1] > 0)
+        dense_map::adjustImageSize(calib_size, image);
+    });
+}
+
+cv::Mat cameraImage::getDepthCloud() const {
+  if (!hasDepthCloud())
+    return cv::Mat();
+
+  std::string const& name = depth_name;  // alias
+  return imageCache().get("depth:" + name, [&name](cv::Mat & depth_cloud) {
+      std::cout << "Reading: " << name << std::endl;
+      dense_map::readXyzImage(name, depth_cloud);
+    });
+}
+
+void visitCameraData(std::vector<cameraImage> const& cams,
+                     std::vector<int> const& cids,
+                     bool with_image, bool with_depth, int num_threads,
+                     std::function<void(int cid, cv::Mat const& image,
+                                        cv::Mat const& depth_cloud)> const& visit) {
+  typedef std::pair<cv::Mat, cv::Mat> ImageAndDepth;
+
+  num_threads = std::max(num_threads, 1);
+  ThreadPool thread_pool(num_threads);
+  // Keep each thread busy while the current camera is processed, but
+  // do not read too far ahead, to not use too much memory.
+  size_t max_in_flight = 2 * num_threads;
+
+  std::deque<std::future<ImageAndDepth>> in_flight;
+  size_t next = 0;
+  for (size_t it = 0; it < cids.size(); it++) {
+    while (next < cids.size() && in_flight.size() < max_in_flight) {
+      cameraImage const* cam = &cams[cids[next]];
+      in_flight.push_back(thread_pool.AddTask([cam, with_image, with_depth]() {
+            ImageAndDepth data;
+            if (with_image)
+              data.first = cam->getImage();
+            if (with_depth)
+              data.second = cam->getDepthCloud();
+            return data;
+          }));
+      next++;
+    }
+
+    ImageAndDepth data = in_flight.front().get();
+    in_flight.pop_front();
+    visit(cids[it], data.first, data.second);
+  }
+}
+
+}  // end namespace dense_map
@@ -18,15 +18,20 @@
  */
 
 #include <opencv2/xfeatures2d.hpp>
+#include <opencv2/flann.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
 
 #include <rig_calibrator/basic_algs.h>
 #include <rig_calibrator/interest_point.h>
+#include <rig_calibrator/feature_cache.h>
 #include <rig_calibrator/camera_image.h>
 #include <rig_calibrator/system_utils.h>
 #include <rig_calibrator/thread.h>
 #include <rig_calibrator/matching.h>
+#include <rig_calibrator/nvm_sidecar.h>
+#include <rig_calibrator/profiler.h>
 #include <rig_calibrator/transform_utils.h>
 #include <camera_model/camera_params.h>
 
@@ -41,20 +46,50 @@
 
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <limits>
+#include <numeric>
+#include <set>
+#include <tuple>
 
 namespace fs = boost::filesystem;
 
 // SIFT is doing so much better than SURF for haz cam images.
-DEFINE_string(feature_detector, "SIFT", "The feature detector to use. SIFT or SURF.");
+DEFINE_string(feature_detector, "SIFT",
+              "The feature detector to use. SIFT, SURF, or ORB. ORB has binary descriptors, "
+              "which are much faster to match, but it gives fewer reliable matches.");
 DEFINE_int32(sift_nFeatures, 10000, "Number of SIFT features");
 DEFINE_int32(sift_nOctaveLayers, 3, "Number of SIFT octave layers");
 DEFINE_double(sift_contrastThreshold, 0.02,
               "SIFT contrast threshold");  // decrease for more ip
 DEFINE_double(sift_edgeThreshold, 10, "SIFT edge threshold");
 DEFINE_double(sift_sigma, 1.6, "SIFT sigma");
+DEFINE_int32(orb_nFeatures, 10000, "Number of ORB features");
+DEFINE_int32(pyramid_matching_level, 0,
+             "If positive, match features coarse-to-fine. First match the features of the "
+             "images reduced by a factor of 2 to this power, and keep the matches consistent "
+             "with the cameras. Then match each full-resolution feature only against the "
+             "features near where the coarse matches predict it to be. Image pairs with too "
+             "few coarse matches are skipped. Much faster for large images.");
+DEFINE_double(pyramid_search_radius, 40.0,
+              "With --pyramid_matching_level, the distance, in full-resolution pixels, from "
+              "the predicted location of a match within which to search for it.");
+DEFINE_bool(guided_matching, false,
+            "Match each feature only against the features in the other image near its "
+            "epipolar curve, which is found with the cameras. Faster, and more robust with "
+            "repetitive texture, if the cameras are reasonably accurate.");
+DEFINE_double(epipolar_band, 20.0,
+              "With --guided_matching, the distance, in pixels, from the epipolar curve of a "
+              "feature within which to search for its match.");
 
 namespace dense_map {
 
@@ -91,6 +126,11 @@ void detectFeatures(const cv::Mat& image, bool verbose,
       key.pt.y += image.rows / 2.0;
     }
 
+  } else if (FLAGS_feature_detector == "ORB") {
+    cv::Ptr<cv::ORB> orb = cv::ORB::create(FLAGS_orb_nFeatures);
+    orb->detect(*image_ptr, storage);
+    orb->compute(*image_ptr, storage, *descriptors);
+
   } else {
     LOG(FATAL) << "Unknown feature detector: " << FLAGS_feature_detector;
   }
@@ -105,11 +145,27 @@ void detectFeatures(const cv::Mat& image, bool verbose,
   }
 }
 
+void detectFeaturesAtLevel(const cv::Mat& image, int level, bool verbose,
+                           // Outputs
+                           cv::Mat* descriptors, Eigen::Matrix2Xd* keypoints) {
+  cv::Mat reduced = image;
+  for (int it = 0; it < level; it++) {
+    cv::Mat tmp;
+    cv::pyrDown(reduced, tmp);
+    reduced = tmp;
+  }
+
+  detectFeatures(reduced, verbose, descriptors, keypoints);
+
+  // A pixel in the reduced image is centered at the pixel of the
+  // full image with 2^level times its coordinates
+  *keypoints *= static_cast<double>(1 << level);
+}
+
 // This really likes haz cam first and nav cam second
-void matchFeatures(std::mutex* match_mutex, int left_image_index, int right_image_index,
-                   cv::Mat const& left_descriptors, cv::Mat const& right_descriptors,
+void matchFeatures(cv::Mat const& left_descriptors, cv::Mat const& right_descriptors,
                    Eigen::Matrix2Xd const& left_keypoints,
-                   Eigen::Matrix2Xd const& right_keypoints, bool verbose,
+                   Eigen::Matrix2Xd const& right_keypoints,
                    // output
                    MATCH_PAIR* matches) {
   std::vector<cv::DMatch> cv_matches;
@@ -162,37 +218,24 @@ void matchFeatures(std::mutex* match_mutex, int left_image_index, int right_imag
     right_ip.push_back(right);
   }
 
-  // Update the shared variable using a lock
-  match_mutex->lock();
-
-  // Print the verbose message inside the lock, otherwise the text
-  // may get messed up.
-  if (verbose)
-    std::cout << "Number of matches for pair "
-              << left_image_index << ' ' << right_image_index << ": "
-              << left_ip.size() << std::endl;
-
-  *matches = std::make_pair(left_ip, right_ip);
-  match_mutex->unlock();
+  matches->first.swap(left_ip);
+  matches->second.swap(right_ip);
 }
 
-// Match features while assuming that the input cameras can be used to filter out
-// outliers by reprojection error.
-void matchFeaturesWithCams(std::mutex* match_mutex, int left_image_index, int right_image_index,
-                           camera::CameraParameters const& left_params,
+// Filter descriptor matches while assuming that the input cameras can
+// be used to filter out outliers by reprojection error.
+// Each concurrent call must be given its own output, then no locking is needed.
+void filterMatchesWithCams(camera::CameraParameters const& left_params,
                            camera::CameraParameters const& right_params,
                            Eigen::Affine3d const& left_world_to_cam,
                            Eigen::Affine3d const& right_world_to_cam,
                            double reprojection_error,
-                           cv::Mat const& left_descriptors, cv::Mat const& right_descriptors,
                            Eigen::Matrix2Xd const& left_keypoints,
                            Eigen::Matrix2Xd const& right_keypoints,
-                           bool verbose,
+                           std::vector<cv::DMatch> const& cv_matches,
                            // output
-                           MATCH_PAIR* matches) {
-  // Match by using descriptors first
-  std::vector<cv::DMatch> cv_matches;
-  interest_point::FindMatches(left_descriptors, right_descriptors, &cv_matches);
+                           MATCH_INDICES* matches) {
+  matches->clear();
 
   // Do filtering
   std::vector<cv::Point2f> left_vec;
@@ -266,38 +309,260 @@ void matchFeaturesWithCams(std::mutex* match_mutex, int left_image_index, int ri
   cv::Mat H = cv::estimateAffine2D(left_vec, right_vec, inlier_mask, cv::RANSAC,
                                    ransacReprojThreshold, maxIters, confidence);
 
-  std::vector<InterestPoint> left_ip, right_ip;
+  matches->clear();
   for (size_t j = 0; j < filtered_cv_matches.size(); j++) {
-    int left_ip_index = filtered_cv_matches.at(j).queryIdx;
-    int right_ip_index = filtered_cv_matches.at(j).trainIdx;
-
     if (inlier_mask.at<uchar>(j, 0) == 0) continue;
+    matches->push_back(std::make_pair(filtered_cv_matches[j].queryIdx,
+                                      filtered_cv_matches[j].trainIdx));
+  }
+}
 
-    cv::Mat left_desc = left_descriptors.row(left_ip_index);
-    cv::Mat right_desc = right_descriptors.row(right_ip_index);
+// Match the features of the images paired with the given right image
+// against a FLANN index built once for the features of that image,
+// then filter the matches using the cameras. The matches for
+// image_pairs[pair_it] go to (*matches)[pair_it], so concurrent calls
+// for different right images need no locking.
+void matchFeaturesAgainstImage(int right_index,
+                               std::vector<size_t> const& pair_ids,
+                               std::vector<std::pair<int, int>> const& image_pairs,
+                               std::vector<camera::CameraParameters> const& cam_params,
+                               std::vector<dense_map::cameraImage> const& cams,
+                               std::vector<Eigen::Affine3d> const& world_to_cam,
+                               double reprojection_error,
+                               std::vector<cv::Mat> const& cid_to_descriptor_map,
+                               std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
+                               // output
+                               std::vector<MATCH_INDICES> * matches) {
+  interest_point::DescriptorIndex index(cid_to_descriptor_map[right_index]);
+
+  for (size_t pair_it : pair_ids) {
+    int left_index = image_pairs[pair_it].first;
+
+    // Match by using descriptors first
+    std::vector<cv::DMatch> cv_matches;
+    index.FindMatches(cid_to_descriptor_map[left_index], &cv_matches);
+
+    filterMatchesWithCams(cam_params[cams[left_index].camera_type],
+                          cam_params[cams[right_index].camera_type],
+                          world_to_cam[left_index], world_to_cam[right_index],
+                          reprojection_error,
+                          cid_to_keypoint_map[left_index], cid_to_keypoint_map[right_index],
+                          cv_matches,
+                          &(*matches)[pair_it]);
+  }
+}
 
-    InterestPoint left;
-    left.setFromCvKeypoint(left_keypoints.col(left_ip_index), left_desc);
+// Match coarse-to-fine the features of the images paired with the
+// given right image. The features of the reduced images are matched
+// and filtered with the cameras first. If enough matches are left,
+// they are fit with an affine transform from the left to the right
+// image, and each full-resolution left feature is matched only
+// against the right features within search_radius of where this
+// transform takes it. Those matches are then filtered with the
+// cameras as well. The outputs are as for matchFeaturesAgainstImage().
+void matchFeaturesCoarseToFine(int right_index,
+                               std::vector<size_t> const& pair_ids,
+                               std::vector<std::pair<int, int>> const& image_pairs,
+                               std::vector<camera::CameraParameters> const& cam_params,
+                               std::vector<dense_map::cameraImage> const& cams,
+                               std::vector<Eigen::Affine3d> const& world_to_cam,
+                               double reprojection_error, double search_radius,
+                               std::vector<cv::Mat> const& cid_to_coarse_descriptor_map,
+                               std::vector<Eigen::Matrix2Xd> const& cid_to_coarse_keypoint_map,
+                               std::vector<cv::Mat> const& cid_to_descriptor_map,
+                               std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
+                               // output
+                               std::vector<MATCH_INDICES> * matches) {
+  // Fewer coarse matches than this do not give a reliable transform
+  size_t min_coarse_matches = 8;
+
+  Eigen::Matrix2Xd const& right_coarse_kp = cid_to_coarse_keypoint_map[right_index];  // alias
+  Eigen::Matrix2Xd const& right_kp = cid_to_keypoint_map[right_index];  // alias
+  interest_point::DescriptorIndex coarse_index(cid_to_coarse_descriptor_map[right_index]);
+  interest_point::KeypointGrid grid(right_kp, search_radius);
+
+  for (size_t pair_it : pair_ids) {
+    int left_index = image_pairs[pair_it].first;
+    Eigen::Matrix2Xd const& left_coarse_kp = cid_to_coarse_keypoint_map[left_index];  // alias
+    Eigen::Matrix2Xd const& left_kp = cid_to_keypoint_map[left_index];  // alias
+    camera::CameraParameters const& left_params = cam_params[cams[left_index].camera_type];
+    camera::CameraParameters const& right_params = cam_params[cams[right_index].camera_type];
+
+    std::vector<cv::DMatch> cv_matches;
+    coarse_index.FindMatches(cid_to_coarse_descriptor_map[left_index], &cv_matches);
+    MATCH_INDICES coarse_matches;
+    filterMatchesWithCams(left_params, right_params,
+                          world_to_cam[left_index], world_to_cam[right_index],
+                          reprojection_error, left_coarse_kp, right_coarse_kp,
+                          cv_matches, &coarse_matches);
+    if (coarse_matches.size() < min_coarse_matches)
+      continue;
 
-    InterestPoint right;
-    right.setFromCvKeypoint(right_keypoints.col(right_ip_index), right_desc);
+    std::vector<cv::Point2f> left_vec, right_vec;
+    for (auto const& match : coarse_matches) {
+      left_vec.push_back(cv::Point2f(left_coarse_kp(0, match.first),
+                                     left_coarse_kp(1, match.first)));
+      right_vec.push_back(cv::Point2f(right_coarse_kp(0, match.second),
+                                      right_coarse_kp(1, match.second)));
+    }
+    cv::Mat inlier_mask;
+    cv::Mat H = cv::estimateAffine2D(left_vec, right_vec, inlier_mask, cv::RANSAC, 20.0);
+    if (H.empty())
+      continue;
+    H.convertTo(H, CV_64F);
+
+    // The right features near the predicted location of each left feature
+    std::vector<std::vector<int>> candidates(left_kp.cols());
+    for (int it = 0; it < left_kp.cols(); it++) {
+      double x = H.at<double>(0, 0) * left_kp(0, it) + H.at<double>(0, 1) * left_kp(1, it)
+        + H.at<double>(0, 2);
+      double y = H.at<double>(1, 0) * left_kp(0, it) + H.at<double>(1, 1) * left_kp(1, it)
+        + H.at<double>(1, 2);
+      grid.FindInBox(x - search_radius, y - search_radius, x + search_radius,
+                     y + search_radius, candidates[it]);
+    }
 
-    left_ip.push_back(left);
-    right_ip.push_back(right);
+    interest_point::FindCandidateMatches(cid_to_descriptor_map[left_index],
+                                         cid_to_descriptor_map[right_index],
+                                         candidates, &cv_matches);
+    filterMatchesWithCams(left_params, right_params,
+                          world_to_cam[left_index], world_to_cam[right_index],
+                          reprojection_error, left_kp, right_kp,
+                          cv_matches, &(*matches)[pair_it]);
   }
+}
 
-  // Update the shared variable using a lock
-  match_mutex->lock();
+// Find the epipolar curve in the right image of a pixel in the left
+// image, both distorted, as a set of segments, with segment i going
+// from segments[2*i] to segments[2*i + 1]. That is the projection of
+// the ray through the left pixel, sampled at depths which grow
+// geometrically, from a small fraction of the distance between the
+// cameras to many times that, and at infinity. Lens distortion bends
+// the curve, so it is sampled finely. Samples behind the right camera
+// or far outside the right image are skipped.
+void epipolarSegments(camera::CameraParameters const& left_params,
+                      camera::CameraParameters const& right_params,
+                      Eigen::Affine3d const& left_to_right,
+                      Eigen::Vector2d const& left_pix,
+                      // Output
+                      std::vector<Eigen::Vector2d> & segments) {
+  segments.clear();
+
+  Eigen::Vector2d undist_left;
+  left_params.Convert<camera::DISTORTED, camera::UNDISTORTED_C>(left_pix, &undist_left);
+  Eigen::Vector3d dir(undist_left.x() / left_params.GetFocalVector().x(),
+                      undist_left.y() / left_params.GetFocalVector().y(), 1.0);
+
+  // The left camera center and the ray, in the right camera coordinates
+  Eigen::Vector3d center = left_to_right.translation();
+  Eigen::Vector3d ray = left_to_right.linear() * dir;
+  double baseline = center.norm();
+
+  Eigen::Vector2i size = right_params.GetDistortedSize();
+  double margin = 0.5 * std::max(size.x(), size.y());
+
+  // Depths from 1/16 of the baseline to 2^20 times it, then infinity
+  int num_samples = 97;
+  bool prev_valid = false;
+  Eigen::Vector2d prev_pix;
+  for (int it = 0; it <= num_samples; it++) {
+    Eigen::Vector3d X;
+    if (it < num_samples) {
+      if (baseline <= 0.0) continue;  // the ray projects to one point
+      X = center + baseline * std::pow(2.0, (it - 16) / 4.0) * ray;
+    } else {
+      X = ray;  // the direction of the point at infinity
+    }
 
-  // Print the verbose message inside the lock, otherwise the text
-  // may get messed up.
-  if (verbose)
-    std::cout << "Number of matches for pair "
-              << left_image_index << ' ' << right_image_index << ": "
-              << left_ip.size() << std::endl;
+    bool valid = (X.z() > 0.0);
+    Eigen::Vector2d dist_pix;
+    if (valid) {
+      Eigen::Vector2d undist_pix = right_params.GetFocalVector().cwiseProduct(X.hnormalized());
+      right_params.Convert<camera::UNDISTORTED_C, camera::DISTORTED>(undist_pix, &dist_pix);
+      valid = (dist_pix.x() >= -margin && dist_pix.x() <= size.x() + margin &&
+               dist_pix.y() >= -margin && dist_pix.y() <= size.y() + margin);
+    }
 
-  *matches = std::make_pair(left_ip, right_ip);
-  match_mutex->unlock();
+    if (valid) {
+      // A sample with no valid neighbor before it starts a new piece
+      segments.push_back(prev_valid ? prev_pix : dist_pix);
+      segments.push_back(dist_pix);
+    }
+    prev_valid = valid;
+    prev_pix = dist_pix;
+  }
+}
+
+// Match each feature of the images paired with the given right image
+// only against the right features within band of its epipolar curve.
+// The matches are then filtered with the cameras. The outputs are as
+// for matchFeaturesAgainstImage().
+void matchFeaturesGuided(int right_index,
+                         std::vector<size_t> const& pair_ids,
+                         std::vector<std::pair<int, int>> const& image_pairs,
+                         std::vector<camera::CameraParameters> const& cam_params,
+                         std::vector<dense_map::cameraImage> const& cams,
+                         std::vector<Eigen::Affine3d> const& world_to_cam,
+                         double reprojection_error, double band,
+                         std::vector<cv::Mat> const& cid_to_descriptor_map,
+                         std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
+                         // output
+                         std::vector<MATCH_INDICES> * matches) {
+  Eigen::Matrix2Xd const& right_kp = cid_to_keypoint_map[right_index];  // alias
+  interest_point::KeypointGrid grid(right_kp, band);
+
+  std::vector<Eigen::Vector2d> segments;
+  std::vector<int> near;
+  for (size_t pair_it : pair_ids) {
+    int left_index = image_pairs[pair_it].first;
+    Eigen::Matrix2Xd const& left_kp = cid_to_keypoint_map[left_index];  // alias
+    camera::CameraParameters const& left_params = cam_params[cams[left_index].camera_type];
+    camera::CameraParameters const& right_params = cam_params[cams[right_index].camera_type];
+    Eigen::Affine3d left_to_right = world_to_cam[right_index] * world_to_cam[left_index].inverse();
+
+    std::vector<std::vector<int>> candidates(left_kp.cols());
+    for (int it = 0; it < left_kp.cols(); it++) {
+      epipolarSegments(left_params, right_params, left_to_right,
+                       Eigen::Vector2d(left_kp.col(it)), segments);
+      for (size_t seg = 0; seg + 1 < segments.size(); seg += 2) {
+        grid.FindNearSegment(segments[seg], segments[seg + 1], band, near);
+        candidates[it].insert(candidates[it].end(), near.begin(), near.end());
+      }
+
+      // Neighboring segments share their ends, so a feature can be found more than once
+      std::sort(candidates[it].begin(), candidates[it].end());
+      candidates[it].erase(std::unique(candidates[it].begin(), candidates[it].end()),
+                           candidates[it].end());
+    }
+
+    std::vector<cv::DMatch> cv_matches;
+    interest_point::FindCandidateMatches(cid_to_descriptor_map[left_index],
+                                         cid_to_descriptor_map[right_index],
+                                         candidates, &cv_matches);
+    filterMatchesWithCams(left_params, right_params,
+                          world_to_cam[left_index], world_to_cam[right_index],
+                          reprojection_error, left_kp, right_kp,
+                          cv_matches, &(*matches)[pair_it]);
+  }
+}
+
+// Form the interest points for given matches, as needed to save a match file
+void matchIndicesToIp(MATCH_INDICES const& match_indices,
+                      cv::Mat const& left_descriptors, cv::Mat const& right_descriptors,
+                      Eigen::Matrix2Xd const& left_keypoints,
+                      Eigen::Matrix2Xd const& right_keypoints,
+                      // Output
+                      MATCH_PAIR* matches) {
+  matches->first.resize(match_indices.size());
+  matches->second.resize(match_indices.size());
+  for (size_t j = 0; j < match_indices.size(); j++) {
+    int left_ip_index = match_indices[j].first;
+    int right_ip_index = match_indices[j].second;
+    matches->first[j].setFromCvKeypoint(left_keypoints.col(left_ip_index),
+                                        left_descriptors.row(left_ip_index));
+    matches->second[j].setFromCvKeypoint(right_keypoints.col(right_ip_index),
+                                         right_descriptors.row(right_ip_index));
+  }
 }
   
 void writeIpRecord(std::ofstream& f, InterestPoint const& p) {
@@ -450,11 +715,67 @@ std::string matchFileName(std::string const& match_dir,
   return match_file;
 }
 
+void selectImagePairs(// Inputs
+                      std::vector<Eigen::Affine3d> const& world_to_cam,
+                      int num_overlaps, int num_nearby, double max_view_angle,
+                      // Outputs
+                      std::vector<std::pair<int, int>> & image_pairs) {
+  image_pairs.clear();
+  int num_cams = world_to_cam.size();
+
+  std::set<std::pair<int, int>> pair_set;
+  for (int it1 = 0; it1 < num_cams; it1++) {
+    for (int it2 = it1 + 1; it2 < std::min(num_cams, it1 + num_overlaps + 1); it2++)
+      pair_set.insert(std::make_pair(it1, it2));
+  }
+  int num_window_pairs = pair_set.size();
+
+  if (num_nearby > 0 && num_cams > 1) {
+    // The camera centers and viewing directions in world coordinates
+    cv::Mat ctrs(num_cams, 3, CV_32F);
+    std::vector<Eigen::Vector3d> dirs(num_cams);
+    for (int cid = 0; cid < num_cams; cid++) {
+      Eigen::Affine3d cam_to_world = world_to_cam[cid].inverse();
+      for (int coord = 0; coord < 3; coord++)
+        ctrs.at<float>(cid, coord) = cam_to_world.translation()[coord];
+      dirs[cid] = (cam_to_world.linear() * Eigen::Vector3d(0, 0, 1)).normalized();
+    }
+    double min_cos = cos(max_view_angle * M_PI / 180.0);
+
+    // Look up more neighbors than needed, as the ones in the window
+    // or looking in a different direction are skipped. With unlimited
+    // checks the search is exact.
+    int num_nbrs = std::min(num_cams, 1 + 2 * num_overlaps + 4 * num_nearby);
+    cv::flann::Index kdtree(ctrs, cv::flann::KDTreeIndexParams(1));
+    cv::Mat nbrs, dists;
+    kdtree.knnSearch(ctrs, nbrs, dists, num_nbrs, cv::flann::SearchParams(-1));
+
+    for (int cid = 0; cid < num_cams; cid++) {
+      int count = 0;
+      for (int it = 0; it < num_nbrs && count < num_nearby; it++) {
+        int nbr = nbrs.at<int>(cid, it);
+        if (nbr < 0 || nbr == cid || std::abs(nbr - cid) <= num_overlaps)
+          continue;
+        if (dirs[cid].dot(dirs[nbr]) < min_cos)
+          continue;
+        pair_set.insert(std::make_pair(std::min(cid, nbr), std::max(cid, nbr)));
+        count++;
+      }
+    }
+  }
+
+  image_pairs.assign(pair_set.begin(), pair_set.end());
+  std::cout << "Selected " << image_pairs.size() << " image pairs to match, of which "
+            << image_pairs.size() - num_window_pairs << " are for nearby cameras."
+            << std::endl;
+}
+
 void detectMatchFeatures(// Inputs
                          std::vector<dense_map::cameraImage> const& cams,
                          std::vector<camera::CameraParameters> const& cam_params,
                          std::string const& out_dir, bool save_matches,
-                         std::vector<Eigen::Affine3d> const& world_to_cam, int num_overlaps,
+                         std::vector<Eigen::Affine3d> const& world_to_cam,
+                         std::vector<std::pair<int, int>> const& image_pairs,
                          int initial_max_reprojection_error, int num_match_threads,
                          bool verbose,
                          // Outputs
@@ -476,111 +797,166 @@ void detectMatchFeatures(// Inputs
 
   std::cout << "Detecting features." << std::endl;
 
+  // Features for images which did not change since the previous run
+  // are loaded from the cache rather than detected again
+  std::string cache_dir;
+  if (FLAGS_feature_cache && !out_dir.empty()) {
+    cache_dir = dense_map::featureCacheDir(out_dir);
+    dense_map::createDir(cache_dir);
+  }
+
   std::vector<cv::Mat> cid_to_descriptor_map;
   std::vector<Eigen::Matrix2Xd> cid_to_keypoint_map;
+  // Cached descriptors point into these, so they must be kept until matching is done
+  std::vector<std::shared_ptr<dense_map::MappedFile>> cid_to_mapped_file;
   cid_to_descriptor_map.resize(cams.size());
   cid_to_keypoint_map.resize(cams.size());
+  cid_to_mapped_file.resize(cams.size());
+
+  // The features of the reduced images, for coarse-to-fine matching
+  if (FLAGS_pyramid_matching_level < 0)
+    LOG(FATAL) << "The value of --pyramid_matching_level must be non-negative.\n";
+  if (FLAGS_pyramid_matching_level > 0 && FLAGS_pyramid_search_radius <= 0.0)
+    LOG(FATAL) << "The value of --pyramid_search_radius must be positive.\n";
+  if (FLAGS_pyramid_matching_level > 0 && FLAGS_matcher == "CUDA_BF")
+    LOG(FATAL) << "Option --pyramid_matching_level is not supported with --matcher CUDA_BF.\n";
+  if (FLAGS_guided_matching && FLAGS_epipolar_band <= 0.0)
+    LOG(FATAL) << "The value of --epipolar_band must be positive.\n";
+  if (FLAGS_guided_matching && FLAGS_matcher == "CUDA_BF")
+    LOG(FATAL) << "Option --guided_matching is not supported with --matcher CUDA_BF.\n";
+  if (FLAGS_guided_matching && FLAGS_pyramid_matching_level > 0)
+    LOG(FATAL) << "Options --guided_matching and --pyramid_matching_level cannot be "
+               << "used together.\n";
+  std::vector<cv::Mat> cid_to_coarse_descriptor_map;
+  std::vector<Eigen::Matrix2Xd> cid_to_coarse_keypoint_map;
+  std::vector<std::shared_ptr<dense_map::MappedFile>> cid_to_coarse_mapped_file;
+  if (FLAGS_pyramid_matching_level > 0) {
+    cid_to_coarse_descriptor_map.resize(cams.size());
+    cid_to_coarse_keypoint_map.resize(cams.size());
+    cid_to_coarse_mapped_file.resize(cams.size());
+  }
+
+  // Detect features only in the images which will be matched
+  std::vector<bool> is_matched(cams.size(), false);
+  for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++) {
+    is_matched[image_pairs[pair_it].first] = true;
+    is_matched[image_pairs[pair_it].second] = true;
+  }
+
   {
     // Make the thread pool go out of scope when not needed to not use up memory
+    dense_map::StageTimer detect_timer("detect_features");
     dense_map::ThreadPool thread_pool;
     for (size_t it = 0; it < cams.size(); it++) {
+      if (!is_matched[it])
+        continue;
       thread_pool.AddTask
-        (&dense_map::detectFeatures,    // multi-threaded  // NOLINT
-         // dense_map::detectFeatures(  // single-threaded // NOLINT
-         cams[it].image, verbose, &cid_to_descriptor_map[it], &cid_to_keypoint_map[it]);
+        (&dense_map::detectFeaturesWithCache,    // multi-threaded  // NOLINT
+         // dense_map::detectFeaturesWithCache(  // single-threaded // NOLINT
+         cams[it], cache_dir, verbose, 0,
+         &cid_to_descriptor_map[it], &cid_to_keypoint_map[it], &cid_to_mapped_file[it]);
+      if (FLAGS_pyramid_matching_level > 0)
+        thread_pool.AddTask
+          (&dense_map::detectFeaturesWithCache,
+           cams[it], cache_dir, verbose, FLAGS_pyramid_matching_level,
+           &cid_to_coarse_descriptor_map[it], &cid_to_coarse_keypoint_map[it],
+           &cid_to_coarse_mapped_file[it]);
     }
     thread_pool.Join();
   }
 
-  MATCH_MAP matches;
-
-  std::vector<std::pair<int, int> > image_pairs;
-  for (size_t it1 = 0; it1 < cams.size(); it1++) {
-    for (size_t it2 = it1 + 1; it2 < std::min(cams.size(), it1 + num_overlaps + 1); it2++) {
-      image_pairs.push_back(std::make_pair(it1, it2));
+  // The matches for image_pairs[pair_it] go to matches[pair_it]. Each
+  // slot is written by one task only, so no lock is needed.
+  if (FLAGS_matcher != "FLANN" && FLAGS_matcher != "CUDA_BF")
+    LOG(FATAL) << "Unknown value for --matcher: " << FLAGS_matcher << "\n";
+
+  dense_map::StageTimer match_timer("match_features");
+  std::vector<dense_map::MATCH_INDICES> matches(image_pairs.size());
+  if (FLAGS_matcher == "CUDA_BF") {
+    std::cout << "Matching features on the GPU." << std::endl;
+    // Match batches of pairs on the GPU, then filter the matches of
+    // each batch with multiple threads. The batches keep bounded the
+    // memory used by the unfiltered matches.
+    size_t batch_size = 1024;
+    dense_map::ThreadPool thread_pool;
+    for (size_t beg = 0; beg < image_pairs.size(); beg += batch_size) {
+      size_t end = std::min(beg + batch_size, image_pairs.size());
+      std::vector<std::pair<int, int>> batch_pairs(image_pairs.begin() + beg,
+                                                   image_pairs.begin() + end);
+      std::vector<std::vector<cv::DMatch>> batch_matches;
+      interest_point::FindMatchesCuda(cid_to_descriptor_map, batch_pairs, &batch_matches);
+
+      for (size_t pair_it = beg; pair_it < end; pair_it++) {
+        int left_image_it = image_pairs[pair_it].first;
+        int right_image_it = image_pairs[pair_it].second;
+        thread_pool.AddTask
+          (&dense_map::filterMatchesWithCams,
+           std::cref(cam_params[cams[left_image_it].camera_type]),
+           std::cref(cam_params[cams[right_image_it].camera_type]),
+           std::cref(world_to_cam[left_image_it]), std::cref(world_to_cam[right_image_it]),
+           initial_max_reprojection_error,
+           std::cref(cid_to_keypoint_map[left_image_it]),
+           std::cref(cid_to_keypoint_map[right_image_it]),
+           std::cref(batch_matches[pair_it - beg]),
+           &matches[pair_it]);
+      }
+      thread_pool.Join();  // batch_matches must persist until then
     }
-  }
-
-  {
+  } else {
     std::cout << "Matching features." << std::endl;
+    // Build the FLANN index for the features of each image only
+    // once, and match against it all images paired with it
+    std::vector<std::vector<size_t>> right_to_pair_ids(cams.size());
+    for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++)
+      right_to_pair_ids[image_pairs[pair_it].second].push_back(pair_it);
+
     dense_map::ThreadPool thread_pool;
-    std::mutex match_mutex;
-    for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++) {
-      auto pair = image_pairs[pair_it];
-      int left_image_it = pair.first, right_image_it = pair.second;
+    for (size_t right_index = 0; right_index < cams.size(); right_index++) {
+      if (right_to_pair_ids[right_index].empty())
+        continue;
+      if (FLAGS_pyramid_matching_level > 0) {
+        thread_pool.AddTask
+          (&dense_map::matchFeaturesCoarseToFine,
+           right_index, std::cref(right_to_pair_ids[right_index]), std::cref(image_pairs),
+           std::cref(cam_params), std::cref(cams), std::cref(world_to_cam),
+           initial_max_reprojection_error, FLAGS_pyramid_search_radius,
+           std::cref(cid_to_coarse_descriptor_map), std::cref(cid_to_coarse_keypoint_map),
+           std::cref(cid_to_descriptor_map), std::cref(cid_to_keypoint_map),
+           &matches);
+        continue;
+      }
+      if (FLAGS_guided_matching) {
+        thread_pool.AddTask
+          (&dense_map::matchFeaturesGuided,
+           right_index, std::cref(right_to_pair_ids[right_index]), std::cref(image_pairs),
+           std::cref(cam_params), std::cref(cams), std::cref(world_to_cam),
+           initial_max_reprojection_error, FLAGS_epipolar_band,
+           std::cref(cid_to_descriptor_map), std::cref(cid_to_keypoint_map),
+           &matches);
+        continue;
+      }
       thread_pool.AddTask
-        (&dense_map::matchFeaturesWithCams,   // multi-threaded  // NOLINT
-         // dense_map::matchFeaturesWithCams( // single-threaded // NOLINT
-         &match_mutex, left_image_it, right_image_it, cam_params[cams[left_image_it].camera_type],
-         cam_params[cams[right_image_it].camera_type], world_to_cam[left_image_it],
-         world_to_cam[right_image_it], initial_max_reprojection_error,
-         cid_to_descriptor_map[left_image_it], cid_to_descriptor_map[right_image_it],
-         cid_to_keypoint_map[left_image_it], cid_to_keypoint_map[right_image_it], verbose,
-         &matches[pair]);
+        (&dense_map::matchFeaturesAgainstImage,   // multi-threaded  // NOLINT
+         // dense_map::matchFeaturesAgainstImage( // single-threaded // NOLINT
+         right_index, std::cref(right_to_pair_ids[right_index]), std::cref(image_pairs),
+         std::cref(cam_params), std::cref(cams), std::cref(world_to_cam),
+         initial_max_reprojection_error,
+         std::cref(cid_to_descriptor_map), std::cref(cid_to_keypoint_map),
+         &matches);
     }
     thread_pool.Join();
   }
-  cid_to_descriptor_map = std::vector<cv::Mat>();  // Wipe, takes memory
-
-  // Give all interest points in a given image a unique id, and put
-  // them in a vector with the id corresponding to the interest point
-  std::vector<std::map<std::pair<float, float>, int>> keypoint_map(cams.size());
-  for (auto it = matches.begin(); it != matches.end(); it++) {
-    std::pair<int, int> const& index_pair = it->first;     // alias
-
-    int left_index = index_pair.first;
-    int right_index = index_pair.second;
-
-    dense_map::MATCH_PAIR const& match_pair = it->second;  // alias
-    std::vector<dense_map::InterestPoint> const& left_ip_vec = match_pair.first;
-    std::vector<dense_map::InterestPoint> const& right_ip_vec = match_pair.second;
-    for (size_t ip_it = 0; ip_it < left_ip_vec.size(); ip_it++) {
-      auto dist_left_ip  = std::make_pair(left_ip_vec[ip_it].x,  left_ip_vec[ip_it].y);
-      auto dist_right_ip = std::make_pair(right_ip_vec[ip_it].x, right_ip_vec[ip_it].y);
-      // Initialize to zero for the moment
-      keypoint_map[left_index][dist_left_ip] = 0;
-      keypoint_map[right_index][dist_right_ip] = 0;
-    }
-  }
-  keypoint_vec.resize(cams.size());
-  for (size_t cid = 0; cid < cams.size(); cid++) {
-    keypoint_vec[cid].resize(keypoint_map[cid].size());
-    int fid = 0;
-    for (auto ip_it = keypoint_map[cid].begin(); ip_it != keypoint_map[cid].end();
-         ip_it++) {
-      auto& dist_ip = ip_it->first;  // alias
-      keypoint_map[cid][dist_ip] = fid;
-      keypoint_vec[cid][fid] = dist_ip;
-      fid++;
-    }
-  }
-
-  // If feature A in image I matches feather B in image J, which
-  // matches feature C in image K, then (A, B, C) belong together in
-  // a track, and will have a single triangulated xyz. Build such a track.
 
-  openMVG::matching::PairWiseMatches match_map;
-  for (auto it = matches.begin(); it != matches.end(); it++) {
-    std::pair<int, int> const& index_pair = it->first;     // alias
-
-    int left_index = index_pair.first;
-    int right_index = index_pair.second;
-
-    dense_map::MATCH_PAIR const& match_pair = it->second;  // alias
-    std::vector<dense_map::InterestPoint> const& left_ip_vec = match_pair.first;
-    std::vector<dense_map::InterestPoint> const& right_ip_vec = match_pair.second;
-
-    std::vector<openMVG::matching::IndMatch> mvg_matches;
+  match_timer.stop();
 
-    for (size_t ip_it = 0; ip_it < left_ip_vec.size(); ip_it++) {
-      auto dist_left_ip  = std::make_pair(left_ip_vec[ip_it].x,  left_ip_vec[ip_it].y);
-      auto dist_right_ip = std::make_pair(right_ip_vec[ip_it].x, right_ip_vec[ip_it].y);
-
-      int left_id = keypoint_map[left_index][dist_left_ip];
-      int right_id = keypoint_map[right_index][dist_right_ip];
-      mvg_matches.push_back(openMVG::matching::IndMatch(left_id, right_id));
-    }
-    match_map[index_pair] = mvg_matches;
+  // Print the number of matches only after all are found, so the
+  // workers need not synchronize to write to the screen.
+  if (verbose) {
+    for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++)
+      std::cout << "Number of matches for pair "
+                << image_pairs[pair_it].first << ' ' << image_pairs[pair_it].second << ": "
+                << matches[pair_it].size() << "\n";
+    std::cout << std::flush;
   }
 
   if (save_matches) {
@@ -590,12 +966,15 @@ void detectMatchFeatures(// Inputs
     std::string match_dir = out_dir + "/matches";
     dense_map::createDir(match_dir);
 
-    for (auto it = matches.begin(); it != matches.end(); it++) {
-      std::pair<int, int> index_pair = it->first;
-      dense_map::MATCH_PAIR const& match_pair = it->second;
+    for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++) {
+      int left_index = image_pairs[pair_it].first;
+      int right_index = image_pairs[pair_it].second;
 
-      int left_index = index_pair.first;
-      int right_index = index_pair.second;
+      dense_map::MATCH_PAIR match_pair;
+      matchIndicesToIp(matches[pair_it],
+                       cid_to_descriptor_map[left_index], cid_to_descriptor_map[right_index],
+                       cid_to_keypoint_map[left_index], cid_to_keypoint_map[right_index],
+                       &match_pair);
 
       std::string const& left_image = cams[left_index].image_name; // alias
       std::string const& right_image = cams[right_index].image_name; // alias
@@ -609,9 +988,81 @@ void detectMatchFeatures(// Inputs
     }
   }
 
+  cid_to_descriptor_map = std::vector<cv::Mat>();  // Wipe, takes memory
+  cid_to_mapped_file = std::vector<std::shared_ptr<dense_map::MappedFile>>();
+  cid_to_coarse_descriptor_map = std::vector<cv::Mat>();
+  cid_to_coarse_keypoint_map = std::vector<Eigen::Matrix2Xd>();
+  cid_to_coarse_mapped_file = std::vector<std::shared_ptr<dense_map::MappedFile>>();
+
+  // Give the matched interest points in each image consecutive ids.
+  // Sort their indices by pixel location and make them unique, so
+  // features detected more than once at the same location become one
+  // feature. This uses flat arrays only, with no lookup by location,
+  // and orders the features in an image by location.
+  keypoint_vec.resize(cams.size());
+  std::vector<std::vector<int>> cid_det_to_fid(cams.size());
+  {
+    std::vector<std::vector<int>> cid_to_det_ids(cams.size());
+    for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++) {
+      int left_index = image_pairs[pair_it].first;
+      int right_index = image_pairs[pair_it].second;
+      for (size_t ip_it = 0; ip_it < matches[pair_it].size(); ip_it++) {
+        cid_to_det_ids[left_index].push_back(matches[pair_it][ip_it].first);
+        cid_to_det_ids[right_index].push_back(matches[pair_it][ip_it].second);
+      }
+    }
+
+    for (size_t cid = 0; cid < cams.size(); cid++) {
+      Eigen::Matrix2Xd const& keypoints = cid_to_keypoint_map[cid];  // alias
+      std::vector<int> & det_ids = cid_to_det_ids[cid];               // alias
+      auto dist_ip = [&keypoints](int det_id) {
+        return std::make_pair(static_cast<float>(keypoints(0, det_id)),
+                              static_cast<float>(keypoints(1, det_id)));
+      };
+
+      std::sort(det_ids.begin(), det_ids.end());
+      det_ids.erase(std::unique(det_ids.begin(), det_ids.end()), det_ids.end());
+      std::stable_sort(det_ids.begin(), det_ids.end(), [&dist_ip](int a, int b) {
+          return dist_ip(a) < dist_ip(b);
+        });
+
+      keypoint_vec[cid].clear();
+      cid_det_to_fid[cid].assign(keypoints.cols(), -1);
+      for (size_t it = 0; it < det_ids.size(); it++) {
+        auto ip = dist_ip(det_ids[it]);
+        if (keypoint_vec[cid].empty() || keypoint_vec[cid].back() != ip)
+          keypoint_vec[cid].push_back(ip);
+        cid_det_to_fid[cid][det_ids[it]] = keypoint_vec[cid].size() - 1;
+      }
+    }
+  }
+
+  dense_map::StageTimer tracks_timer("build_tracks");
+
+  // If feature A in image I matches feather B in image J, which
+  // matches feature C in image K, then (A, B, C) belong together in
+  // a track, and will have a single triangulated xyz. Build such a track.
+
+  openMVG::matching::PairWiseMatches match_map;
+  for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++) {
+    std::pair<int, int> const& index_pair = image_pairs[pair_it];  // alias
+
+    int left_index = index_pair.first;
+    int right_index = index_pair.second;
+
+    std::vector<openMVG::matching::IndMatch> mvg_matches;
+    mvg_matches.reserve(matches[pair_it].size());
+    for (size_t ip_it = 0; ip_it < matches[pair_it].size(); ip_it++) {
+      int left_id = cid_det_to_fid[left_index][matches[pair_it][ip_it].first];
+      int right_id = cid_det_to_fid[right_index][matches[pair_it][ip_it].second];
+      mvg_matches.push_back(openMVG::matching::IndMatch(left_id, right_id));
+    }
+    match_map[index_pair].swap(mvg_matches);
+  }
+
   // De-allocate data not needed anymore and take up a lot of RAM
-  matches.clear(); matches = MATCH_MAP();
-  keypoint_map.clear(); keypoint_map.shrink_to_fit();
+  matches.clear(); matches = std::vector<dense_map::MATCH_INDICES>();
+  cid_det_to_fid.clear(); cid_det_to_fid.shrink_to_fit();
   cid_to_keypoint_map.clear(); cid_to_keypoint_map.shrink_to_fit();
 
   {
@@ -650,49 +1101,58 @@ void multiViewTriangulation(// Inputs
                             std::vector<camera::CameraParameters>   const& cam_params,
                             std::vector<dense_map::cameraImage>     const& cams,
                             std::vector<Eigen::Affine3d>            const& world_to_cam,
-                            std::vector<std::map<int, int>>         const& pid_to_cid_fid,
                             std::vector<std::vector<std::pair<float, float>>>
                             const& keypoint_vec,
-                            // Outputs
-                            std::vector<std::map<int, std::map<int, int>>>& pid_cid_fid_inlier,
+                            int num_threads,
+                            // Outputs (the inlier flags get updated)
+                            dense_map::TrackStore& tracks,
                             std::vector<Eigen::Vector3d>& xyz_vec) {
   
   xyz_vec.clear();
-  xyz_vec.resize(pid_to_cid_fid.size());
+  xyz_vec.resize(tracks.size());
+
+  // Undistort the keypoints of each image in bulk, so that the
+  // distortion model is looked up once per image rather than once
+  // per feature.
+  int num_cams = cams.size();
+  std::vector<std::vector<Eigen::Vector2d>> undist_keypoints(num_cams);
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+  for (int cid = 0; cid < num_cams; cid++) {
+    std::vector<Eigen::Vector2d> dist_keypoints(keypoint_vec[cid].size());
+    for (size_t fid = 0; fid < keypoint_vec[cid].size(); fid++)
+      dist_keypoints[fid] = Eigen::Vector2d(keypoint_vec[cid][fid].first,
+                                            keypoint_vec[cid][fid].second);
+    cam_params[cams[cid].camera_type].UndistortPixels(dist_keypoints,
+                                                      &undist_keypoints[cid]);
+  }
 
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
+  // Each track is triangulated independently and only its own
+  // features and point are modified, so this can run in parallel.
+  int num_tracks = tracks.size();
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1024)
+  for (int pid = 0; pid < num_tracks; pid++) {
     std::vector<double> focal_length_vec;
     std::vector<Eigen::Affine3d> world_to_cam_aff_vec;
     std::vector<Eigen::Vector2d> pix_vec;
 
-    for (auto cid_fid = pid_to_cid_fid[pid].begin(); cid_fid != pid_to_cid_fid[pid].end();
-         cid_fid++) {
-      int cid = cid_fid->first;
-      int fid = cid_fid->second;
+    for (auto const& obs : tracks[pid]) {
+      int cid = obs.cid;
+      int fid = obs.fid;
 
       // Triangulate inliers only
-      if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid))
+      if (!obs.inlier)
         continue;
 
-      Eigen::Vector2d dist_ip(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
-      Eigen::Vector2d undist_ip;
-      cam_params[cams[cid].camera_type].Convert<camera::DISTORTED, camera::UNDISTORTED_C>
-        (dist_ip, &undist_ip);
-
       focal_length_vec.push_back(cam_params[cams[cid].camera_type].GetFocalLength());
       world_to_cam_aff_vec.push_back(world_to_cam[cid]);
-      pix_vec.push_back(undist_ip);
+      pix_vec.push_back(undist_keypoints[cid][fid]);
     }
 
     if (pix_vec.size() < 2) {
       // If after outlier filtering less than two rays are left, can't triangulate.
       // Must set all features for this pid to outliers.
-      for (auto cid_fid = pid_to_cid_fid[pid].begin(); cid_fid != pid_to_cid_fid[pid].end();
-           cid_fid++) {
-        int cid = cid_fid->first;
-        int fid = cid_fid->second;
-        dense_map::setMapValue(pid_cid_fid_inlier, pid, cid, fid, 0);
-      }
+      for (auto& obs : tracks[pid])
+        obs.inlier = 0;
 
       // Nothing else to do
       continue;
@@ -708,12 +1168,8 @@ void multiViewTriangulation(// Inputs
     }
     if (bad_xyz) {
       // if triangulation failed, must set all features for this pid to outliers.
-      for (auto cid_fid = pid_to_cid_fid[pid].begin(); cid_fid != pid_to_cid_fid[pid].end();
-           cid_fid++) {
-        int cid = cid_fid->first;
-        int fid = cid_fid->second;
-        dense_map::setMapValue(pid_cid_fid_inlier, pid, cid, fid, 0);
-      }
+      for (auto& obs : tracks[pid])
+        obs.inlier = 0;
     }
     
   } // end iterating over triangulated points
@@ -721,40 +1177,38 @@ void multiViewTriangulation(// Inputs
   return;
 }
   
-// Given all the merged and filtered tracks in pid_cid_fid, for each
-// image pair cid1 and cid2 with cid1 < cid2 < cid1 + num_overlaps + 1,
-// save the matches of this pair which occur in the set of tracks.
+// Given all the merged and filtered tracks, for each of the given
+// image pairs, save the matches of this pair which occur in the set
+// of tracks. If no pairs are given, save the matches for all pairs.
 void saveInlinerMatchPairs(// Inputs
                            std::vector<dense_map::cameraImage> const& cams,
-                           int num_overlaps,
-                           std::vector<std::map<int, int>> const& pid_to_cid_fid,
+                           std::vector<std::pair<int, int>> const& image_pairs,
+                           dense_map::TrackStore const& tracks,
                            std::vector<std::vector<std::pair<float, float>>>
                            const& keypoint_vec,
-                           std::vector<std::map<int, std::map<int, int>>>
-                           const& pid_cid_fid_inlier,
                            std::string const& out_dir) {
   MATCH_MAP matches;
+  std::set<std::pair<int, int>> pair_set(image_pairs.begin(), image_pairs.end());
 
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-    for (auto cid_fid1 = pid_to_cid_fid[pid].begin();
-         cid_fid1 != pid_to_cid_fid[pid].end(); cid_fid1++) {
-      int cid1 = cid_fid1->first;
-      int fid1 = cid_fid1->second;
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
+    for (auto const& obs1 : tracks[pid]) {
+      int cid1 = obs1.cid;
+      int fid1 = obs1.fid;
 
-      for (auto cid_fid2 = pid_to_cid_fid[pid].begin();
-           cid_fid2 != pid_to_cid_fid[pid].end(); cid_fid2++) {
-        int cid2 = cid_fid2->first;
-        int fid2 = cid_fid2->second;
+      for (auto const& obs2 : tracks[pid]) {
+        int cid2 = obs2.cid;
+        int fid2 = obs2.fid;
 
-        // When num_overlaps == 0, we save only matches read from nvm rather
+        // When no pairs were matched, we save only matches read from nvm rather
         // ones made wen this tool was run.
-        bool is_good = (cid1 < cid2 && (num_overlaps == 0 || cid2 < cid1 + num_overlaps + 1));
+        bool is_good = (cid1 < cid2 &&
+                        (pair_set.empty() || pair_set.find(std::make_pair(cid1, cid2))
+                         != pair_set.end()));
         if (!is_good)
           continue;
 
         // Consider inliers only
-        if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid1, fid1) ||
-            !dense_map::getMapValue(pid_cid_fid_inlier, pid, cid2, fid2))
+        if (!obs1.inlier || !obs2.inlier)
           continue;
 
         auto index_pair = std::make_pair(cid1, cid2);
@@ -1244,7 +1698,94 @@ Eigen::Affine3d registrationTransform(std::string const& hugin_file, std::string
   return registration_trans;
 }
   
-// Reads the NVM control network format.
+namespace {
+
+// Parsing of nvm files, which are read in memory whole. The buffer
+// ends with a null character, so strtod() and strtoll() stop there.
+// A value is parsed only if it ends before 'end', so that a value
+// missing from a line is not taken from the next one.
+bool nvmParseInt(const char* & ptr, const char* end, ptrdiff_t & val) {
+  char* next = NULL;
+  long long v = strtoll(ptr, &next, 10);
+  if (next == ptr || next > end) return false;
+  val = v;
+  ptr = next;
+  return true;
+}
+
+bool nvmParseDouble(const char* & ptr, const char* end, double & val) {
+  char* next = NULL;
+  double v = strtod(ptr, &next);
+  if (next == ptr || next > end) return false;
+  val = v;
+  ptr = next;
+  return true;
+}
+
+bool nvmParseToken(const char* & ptr, const char* end, std::string & token) {
+  while (ptr < end && isspace(static_cast<unsigned char>(*ptr))) ptr++;
+  const char* beg = ptr;
+  while (ptr < end && !isspace(static_cast<unsigned char>(*ptr))) ptr++;
+  token.assign(beg, ptr);
+  return ptr > beg;
+}
+
+// A feature of a track, before it is put in the keypoint map
+struct NvmFeature {
+  int cid, fid;
+  Eigen::Vector2d pt;
+};
+
+// Parse the points in the given lines of an nvm file, one point per
+// line. Return the index of the first point which could not be
+// parsed, or -1 on success.
+ptrdiff_t parseNvmPoints(const char* buf, std::vector<size_t> const& line_beg,
+                         std::vector<size_t> const& line_end, ptrdiff_t start, ptrdiff_t stop,
+                         ptrdiff_t number_of_cid,
+                         // Outputs
+                         std::vector<std::map<int, int>> * pid_to_cid_fid,
+                         std::vector<Eigen::Vector3d> * pid_to_xyz,
+                         std::vector<NvmFeature> * features) {
+  for (ptrdiff_t pid = start; pid < stop; pid++) {
+    const char* ptr = buf + line_beg[pid];
+    const char* end = buf + line_end[pid];
+    Eigen::Vector3d xyz;
+    ptrdiff_t color, number_of_measures;
+    if (!nvmParseDouble(ptr, end, xyz[0]) || !nvmParseDouble(ptr, end, xyz[1]) ||
+        !nvmParseDouble(ptr, end, xyz[2]) || !nvmParseInt(ptr, end, color) ||
+        !nvmParseInt(ptr, end, color) || !nvmParseInt(ptr, end, color) ||
+        !nvmParseInt(ptr, end, number_of_measures) || number_of_measures < 0)
+      return pid;
+
+    std::map<int, int> & cid_fid = pid_to_cid_fid->at(pid);
+    cid_fid.clear();
+    pid_to_xyz->at(pid) = xyz;
+    for (ptrdiff_t m = 0; m < number_of_measures; m++) {
+      ptrdiff_t cid, fid;
+      Eigen::Vector2d pt;
+      if (!nvmParseInt(ptr, end, cid) || !nvmParseInt(ptr, end, fid) ||
+          !nvmParseDouble(ptr, end, pt[0]) || !nvmParseDouble(ptr, end, pt[1]) ||
+          cid < 0 || cid >= number_of_cid || fid < 0 || fid > std::numeric_limits<int>::max())
+        return pid;
+
+      cid_fid[cid] = fid;
+      NvmFeature feature;
+      feature.cid = cid;
+      feature.fid = fid;
+      feature.pt = pt;
+      features->push_back(feature);
+    }
+  }
+
+  return -1;
+}
+
+}  // end anonymous namespace
+
+// Reads the NVM control network format. If there is an up-to-date
+// binary sidecar for the file, that is read instead. Otherwise the
+// points are parsed in parallel, and the sidecar is saved, if
+// --nvm_sidecar is set.
 void ReadNVM(std::string const& input_filename,
              std::vector<Eigen::Matrix2Xd> * cid_to_keypoint_map,
              std::vector<std::string> * cid_to_filename,
@@ -1252,19 +1793,37 @@ void ReadNVM(std::string const& input_filename,
              std::vector<Eigen::Vector3d> * pid_to_xyz,
              std::vector<Eigen::Affine3d> *
              cid_to_cam_t_global) {
-  std::ifstream f(input_filename, std::ios::in);
-  std::string token;
-  std::getline(f, token);
-  
+  if (FLAGS_nvm_sidecar &&
+      dense_map::readNvmSidecar(input_filename, cid_to_keypoint_map, cid_to_filename,
+                                pid_to_cid_fid, pid_to_xyz, cid_to_cam_t_global)) {
+    std::cout << "Reading: " << dense_map::nvmSidecarFile(input_filename) << std::endl;
+    return;
+  }
+
+  std::cout << "Reading: " << input_filename << std::endl;
+  std::ifstream f(input_filename, std::ios::in | std::ios::binary);
+  if (!f.is_open())
+    LOG(FATAL) << "Cannot open file: " << input_filename << "\n";
+  f.seekg(0, std::ios::end);
+  size_t file_size = f.tellg();
+  f.seekg(0, std::ios::beg);
+  std::vector<char> buffer(file_size + 1, '\0');
+  if (file_size > 0 && !f.read(&buffer[0], file_size))
+    LOG(FATAL) << "Cannot read file: " << input_filename << "\n";
+  f.close();
+  const char* buf = &buffer[0];
+  const char* buf_end = buf + file_size;
+
   // Assert that we start with our NVM token
-  if (token.compare(0, 6, "NVM_V3") != 0) {
+  if (file_size < 6 || strncmp(buf, "NVM_V3", 6) != 0) {
     LOG(FATAL) << "File doesn't start with NVM token";
   }
+  const char* ptr = static_cast<const char*>(memchr(buf, '\n', file_size));
+  if (ptr == NULL) ptr = buf_end;
 
   // Read the number of cameras
-  ptrdiff_t number_of_cid;
-  f >> number_of_cid;
-  if (number_of_cid < 1) {
+  ptrdiff_t number_of_cid = 0;
+  if (!nvmParseInt(ptr, buf_end, number_of_cid) || number_of_cid < 1) {
     LOG(FATAL) << "NVM file is missing cameras";
   }
 
@@ -1273,17 +1832,18 @@ void ReadNVM(std::string const& input_filename,
   cid_to_filename->resize(number_of_cid);
   cid_to_cam_t_global->resize(number_of_cid);
   for (ptrdiff_t cid = 0; cid < number_of_cid; cid++) {
-    // Clear keypoints from map. We'll read these in shortly
-    cid_to_keypoint_map->at(cid).resize(Eigen::NoChange_t(), 2);
-
     // Read the line that contains camera information
     double focal, dist1, dist2;
     Eigen::Quaterniond q;
     Eigen::Vector3d c;
-    f >> token >> focal;
-    f >> q.w() >> q.x() >> q.y() >> q.z();
-    f >> c[0] >> c[1] >> c[2] >> dist1 >> dist2;
-    cid_to_filename->at(cid) = token;
+    if (!nvmParseToken(ptr, buf_end, cid_to_filename->at(cid)) ||
+        !nvmParseDouble(ptr, buf_end, focal) ||
+        !nvmParseDouble(ptr, buf_end, q.w()) || !nvmParseDouble(ptr, buf_end, q.x()) ||
+        !nvmParseDouble(ptr, buf_end, q.y()) || !nvmParseDouble(ptr, buf_end, q.z()) ||
+        !nvmParseDouble(ptr, buf_end, c[0]) || !nvmParseDouble(ptr, buf_end, c[1]) ||
+        !nvmParseDouble(ptr, buf_end, c[2]) || !nvmParseDouble(ptr, buf_end, dist1) ||
+        !nvmParseDouble(ptr, buf_end, dist2))
+      LOG(FATAL) << "Unable to correctly read CID: " << cid;
 
     // Solve for t, which is part of the affine transform
     Eigen::Matrix3d r = q.matrix();
@@ -1292,40 +1852,70 @@ void ReadNVM(std::string const& input_filename,
   }
 
   // Read the number of points
-  ptrdiff_t number_of_pid;
-  f >> number_of_pid;
-  if (number_of_pid < 1) {
+  ptrdiff_t number_of_pid = 0;
+  if (!nvmParseInt(ptr, buf_end, number_of_pid) || number_of_pid < 1) {
     LOG(FATAL) << "The NVM file has no triangulated points.";
   }
 
-  // Read the point
+  // Each point is on its own line. Find the lines, skipping empty ones.
+  std::vector<size_t> line_beg, line_end;
+  line_beg.reserve(number_of_pid);
+  line_end.reserve(number_of_pid);
+  while (static_cast<ptrdiff_t>(line_beg.size()) < number_of_pid && ptr < buf_end) {
+    const char* eol = static_cast<const char*>(memchr(ptr, '\n', buf_end - ptr));
+    if (eol == NULL) eol = buf_end;
+    const char* p = ptr;
+    while (p < eol && isspace(static_cast<unsigned char>(*p))) p++;
+    if (p < eol) {
+      line_beg.push_back(p - buf);
+      line_end.push_back(eol - buf);
+    }
+    ptr = eol + 1;
+  }
+  if (static_cast<ptrdiff_t>(line_beg.size()) < number_of_pid)
+    LOG(FATAL) << "Unable to correctly read PID: " << line_beg.size();
+
+  // Parse the points in blocks, in parallel. The features are put in
+  // the keypoint map afterwards, in the order of the points, as a
+  // feature can show up in more than one point.
   pid_to_cid_fid->resize(number_of_pid);
   pid_to_xyz->resize(number_of_pid);
-  Eigen::Vector3d xyz;
-  Eigen::Vector3i color;
-  Eigen::Vector2d pt;
-  ptrdiff_t cid, fid;
-  for (ptrdiff_t pid = 0; pid < number_of_pid; pid++) {
-    pid_to_cid_fid->at(pid).clear();
-
-    ptrdiff_t number_of_measures;
-    f >> xyz[0] >> xyz[1] >> xyz[2] >>
-      color[0] >> color[1] >> color[2] >> number_of_measures;
-    pid_to_xyz->at(pid) = xyz;
-    for (ptrdiff_t m = 0; m < number_of_measures; m++) {
-      f >> cid >> fid >> pt[0] >> pt[1];
-
-      pid_to_cid_fid->at(pid)[cid] = fid;
-
-      if (cid_to_keypoint_map->at(cid).cols() <= fid) {
-        cid_to_keypoint_map->at(cid).conservativeResize(Eigen::NoChange_t(), fid + 1);
-      }
-      cid_to_keypoint_map->at(cid).col(fid) = pt;
+  ptrdiff_t block = 16384;
+  ptrdiff_t num_blocks = (number_of_pid + block - 1) / block;
+  std::vector<std::vector<NvmFeature>> block_features(num_blocks);
+  std::vector<ptrdiff_t> block_bad_pid(num_blocks, -1);
+  {
+    dense_map::ThreadPool thread_pool;
+    for (ptrdiff_t b = 0; b < num_blocks; b++) {
+      ptrdiff_t start = b * block, stop = std::min(start + block, number_of_pid);
+      thread_pool.AddTask([&, b, start, stop]() {
+          block_bad_pid[b] = parseNvmPoints(buf, line_beg, line_end, start, stop, number_of_cid,
+                                            pid_to_cid_fid, pid_to_xyz, &block_features[b]);
+        });
     }
+    thread_pool.Join();
+  }
+  for (ptrdiff_t b = 0; b < num_blocks; b++) {
+    if (block_bad_pid[b] >= 0)
+      LOG(FATAL) << "Unable to correctly read PID: " << block_bad_pid[b];
+  }
 
-    if (!f.good())
-      LOG(FATAL) << "Unable to correctly read PID: " << pid;
+  std::vector<int> num_fid(number_of_cid, 0);
+  for (ptrdiff_t b = 0; b < num_blocks; b++) {
+    for (NvmFeature const& feature : block_features[b])
+      num_fid[feature.cid] = std::max(num_fid[feature.cid], feature.fid + 1);
   }
+  for (ptrdiff_t cid = 0; cid < number_of_cid; cid++)
+    cid_to_keypoint_map->at(cid) = Eigen::Matrix2Xd::Zero(2, num_fid[cid]);
+  for (ptrdiff_t b = 0; b < num_blocks; b++) {
+    for (NvmFeature const& feature : block_features[b])
+      cid_to_keypoint_map->at(feature.cid).col(feature.fid) = feature.pt;
+    block_features[b] = std::vector<NvmFeature>();  // not needed anymore
+  }
+
+  if (FLAGS_nvm_sidecar)
+    dense_map::writeNvmSidecar(input_filename, *cid_to_keypoint_map, *cid_to_filename,
+                               *pid_to_cid_fid, *pid_to_xyz, *cid_to_cam_t_global);
 }
 
 // Write the inliers in nvm format. The keypoints are shifted relative to the optical
@@ -1335,8 +1925,7 @@ void writeNvm(std::string                                       const& nvm_file,
               std::vector<dense_map::cameraImage>               const& cams,
               std::vector<Eigen::Affine3d>                      const& world_to_cam,
               std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
-              std::vector<std::map<int, int>>                   const& pid_to_cid_fid,
-              std::vector<std::map<int, std::map<int, int>>>    const& pid_cid_fid_inlier,
+              dense_map::TrackStore                             const& tracks,
               std::vector<Eigen::Vector3d>                      const& xyz_vec) {
 
   // Sanity checks
@@ -1344,9 +1933,7 @@ void writeNvm(std::string                                       const& nvm_file,
     LOG(FATAL) << "Expecting as many world-to-camera transforms as cameras.\n";
   if (world_to_cam.size() != keypoint_vec.size()) 
     LOG(FATAL) << "Expecting as many sets of keypoints as cameras.\n";  
-  if (pid_to_cid_fid.size() != pid_cid_fid_inlier.size())
-    LOG(FATAL) << "Expecting as many inlier flags as there are tracks.\n";
-  if (pid_to_cid_fid.size() != xyz_vec.size()) 
+  if (tracks.size() != xyz_vec.size()) 
     LOG(FATAL) << "Expecting as many tracks as there are triangulated points.\n";
 
   // Initialize the keypoints in expected format. Copy the filenames
@@ -1367,16 +1954,15 @@ void writeNvm(std::string                                       const& nvm_file,
   // Keep track how many fid we end up having for each cid
   std::vector<int> fid_count(keypoint_vec.size(), 0);
   
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
 
     std::map<int, int> nvm_cid_fid;
-    for (auto cid_fid = pid_to_cid_fid[pid].begin();
-         cid_fid != pid_to_cid_fid[pid].end(); cid_fid++) {
-      int cid = cid_fid->first;
-      int fid = cid_fid->second;
+    for (auto const& obs : tracks[pid]) {
+      int cid = obs.cid;
+      int fid = obs.fid;
 
       // Keep inliers only
-      if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid))
+      if (!obs.inlier)
         continue;
 
       Eigen::Vector2d dist_ip(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
@@ -1431,7 +2017,9 @@ void WriteNVM(std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
   CHECK(cid_to_filename.size() == cid_to_cam_t_global.size())
     << "Unequal number of filename and camera transforms";
 
-  // Write camera information
+  // Write camera information. Keep the poses as they will be when
+  // read back from the text, for the sidecar.
+  std::vector<Eigen::Affine3d> written_cam_t_global(cid_to_filename.size());
   f << cid_to_filename.size() << std::endl;
   for (size_t cid = 0; cid < cid_to_filename.size(); cid++) {
 
@@ -1447,31 +2035,62 @@ void WriteNVM(std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
       << " " << q.w() << " " << q.x() << " " << q.y() << " " << q.z() << " "
       << camera_center[0] << " " << camera_center[1] << " "
       << camera_center[2] << " " << "0 0\n"; // zero distortion, not used
+
+    Eigen::Matrix3d r = q.matrix();
+    written_cam_t_global[cid].linear() = r;
+    written_cam_t_global[cid].translation() = -r * camera_center;
   }
 
   // Write the number of points
   f << pid_to_cid_fid.size() << std::endl;
 
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-    f << pid_to_xyz[pid][0] << " " << pid_to_xyz[pid][1] << " "
-      << pid_to_xyz[pid][2] << " 0 0 0 "
-      << pid_to_cid_fid[pid].size();
-
+  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++)
     CHECK(pid_to_cid_fid[pid].size() > 1)
       << "PID " << pid << " has " << pid_to_cid_fid[pid].size() << " measurements";
 
-    for (std::map<int, int>::const_iterator it = pid_to_cid_fid[pid].begin();
-         it != pid_to_cid_fid[pid].end(); it++) {
-      f << " " << it->first << " " << it->second << " "
-        << cid_to_keypoint_map[it->first].col(it->second)[0] << " "
-        << cid_to_keypoint_map[it->first].col(it->second)[1];
+  // Format the points in parallel, in blocks. The text for a batch of
+  // blocks is written before the next batch is formatted, to not keep
+  // the text of all points in memory. The format is the same as
+  // streaming the values with a precision of 17.
+  size_t num_pid = pid_to_cid_fid.size(), block = 16384, blocks_per_batch = 64;
+  std::vector<std::string> block_text(blocks_per_batch);
+  dense_map::ThreadPool thread_pool;
+  for (size_t batch_start = 0; batch_start < num_pid; batch_start += block * blocks_per_batch) {
+    for (size_t b = 0; b < blocks_per_batch; b++) {
+      size_t start = batch_start + b * block, stop = std::min(start + block, num_pid);
+      block_text[b].clear();
+      if (start >= stop) continue;
+      thread_pool.AddTask([&, b, start, stop]() {
+          std::string & text = block_text[b];
+          char buf[256];
+          for (size_t pid = start; pid < stop; pid++) {
+            snprintf(buf, sizeof(buf), "%.17g %.17g %.17g 0 0 0 %zu", pid_to_xyz[pid][0],
+                     pid_to_xyz[pid][1], pid_to_xyz[pid][2], pid_to_cid_fid[pid].size());
+            text += buf;
+            for (auto it = pid_to_cid_fid[pid].begin(); it != pid_to_cid_fid[pid].end(); it++) {
+              Eigen::Vector2d pt = cid_to_keypoint_map[it->first].col(it->second);
+              snprintf(buf, sizeof(buf), " %d %d %.17g %.17g", it->first, it->second,
+                       pt[0], pt[1]);
+              text += buf;
+            }
+            text += "\n";
+          }
+        });
     }
-    f << std::endl;
+    thread_pool.Join();
+    for (size_t b = 0; b < blocks_per_batch; b++)
+      f.write(block_text[b].data(), block_text[b].size());
   }
 
   // Close the file
   f.flush();
   f.close();
+  if (!f)
+    LOG(FATAL) << "Failed writing: " << output_filename << "\n";
+
+  if (FLAGS_nvm_sidecar)
+    dense_map::writeNvmSidecar(output_filename, cid_to_keypoint_map, cid_to_filename,
+                               pid_to_cid_fid, pid_to_xyz, written_cam_t_global);
 }
 
 // A function to copy image data from maps to vectors with the data stored
@@ -1533,8 +2152,124 @@ void ImageDataToVectors
 }
 
 
+namespace {
+
+// The layout of a depth cloud file is: this header, padding to
+// kXyzDataOffset bytes, and the values, as rows x cols x channels
+// numbers, in row-major order, with the channels of a pixel
+// together. That is the layout of a cv::Mat of type CV_32FC3, so
+// the values can be read with one call, or memory-mapped. Float16
+// values take half the space, at the cost of precision. Native byte
+// order is used.
+//
+// The legacy format, which can still be read, has just the rows,
+// cols, and channels as int values, followed by the float values.
+const char kXyzMagic[8] = {'R', 'C', 'X', 'Y', 'Z', 'I', 'M', 'G'};
+const int32_t kXyzVersion = 1;
+const size_t kXyzDataOffset = 64;
+
+enum XyzValueType { XYZ_FLOAT32 = 0, XYZ_FLOAT16 = 1 };
+
+struct XyzImageHeader {
+  char    magic[8];
+  int32_t version;
+  int32_t rows;
+  int32_t cols;
+  int32_t channels;
+  int32_t value_type;
+  int32_t reserved;
+};
+
+// Conversion between float and IEEE half precision. Values too large
+// for half precision become infinity, and tiny ones become zero or
+// denormals. Rounding is to nearest.
+uint16_t floatToHalf(float val) {
+  uint32_t x;
+  std::memcpy(&x, &val, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  int32_t  exp  = static_cast<int32_t>((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+
+  if (((x >> 23) & 0xff) == 0xff)  // inf or nan
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if (exp >= 31)  // overflow
+    return sign | 0x7c00;
+  if (exp <= 0) {  // denormal or zero
+    if (exp < -10)
+      return sign;
+    mant |= 0x800000;
+    int shift = 14 - exp;
+    uint32_t half = mant >> shift;
+    if ((mant >> (shift - 1)) & 1) half++;  // round
+    return sign | half;
+  }
+
+  uint32_t half = sign | (exp << 10) | (mant >> 13);
+  if (mant & 0x1000) half++;  // round, may carry into the exponent, which is correct
+  return half;
+}
+
+float halfToFloat(uint16_t half) {
+  uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  int32_t  exp  = (half >> 10) & 0x1f;
+  uint32_t mant = half & 0x3ff;
+
+  uint32_t x = 0;
+  if (exp == 0x1f) {
+    x = sign | 0x7f800000 | (mant << 13);  // inf or nan
+  } else if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {
+      // Normalize the denormal
+      exp = 1;
+      while ((mant & 0x400) == 0) {
+        mant <<= 1;
+        exp--;
+      }
+      mant &= 0x3ff;
+      x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+  } else {
+    x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+  }
+
+  float val;
+  std::memcpy(&val, &x, sizeof(val));
+  return val;
+}
+
+// Read the values of a depth cloud in the legacy format, after the
+// rows, cols, and channels were read
+void readLegacyXyzValues(std::string const& filename, std::ifstream & f,
+                         int rows, int cols, int channels, cv::Mat & img) {
+  if (rows < 0 || cols < 0 || channels <= 0)
+    LOG(FATAL) << "Invalid depth cloud dimensions in: " << filename << "\n";
+
+  img = cv::Mat::zeros(rows, cols, CV_32FC3);
+  if (channels == 3) {
+    // The layout on disk is the same as in memory
+    f.read(reinterpret_cast<char*>(img.data), img.total() * img.elemSize());
+  } else {
+    std::vector<float> row_vals(static_cast<size_t>(cols) * channels);
+    for (int row = 0; row < rows; row++) {
+      f.read(reinterpret_cast<char*>(row_vals.data()), row_vals.size() * sizeof(float));
+      for (int col = 0; col < cols; col++) {
+        cv::Vec3f & P = img.at<cv::Vec3f>(row, col);  // alias
+        for (int c = 0; c < std::min(channels, 3); c++)
+          P[c] = row_vals[col * channels + c];
+      }
+    }
+  }
+
+  if (!f)
+    LOG(FATAL) << "Could not read the depth cloud: " << filename << "\n";
+}
+
+}  // namespace
+
 // Write an image with 3 floats per pixel. OpenCV's imwrite() cannot do that.
-void saveXyzImage(std::string const& filename, cv::Mat const& img) {
+void saveXyzImage(std::string const& filename, cv::Mat const& img, bool use_float16) {
   if (img.depth() != CV_32F)
     LOG(FATAL) << "Expecting an image with float values\n";
   if (img.channels() != 3) LOG(FATAL) << "Expecting 3 channels.\n";
@@ -1543,40 +2278,35 @@ void saveXyzImage(std::string const& filename, cv::Mat const& img) {
   f.open(filename.c_str(), std::ios::binary | std::ios::out);
   if (!f.is_open()) LOG(FATAL) << "Cannot open file for writing: " << filename << "\n";
 
-  // Assign these to explicit variables so we know their type and size in bytes
-  int rows = img.rows, cols = img.cols, channels = img.channels();
-
-  // TODO(oalexan1): Avoid C-style cast. Test if
-  // reinterpret_cast<char*> does the same thing.
-  f.write((char*)(&rows), sizeof(rows));         // NOLINT
-  f.write((char*)(&cols), sizeof(cols));         // NOLINT
-  f.write((char*)(&channels), sizeof(channels)); // NOLINT
-
-  for (int row = 0; row < rows; row++) {
-    for (int col = 0; col < cols; col++) {
-      cv::Vec3f const& P = img.at<cv::Vec3f>(row, col);  // alias
-      // TODO(oalexan1): See if using reinterpret_cast<char*> does the same
-      // thing.
-      for (int c = 0; c < channels; c++)
-        f.write((char*)(&P[c]), sizeof(P[c])); // NOLINT
+  XyzImageHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kXyzMagic, sizeof(kXyzMagic));
+  header.version    = kXyzVersion;
+  header.rows       = img.rows;
+  header.cols       = img.cols;
+  header.channels   = img.channels();
+  header.value_type = use_float16 ? XYZ_FLOAT16 : XYZ_FLOAT32;
+
+  std::vector<char> padding(kXyzDataOffset - sizeof(header), 0);
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  f.write(padding.data(), padding.size());
+
+  // Write a row at a time, as the image need not be continuous
+  size_t row_len = static_cast<size_t>(img.cols) * img.channels();
+  std::vector<uint16_t> half_vals(row_len);
+  for (int row = 0; row < img.rows; row++) {
+    const float* vals = img.ptr<float>(row);
+    if (use_float16) {
+      for (size_t it = 0; it < row_len; it++)
+        half_vals[it] = floatToHalf(vals[it]);
+      f.write(reinterpret_cast<const char*>(half_vals.data()), row_len * sizeof(uint16_t));
+    } else {
+      f.write(reinterpret_cast<const char*>(vals), row_len * sizeof(float));
     }
   }
 
-  return;
-}
-
-// Save images and depth clouds to disk
-void saveImagesAndDepthClouds(std::vector<dense_map::cameraImage> const& cams) {
-  for (size_t it = 0; it < cams.size(); it++) {
-
-    std::cout << "Writing: " << cams[it].image_name << std::endl;
-    cv::imwrite(cams[it].image_name, cams[it].image);
-
-    if (cams[it].depth_cloud.cols > 0 && cams[it].depth_cloud.rows > 0) {
-      std::cout << "Writing: " << cams[it].depth_name << std::endl;
-      dense_map::saveXyzImage(cams[it].depth_name, cams[it].depth_cloud);
-    }
-  }
+  if (!f)
+    LOG(FATAL) << "Could not write: " << filename << "\n";
 
   return;
 }
@@ -1587,24 +2317,48 @@ void readXyzImage(std::string const& filename, cv::Mat & img) {
   f.open(filename.c_str(), std::ios::binary | std::ios::in);
   if (!f.is_open()) LOG(FATAL) << "Cannot open file for reading: " << filename << "\n";
 
-  int rows, cols, channels;
-  f.read((char*)(&rows), sizeof(rows));         // NOLINT
-  f.read((char*)(&cols), sizeof(cols));         // NOLINT
-  f.read((char*)(&channels), sizeof(channels)); // NOLINT
-
-  img = cv::Mat::zeros(rows, cols, CV_32FC3);
+  XyzImageHeader header;
+  std::memset(&header, 0, sizeof(header));
+  f.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+  if (!f || std::memcmp(header.magic, kXyzMagic, sizeof(kXyzMagic)) != 0) {
+    // The legacy format. The first three ints are rows, cols, and channels.
+    int dims[3] = {0, 0, 0};
+    f.clear();
+    f.seekg(0);
+    f.read(reinterpret_cast<char*>(dims), sizeof(dims));
+    if (!f)
+      LOG(FATAL) << "Could not read the depth cloud: " << filename << "\n";
+    readLegacyXyzValues(filename, f, dims[0], dims[1], dims[2], img);
+    return;
+  }
 
-  for (int row = 0; row < rows; row++) {
-    for (int col = 0; col < cols; col++) {
-      cv::Vec3f P;
-      // TODO(oalexan1): See if using reinterpret_cast<char*> does the same
-      // thing.
-      for (int c = 0; c < channels; c++)
-        f.read((char*)(&P[c]), sizeof(P[c])); // NOLINT
-      img.at<cv::Vec3f>(row, col) = P;
-    }
+  if (header.version != kXyzVersion)
+    LOG(FATAL) << "Unsupported depth cloud version " << header.version
+               << " in: " << filename << "\n";
+  if (header.rows < 0 || header.cols < 0 || header.channels != 3)
+    LOG(FATAL) << "Invalid depth cloud dimensions in: " << filename << "\n";
+  if (header.value_type != XYZ_FLOAT32 && header.value_type != XYZ_FLOAT16)
+    LOG(FATAL) << "Unsupported depth cloud value type in: " << filename << "\n";
+
+  img = cv::Mat(header.rows, header.cols, CV_32FC3);
+  size_t num_vals = img.total() * 3;
+
+  f.seekg(kXyzDataOffset);
+  if (header.value_type == XYZ_FLOAT32) {
+    // Read straight into the image, which has the same layout
+    f.read(reinterpret_cast<char*>(img.data), num_vals * sizeof(float));
+  } else {
+    std::vector<uint16_t> half_vals(num_vals);
+    f.read(reinterpret_cast<char*>(half_vals.data()), num_vals * sizeof(uint16_t));
+    float* vals = reinterpret_cast<float*>(img.data);
+    for (size_t it = 0; it < num_vals; it++)
+      vals[it] = halfToFloat(half_vals[it]);
   }
 
+  if (!f)
+    LOG(FATAL) << "Could not read the depth cloud: " << filename << "\n";
+
   return;
 }
   
@@ -1647,10 +2401,8 @@ void readImageEntry(// Inputs
     LOG(FATAL) << "Duplicate timestamp " << std::setprecision(17) << timestamp
                << " for sensor id " << cam_type << "\n";
   
-  // Read the image as grayscale, in order for feature matching to work
-  // For texturing, texrecon should use the original color images.
-  std::cout << "Reading: " << image_file << std::endl;
-  image_map[timestamp].image        = cv::imread(image_file, cv::IMREAD_GRAYSCALE);
+  // The image is not read here, but only when needed, to save memory.
+  // See cameraImage::getImage().
   image_map[timestamp].name         = image_file;
   image_map[timestamp].timestamp    = timestamp;
   image_map[timestamp].world_to_cam = world_to_cam;
@@ -1660,11 +2412,9 @@ void readImageEntry(// Inputs
     LOG(FATAL) << "Duplicate timestamp " << std::setprecision(17) << timestamp
                << " for sensor id " << cam_type << "\n";
 
-  // Read the depth data, if present
+  // Record the depth data, if present
   std::string depth_file = fs::path(image_file).replace_extension(".pc").string();
   if (fs::exists(depth_file)) {
-    std::cout << "Reading: " << depth_file << std::endl;
-    dense_map::readXyzImage(depth_file, depth_map[timestamp].image);
     depth_map[timestamp].name      = depth_file;
     depth_map[timestamp].timestamp = timestamp;
   }
@@ -1790,7 +2540,7 @@ void readNvm(// Inputs
 void appendMatchesFromNvm(// Inputs
                           std::vector<camera::CameraParameters> const& cam_params,
                           std::vector<dense_map::cameraImage>   const& cams,
-                          nvmData const& nvm,
+                          nvmData const& nvm, bool allow_missing_images,
                           // Outputs (these get appended to)
                           std::vector<std::map<int, int>> & pid_to_cid_fid,
                           std::vector<std::vector<std::pair<float, float>>> & keypoint_vec) {
@@ -1805,10 +2555,13 @@ void appendMatchesFromNvm(// Inputs
   std::map<std::string, int> nvm_image_name_to_cid;
   for (size_t nvm_cid = 0; nvm_cid < nvm.cid_to_filename.size(); nvm_cid++)
     nvm_image_name_to_cid[nvm.cid_to_filename[nvm_cid]] = nvm_cid;
-  std::map<int, int> nvm_cid_to_cams_cid;
+  // This is -1 for the images not in 'cams'
+  std::vector<int> nvm_cid_to_cams_cid(nvm.cid_to_filename.size(), -1);
   for (size_t cid = 0; cid < cams.size(); cid++) {
     std::string const& image_name = cams[cid].image_name;
     auto nvm_it = nvm_image_name_to_cid.find(image_name);
+    if (nvm_it == nvm_image_name_to_cid.end() && allow_missing_images)
+      continue;
     if (nvm_it == nvm_image_name_to_cid.end()) 
       LOG(FATAL) << "Could not look up image: " << image_name << " in the input nvm file.\n";
     int nvm_cid = nvm_it->second;
@@ -1824,13 +2577,12 @@ void appendMatchesFromNvm(// Inputs
          cid_fid != nvm.pid_to_cid_fid[pid].end(); cid_fid++) {
       int nvm_cid = cid_fid->first;
       int nvm_fid = cid_fid->second;
-      Eigen::Vector2d keypoint = nvm.cid_to_keypoint_map.at(nvm_cid).col(nvm_fid);
 
-      auto it = nvm_cid_to_cams_cid.find(nvm_cid);
-      if (it == nvm_cid_to_cams_cid.end()) 
+      int cid = nvm_cid_to_cams_cid.at(nvm_cid); // cid value in 'cams'
+      if (cid < 0)
         continue; // this image went missing during bracketing
 
-      int cid = it->second; // cid value in 'cams'
+      Eigen::Vector2d keypoint = nvm.cid_to_keypoint_map.at(nvm_cid).col(nvm_fid);
       // Add the offset Theia removes
       keypoint += cam_params[cams[cid].camera_type].GetOpticalOffset();
 
@@ -1846,4 +2598,114 @@ void appendMatchesFromNvm(// Inputs
   } // end iterating over nvm pid
 }
   
+// Replace the poses of the images which are in the given nvm file
+// with the poses from it.
+void setPosesFromNvm(// Inputs
+                     nvmData const& nvm,
+                     std::vector<std::string> const& ref_image_files,
+                     // Outputs
+                     std::vector<Eigen::Affine3d>& world_to_ref,
+                     std::vector<std::vector<ImageMessage>>& image_data) {
+  std::map<std::string, int> image_name_to_cid;
+  for (size_t cid = 0; cid < nvm.cid_to_filename.size(); cid++)
+    image_name_to_cid[nvm.cid_to_filename[cid]] = cid;
+
+  for (size_t ref_it = 0; ref_it < ref_image_files.size(); ref_it++) {
+    auto it = image_name_to_cid.find(ref_image_files[ref_it]);
+    if (it != image_name_to_cid.end())
+      world_to_ref[ref_it] = nvm.cid_to_cam_t_global[it->second];
+  }
+
+  int num_found = 0, num_images = 0;
+  for (size_t cam_type = 0; cam_type < image_data.size(); cam_type++) {
+    for (size_t it = 0; it < image_data[cam_type].size(); it++) {
+      num_images++;
+      auto nvm_it = image_name_to_cid.find(image_data[cam_type][it].name);
+      if (nvm_it == image_name_to_cid.end())
+        continue;
+      image_data[cam_type][it].world_to_cam = nvm.cid_to_cam_t_global[nvm_it->second];
+      num_found++;
+    }
+  }
+
+  std::cout << "Initialized the poses of " << num_found << " out of " << num_images
+            << " images from the previous run." << std::endl;
+}
+
+// Remove the pairs having both images in the given nvm file
+void removeProcessedPairs(// Inputs
+                          std::vector<dense_map::cameraImage> const& cams,
+                          nvmData const& nvm,
+                          // Outputs
+                          std::vector<std::pair<int, int>> & image_pairs) {
+  std::set<std::string> processed(nvm.cid_to_filename.begin(), nvm.cid_to_filename.end());
+  std::vector<bool> is_processed(cams.size());
+  for (size_t cid = 0; cid < cams.size(); cid++)
+    is_processed[cid] = (processed.find(cams[cid].image_name) != processed.end());
+
+  std::vector<std::pair<int, int>> new_pairs;
+  for (size_t pair_it = 0; pair_it < image_pairs.size(); pair_it++) {
+    if (!is_processed[image_pairs[pair_it].first] || !is_processed[image_pairs[pair_it].second])
+      new_pairs.push_back(image_pairs[pair_it]);
+  }
+
+  std::cout << "Matching " << new_pairs.size() << " image pairs with new images, "
+            << "and skipping " << image_pairs.size() - new_pairs.size()
+            << " pairs matched in the previous run." << std::endl;
+  image_pairs.swap(new_pairs);
+}
+
+// Merge the tracks which have a feature in common. Features in the
+// same image within a thousandth of a pixel are the same. A merged
+// track keeps the first of several features in the same image.
+void mergeTracks(// Inputs
+                 std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
+                 // Outputs
+                 std::vector<std::map<int, int>> & pid_to_cid_fid) {
+  double tol = 1e-3;
+
+  // Union-find over the tracks
+  std::vector<int> parent(pid_to_cid_fid.size());
+  std::iota(parent.begin(), parent.end(), 0);
+  auto root = [&parent](int pid) {
+    while (parent[pid] != pid) {
+      parent[pid] = parent[parent[pid]];
+      pid = parent[pid];
+    }
+    return pid;
+  };
+
+  std::map<std::tuple<int, int64_t, int64_t>, int> feature_to_pid;
+  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
+    for (auto const& cid_fid : pid_to_cid_fid[pid]) {
+      auto const& ip = keypoint_vec[cid_fid.first][cid_fid.second];  // alias
+      auto key = std::make_tuple(cid_fid.first, static_cast<int64_t>(std::llround(ip.first / tol)),
+                                 static_cast<int64_t>(std::llround(ip.second / tol)));
+      auto it = feature_to_pid.find(key);
+      if (it == feature_to_pid.end())
+        feature_to_pid[key] = pid;
+      else
+        parent[root(pid)] = root(it->second);
+    }
+  }
+
+  // Collect the merged tracks, in the order of their first track
+  std::map<int, int> root_to_out;
+  std::vector<std::map<int, int>> merged;
+  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
+    int r = root(pid);
+    auto it = root_to_out.find(r);
+    if (it == root_to_out.end()) {
+      it = root_to_out.insert(std::make_pair(r, merged.size())).first;
+      merged.push_back(std::map<int, int>());
+    }
+    for (auto const& cid_fid : pid_to_cid_fid[pid])
+      merged[it->second].insert(cid_fid);  // keeps an existing feature for this image
+  }
+
+  std::cout << "Merged " << pid_to_cid_fid.size() << " tracks into " << merged.size()
+            << "." << std::endl;
+  pid_to_cid_fid.swap(merged);
+}
+
 }  // end namespace dense_map
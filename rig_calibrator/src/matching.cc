@@ -18,12 +18,21 @@
 
 #include <rig_calibrator/matching.h>
 #include <opencv2/xfeatures2d.hpp>
+#include <opencv2/opencv_modules.hpp>
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+#include <opencv2/cudafeatures2d.hpp>
+#endif
 
 #include <Eigen/Core>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <set>
 #include <vector>
 
 // Customize the feature detectors.
@@ -41,7 +50,70 @@ DEFINE_double(default_surf_threshold, 10,
 DEFINE_double(max_surf_threshold, 1000,
               "Maximum threshold for feature detection using SURF.");
 DEFINE_double(goodness_ratio, 0.8,
-              "A smaller value keeps fewer but more reliable float descriptor matches.");
+              "A smaller value keeps fewer but more reliable descriptor matches.");
+DEFINE_string(matcher, "FLANN",
+              "The descriptor matcher to use. FLANN, which is approximate and runs on the "
+              "CPU, or CUDA_BF, which is brute force on the GPU, if OpenCV was built with CUDA.");
+
+namespace {
+
+  // Copy binary descriptors into 64-bit words, padding each with zeros
+  // to a whole number of words, so the Hamming distance can be found
+  // with popcount a word at a time
+  int PackBinaryDescriptors(const cv::Mat & descriptor_map, std::vector<uint64_t> * packed) {
+    int num_bytes = descriptor_map.cols * descriptor_map.elemSize();
+    int num_words = (num_bytes + 7) / 8;
+    packed->assign(static_cast<size_t>(descriptor_map.rows) * num_words, 0);
+    for (int row = 0; row < descriptor_map.rows; row++)
+      std::memcpy(&(*packed)[static_cast<size_t>(row) * num_words],
+                  descriptor_map.ptr<uchar>(row), num_bytes);
+    return num_words;
+  }
+
+  inline int HammingDistance(const uint64_t* a, const uint64_t* b, int num_words) {
+    int dist = 0;
+    for (int it = 0; it < num_words; it++)
+      dist += __builtin_popcountll(a[it] ^ b[it]);
+    return dist;
+  }
+
+  // Find the two nearest neighbors of each query descriptor among the
+  // train descriptors, by brute force
+  void HammingKnnMatch(std::vector<uint64_t> const& query, std::vector<uint64_t> const& train,
+                       int num_words,
+                       std::vector<std::vector<cv::DMatch>> * possible_matches) {
+    int num_query = query.size() / num_words;
+    int num_train = train.size() / num_words;
+    possible_matches->resize(num_query);
+    for (int q = 0; q < num_query; q++) {
+      const uint64_t* q_ptr = &query[static_cast<size_t>(q) * num_words];
+      int best = -1, second = -1;
+      int best_dist = std::numeric_limits<int>::max();
+      int second_dist = std::numeric_limits<int>::max();
+      for (int t = 0; t < num_train; t++) {
+        int dist = HammingDistance(q_ptr, &train[static_cast<size_t>(t) * num_words],
+                                   num_words);
+        if (dist < best_dist) {
+          second = best;
+          second_dist = best_dist;
+          best = t;
+          best_dist = dist;
+        } else if (dist < second_dist) {
+          second = t;
+          second_dist = dist;
+        }
+      }
+
+      std::vector<cv::DMatch> & knn = (*possible_matches)[q];  // alias
+      knn.clear();
+      if (best >= 0)
+        knn.push_back(cv::DMatch(q, best, best_dist));
+      if (second >= 0)
+        knn.push_back(cv::DMatch(q, second, second_dist));
+    }
+  }
+
+}  // namespace
 
 namespace interest_point {
 
@@ -194,13 +266,54 @@ namespace interest_point {
         img2_descriptor_map.rows == 0)
       return;
 
+    DescriptorIndex index(img2_descriptor_map);
+    index.FindMatches(img1_descriptor_map, matches);
+  }
+
+  DescriptorIndex::DescriptorIndex(const cv::Mat & descriptor_map):
+    descriptor_map_(descriptor_map), num_words_(0) {
+    if (descriptor_map_.rows == 0)
+      return;
+
+    if (descriptor_map_.depth() == CV_8U) {
+      num_words_ = PackBinaryDescriptors(descriptor_map_, &binary_descriptors_);
+      return;
+    }
+
     // Traditional floating point descriptor
-    cv::FlannBasedMatcher matcher;
+    matcher_.add(std::vector<cv::Mat>(1, descriptor_map_));
+    matcher_.train();
+  }
+
+  void DescriptorIndex::FindMatches(const cv::Mat & query_descriptor_map,
+                                    std::vector<cv::DMatch> * matches) {
+    CHECK(query_descriptor_map.depth() == descriptor_map_.depth())
+      << "Mixed descriptor types. Did you mash BRISK with SIFT/SURF?";
+
+    matches->clear();
+    if (query_descriptor_map.rows == 0 || descriptor_map_.rows == 0)
+      return;
+
+    // The index was built already, so this only does the queries
     std::vector<std::vector<cv::DMatch> > possible_matches;
-    matcher.knnMatch(img1_descriptor_map, img2_descriptor_map, possible_matches, 2);
+    if (descriptor_map_.depth() == CV_8U) {
+      std::vector<uint64_t> query;
+      if (PackBinaryDescriptors(query_descriptor_map, &query) != num_words_)
+        LOG(FATAL) << "The binary descriptors to match have different lengths.";
+      HammingKnnMatch(query, binary_descriptors_, num_words_, &possible_matches);
+    } else {
+      matcher_.knnMatch(query_descriptor_map, possible_matches, 2);
+    }
+    FilterByGoodnessRatio(possible_matches, matches);
+  }
+
+  void FilterByGoodnessRatio(std::vector<std::vector<cv::DMatch>> const& possible_matches,
+                             std::vector<cv::DMatch> * matches) {
     matches->clear();
     matches->reserve(possible_matches.size());
     for (std::vector<cv::DMatch> const& best_pair : possible_matches) {
+      if (best_pair.empty())
+        continue;
       if (best_pair.size() == 1) {
         // This was the only best match, push it.
         matches->push_back(best_pair.at(0));
@@ -212,4 +325,204 @@ namespace interest_point {
       }
     }
   }
+
+  void FindCandidateMatches(const cv::Mat & query_descriptor_map,
+                            const cv::Mat & train_descriptor_map,
+                            std::vector<std::vector<int>> const& candidates,
+                            std::vector<cv::DMatch> * matches) {
+    CHECK(query_descriptor_map.depth() == train_descriptor_map.depth())
+      << "Mixed descriptor types. Did you mash BRISK with SIFT/SURF?";
+
+    matches->clear();
+    if (query_descriptor_map.rows == 0 || train_descriptor_map.rows == 0)
+      return;
+    if (static_cast<int>(candidates.size()) != query_descriptor_map.rows)
+      LOG(FATAL) << "Expecting a list of candidate matches for each descriptor.\n";
+
+    bool is_binary = (train_descriptor_map.depth() == CV_8U);
+    bool is_float = (train_descriptor_map.depth() == CV_32F);
+    std::vector<uint64_t> query, train;
+    int num_words = 0;
+    if (is_binary) {
+      num_words = PackBinaryDescriptors(train_descriptor_map, &train);
+      if (PackBinaryDescriptors(query_descriptor_map, &query) != num_words)
+        LOG(FATAL) << "The binary descriptors to match have different lengths.";
+    }
+    int num_cols = train_descriptor_map.cols;
+
+    std::vector<std::vector<cv::DMatch>> possible_matches(query_descriptor_map.rows);
+    for (int q = 0; q < query_descriptor_map.rows; q++) {
+      int best = -1, second = -1;
+      float best_dist = std::numeric_limits<float>::max();
+      float second_dist = std::numeric_limits<float>::max();
+      for (int t : candidates[q]) {
+        float dist = 0.0;
+        if (is_binary) {
+          dist = HammingDistance(&query[static_cast<size_t>(q) * num_words],
+                                 &train[static_cast<size_t>(t) * num_words], num_words);
+        } else if (is_float) {
+          const float* a = query_descriptor_map.ptr<float>(q);
+          const float* b = train_descriptor_map.ptr<float>(t);
+          for (int c = 0; c < num_cols; c++)
+            dist += (a[c] - b[c]) * (a[c] - b[c]);
+          dist = std::sqrt(dist);
+        } else {
+          dist = cv::norm(query_descriptor_map.row(q), train_descriptor_map.row(t),
+                          cv::NORM_L2);
+        }
+        if (dist < best_dist) {
+          second = best;
+          second_dist = best_dist;
+          best = t;
+          best_dist = dist;
+        } else if (dist < second_dist) {
+          second = t;
+          second_dist = dist;
+        }
+      }
+
+      if (best >= 0)
+        possible_matches[q].push_back(cv::DMatch(q, best, best_dist));
+      if (second >= 0)
+        possible_matches[q].push_back(cv::DMatch(q, second, second_dist));
+    }
+    FilterByGoodnessRatio(possible_matches, matches);
+  }
+
+  KeypointGrid::KeypointGrid(Eigen::Matrix2Xd const& keypoints, double cell_size):
+    keypoints_(keypoints), cell_size_(cell_size), min_x_(0.0), min_y_(0.0),
+    num_cols_(0), num_rows_(0) {
+    if (cell_size_ <= 0.0)
+      LOG(FATAL) << "The grid cell size must be positive.\n";
+    if (keypoints_.cols() == 0)
+      return;
+
+    min_x_ = keypoints_.row(0).minCoeff();
+    min_y_ = keypoints_.row(1).minCoeff();
+    num_cols_ = static_cast<int>((keypoints_.row(0).maxCoeff() - min_x_) / cell_size_) + 1;
+    num_rows_ = static_cast<int>((keypoints_.row(1).maxCoeff() - min_y_) / cell_size_) + 1;
+
+    // Count the keypoints in each cell, then fill in the cells
+    std::vector<int> cells(keypoints_.cols());
+    cell_start_.assign(static_cast<size_t>(num_cols_) * num_rows_ + 1, 0);
+    for (int it = 0; it < keypoints_.cols(); it++) {
+      int col = static_cast<int>((keypoints_(0, it) - min_x_) / cell_size_);
+      int row = static_cast<int>((keypoints_(1, it) - min_y_) / cell_size_);
+      cells[it] = row * num_cols_ + col;
+      cell_start_[cells[it] + 1]++;
+    }
+    for (size_t c = 1; c < cell_start_.size(); c++)
+      cell_start_[c] += cell_start_[c - 1];
+
+    std::vector<int> pos(cell_start_.begin(), cell_start_.end() - 1);
+    cell_keypoints_.resize(keypoints_.cols());
+    for (int it = 0; it < keypoints_.cols(); it++)
+      cell_keypoints_[pos[cells[it]]++] = it;
+  }
+
+  void KeypointGrid::FindInBox(double min_x, double min_y, double max_x, double max_y,
+                               std::vector<int> & indices) const {
+    indices.clear();
+    if (num_cols_ == 0 || !(min_x <= max_x) || !(min_y <= max_y))
+      return;
+
+    // The cells overlapping the box, clipped to the grid. Clip before
+    // casting, as the box may be far outside the grid.
+    auto clip = [](double val, int max_val) {
+      return static_cast<int>(std::max(-1.0, std::min(std::floor(val), 1.0 * max_val)));
+    };
+    int beg_col = std::max(0, clip((min_x - min_x_) / cell_size_, num_cols_));
+    int beg_row = std::max(0, clip((min_y - min_y_) / cell_size_, num_rows_));
+    int end_col = std::min(num_cols_ - 1, clip((max_x - min_x_) / cell_size_, num_cols_));
+    int end_row = std::min(num_rows_ - 1, clip((max_y - min_y_) / cell_size_, num_rows_));
+
+    for (int row = beg_row; row <= end_row; row++) {
+      for (int col = beg_col; col <= end_col; col++) {
+        int cell = row * num_cols_ + col;
+        for (int c = cell_start_[cell]; c < cell_start_[cell + 1]; c++) {
+          int it = cell_keypoints_[c];
+          double x = keypoints_(0, it), y = keypoints_(1, it);
+          if (x >= min_x && x <= max_x && y >= min_y && y <= max_y)
+            indices.push_back(it);
+        }
+      }
+    }
+  }
+
+  void KeypointGrid::FindNearSegment(Eigen::Vector2d const& p, Eigen::Vector2d const& q,
+                                     double dist, std::vector<int> & indices) const {
+    std::vector<int> in_box;
+    FindInBox(std::min(p.x(), q.x()) - dist, std::min(p.y(), q.y()) - dist,
+              std::max(p.x(), q.x()) + dist, std::max(p.y(), q.y()) + dist, in_box);
+
+    indices.clear();
+    Eigen::Vector2d d = q - p;
+    double len2 = d.squaredNorm();
+    for (int it : in_box) {
+      Eigen::Vector2d v = keypoints_.col(it) - p;
+      double t = 0.0;
+      if (len2 > 0.0)
+        t = std::max(0.0, std::min(1.0, v.dot(d) / len2));
+      if ((v - t * d).norm() <= dist)
+        indices.push_back(it);
+    }
+  }
+
+  void FindMatchesCuda(std::vector<cv::Mat> const& descriptors,
+                       std::vector<std::pair<int, int>> const& pairs,
+                       std::vector<std::vector<cv::DMatch>> * matches) {
+    matches->clear();
+    matches->resize(pairs.size());
+
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+    // Upload the descriptors of the images in these pairs, once per image
+    std::set<int> image_ids;
+    for (size_t it = 0; it < pairs.size(); it++) {
+      image_ids.insert(pairs[it].first);
+      image_ids.insert(pairs[it].second);
+    }
+    // The norm is chosen from the descriptor type. An image without
+    // features has an empty descriptor matrix, whose type says nothing.
+    std::map<int, cv::cuda::GpuMat> gpu_descriptors;
+    int depth = -1;
+    for (int id : image_ids) {
+      if (!descriptors[id].empty()) {
+        if (depth < 0)
+          depth = descriptors[id].depth();
+        CHECK(descriptors[id].depth() == depth)
+          << "Mixed descriptor types. Did you mash BRISK with SIFT/SURF?";
+      }
+      gpu_descriptors[id].upload(descriptors[id]);
+    }
+    int norm_type = (depth == CV_8U) ? cv::NORM_HAMMING : cv::NORM_L2;  // binary or not
+
+    // Submit all pairs, distributed over a few streams, so that
+    // the transfers and the matching can overlap
+    cv::Ptr<cv::cuda::DescriptorMatcher> matcher
+      = cv::cuda::DescriptorMatcher::createBFMatcher(norm_type);
+    const size_t num_streams = 4;
+    std::vector<cv::cuda::Stream> streams(num_streams);
+    std::vector<cv::cuda::GpuMat> gpu_matches(pairs.size());
+    for (size_t it = 0; it < pairs.size(); it++) {
+      cv::cuda::GpuMat const& left = gpu_descriptors[pairs[it].first];
+      cv::cuda::GpuMat const& right = gpu_descriptors[pairs[it].second];
+      if (left.rows == 0 || right.rows == 0)
+        continue;
+      matcher->knnMatchAsync(left, right, gpu_matches[it], 2, cv::noArray(),
+                             streams[it % num_streams]);
+    }
+    for (size_t it = 0; it < num_streams; it++)
+      streams[it].waitForCompletion();
+
+    for (size_t it = 0; it < pairs.size(); it++) {
+      if (gpu_matches[it].empty())
+        continue;
+      std::vector<std::vector<cv::DMatch>> possible_matches;
+      matcher->knnMatchConvert(gpu_matches[it], possible_matches);
+      FilterByGoodnessRatio(possible_matches, &(*matches)[it]);
+    }
+#else
+    LOG(FATAL) << "Matching on the GPU needs OpenCV built with CUDA. Use --matcher FLANN.";
+#endif
+  }
 }  // namespace interest_point
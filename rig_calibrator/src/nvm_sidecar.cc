@@ -0,0 +1,329 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <rig_calibrator/nvm_sidecar.h>
+#include <rig_calibrator/thread.h>
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+DEFINE_bool(nvm_sidecar, true,
+            "Save next to each nvm file a binary copy of its data, as <nvm file>.bin, and "
+            "read that instead of the nvm file if the nvm file did not change since. "
+            "This is much faster for large nvm files.");
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+// The layout of a sidecar is: this header, the image names, each
+// followed by a newline, then for each camera its world-to-camera
+// rotation (column-major) and translation as 12 doubles, the number
+// of keypoints of each camera, the keypoints of all cameras as pairs
+// of doubles (which is how Eigen stores a Matrix2Xd), the triangulated
+// points as triples of doubles, the offsets of the tracks into the
+// list of features as num_pid + 1 integers, and the features, as
+// pairs of 32-bit cid and fid values.
+const char kMagic[8] = {'R', 'C', 'N', 'V', 'M', 'B', '0', '1'};
+
+struct NvmSidecarHeader {
+  char     magic[8];
+  int64_t  nvm_mtime;
+  uint64_t nvm_size;
+  uint64_t num_cid;
+  uint64_t num_pid;
+  uint64_t num_obs;
+  uint64_t num_keypoints;
+  uint64_t names_size;
+};
+
+// Find the modification time and size of the nvm file. These are
+// used to tell if the sidecar is still up-to-date.
+bool nvmFileStamp(std::string const& nvm_file, int64_t & mtime, uint64_t & size) {
+  boost::system::error_code ec;
+  std::time_t t = fs::last_write_time(nvm_file, ec);
+  if (ec) return false;
+  uintmax_t s = fs::file_size(nvm_file, ec);
+  if (ec) return false;
+  mtime = t;
+  size = s;
+  return true;
+}
+
+template <typename T>
+bool readArray(std::ifstream & ifs, T * data, uint64_t count) {
+  if (count == 0) return true;
+  ifs.read(reinterpret_cast<char*>(data), sizeof(T) * count);
+  return static_cast<bool>(ifs);
+}
+
+template <typename T>
+void writeArray(std::ofstream & ofs, T const* data, uint64_t count) {
+  if (count == 0) return;
+  ofs.write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+}
+
+}  // end anonymous namespace
+
+namespace dense_map {
+
+std::string nvmSidecarFile(std::string const& nvm_file) {
+  return nvm_file + ".bin";
+}
+
+bool readNvmSidecar(std::string const& nvm_file,
+                    // Outputs
+                    std::vector<Eigen::Matrix2Xd> * cid_to_keypoint_map,
+                    std::vector<std::string> * cid_to_filename,
+                    std::vector<std::map<int, int>> * pid_to_cid_fid,
+                    std::vector<Eigen::Vector3d> * pid_to_xyz,
+                    std::vector<Eigen::Affine3d> * cid_to_cam_t_global) {
+  int64_t nvm_mtime = 0;
+  uint64_t nvm_size = 0;
+  if (!nvmFileStamp(nvm_file, nvm_mtime, nvm_size)) return false;
+
+  std::string sidecar_file = nvmSidecarFile(nvm_file);
+  boost::system::error_code ec;
+  uintmax_t sidecar_size = fs::file_size(sidecar_file, ec);
+  if (ec || sidecar_size < sizeof(NvmSidecarHeader)) return false;
+
+  std::ifstream ifs(sidecar_file.c_str(), std::ios::binary);
+  if (!ifs.is_open()) return false;
+
+  NvmSidecarHeader header;
+  if (!readArray(ifs, &header, 1)) return false;
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) return false;
+  if (header.nvm_mtime != nvm_mtime || header.nvm_size != nvm_size) return false;
+
+  // Check the size before allocating anything, to not be fooled by a
+  // corrupted header. Each count is bounded by the file size first,
+  // so the total below cannot overflow.
+  uint64_t max_count = sidecar_size;
+  if (header.num_cid > max_count || header.num_pid > max_count || header.num_obs > max_count ||
+      header.num_keypoints > max_count || header.names_size > max_count)
+    return false;
+  uint64_t expected_size = sizeof(header) + header.names_size
+    + header.num_cid * (12 * sizeof(double) + sizeof(uint64_t))
+    + header.num_keypoints * 2 * sizeof(double)
+    + header.num_pid * 3 * sizeof(double)
+    + (header.num_pid + 1) * sizeof(uint64_t)
+    + header.num_obs * 2 * sizeof(int32_t);
+  if (expected_size != sidecar_size) return false;
+
+  std::string names(header.names_size, '\0');
+  if (!readArray(ifs, &names[0], names.size())) return false;
+  std::vector<std::string> filenames;
+  size_t beg = 0;
+  while (beg < names.size()) {
+    size_t end = names.find('\n', beg);
+    if (end == std::string::npos) return false;
+    filenames.push_back(names.substr(beg, end - beg));
+    beg = end + 1;
+  }
+  if (filenames.size() != header.num_cid) return false;
+
+  std::vector<double> poses(12 * header.num_cid);
+  std::vector<uint64_t> num_keypoints(header.num_cid);
+  if (!readArray(ifs, poses.data(), poses.size()) ||
+      !readArray(ifs, num_keypoints.data(), num_keypoints.size()))
+    return false;
+
+  uint64_t total_keypoints = 0;
+  for (size_t cid = 0; cid < num_keypoints.size(); cid++) {
+    if (num_keypoints[cid] > header.num_keypoints) return false;
+    total_keypoints += num_keypoints[cid];
+  }
+  if (total_keypoints != header.num_keypoints) return false;
+
+  std::vector<Eigen::Matrix2Xd> keypoint_map(header.num_cid);
+  for (size_t cid = 0; cid < keypoint_map.size(); cid++) {
+    keypoint_map[cid].resize(Eigen::NoChange_t(), num_keypoints[cid]);
+    if (!readArray(ifs, keypoint_map[cid].data(), 2 * num_keypoints[cid])) return false;
+  }
+
+  std::vector<Eigen::Vector3d> xyz(header.num_pid);
+  std::vector<uint64_t> offsets(header.num_pid + 1);
+  std::vector<int32_t> obs(2 * header.num_obs);
+  for (size_t pid = 0; pid < xyz.size(); pid++) {
+    if (!readArray(ifs, xyz[pid].data(), 3)) return false;
+  }
+  if (!readArray(ifs, offsets.data(), offsets.size()) ||
+      !readArray(ifs, obs.data(), obs.size()))
+    return false;
+
+  // Validate the tracks, so that bad indices cannot be used later
+  if (offsets[0] != 0 || offsets.back() != header.num_obs) return false;
+  for (size_t pid = 0; pid < header.num_pid; pid++) {
+    if (offsets[pid + 1] < offsets[pid]) return false;
+  }
+  for (size_t it = 0; it < header.num_obs; it++) {
+    int32_t cid = obs[2 * it], fid = obs[2 * it + 1];
+    if (cid < 0 || static_cast<uint64_t>(cid) >= header.num_cid || fid < 0 ||
+        static_cast<uint64_t>(fid) >= num_keypoints[cid])
+      return false;
+  }
+
+  // Creating the maps is the slowest part, and each track is
+  // independent of the others
+  std::vector<std::map<int, int>> tracks(header.num_pid);
+  {
+    size_t block = 65536;
+    dense_map::ThreadPool thread_pool;
+    for (size_t start = 0; start < tracks.size(); start += block) {
+      size_t stop = std::min(start + block, tracks.size());
+      thread_pool.AddTask([&tracks, &offsets, &obs, start, stop]() {
+          for (size_t pid = start; pid < stop; pid++) {
+            for (uint64_t it = offsets[pid]; it < offsets[pid + 1]; it++)
+              tracks[pid][obs[2 * it]] = obs[2 * it + 1];
+          }
+        });
+    }
+    thread_pool.Join();
+  }
+
+  cid_to_cam_t_global->resize(header.num_cid);
+  for (size_t cid = 0; cid < header.num_cid; cid++) {
+    Eigen::Affine3d & world_to_cam = cid_to_cam_t_global->at(cid);
+    world_to_cam.linear() = Eigen::Map<const Eigen::Matrix3d>(&poses[12 * cid]);
+    world_to_cam.translation() = Eigen::Map<const Eigen::Vector3d>(&poses[12 * cid + 9]);
+  }
+  cid_to_filename->swap(filenames);
+  cid_to_keypoint_map->swap(keypoint_map);
+  pid_to_xyz->swap(xyz);
+  pid_to_cid_fid->swap(tracks);
+
+  return true;
+}
+
+void writeNvmSidecar(std::string const& nvm_file,
+                     std::vector<Eigen::Matrix2Xd> const& cid_to_keypoint_map,
+                     std::vector<std::string> const& cid_to_filename,
+                     std::vector<std::map<int, int>> const& pid_to_cid_fid,
+                     std::vector<Eigen::Vector3d> const& pid_to_xyz,
+                     std::vector<Eigen::Affine3d> const& cid_to_cam_t_global) {
+  std::string sidecar_file = nvmSidecarFile(nvm_file);
+
+  NvmSidecarHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  if (!nvmFileStamp(nvm_file, header.nvm_mtime, header.nvm_size)) {
+    LOG(WARNING) << "Cannot find the size and time of: " << nvm_file << "\n";
+    return;
+  }
+
+  size_t num_cid = cid_to_filename.size();
+  if (cid_to_keypoint_map.size() != num_cid || cid_to_cam_t_global.size() != num_cid ||
+      pid_to_xyz.size() != pid_to_cid_fid.size()) {
+    LOG(WARNING) << "Inconsistent nvm data. Not writing: " << sidecar_file << "\n";
+    return;
+  }
+
+  // As when reading the nvm file, each camera has keypoints up to
+  // the largest index used in a track
+  std::string names;
+  std::vector<uint64_t> num_keypoints(num_cid, 0);
+  std::vector<uint64_t> offsets(1, 0);
+  std::vector<int32_t> obs;
+  for (size_t cid = 0; cid < num_cid; cid++) {
+    if (cid_to_filename[cid].find('\n') != std::string::npos) {
+      LOG(WARNING) << "Image names with newlines are not supported. Not writing: "
+                   << sidecar_file << "\n";
+      return;
+    }
+    names += cid_to_filename[cid] + "\n";
+  }
+  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
+    for (auto const& cid_fid : pid_to_cid_fid[pid]) {
+      int cid = cid_fid.first, fid = cid_fid.second;
+      if (cid < 0 || static_cast<size_t>(cid) >= num_cid || fid < 0 ||
+          fid >= cid_to_keypoint_map[cid].cols()) {
+        LOG(WARNING) << "Invalid feature in track " << pid << ". Not writing: "
+                     << sidecar_file << "\n";
+        return;
+      }
+      num_keypoints[cid] = std::max(num_keypoints[cid], static_cast<uint64_t>(fid) + 1);
+      obs.push_back(cid);
+      obs.push_back(fid);
+    }
+    offsets.push_back(obs.size() / 2);
+  }
+
+  header.num_cid = num_cid;
+  header.num_pid = pid_to_cid_fid.size();
+  header.num_obs = obs.size() / 2;
+  header.names_size = names.size();
+  for (size_t cid = 0; cid < num_cid; cid++)
+    header.num_keypoints += num_keypoints[cid];
+
+  std::string tmp_file = sidecar_file + ".tmp" + std::to_string(getpid());
+  std::ofstream ofs(tmp_file.c_str(), std::ios::binary);
+  if (!ofs.is_open()) {
+    LOG(WARNING) << "Cannot write: " << tmp_file << "\n";
+    return;
+  }
+
+  writeArray(ofs, &header, 1);
+  writeArray(ofs, names.data(), names.size());
+  for (size_t cid = 0; cid < num_cid; cid++) {
+    Eigen::Matrix3d linear = cid_to_cam_t_global[cid].linear();
+    Eigen::Vector3d translation = cid_to_cam_t_global[cid].translation();
+    writeArray(ofs, linear.data(), 9);
+    writeArray(ofs, translation.data(), 3);
+  }
+  writeArray(ofs, num_keypoints.data(), num_keypoints.size());
+  {
+    // The keypoints not in any track are not in the nvm file, and
+    // are zero when it is read, so are saved as zero here too
+    std::vector<Eigen::Matrix2Xd> keypoints(num_cid);
+    for (size_t cid = 0; cid < num_cid; cid++)
+      keypoints[cid] = Eigen::Matrix2Xd::Zero(2, num_keypoints[cid]);
+    for (size_t it = 0; it < obs.size(); it += 2)
+      keypoints[obs[it]].col(obs[it + 1]) = cid_to_keypoint_map[obs[it]].col(obs[it + 1]);
+    for (size_t cid = 0; cid < num_cid; cid++)
+      writeArray(ofs, keypoints[cid].data(), 2 * num_keypoints[cid]);
+  }
+  for (size_t pid = 0; pid < pid_to_xyz.size(); pid++)
+    writeArray(ofs, pid_to_xyz[pid].data(), 3);
+  writeArray(ofs, offsets.data(), offsets.size());
+  writeArray(ofs, obs.data(), obs.size());
+
+  ofs.close();
+  if (!ofs) {
+    LOG(WARNING) << "Failed writing: " << tmp_file << "\n";
+    std::remove(tmp_file.c_str());
+    return;
+  }
+
+  if (std::rename(tmp_file.c_str(), sidecar_file.c_str()) != 0) {
+    LOG(WARNING) << "Failed to rename " << tmp_file << " to " << sidecar_file << "\n";
+    std::remove(tmp_file.c_str());
+  }
+}
+
+}  // end namespace dense_map
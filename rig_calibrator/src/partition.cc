@@ -0,0 +1,162 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <rig_calibrator/partition.h>
+#include <rig_calibrator/camera_image.h>
+#include <camera_model/camera_params.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+namespace dense_map {
+
+void formPartitions(int num_keys, int num_partitions, int overlap,
+                    std::vector<Partition> & partitions) {
+  partitions.clear();
+  if (num_keys <= 0)
+    return;
+
+  num_partitions = std::max(1, std::min(num_partitions, num_keys));
+  overlap = std::max(0, overlap);
+  for (int it = 0; it < num_partitions; it++) {
+    Partition p;
+    // Spread the remainder of the division over the first clusters
+    p.core_beg = static_cast<int>((static_cast<int64_t>(num_keys) * it) / num_partitions);
+    p.core_end = static_cast<int>((static_cast<int64_t>(num_keys) * (it + 1)) / num_partitions);
+    p.beg = std::max(0, p.core_beg - overlap);
+    p.end = std::min(num_keys, p.core_end + overlap);
+    partitions.push_back(p);
+  }
+}
+
+void partitionKeys(std::vector<cameraImage> const& cams, bool no_rig,
+                   std::vector<int> & cam_keys) {
+  cam_keys.resize(cams.size());
+  for (size_t cid = 0; cid < cams.size(); cid++)
+    cam_keys[cid] = no_rig ? static_cast<int>(cid) : cams[cid].beg_ref_index;
+}
+
+void selectPartitionTracks(TrackStore const& tracks, std::vector<int> const& cam_keys,
+                           Partition const& partition, std::vector<int> & pids) {
+  pids.clear();
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
+    for (auto const& obs : tracks[pid]) {
+      int key = cam_keys[obs.cid];
+      if (obs.inlier && key >= partition.beg && key < partition.end) {
+        pids.push_back(pid);
+        break;
+      }
+    }
+  }
+}
+
+void averageSensorParams(std::vector<std::vector<double>> const& values,
+                         std::vector<double> const& weights,
+                         std::vector<int> const& quat_offsets,
+                         std::vector<double> & average) {
+  if (values.size() != weights.size())
+    LOG(FATAL) << "Expecting as many weights as sets of values.\n";
+
+  // The quaternions are made to agree in sign with the ones from the
+  // first cluster which has a positive weight
+  int ref = -1;
+  double total_weight = 0.0;
+  for (size_t it = 0; it < values.size(); it++) {
+    if (weights[it] <= 0.0) continue;
+    if (values[it].size() != average.size())
+      LOG(FATAL) << "Expecting the same number of values from each cluster.\n";
+    if (ref < 0) ref = it;
+    total_weight += weights[it];
+  }
+  if (ref < 0)
+    return;
+
+  std::vector<double> sum(average.size(), 0.0);
+  for (size_t it = 0; it < values.size(); it++) {
+    if (weights[it] <= 0.0) continue;
+    std::vector<double> v = values[it];
+    for (size_t q = 0; q < quat_offsets.size(); q++) {
+      int beg = quat_offsets[q];
+      double dot = 0.0;
+      for (int c = 0; c < 4; c++) dot += v[beg + c] * values[ref][beg + c];
+      if (dot < 0.0) {
+        for (int c = 0; c < 4; c++) v[beg + c] = -v[beg + c];
+      }
+    }
+    for (size_t c = 0; c < v.size(); c++)
+      sum[c] += weights[it] * v[c];
+  }
+
+  for (size_t c = 0; c < sum.size(); c++)
+    average[c] = sum[c] / total_weight;
+  for (size_t q = 0; q < quat_offsets.size(); q++) {
+    Eigen::Map<Eigen::Vector4d> quat(&average[quat_offsets[q]]);
+    double norm = quat.norm();
+    if (norm > 0.0) quat /= norm;
+  }
+}
+
+void calcPixelResiduals(std::vector<camera::CameraParameters> const& cam_params,
+                        std::vector<cameraImage> const& cams,
+                        std::vector<Eigen::Affine3d> const& world_to_cam,
+                        std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
+                        std::vector<Eigen::Vector3d> const& xyz_vec, int num_threads,
+                        // Outputs
+                        TrackStore & tracks, std::vector<double> & residuals) {
+  // The residuals of each track start right after the ones of the
+  // previous track, so the tracks can then be processed in parallel
+  int num_tracks = tracks.size();
+  std::vector<size_t> track_start(num_tracks + 1, 0);
+  for (int pid = 0; pid < num_tracks; pid++) {
+    size_t num_inliers = 0;
+    for (auto& obs : tracks[pid]) {
+      obs.residual_index = -1;
+      if (obs.inlier) {
+        obs.residual_index = track_start[pid] + 2 * num_inliers;
+        num_inliers++;
+      }
+    }
+    track_start[pid + 1] = track_start[pid] + 2 * num_inliers;
+  }
+  if (track_start[num_tracks] > static_cast<size_t>(std::numeric_limits<int>::max()))
+    LOG(FATAL) << "Too many residuals.\n";
+
+  residuals.resize(track_start[num_tracks]);
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1024)
+  for (int pid = 0; pid < num_tracks; pid++) {
+    for (auto const& obs : tracks[pid]) {
+      if (!obs.inlier) continue;
+
+      camera::CameraParameters const& params = cam_params[cams[obs.cid].camera_type];
+      Eigen::Vector3d X = world_to_cam[obs.cid] * xyz_vec[pid];
+      Eigen::Vector2d undist_pix = params.GetFocalVector().cwiseProduct(X.hnormalized());
+      Eigen::Vector2d dist_pix;
+      params.Convert<camera::UNDISTORTED_C, camera::DISTORTED>(undist_pix, &dist_pix);
+
+      std::pair<float, float> const& ip = keypoint_vec[obs.cid][obs.fid];
+      residuals[obs.residual_index + 0] = dist_pix[0] - ip.first;
+      residuals[obs.residual_index + 1] = dist_pix[1] - ip.second;
+    }
+  }
+}
+
+}  // end namespace dense_map
@@ -0,0 +1,201 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <rig_calibrator/profiler.h>
+
+#include <glog/logging.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace dense_map {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// All times are measured from when the program started
+Clock::time_point const g_start_time = Clock::now();
+
+struct StageRecord {
+  std::string name;
+  std::string path;  // names of the parents and of this stage, separated by slashes
+  int depth;
+  double start_seconds;
+  double seconds;
+  double start_rss_mb;
+  double end_rss_mb;
+  double peak_rss_mb;
+  bool done;
+};
+
+std::mutex g_records_mutex;
+std::vector<StageRecord> g_records;
+
+// Indices of the stages running in this thread, with the innermost last
+thread_local std::vector<size_t> t_running_stages;
+
+double secondsSinceStart() {
+  return std::chrono::duration<double>(Clock::now() - g_start_time).count();
+}
+
+// Escape the characters which cannot show up as they are in a JSON string
+std::string jsonString(std::string const& str) {
+  std::string out = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned int>(c));
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  out += "\"";
+  return out;
+}
+
+}  // end anonymous namespace
+
+double currentRssMb() {
+#ifdef __linux__
+  // The second value in this file is the number of resident pages
+  std::ifstream ifs("/proc/self/statm");
+  double total_pages = 0, resident_pages = 0;
+  if (ifs >> total_pages >> resident_pages)
+    return resident_pages * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+#endif
+  return 0.0;
+}
+
+double peakRssMb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0.0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);  // in bytes
+#else
+  return usage.ru_maxrss / 1024.0;  // in kilobytes
+#endif
+}
+
+StageTimer::StageTimer(std::string const& name): m_index(0), m_stopped(false) {
+  StageRecord record;
+  record.name = name;
+  record.path = name;
+  record.depth = t_running_stages.size();
+  record.start_seconds = secondsSinceStart();
+  record.seconds = 0.0;
+  record.start_rss_mb = currentRssMb();
+  record.end_rss_mb = record.start_rss_mb;
+  record.peak_rss_mb = peakRssMb();
+  record.done = false;
+
+  std::lock_guard<std::mutex> lock(g_records_mutex);
+  if (!t_running_stages.empty())
+    record.path = g_records[t_running_stages.back()].path + "/" + name;
+  m_index = g_records.size();
+  g_records.push_back(record);
+  t_running_stages.push_back(m_index);
+}
+
+StageTimer::~StageTimer() {
+  stop();
+}
+
+void StageTimer::stop() {
+  if (m_stopped)
+    return;
+  m_stopped = true;
+
+  double end_seconds = secondsSinceStart();
+  double end_rss_mb = currentRssMb();
+  double peak_rss_mb = peakRssMb();
+
+  std::lock_guard<std::mutex> lock(g_records_mutex);
+  StageRecord& record = g_records[m_index];
+  record.seconds = end_seconds - record.start_seconds;
+  record.end_rss_mb = end_rss_mb;
+  record.peak_rss_mb = peak_rss_mb;
+  record.done = true;
+
+  // Normally this is the innermost stage, unless stages were stopped out of order
+  auto it = std::find(t_running_stages.begin(), t_running_stages.end(), m_index);
+  if (it != t_running_stages.end())
+    t_running_stages.erase(it);
+}
+
+void writeProfileReport(std::string const& report_file) {
+  double now_seconds = secondsSinceStart();
+  double now_rss_mb = currentRssMb();
+  double now_peak_rss_mb = peakRssMb();
+
+  std::vector<StageRecord> records;
+  {
+    std::lock_guard<std::mutex> lock(g_records_mutex);
+    records = g_records;
+  }
+
+  std::cout << "Writing: " << report_file << std::endl;
+  std::ofstream ofs(report_file.c_str());
+  if (!ofs.good())
+    LOG(FATAL) << "Cannot write: " << report_file << "\n";
+
+  ofs << std::fixed << std::setprecision(6);
+  ofs << "{\n";
+  ofs << "  \"total_seconds\": " << now_seconds << ",\n";
+  ofs << "  \"rss_mb\": " << now_rss_mb << ",\n";
+  ofs << "  \"peak_rss_mb\": " << now_peak_rss_mb << ",\n";
+  ofs << "  \"stages\": [";
+  for (size_t it = 0; it < records.size(); it++) {
+    StageRecord& r = records[it];
+    if (!r.done) {
+      r.seconds = now_seconds - r.start_seconds;
+      r.end_rss_mb = now_rss_mb;
+      r.peak_rss_mb = now_peak_rss_mb;
+    }
+
+    ofs << (it == 0 ? "\n" : ",\n");
+    ofs << "    {\"name\": " << jsonString(r.name)
+        << ", \"path\": " << jsonString(r.path)
+        << ", \"depth\": " << r.depth
+        << ", \"start_seconds\": " << r.start_seconds
+        << ", \"seconds\": " << r.seconds
+        << ", \"start_rss_mb\": " << r.start_rss_mb
+        << ", \"end_rss_mb\": " << r.end_rss_mb
+        << ", \"peak_rss_mb\": " << r.peak_rss_mb
+        << ", \"finished\": " << (r.done ? "true" : "false") << "}";
+  }
+  ofs << "\n  ]\n}\n";
+  ofs.close();
+}
+
+}  // end namespace dense_map
@@ -28,8 +28,12 @@ namespace dense_map {
 void createDir(std::string const& dir) {
   if (dir == "") return;  // This can be useful if dir was created with parent_path().
 
+  // Another thread or process may create the directory at the same
+  // time, so only check that it exists in the end
   if (!boost::filesystem::exists(dir)) {
-    if (!boost::filesystem::create_directories(dir) || !boost::filesystem::is_directory(dir))
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(dir, ec);
+    if (!boost::filesystem::is_directory(dir))
       LOG(FATAL) << "Failed to create directory: " << dir << "\n";
   }
 }
@@ -31,7 +31,10 @@
 #include <camera_model/camera_model.h>
 #include <rig_calibrator/system_utils.h>
 #include <rig_calibrator/camera_image.h>
+#include <rig_calibrator/image_cache.h>
 #include <rig_calibrator/basic_algs.h>
+#include <rig_calibrator/happly.h>
+#include <rig_calibrator/thread.h>
 
 #include <glog/logging.h>
 
@@ -46,6 +49,8 @@
 #include <util/file_system.h>
 
 // System includes
+#include <algorithm>
+#include <cstdio>
 #include <string>
 #include <map>
 #include <iostream>
@@ -102,7 +107,8 @@ void copy_into(mve::ByteImage::ConstPtr src, int64_t x, int64_t y, mve::ByteImag
 typedef std::vector<std::pair<int, int>> PixelVector;
 typedef std::set<std::pair<int, int>> PixelSet;
 
-bool IsaacTextureAtlas::insert(IsaacTexturePatch::ConstPtr texture_patch) {
+bool IsaacTextureAtlas::place(IsaacTexturePatch::ConstPtr texture_patch,
+                              Eigen::Vector2d& offset) {
   if (finalized)
     throw util::Exception("No insertion possible, IsaacTextureAtlas already finalized");
 
@@ -120,12 +126,49 @@ bool IsaacTextureAtlas::insert(IsaacTexturePatch::ConstPtr texture_patch) {
   // only care for the structure
   // copy_into(patch_image, rect.min_x, rect.min_y, image, TILE_PADDING);
 
+  // Calculate where the patch will go after insertion
+  offset = Eigen::Vector2d(rect.min_x + TILE_PADDING, rect.min_y + TILE_PADDING);
+
+  return true;
+}
+
+void IsaacTextureAtlas::add_placed(std::vector<IsaacTexturePatch::ConstPtr> const& placed_patches,
+                                   std::vector<Eigen::Vector2d> const& placed_offsets) {
+  if (placed_patches.size() != placed_offsets.size())
+    LOG(FATAL) << "There must be as many placed patches as offsets.\n";
+
+  // Find where the faces of each patch start, then copy the patches
+  // in parallel
+  size_t num_patches = placed_patches.size();
+  std::vector<size_t> start(num_patches + 1, 0);
+  for (size_t it = 0; it < num_patches; it++)
+    start[it + 1] = start[it] + placed_patches[it]->get_faces().size();
+
+  size_t old_num_faces = faces.size();
+  faces.resize(old_num_faces + start[num_patches]);
+  texcoords.resize(3 * faces.size());
+
+#pragma omp parallel for schedule(dynamic, 4096)
+  for (size_t it = 0; it < num_patches; it++) {
+    IsaacTexturePatch::Faces const& patch_faces = placed_patches[it]->get_faces();  // alias
+    IsaacTexturePatch::Texcoords const& patch_texcoords
+      = placed_patches[it]->get_texcoords();  // alias
+    size_t beg = old_num_faces + start[it];
+    for (size_t i = 0; i < patch_faces.size(); i++) {
+      faces[beg + i] = patch_faces[i];
+      for (int64_t j = 0; j < 3; j++)
+        texcoords[3 * (beg + i) + j] = patch_texcoords[i * 3 + j] + placed_offsets[it];
+    }
+  }
+}
+
+bool IsaacTextureAtlas::insert(IsaacTexturePatch::ConstPtr texture_patch) {
+  Eigen::Vector2d offset;
+  if (!place(texture_patch, offset)) return false;
+
   IsaacTexturePatch::Faces const& patch_faces = texture_patch->get_faces();              // alias
   IsaacTexturePatch::Texcoords const& patch_texcoords = texture_patch->get_texcoords();  // alias
 
-  // Calculate where the patch will go after insertion
-  Eigen::Vector2d offset = Eigen::Vector2d(rect.min_x + TILE_PADDING, rect.min_y + TILE_PADDING);
-
   faces.insert(faces.end(), patch_faces.begin(), patch_faces.end());
 
   // Insert the texcoords in the right place
@@ -156,22 +199,12 @@ struct VectorCompare {
 typedef std::map<Eigen::Vector2d, std::size_t, VectorCompare> TexcoordMap;
 
 void IsaacTextureAtlas::merge_texcoords() {
-  Texcoords tmp;
-  tmp.swap(this->texcoords);
-
-  // Do not remove duplicates, as that messes up the book-keeping
-  TexcoordMap texcoord_map;
-  for (Eigen::Vector2d const& texcoord : tmp) {
-    TexcoordMap::iterator iter = texcoord_map.find(texcoord);
-    // if (iter == texcoord_map.end()) {
-    std::size_t texcoord_id = this->texcoords.size();
-    texcoord_map[texcoord] = texcoord_id;
-    this->texcoords.push_back(texcoord);
-    this->texcoord_ids.push_back(texcoord_id);
-    //} else {
-    // this->texcoord_ids.push_back(iter->second);
-    //}
-  }
+  // Do not remove duplicates, as that messes up the book-keeping. So
+  // each texcoord keeps its own index, and there is no need to look
+  // them up in a TexcoordMap.
+  this->texcoord_ids.resize(this->texcoords.size());
+  for (std::size_t texcoord_id = 0; texcoord_id < this->texcoords.size(); texcoord_id++)
+    this->texcoord_ids[texcoord_id] = texcoord_id;
 }
 
 // Set the final height by removing unused space. Allocate the image buffer.
@@ -190,6 +223,7 @@ void IsaacTextureAtlas::resize_atlas() {
 
 // Scale the texcoords once the final atlas dimensions are known
 void IsaacTextureAtlas::scale_texcoords() {
+#pragma omp parallel for
   for (size_t tex_it = 0; tex_it < this->texcoords.size(); tex_it++) {
     texcoords[tex_it][0] /= this->width;
     texcoords[tex_it][1] /= this->height;
@@ -261,12 +295,79 @@ void isaac_build_model(mve::TriangleMesh::ConstPtr mesh,
   // TODO(oalexan1): remove unreferenced vertices/normals.
 }
 
+// Load a triangle mesh with happly, which reads binary files from a memory
+// map in large blocks rather than value by value. Return false if the file
+// has anything other than vertices (with optional normals) and triangles,
+// so that the caller can use mve's more general reader.
+bool loadPlyMesh(std::string const& mesh_file, mve::TriangleMesh::Ptr& mesh) {
+  std::vector<double> x, y, z, nx, ny, nz;
+  std::vector<unsigned int> indices;
+  std::vector<size_t> starts;
+  try {
+    happly::PLYData ply(mesh_file);
+    if (!ply.hasElement("vertex") || !ply.hasElement("face")) return false;
+    for (auto const& name : ply.getElementNames()) {
+      if (name != "vertex" && name != "face") return false;
+    }
+
+    happly::Element& vertex_elem = ply.getElement("vertex");
+    for (auto const& name : vertex_elem.getPropertyNames()) {
+      if (name != "x" && name != "y" && name != "z" &&
+          name != "nx" && name != "ny" && name != "nz")
+        return false;  // such as colors
+    }
+    x = vertex_elem.getProperty<double>("x");
+    y = vertex_elem.getProperty<double>("y");
+    z = vertex_elem.getProperty<double>("z");
+    if (vertex_elem.hasProperty("nx") && vertex_elem.hasProperty("ny") &&
+        vertex_elem.hasProperty("nz")) {
+      nx = vertex_elem.getProperty<double>("nx");
+      ny = vertex_elem.getProperty<double>("ny");
+      nz = vertex_elem.getProperty<double>("nz");
+    }
+
+    happly::Element& face_elem = ply.getElement("face");
+    std::string indices_name = "vertex_indices";
+    if (!face_elem.hasProperty(indices_name)) indices_name = "vertex_index";
+    std::vector<std::string> face_props = face_elem.getPropertyNames();
+    if (face_props.size() != 1 || face_props[0] != indices_name) return false;
+    face_elem.getListPropertyFlat<unsigned int>(indices_name, indices, starts);
+  } catch (std::exception const&) {
+    return false;
+  }
+
+  size_t num_vertices = x.size();
+  for (size_t face_it = 0; face_it + 1 < starts.size(); face_it++) {
+    if (starts[face_it + 1] - starts[face_it] != 3) return false;
+  }
+  for (size_t it = 0; it < indices.size(); it++) {
+    if (indices[it] >= num_vertices) return false;
+  }
+
+  mesh = mve::TriangleMesh::create();
+  mve::TriangleMesh::VertexList& vertices = mesh->get_vertices();
+  vertices.resize(num_vertices);
+  for (size_t it = 0; it < num_vertices; it++)
+    vertices[it] = math::Vec3f(x[it], y[it], z[it]);
+
+  if (nx.size() == num_vertices) {
+    mve::TriangleMesh::NormalList& normals = mesh->get_vertex_normals();
+    normals.resize(num_vertices);
+    for (size_t it = 0; it < num_vertices; it++)
+      normals[it] = math::Vec3f(nx[it], ny[it], nz[it]);
+  }
+
+  mesh->get_faces().swap(indices);
+  return true;
+}
+
 void loadMeshBuildTree(std::string const& mesh_file, mve::TriangleMesh::Ptr& mesh,
                        std::shared_ptr<mve::MeshInfo>& mesh_info,
                        std::shared_ptr<tex::Graph>& graph,
                        std::shared_ptr<BVHTree>& bvh_tree) {
   std::cout << "Loading mesh: " << mesh_file << std::endl;
-  mesh = mve::geom::load_ply_mesh(mesh_file);
+  if (!loadPlyMesh(mesh_file, mesh))
+    mesh = mve::geom::load_ply_mesh(mesh_file);
 
   mesh_info = std::shared_ptr<mve::MeshInfo>(new mve::MeshInfo(mesh));
   tex::prepare_mesh(mesh_info.get(), mesh);
@@ -299,6 +400,151 @@ math::Vec3f eigen_to_vec3f(Eigen::Vector3d const& V) {
   return v;
 }
 
+// Build the node for the faces face_order[beg], ..., face_order[end - 1]
+// and its descendants, splitting the faces in half along the longest
+// axis of the box of their centers. Return the index of the node.
+int64_t buildFaceTree(std::vector<math::Vec3f> const& vertices,
+                      std::vector<unsigned int> const& faces,
+                      int64_t beg, int64_t end, FaceGeometry& face_geom) {
+  // Each leaf has at most this many faces
+  int64_t leaf_size = 256;
+
+  std::vector<int64_t>& face_order = face_geom.face_order;  // alias
+  std::vector<Eigen::Vector3d> const& centers = face_geom.centers;  // alias
+
+  FaceTreeNode node;
+  node.beg = beg;
+  node.end = end;
+  node.left = -1;
+  node.right = -1;
+  int64_t node_id = face_geom.tree.size();
+  face_geom.tree.push_back(node);
+
+  if (end - beg <= leaf_size) {
+    // The leaf box bounds the face vertices
+    Eigen::Vector3d box_min = Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+    Eigen::Vector3d box_max = -box_min;
+    for (int64_t it = beg; it < end; it++) {
+      for (int vertex_it = 0; vertex_it < 3; vertex_it++) {
+        Eigen::Vector3d V = vec3f_to_eigen(vertices[faces[3 * face_order[it] + vertex_it]]);
+        box_min = box_min.cwiseMin(V);
+        box_max = box_max.cwiseMax(V);
+      }
+    }
+    face_geom.tree[node_id].box_min = box_min;
+    face_geom.tree[node_id].box_max = box_max;
+    return node_id;
+  }
+
+  Eigen::Vector3d ctr_min = Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+  Eigen::Vector3d ctr_max = -ctr_min;
+  for (int64_t it = beg; it < end; it++) {
+    ctr_min = ctr_min.cwiseMin(centers[face_order[it]]);
+    ctr_max = ctr_max.cwiseMax(centers[face_order[it]]);
+  }
+  int axis = 0;
+  (ctr_max - ctr_min).maxCoeff(&axis);
+
+  int64_t mid = beg + (end - beg) / 2;
+  std::nth_element(face_order.begin() + beg, face_order.begin() + mid,
+                   face_order.begin() + end, [&centers, axis](int64_t a, int64_t b) {
+                     return centers[a][axis] < centers[b][axis];
+                   });
+
+  // Note that face_geom.tree may be reallocated by these calls
+  int64_t left = buildFaceTree(vertices, faces, beg, mid, face_geom);
+  int64_t right = buildFaceTree(vertices, faces, mid, end, face_geom);
+  FaceTreeNode& curr = face_geom.tree[node_id];
+  curr.left = left;
+  curr.right = right;
+  curr.box_min = face_geom.tree[left].box_min.cwiseMin(face_geom.tree[right].box_min);
+  curr.box_max = face_geom.tree[left].box_max.cwiseMax(face_geom.tree[right].box_max);
+
+  return node_id;
+}
+
+// Find the center and normal of each mesh face
+void computeFaceGeometry(mve::TriangleMesh::ConstPtr mesh, FaceGeometry& face_geom) {
+  std::vector<math::Vec3f> const& vertices = mesh->get_vertices();
+  std::vector<unsigned int> const& faces = mesh->get_faces();
+  std::vector<math::Vec3f> const& face_normals = mesh->get_face_normals();
+
+  int64_t num_faces = faces.size() / 3;
+  if (static_cast<int64_t>(face_normals.size()) != num_faces)
+    LOG(FATAL) << "A mesh must have as many faces as face normals.";
+
+  face_geom.centers.resize(num_faces);
+  face_geom.normals.resize(num_faces);
+#pragma omp parallel for
+  for (int64_t face_id = 0; face_id < num_faces; face_id++) {
+    math::Vec3f const& v1 = vertices[faces[3 * face_id + 0]];
+    math::Vec3f const& v2 = vertices[faces[3 * face_id + 1]];
+    math::Vec3f const& v3 = vertices[faces[3 * face_id + 2]];
+    face_geom.centers[face_id] = vec3f_to_eigen((v1 + v2 + v3) / 3.0f);
+    face_geom.normals[face_id] = vec3f_to_eigen(face_normals[face_id]);
+  }
+
+  face_geom.face_order.resize(num_faces);
+  for (int64_t face_id = 0; face_id < num_faces; face_id++)
+    face_geom.face_order[face_id] = face_id;
+  face_geom.tree.clear();
+  if (num_faces > 0)
+    buildFaceTree(vertices, faces, 0, num_faces, face_geom);
+}
+
+// Find the faces in tree nodes which are not fully outside the
+// camera view frustum, in increasing order
+void frustumCullFaces(FaceGeometry const& face_geom, camera::CameraModel const& cam,
+                      std::vector<int64_t>& candidates) {
+  candidates.clear();
+  if (face_geom.tree.empty())
+    return;
+
+  // The planes bounding the frustum, in camera coordinates. They go
+  // through the camera center, so are given by their normals, which
+  // point out of the frustum. These agree with the bounds in
+  // CameraModel::DistortedImageCoordinates().
+  Eigen::Vector2d const& focal = cam.GetParameters().GetFocalVector();
+  Eigen::Vector2d const& half = cam.GetParameters().GetUndistortedHalfSize();
+  std::vector<Eigen::Vector3d> planes;
+  planes.push_back(Eigen::Vector3d( focal[0], 0.0, -half[0]).normalized());
+  planes.push_back(Eigen::Vector3d(-focal[0], 0.0, -half[0]).normalized());
+  planes.push_back(Eigen::Vector3d(0.0,  focal[1], -half[1]).normalized());
+  planes.push_back(Eigen::Vector3d(0.0, -focal[1], -half[1]).normalized());
+  planes.push_back(Eigen::Vector3d(0.0, 0.0, -1.0));  // behind the camera
+
+  // Descend only into nodes whose bounding sphere is not fully
+  // outside any of the planes
+  Eigen::Affine3d const& world_to_cam = cam.GetTransform();
+  std::vector<int64_t> stack(1, 0);
+  while (!stack.empty()) {
+    FaceTreeNode const& node = face_geom.tree[stack.back()];
+    stack.pop_back();
+
+    Eigen::Vector3d ctr = world_to_cam * (0.5 * (node.box_min + node.box_max));
+    double radius = 0.5 * (node.box_max - node.box_min).norm();
+    bool outside = false;
+    for (size_t it = 0; it < planes.size(); it++) {
+      if (planes[it].dot(ctr) > radius) {
+        outside = true;
+        break;
+      }
+    }
+    if (outside)
+      continue;
+
+    if (node.left < 0) {
+      for (int64_t it = node.beg; it < node.end; it++)
+        candidates.push_back(face_geom.face_order[it]);
+    } else {
+      stack.push_back(node.left);
+      stack.push_back(node.right);
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end());
+}
+
 void calculate_texture_size(double height_factor,
                             std::list<IsaacTexturePatch::ConstPtr> const& texture_patches,
                             int64_t& texture_width, int64_t& texture_height) {
@@ -456,10 +702,16 @@ void generate_texture_atlases(double height_factor,
     texture_atlases->push_back(IsaacTextureAtlas::create(texture_width, texture_height));
     IsaacTextureAtlas::Ptr texture_atlas = texture_atlases->back();
 
-    /* Try to insert each of the texture patches into the texture atlas. */
+    /* Try to place each of the texture patches in the texture atlas. This
+     * is sequential, but does not copy anything. */
+    std::vector<IsaacTexturePatch::ConstPtr> placed_patches;
+    std::vector<Eigen::Vector2d> placed_offsets;
     std::list<IsaacTexturePatch::ConstPtr>::iterator it = local_texture_patches.begin();
     for (; it != local_texture_patches.end();) {
-      if (texture_atlas->insert(*it)) {
+      Eigen::Vector2d offset;
+      if (texture_atlas->place(*it, offset)) {
+        placed_patches.push_back(*it);
+        placed_offsets.push_back(offset);
         it = local_texture_patches.erase(it);
         count++;
 
@@ -471,6 +723,9 @@ void generate_texture_atlases(double height_factor,
       }
     }
 
+    // Now add the faces and texcoords of the placed patches in parallel
+    texture_atlas->add_placed(placed_patches, placed_offsets);
+
     texture_atlas->finalize();  // this will change the atlas dimensions
   }
 
@@ -489,51 +744,6 @@ void generate_texture_atlases(double height_factor,
   return;
 }
 
-void isaac_save_model(IsaacObjModel* obj_model, std::string const& prefix) {
-  int64_t OBJ_INDEX_OFFSET = 1;
-
-  IsaacObjModel::Vertices const& vertices = obj_model->get_vertices();
-  IsaacObjModel::Normals const& normals = obj_model->get_normals();
-  IsaacObjModel::TexCoords const& texcoords = obj_model->get_texcoords();
-  IsaacObjModel::Groups const& groups = obj_model->get_groups();
-  MaterialLib const& material_lib = obj_model->get_material_lib();
-
-  material_lib.save_to_files(prefix);
-
-  std::string name = util::fs::basename(prefix);
-  std::ofstream out((prefix + ".obj").c_str());
-  if (!out.good()) throw util::FileException(prefix + ".obj", std::strerror(errno));
-
-  out << "mtllib " << name << ".mtl" << "\n";
-
-  out << std::setprecision(16);
-  for (std::size_t i = 0; i < vertices.size(); i++)
-    out << "v " << vertices[i][0] << " " << vertices[i][1] << " " << vertices[i][2] << "\n";
-
-  // Here use 1.0 rather than 1.0f to not lose precision
-  for (std::size_t i = 0; i < texcoords.size(); i++)
-    out << "vt " << texcoords[i][0] << " " << 1.0 - texcoords[i][1] << "\n";
-
-  for (std::size_t i = 0; i < normals.size(); i++)
-    out << "vn " << normals[i][0] << " " << normals[i][1] << " " << normals[i][2] << "\n";
-
-  for (std::size_t i = 0; i < groups.size(); i++) {
-    out << "usemtl " << groups[i].material_name << "\n";
-    for (std::size_t j = 0; j < groups[i].faces.size(); j++) {
-      IsaacObjModel::Face const& face = groups[i].faces[j];
-      out << "f";
-      for (std::size_t k = 0; k < 3; ++k) {
-        out << " "
-            << face.vertex_ids[k] + OBJ_INDEX_OFFSET << "/"   // NOLINT
-            << face.texcoord_ids[k] + OBJ_INDEX_OFFSET << "/" // NOLINT
-            << face.normal_ids[k] + OBJ_INDEX_OFFSET;         // NOLINT
-      }
-      out << "\n";
-    }
-  }
-  out.close();
-}
-
 typedef std::pair<double, double> pointPair;
 
 // Find the intersection of two lines. Return true if the intersection succeeded.
@@ -720,7 +930,7 @@ void formModel(mve::TriangleMesh::ConstPtr mesh, double pixel_size, int64_t num_
   std::vector<IsaacTexturePatch::ConstPtr> texture_patches(num_faces);
 
   double total_area = 0.0;
-#pragma omp parallel for
+#pragma omp parallel for reduction(+:total_area)
   for (int64_t face_id = 0; face_id < num_faces; face_id++) {
     math::Vec3f const& v1 = vertices[faces[3 * face_id + 0]];
     math::Vec3f const& v2 = vertices[faces[3 * face_id + 1]];
@@ -881,6 +1091,135 @@ void formModel(mve::TriangleMesh::ConstPtr mesh, double pixel_size, int64_t num_
   std::cout << "Forming the model took: " << timer.get_elapsed() / 1000.0 << " seconds\n";
 }
 
+// Write text to a file, or to a string, via a large buffer. Numbers
+// are formatted without the overhead of std::ostream. Floating point
+// values have 16 significant digits, as with std::setprecision(16),
+// so the output is the same as before.
+class BufferedTextWriter {
+ public:
+  // Write to a string, which is retrieved with str()
+  BufferedTextWriter(): m_fp(NULL) {}
+
+  // Write to a file. Check with good() if it could be opened.
+  explicit BufferedTextWriter(std::string const& filename): m_fp(NULL) {
+    m_fp = fopen(filename.c_str(), "wb");
+    m_buf.reserve(BUF_SIZE + 64);
+  }
+
+  ~BufferedTextWriter() {
+    flush();
+    if (m_fp != NULL) fclose(m_fp);
+  }
+
+  bool good() const { return m_fp != NULL; }
+
+  void addText(char const* text) {
+    m_buf.append(text);
+    maybeFlush();
+  }
+
+  void addText(std::string const& text) {
+    m_buf.append(text);
+    maybeFlush();
+  }
+
+  void addDouble(double val) {
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%.16g", val);
+    m_buf.append(tmp, len);
+    maybeFlush();
+  }
+
+  void addInt(int64_t val) {
+    char tmp[32];
+    int len = 0;
+    uint64_t uval = val < 0 ? -static_cast<uint64_t>(val) : static_cast<uint64_t>(val);
+    do {
+      tmp[len++] = '0' + uval % 10;
+      uval /= 10;
+    } while (uval > 0);
+    if (val < 0) tmp[len++] = '-';
+    std::reverse(tmp, tmp + len);
+    m_buf.append(tmp, len);
+    maybeFlush();
+  }
+
+  // The text so far, when writing to a string
+  std::string& str() { return m_buf; }
+
+  // Write the buffered text to the file, if writing to a file
+  void flush() {
+    if (m_fp == NULL || m_buf.empty()) return;
+    if (fwrite(m_buf.data(), 1, m_buf.size(), m_fp) != m_buf.size())
+      LOG(FATAL) << "Failed writing to disk.\n";
+    m_buf.clear();
+  }
+
+ private:
+  static const size_t BUF_SIZE = 1 << 22;
+
+  void maybeFlush() {
+    if (m_buf.size() >= BUF_SIZE) flush();
+  }
+
+  FILE* m_fp;
+  std::string m_buf;
+};
+
+// Write the obj file for the given model, using the material file
+// mtl_prefix.mtl
+void writeObjText(IsaacObjModel& texture_model, std::string const& mtl_prefix,
+                  BufferedTextWriter& out) {
+  std::vector<math::Vec3f> const& vertices = texture_model.get_vertices();
+  std::vector<Eigen::Vector2d> const& texcoords = texture_model.get_texcoords();
+  std::vector<math::Vec3f> const& normals = texture_model.get_normals();
+  std::vector<IsaacObjModel::Group> const& groups = texture_model.get_groups();
+
+  out.addText("mtllib " + mtl_prefix + ".mtl\n");
+
+  // Must have high precision, as otherwise for large .obj files a loss of precision
+  // will happen when the normalized texcoords are not saved with enough digits
+  // and then on loading are multiplied back by the large texture dimensions.
+  // The writer uses 16 digits.
+  for (std::size_t i = 0; i < vertices.size(); i++) {
+    out.addText("v ");
+    out.addDouble(vertices[i][0]); out.addText(" ");
+    out.addDouble(vertices[i][1]); out.addText(" ");
+    out.addDouble(vertices[i][2]); out.addText("\n");
+  }
+
+  // Here use 1.0 rather than 1.0f to not lose precision
+  for (std::size_t i = 0; i < texcoords.size(); i++) {
+    out.addText("vt ");
+    out.addDouble(texcoords[i][0]); out.addText(" ");
+    out.addDouble(1.0 - texcoords[i][1]); out.addText("\n");
+  }
+
+  for (std::size_t i = 0; i < normals.size(); i++) {
+    out.addText("vn ");
+    out.addDouble(normals[i][0]); out.addText(" ");
+    out.addDouble(normals[i][1]); out.addText(" ");
+    out.addDouble(normals[i][2]); out.addText("\n");
+  }
+
+  int64_t OBJ_INDEX_OFFSET = 1;  // have indices start from 1
+
+  for (std::size_t i = 0; i < groups.size(); i++) {
+    out.addText("usemtl " + groups[i].material_name + "\n");
+    for (std::size_t j = 0; j < groups[i].faces.size(); j++) {
+      IsaacObjModel::Face const& face = groups[i].faces[j];
+      out.addText("f");
+      for (std::size_t k = 0; k < 3; ++k) {
+        out.addText(" ");
+        out.addInt(face.vertex_ids[k] + OBJ_INDEX_OFFSET);   out.addText("/");
+        out.addInt(face.texcoord_ids[k] + OBJ_INDEX_OFFSET); out.addText("/");
+        out.addInt(face.normal_ids[k] + OBJ_INDEX_OFFSET);
+      }
+      out.addText("\n");
+    }
+  }
+}
+
 void formMtl(std::string const& out_prefix, std::string& mtl_str) {
   std::ostringstream ofs;
   ofs << "newmtl material0000\n";
@@ -894,110 +1233,291 @@ void formMtl(std::string const& out_prefix, std::string& mtl_str) {
   mtl_str = ofs.str();
 }
 
-void formObjCustomUV(mve::TriangleMesh::ConstPtr mesh, std::vector<Eigen::Vector3i> const& face_vec,
-                     std::map<int, Eigen::Vector2d> const& uv_map, std::string const& out_prefix,
-                     std::string& obj_str) {
+// Write the obj file for a mesh with the given textured faces and
+// per-vertex (u, v) values, using the material file mtl_prefix.mtl
+void writeObjCustomUVText(mve::TriangleMesh::ConstPtr mesh,
+                          std::vector<Eigen::Vector3i> const& face_vec,
+                          std::vector<Eigen::Vector2d> const& vertex_uv,
+                          std::string const& mtl_prefix, BufferedTextWriter& out) {
   // Get handles to the vertices and vertex normals
   std::vector<math::Vec3f> const& vertices = mesh->get_vertices();
   std::vector<math::Vec3f> const& mesh_normals = mesh->get_vertex_normals();
   if (vertices.size() != mesh_normals.size())
     LOG(FATAL) << "A mesh must have as many vertices as vertex normals.";
 
-  // The uv_map assigns to each of the mesh vertices that is visible
-  // in the texture its (u, v) pair. Find the map from each vertex
-  // index to the index in the list of (u, v) pairs.
-  std::map<int, int> vertex_to_uv;
+  if (vertex_uv.size() != vertices.size())
+    LOG(FATAL) << "There must be one (u, v) pair per mesh vertex.";
+
+  // Only the vertices of the given faces are visible in the
+  // texture. Find the map from each such vertex index to the index in
+  // the list of (u, v) pairs. The pairs are in increasing order of
+  // vertex index.
+  std::vector<int64_t> vertex_to_uv(vertices.size(), -1);
+  for (std::size_t j = 0; j < face_vec.size(); j++) {
+    for (std::size_t k = 0; k < 3; k++)
+      vertex_to_uv[face_vec[j][k]] = 0;
+  }
   int64_t count = 0;
-  for (auto it = uv_map.begin(); it != uv_map.end(); it++) {
-    vertex_to_uv[it->first] = count;
+  for (std::size_t i = 0; i < vertex_to_uv.size(); i++) {
+    if (vertex_to_uv[i] < 0)
+      continue;
+    vertex_to_uv[i] = count;
     count++;
   }
 
-  std::ostringstream out;
+  out.addText("mtllib " + mtl_prefix + ".mtl\n");
 
-  out << "mtllib " << out_prefix << ".mtl\n";
-
-  out << std::setprecision(16);
   for (std::size_t i = 0; i < vertices.size(); i++) {
-    out << "v " << vertices[i][0] << " " << vertices[i][1] << " " << vertices[i][2] << "\n";
+    out.addText("v ");
+    out.addDouble(vertices[i][0]); out.addText(" ");
+    out.addDouble(vertices[i][1]); out.addText(" ");
+    out.addDouble(vertices[i][2]); out.addText("\n");
   }
 
-  for (auto it = uv_map.begin(); it != uv_map.end(); it++)
-    out << "vt " << (it->second)[0] << " " << (it->second)[1] << "\n";
+  for (std::size_t i = 0; i < vertex_to_uv.size(); i++) {
+    if (vertex_to_uv[i] >= 0) {
+      out.addText("vt ");
+      out.addDouble(vertex_uv[i][0]); out.addText(" ");
+      out.addDouble(vertex_uv[i][1]); out.addText("\n");
+    }
+  }
 
-  for (std::size_t i = 0; i < mesh_normals.size(); i++)
-    out << "vn " << mesh_normals[i][0] << " " << mesh_normals[i][1] << " "
-        << mesh_normals[i][2] << "\n";
+  for (std::size_t i = 0; i < mesh_normals.size(); i++) {
+    out.addText("vn ");
+    out.addDouble(mesh_normals[i][0]); out.addText(" ");
+    out.addDouble(mesh_normals[i][1]); out.addText(" ");
+    out.addDouble(mesh_normals[i][2]); out.addText("\n");
+  }
 
   int64_t OBJ_INDEX_OFFSET = 1;  // have indices start from 1
   for (std::size_t j = 0; j < face_vec.size(); j++) {
-    out << "f";
+    out.addText("f");
     for (std::size_t k = 0; k < 3; ++k) {
-      out << " " << face_vec[j][k] + OBJ_INDEX_OFFSET << "/"
-          << vertex_to_uv[face_vec[j][k]] + OBJ_INDEX_OFFSET << "/"
-          << face_vec[j][k] + OBJ_INDEX_OFFSET;
+      out.addText(" ");
+      out.addInt(face_vec[j][k] + OBJ_INDEX_OFFSET);               out.addText("/");
+      out.addInt(vertex_to_uv[face_vec[j][k]] + OBJ_INDEX_OFFSET); out.addText("/");
+      out.addInt(face_vec[j][k] + OBJ_INDEX_OFFSET);
     }
-    out << "\n";
+    out.addText("\n");
   }
-  obj_str = out.str();
 }
 
-void formObj(IsaacObjModel& texture_model, std::string const& out_prefix, std::string& obj_str) {
-  std::vector<math::Vec3f> const& vertices = texture_model.get_vertices();
-  std::vector<Eigen::Vector2d> const& texcoords = texture_model.get_texcoords();
-  std::vector<math::Vec3f> const& normals = texture_model.get_normals();
-  std::vector<IsaacObjModel::Group> const& groups = texture_model.get_groups();
+void formObjCustomUV(mve::TriangleMesh::ConstPtr mesh, std::vector<Eigen::Vector3i> const& face_vec,
+                     std::vector<Eigen::Vector2d> const& vertex_uv, std::string const& out_prefix,
+                     std::string& obj_str) {
+  BufferedTextWriter out;
+  writeObjCustomUVText(mesh, face_vec, vertex_uv, out_prefix, out);
+  obj_str.swap(out.str());
+}
 
-  std::ostringstream out;
+// Write the obj file directly to disk, without first forming it in memory
+void saveObjCustomUV(mve::TriangleMesh::ConstPtr mesh, std::vector<Eigen::Vector3i> const& face_vec,
+                     std::vector<Eigen::Vector2d> const& vertex_uv, std::string const& out_prefix,
+                     std::string const& obj_file) {
+  BufferedTextWriter out(obj_file);
+  if (!out.good())
+    LOG(FATAL) << "Cannot write: " << obj_file << "\n";
+  writeObjCustomUVText(mesh, face_vec, vertex_uv, out_prefix, out);
+}
 
-  out << "mtllib " << out_prefix << ".mtl\n";
+// Save the mesh with the given textured faces and per-vertex (u, v)
+// values as a binary ply file. The texture image is recorded in a
+// comment, as is the convention.
+void saveTexturedPly(mve::TriangleMesh::ConstPtr mesh,
+                     std::vector<Eigen::Vector3i> const& face_vec,
+                     std::vector<Eigen::Vector2d> const& vertex_uv,
+                     std::string const& texture_file, std::string const& ply_file) {
+  std::vector<math::Vec3f> const& vertices = mesh->get_vertices();
+  std::vector<math::Vec3f> const& mesh_normals = mesh->get_vertex_normals();
+  if (vertices.size() != mesh_normals.size() || vertex_uv.size() != vertices.size())
+    LOG(FATAL) << "A mesh must have as many vertices as vertex normals and (u, v) pairs.";
+
+  size_t num_vertices = vertices.size();
+  std::vector<float> x(num_vertices), y(num_vertices), z(num_vertices);
+  std::vector<float> nx(num_vertices), ny(num_vertices), nz(num_vertices);
+  std::vector<float> u(num_vertices), v(num_vertices);
+  for (size_t it = 0; it < num_vertices; it++) {
+    x[it] = vertices[it][0];      y[it] = vertices[it][1];      z[it] = vertices[it][2];
+    nx[it] = mesh_normals[it][0]; ny[it] = mesh_normals[it][1]; nz[it] = mesh_normals[it][2];
+    u[it] = vertex_uv[it][0];     v[it] = vertex_uv[it][1];
+  }
 
-  // Must have high precision, as otherwise for large .obj files a loss of precision
-  // will happen when the normalized texcoords are not saved with enough digits
-  // and then on loading are multiplied back by the large texture dimensions.
-  out << std::setprecision(16);
+  std::vector<std::vector<int>> ply_faces(face_vec.size());
+  for (size_t it = 0; it < face_vec.size(); it++)
+    ply_faces[it] = {face_vec[it][0], face_vec[it][1], face_vec[it][2]};
+
+  happly::PLYData ply;
+  ply.comments.push_back("TextureFile " + texture_file);
+  ply.addElement("vertex", num_vertices);
+  happly::Element& vertex_elem = ply.getElement("vertex");
+  vertex_elem.addProperty<float>("x", x);
+  vertex_elem.addProperty<float>("y", y);
+  vertex_elem.addProperty<float>("z", z);
+  vertex_elem.addProperty<float>("nx", nx);
+  vertex_elem.addProperty<float>("ny", ny);
+  vertex_elem.addProperty<float>("nz", nz);
+  vertex_elem.addProperty<float>("texture_u", u);
+  vertex_elem.addProperty<float>("texture_v", v);
+  ply.addElement("face", ply_faces.size());
+  ply.getElement("face").addListProperty<int>("vertex_indices", ply_faces);
+
+  std::cout << "Writing: " << ply_file << std::endl;
+  ply.write(ply_file, happly::DataFormat::Binary);
+}
 
-  for (std::size_t i = 0; i < vertices.size(); i++)
-    out << "v " << vertices[i][0] << " " << vertices[i][1] << " " << vertices[i][2] << "\n";
+void formObj(IsaacObjModel& texture_model, std::string const& out_prefix, std::string& obj_str) {
+  BufferedTextWriter out;
+  writeObjText(texture_model, out_prefix, out);
+  obj_str.swap(out.str());
+}
 
-  // Here use 1.0 rather than 1.0f to not lose precision
-  for (std::size_t i = 0; i < texcoords.size(); i++)
-    out << "vt " << texcoords[i][0] << " " << 1.0 - texcoords[i][1] << "\n";
+// Write the obj file directly to disk, without first forming it in memory
+void saveObj(IsaacObjModel& texture_model, std::string const& out_prefix,
+             std::string const& obj_file) {
+  BufferedTextWriter out(obj_file);
+  if (!out.good())
+    LOG(FATAL) << "Cannot write: " << obj_file << "\n";
+  writeObjText(texture_model, out_prefix, out);
+}
 
-  for (std::size_t i = 0; i < normals.size(); i++)
-    out << "vn " << normals[i][0] << " " << normals[i][1] << " " << normals[i][2] << "\n";
+void isaac_save_model(IsaacObjModel* obj_model, std::string const& prefix) {
+  MaterialLib const& material_lib = obj_model->get_material_lib();
+  material_lib.save_to_files(prefix);
 
-  int64_t OBJ_INDEX_OFFSET = 1;  // have indices start from 1
+  std::string name = util::fs::basename(prefix);
+  BufferedTextWriter out(prefix + ".obj");
+  if (!out.good()) throw util::FileException(prefix + ".obj", std::strerror(errno));
+  writeObjText(*obj_model, name, out);
+}
 
-  for (std::size_t i = 0; i < groups.size(); i++) {
-    out << "usemtl " << groups[i].material_name << "\n";
-    for (std::size_t j = 0; j < groups[i].faces.size(); j++) {
-      IsaacObjModel::Face const& face = groups[i].faces[j];
-      out << "f";
-      for (std::size_t k = 0; k < 3; ++k) {
-        out << " "                                             // NOLINT
-            << face.vertex_ids[k]   + OBJ_INDEX_OFFSET << "/"  // NOLINT
-            << face.texcoord_ids[k] + OBJ_INDEX_OFFSET << "/"  // NOLINT
-            << face.normal_ids[k]   + OBJ_INDEX_OFFSET;        // NOLINT
-      }
-      out << "\n";
+// Project all mesh vertices into the camera, in batches, returning
+// the distorted pixels. See CameraModel::DistortedImageCoordinates()
+// for when a vertex is valid.
+void projectVertices(std::vector<math::Vec3f> const& vertices, camera::CameraModel const& cam,
+                     // Outputs
+                     camera::PixelBatch& dist_pixels, camera::MaskBatch& valid) {
+  int64_t num_vertices = vertices.size();
+  dist_pixels.resize(num_vertices, 2);
+  valid.resize(num_vertices);
+
+  // Work in chunks, to not use a lot of memory for intermediate results
+  int64_t chunk_size = 1 << 16;
+  int64_t num_chunks = (num_vertices + chunk_size - 1) / chunk_size;
+#pragma omp parallel for
+  for (int64_t chunk = 0; chunk < num_chunks; chunk++) {
+    int64_t beg = chunk * chunk_size;
+    int64_t len = std::min(chunk_size, num_vertices - beg);
+
+    camera::PointBatch points(len, 3);
+    for (int64_t it = 0; it < len; it++) {
+      for (int coord = 0; coord < 3; coord++)
+        points(it, coord) = vertices[beg + it][coord];
     }
+
+    camera::PixelBatch chunk_pixels;
+    camera::MaskBatch chunk_valid;
+    cam.DistortedImageCoordinates(points, &chunk_pixels, &chunk_valid);
+    dist_pixels.middleRows(beg, len) = chunk_pixels;
+    valid.segment(beg, len) = chunk_valid;
+  }
+}
+
+// Project into the camera only the vertices of the given faces. The
+// other vertices are marked as invalid.
+void projectFaceVertices(std::vector<math::Vec3f> const& vertices,
+                         std::vector<unsigned int> const& faces,
+                         std::vector<int64_t> const& face_ids,
+                         camera::CameraModel const& cam,
+                         // Outputs
+                         camera::PixelBatch& vertex_pixels, camera::MaskBatch& vertex_valid) {
+  std::vector<char> is_used(vertices.size(), 0);
+  for (size_t it = 0; it < face_ids.size(); it++) {
+    for (int vertex_it = 0; vertex_it < 3; vertex_it++)
+      is_used[faces[3 * face_ids[it] + vertex_it]] = 1;
   }
 
-  obj_str = out.str();
+  std::vector<int64_t> used_ids;
+  std::vector<math::Vec3f> used_vertices;
+  for (size_t vertex_id = 0; vertex_id < vertices.size(); vertex_id++) {
+    if (!is_used[vertex_id])
+      continue;
+    used_ids.push_back(vertex_id);
+    used_vertices.push_back(vertices[vertex_id]);
+  }
+
+  camera::PixelBatch used_pixels;
+  camera::MaskBatch used_valid;
+  projectVertices(used_vertices, cam, used_pixels, used_valid);
+
+  vertex_pixels = camera::PixelBatch::Zero(vertices.size(), 2);
+  vertex_valid = camera::MaskBatch::Constant(vertices.size(), false);
+  for (size_t it = 0; it < used_ids.size(); it++) {
+    vertex_pixels.row(used_ids[it]) = used_pixels.row(it);
+    vertex_valid[used_ids[it]] = used_valid[it];
+  }
+}
+
+// Find the cost of texturing a face from a camera with the given
+// center. Return false if the face points away from the camera, is
+// seen at too oblique an angle, or has a smaller cost already.
+bool faceCostForCamera(FaceGeometry const& face_geom, int64_t face_id,
+                       Eigen::Vector3d const& cam_ctr, double smallest_cost,
+                       double& cost_val) {
+  Eigen::Vector3d face_to_cam_vec = cam_ctr - face_geom.centers[face_id];
+  double face_to_cam_dist = face_to_cam_vec.norm();
+  double face_normal_to_cam_dot_prod
+    = face_to_cam_vec.dot(face_geom.normals[face_id]) / face_to_cam_dist;
+
+  if (face_normal_to_cam_dot_prod <= 0.0) return false;  // The face points away from the camera
+
+  // Angle between face normal and ray from face center to camera center
+  // is bigger than 75 degrees.
+  // TODO(oalexan1): Make this a parameter.
+  // TODO(oalexan1): Filter by distance from each of
+  // v1, v2, v3 to view_pos.
+  double face_normal_to_cam_angle = std::acos(face_normal_to_cam_dot_prod);  // radians
+  if (face_normal_to_cam_angle > 75.0 * M_PI / 180.0) return false;
+
+  // The further a camera is and the bigger then angle between the
+  // camera direction and the face normal, the less we want this
+  // camera's texture for this triangle.
+  cost_val = face_normal_to_cam_angle + face_to_cam_dist;
+  return (cost_val < smallest_cost);
+}
+
+// Return true if rays from the face vertices to the camera center
+// do not intersect the mesh somewhere else.
+bool faceVerticesSeeCamera(std::vector<math::Vec3f> const& vertices,
+                           unsigned int const* face_vertices,
+                           Eigen::Vector3d const& cam_ctr,
+                           std::shared_ptr<BVHTree> const& bvh_tree) {
+  for (std::size_t vertex_it = 0; vertex_it < 3; vertex_it++) {
+    BVHTree::Ray ray;
+    ray.origin = vertices[face_vertices[vertex_it]];
+    ray.dir = eigen_to_vec3f(cam_ctr) - ray.origin;
+    ray.tmax = ray.dir.norm();
+    ray.tmin = ray.tmax * 0.0001f;
+    ray.dir.normalize();
+
+    BVHTree::Hit hit;
+    if (bvh_tree->intersect(ray, &hit))
+      return false;
+  }
+  return true;
 }
 
 // Project texture and find the UV coordinates
 void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> bvh_tree,
+                    FaceGeometry const& face_geom,
                     cv::Mat const& image,
                     camera::CameraModel const& cam,
                     // outputs
                     std::vector<double>& smallest_cost_per_face,
                     std::vector<Eigen::Vector3i>& face_vec,
-                    std::map<int, Eigen::Vector2d>& uv_map) {
+                    std::vector<Eigen::Vector2d>& vertex_uv) {
   // Wipe the outputs
   face_vec.clear();
-  uv_map.clear();
+  vertex_uv.clear();
 
   // Here need to take into account that for real (not simulated)
   // images the camera may have been calibrated at 1/4 the original
@@ -1028,141 +1548,85 @@ void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> b
     LOG(FATAL) << "A mesh must have as many vertices as vertex normals.";
 
   std::vector<unsigned int> const& faces = mesh->get_faces();
-  std::vector<math::Vec3f> const& face_normals = mesh->get_face_normals();
+  int64_t num_faces = faces.size() / 3;
 
   if (smallest_cost_per_face.size() != faces.size())
     LOG(FATAL) << "There must be one cost value per face.";
+  if (static_cast<int64_t>(face_geom.centers.size()) != num_faces)
+    LOG(FATAL) << "The face geometry does not match the mesh.";
+
+  // Skip the faces in parts of the mesh outside the camera view
+  std::vector<int64_t> candidates;
+  frustumCullFaces(face_geom, cam, candidates);
+  int64_t num_candidates = candidates.size();
+
+  // Project each vertex only once, rather than for each face it is in
+  camera::PixelBatch vertex_pixels;
+  camera::MaskBatch vertex_valid;
+  projectFaceVertices(vertices, faces, candidates, cam, vertex_pixels, vertex_valid);
+
+  // Skip pixels that don't project in the window of dimensions
+  // dist_crop_size centered at the image center. Note that
+  // dist_crop_size is read from the camera configuration, and is
+  // normally either the full image or something smaller if the
+  // user restricts the domain of validity of the distortion
+  // model.
+  Eigen::Vector2i dist_size      = cam.GetParameters().GetDistortedSize();
+  Eigen::Vector2i dist_crop_size = cam.GetParameters().GetDistortedCropSize();
+  vertex_valid = vertex_valid &&
+    ((vertex_pixels.col(0).array() - dist_size[0] / 2.0).abs() <= dist_crop_size[0] / 2.0) &&
+    ((vertex_pixels.col(1).array() - dist_size[1] / 2.0).abs() <= dist_crop_size[1] / 2.0);
+
+  // The (u, v) coordinates of each vertex depend only on its pixel
+  vertex_uv.resize(vertices.size());
+  for (std::size_t vertex_id = 0; vertex_id < vertices.size(); vertex_id++) {
+    // TODO(oalexan1): Maybe use:
+    // v = (calib_image_rows - 1 - dist_pix.y())/image_rows ?
+    vertex_uv[vertex_id] = Eigen::Vector2d(vertex_pixels(vertex_id, 0) / calib_image_cols,
+                                           1.0 - vertex_pixels(vertex_id, 1) / calib_image_rows);
+  }
 
-#pragma omp parallel for
-  for (std::size_t face_id = 0; face_id < faces.size() / 3; face_id++) {
-    math::Vec3f const& v1 = vertices[faces[3 * face_id + 0]];
-    math::Vec3f const& v2 = vertices[faces[3 * face_id + 1]];
-    math::Vec3f const& v3 = vertices[faces[3 * face_id + 2]];
-    math::Vec3f const& face_normal = face_normals[face_id];
-    math::Vec3f const face_center = (v1 + v2 + v3) / 3.0f;
-
+  // Each face is processed by one iteration only, which then owns its
+  // entries in smallest_cost_per_face and is_textured, so the threads
+  // need no synchronization. The textured faces are collected at the end.
+  std::vector<char> is_textured(num_faces, 0);
+#pragma omp parallel for schedule(dynamic, 256)
+  for (int64_t cand_it = 0; cand_it < num_candidates; cand_it++) {
+    int64_t face_id = candidates[cand_it];
     // Do some geometric checks and compute the cost for this face and camera
-
-    Eigen::Vector3d cam_to_face_vec = (vec3f_to_eigen(face_center) - cam_ctr).normalized();
-    Eigen::Vector3d face_to_cam_vec = -cam_to_face_vec;
-    double face_normal_to_cam_dot_prod = face_to_cam_vec.dot(vec3f_to_eigen(face_normal));
-
-    if (face_normal_to_cam_dot_prod <= 0.0) continue;  // The face points away from the camera
-
-    // Angle between face normal and ray from face center to camera center
-    // is bigger than 75 degrees.
-    // TODO(oalexan1): Make this a parameter.
-    // TODO(oalexan1): Filter by distance from each of
-    // v1, v2, v3 to view_pos.
-    double face_normal_to_cam_angle = std::acos(face_normal_to_cam_dot_prod);  // radians
-    if (face_normal_to_cam_angle > 75.0 * M_PI / 180.0) continue;
-
-    // The further a camera is and the bigger then angle between the
-    // camera direction and the face normal, the less we want this
-    // camera's texture for this triangle.
-    double cost_val = face_normal_to_cam_angle + (vec3f_to_eigen(face_center) - cam_ctr).norm();
-    if (cost_val >= smallest_cost_per_face[face_id]) {
+    double cost_val = 0.0;
+    if (!faceCostForCamera(face_geom, face_id, cam_ctr, smallest_cost_per_face[face_id],
+                           cost_val))
       continue;
-    }
 
     // A mesh triangle is visible if rays from its vertices do not
     // intersect the mesh somewhere else before hitting the camera,
-    // and hit the camera inside the image bounds.
-    bool visible = true;
-    math::Vec3f const* samples[] = {&v1, &v2, &v3};
-
-    std::vector<Eigen::Vector2d> UV;
-    for (std::size_t vertex_it = 0; vertex_it < 3; vertex_it++) {
-      BVHTree::Ray ray;
-      ray.origin = *samples[vertex_it];
-      ray.dir = eigen_to_vec3f(cam_ctr) - ray.origin;
-      ray.tmax = ray.dir.norm();
-      ray.tmin = ray.tmax * 0.0001f;
-      ray.dir.normalize();
-
-      BVHTree::Hit hit;
-      if (bvh_tree->intersect(ray, &hit)) {
-        visible = false;
-        break;
-      }
-
-      // Triangle vertex in world coordinates
-      Eigen::Vector3d world_pt = vec3f_to_eigen(*samples[vertex_it]);
-
-      // Transform the vertex to camera coordinates
-      Eigen::Affine3d const& world2cam = cam.GetTransform();
-      Eigen::Vector3d cam_pt = world2cam * world_pt;
-
-      // Skip points that project behind the camera
-      if (cam_pt.z() <= 0) {
-        visible = false;
-        break;
-      }
-
-      // Get the undistorted pixel
-      Eigen::Vector2d undist_centered_pix =
-        cam.GetParameters().GetFocalVector().cwiseProduct(cam_pt.hnormalized());
-      if (std::abs(undist_centered_pix[0]) > cam.GetParameters().GetUndistortedHalfSize()[0] ||
-          std::abs(undist_centered_pix[1]) > cam.GetParameters().GetUndistortedHalfSize()[1]) {
-        // If we are out of acceptable undistorted region, there's some uncertainty whether
-        // the distortion computation in the next operation will work, so quit early.
-        visible = false;
-        break;
-      }
-
-      // Get the distorted pixel value
-      Eigen::Vector2d dist_pix;
-      cam.GetParameters().Convert<camera::UNDISTORTED_C, camera::DISTORTED>
-        (undist_centered_pix, &dist_pix);
-
-      // Skip pixels that don't project in the window of dimensions
-      // dist_crop_size centered at the image center. Note that
-      // dist_crop_size is read from the camera configuration, and is
-      // normally either the full image or something smaller if the
-      // user restricts the domain of validity of the distortion
-      // model.
-      Eigen::Vector2i dist_size      = cam.GetParameters().GetDistortedSize();
-      Eigen::Vector2i dist_crop_size = cam.GetParameters().GetDistortedCropSize();
-      if (std::abs(dist_pix[0] - dist_size[0] / 2.0) > dist_crop_size[0] / 2.0  ||
-          std::abs(dist_pix[1] - dist_size[1] / 2.0) > dist_crop_size[1] / 2.0) {
-        visible = false;
-        break;
-      }
-      
-      // Find the u, v coordinates of each vertex
-      double u = dist_pix.x() / calib_image_cols;
-      // TODO(oalexan1): Maybe use:
-      // v = (calib_image_rows - 1 - dist_pix.y())/image_rows ?
-      double v = 1.0 - dist_pix.y() / calib_image_rows;
-
-      UV.push_back(Eigen::Vector2d(u, v));
-    }
-
-    if (!visible) continue;
-
-#pragma omp critical
-    {
-      // Here we integrate the results from each loop iteration so have
-      // to use a lock (critical section).
-
-      // Sanity check, to ensure nothing got mixed up with the multiple
-      // threads
-      if (cost_val >= smallest_cost_per_face[face_id])
-        LOG(FATAL) << "Book-keeping error in estimating cost per face.";
-
-      smallest_cost_per_face[face_id] = cost_val;
-
-      for (std::size_t vertex_it = 0; vertex_it < 3; vertex_it++)
-        uv_map[faces[3 * face_id + vertex_it]] = UV[vertex_it];
+    // and hit the camera inside the image bounds. Check first if the
+    // vertices project in the image, as that is cheaper than ray
+    // tracing.
+    unsigned int const* face_vertices = &faces[3 * face_id];
+    if (!vertex_valid[face_vertices[0]] || !vertex_valid[face_vertices[1]] ||
+        !vertex_valid[face_vertices[2]])
+      continue;
+    if (!faceVerticesSeeCamera(vertices, face_vertices, cam_ctr, bvh_tree))
+      continue;
 
-      face_vec.push_back(Eigen::Vector3i(faces[3 * face_id + 0], faces[3 * face_id + 1], faces[3 * face_id + 2]));
-    }
+    smallest_cost_per_face[face_id] = cost_val;
+    is_textured[face_id] = 1;
   }  // End loop over mesh faces
+
+  for (int64_t cand_it = 0; cand_it < num_candidates; cand_it++) {
+    int64_t face_id = candidates[cand_it];
+    if (is_textured[face_id])
+      face_vec.push_back(Eigen::Vector3i(faces[3 * face_id + 0], faces[3 * face_id + 1],
+                                         faces[3 * face_id + 2]));
+  }
 }
 
 // Project texture using a texture model that was already pre-filled, so
 // just update pixel values
 void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> bvh_tree,
+                    FaceGeometry const& face_geom,
                     cv::Mat const& image, camera::CameraModel const& cam,
                     std::vector<double>& smallest_cost_per_face, double pixel_size,
                     int64_t num_threads, std::vector<FaceInfo> const& face_projection_info,
@@ -1215,116 +1679,61 @@ void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> b
     LOG(FATAL) << "A mesh must have as many vertices as vertex normals.";
 
   std::vector<unsigned int> const& faces = mesh->get_faces();
-  std::vector<math::Vec3f> const& face_normals = mesh->get_face_normals();
+  int64_t num_faces = faces.size() / 3;
 
   if (smallest_cost_per_face.size() != faces.size())
     LOG(FATAL) << "There must be one cost value per face.";
-
-#pragma omp parallel for
-  for (std::size_t face_id = 0; face_id < faces.size() / 3; face_id++) {
-    math::Vec3f const& v1 = vertices[faces[3 * face_id + 0]];
-    math::Vec3f const& v2 = vertices[faces[3 * face_id + 1]];
-    math::Vec3f const& v3 = vertices[faces[3 * face_id + 2]];
-    math::Vec3f const& face_normal = face_normals[face_id];
-    math::Vec3f const face_center = (v1 + v2 + v3) / 3.0f;
-
+  if (static_cast<int64_t>(face_geom.centers.size()) != num_faces)
+    LOG(FATAL) << "The face geometry does not match the mesh.";
+
+  // Skip the faces in parts of the mesh outside the camera view
+  std::vector<int64_t> candidates;
+  frustumCullFaces(face_geom, cam, candidates);
+  int64_t num_candidates = candidates.size();
+
+  // Project each vertex only once, rather than for each face it is
+  // in. Skip pixels that don't project in the image.
+  camera::PixelBatch vertex_pixels;
+  camera::MaskBatch vertex_valid;
+  projectFaceVertices(vertices, faces, candidates, cam, vertex_pixels, vertex_valid);
+  double max_col = calib_image_cols - 1, max_row = calib_image_rows - 1;
+  vertex_valid = vertex_valid &&
+    (vertex_pixels.col(0).array() >= 0.0) && (vertex_pixels.col(0).array() <= max_col) &&
+    (vertex_pixels.col(1).array() >= 0.0) && (vertex_pixels.col(1).array() <= max_row);
+
+  // Each face is processed by one iteration only, which then owns its
+  // entry in smallest_cost_per_face, so no lock is needed
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int64_t cand_it = 0; cand_it < num_candidates; cand_it++) {
+    int64_t face_id = candidates[cand_it];
     // Do some geometric checks and compute the cost for this face and camera
-
-    Eigen::Vector3d cam_to_face_vec = (vec3f_to_eigen(face_center) - cam_ctr).normalized();
-    Eigen::Vector3d face_to_cam_vec = -cam_to_face_vec;
-    double face_normal_to_cam_dot_prod = face_to_cam_vec.dot(vec3f_to_eigen(face_normal));
-
-    if (face_normal_to_cam_dot_prod <= 0.0) continue;  // The face points away from the camera
-
-    // Angle between face normal and ray from face center to camera center
-    // is bigger than 75 degrees.
-    // TODO(oalexan1): Make this a parameter.
-    // TODO(oalexan1): Filter by distance from each of
-    // v1, v2, v3 to view_pos.
-    double face_normal_to_cam_angle = std::acos(face_normal_to_cam_dot_prod);  // radians
-    if (face_normal_to_cam_angle > 75.0 * M_PI / 180.0) continue;
-
-    // The further a camera is and the bigger then angle between the
-    // camera direction and the face normal, the less we want this
-    // camera's texture for this triangle.
-    double cost_val = face_normal_to_cam_angle + (vec3f_to_eigen(face_center) - cam_ctr).norm();
-    if (cost_val >= smallest_cost_per_face[face_id]) {
+    double cost_val = 0.0;
+    if (!faceCostForCamera(face_geom, face_id, cam_ctr, smallest_cost_per_face[face_id],
+                           cost_val))
       continue;
-    }
 
-    // A mesh triangle is visible if rays from its vertices do not
-    // intersect the mesh somewhere else before hitting the camera,
-    // and hit the camera inside the image bounds.
-    bool visible = true;
-    math::Vec3f const* samples[] = {&v1, &v2, &v3};
-
-    for (std::size_t vertex_it = 0; vertex_it < 3; vertex_it++) {
-      BVHTree::Ray ray;
-      ray.origin = *samples[vertex_it];
-      ray.dir = eigen_to_vec3f(cam_ctr) - ray.origin;
-      ray.tmax = ray.dir.norm();
-      ray.tmin = ray.tmax * 0.0001f;
-      ray.dir.normalize();
-
-      BVHTree::Hit hit;
-      if (bvh_tree->intersect(ray, &hit)) {
-        visible = false;
-        break;
-      }
-
-      // Triangle vertex in world coordinates
-      Eigen::Vector3d world_pt = vec3f_to_eigen(*samples[vertex_it]);
-
-      // Transform the vertex to camera coordinates
-      Eigen::Affine3d const& world2cam = cam.GetTransform();
-      Eigen::Vector3d cam_pt = world2cam * world_pt;
-
-      // Skip points that project behind the camera
-      if (cam_pt.z() <= 0) {
-        visible = false;
-        break;
-      }
-
-      // Get the undistorted pixel
-      Eigen::Vector2d undist_centered_pix
-        = cam.GetParameters().GetFocalVector().cwiseProduct(cam_pt.hnormalized());
-      if (std::abs(undist_centered_pix[0]) > cam.GetParameters().GetUndistortedHalfSize()[0] ||
-          std::abs(undist_centered_pix[1]) > cam.GetParameters().GetUndistortedHalfSize()[1]) {
-        // If we are out of acceptable undistorted region, there's some uncertainty whether
-        // the distortion computation in the next operation will work, so quit early.
-        visible = false;
-        break;
-      }
-
-      // Get the distorted pixel value
-      Eigen::Vector2d dist_pix;
-      cam.GetParameters().Convert<camera::UNDISTORTED_C,
-        camera::DISTORTED>(undist_centered_pix, &dist_pix);
-
-      // Skip pixels that don't project in the image
-      if (dist_pix.x() < 0 || dist_pix.x() > calib_image_cols - 1 || dist_pix.y() < 0 ||
-          dist_pix.y() > calib_image_rows - 1) {
-        visible = false;
-        break;
-      }
-    }
-
-    // Skip faces that are not fully seen from this camera
-    if (!visible) continue;
+    // Skip faces that are not fully seen from this camera. Check first
+    // if the vertices project in the image, as that is cheaper than
+    // ray tracing.
+    unsigned int const* face_vertices = &faces[3 * face_id];
+    if (!vertex_valid[face_vertices[0]] || !vertex_valid[face_vertices[1]] ||
+        !vertex_valid[face_vertices[2]])
+      continue;
+    if (!faceVerticesSeeCamera(vertices, face_vertices, cam_ctr, bvh_tree))
+      continue;
 
     FaceInfo const& F = face_projection_info[face_id];  // alias
 
     // Skip faces for which we did not figure out how to project them
     if (F.shift_u == std::numeric_limits<int>::max()) continue;
 
-    // Form the transform from the y-z plane pixels to the camera
-    Eigen::Affine3d const& world2cam = cam.GetTransform();
+    // Form the transform from the y-z plane pixels to the world
     Eigen::Affine3d const& YZPlaneToTriangleFace = F.YZPlaneToTriangleFace;
 
     // The transform from sampled pixel space to the y-z plane
     Eigen::Affine3d S;
     S.matrix() << 1, 0, 0, F.x, 0, pixel_size, 0, F.min_y, 0, 0, pixel_size, F.min_z, 0, 0, 0, 1;
-    Eigen::Affine3d T = world2cam * YZPlaneToTriangleFace * S;
+    Eigen::Affine3d T = YZPlaneToTriangleFace * S;
 
     // Sample the triangle face in predetermined fashion and
     // project all those samples in the camera.
@@ -1340,6 +1749,8 @@ void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> b
     // the triangle are sampled well.
     tri = bias_triangle(tri, 1.5 * pixel_size * F.face_info_padding);
 
+    // First find all the samples, then project them together
+    std::vector<std::pair<int64_t, int64_t>> samples_yz;
     for (int64_t iz = 0; iz < F.height; iz++) {
       double out_y0 = -1.0, out_y1 = -1.0;
       double z = F.min_z + iz * pixel_size;
@@ -1352,77 +1763,60 @@ void projectTexture(mve::TriangleMesh::ConstPtr mesh, std::shared_ptr<BVHTree> b
         std::min(static_cast<int64_t>(ceil((out_y1 - F.min_y) / pixel_size)),
                  static_cast<int64_t>(F.width) - 1L);
 
-      for (int64_t iy = min_iy; iy <= max_iy; iy++) {
-        // The point in the plane in which we do the book-keeping
-        // Eigen::Vector3d P(F.x, F.min_y + iy * pixel_size, F.min_z + iz *
-        // pixel_size);
-        // Transform to the actual plane of the triangle
-        // P = F.YZPlaneToTriangleFace * P;
-        // Transform the vertex to camera coordinates
-        // Eigen::Vector3d cam_pt = T * P;
-
-        // Optimized version in the above
-        Eigen::Vector3d cam_pt = T * Eigen::Vector3d(0, iy, iz);
-
-        // Skip points that project behind the camera
-        if (cam_pt.z() <= 0) continue;
-
-        // Get the undistorted pixel
-        Eigen::Vector2d undist_centered_pix
-          = cam.GetParameters().GetFocalVector().cwiseProduct(cam_pt.hnormalized());
-        if (std::abs(undist_centered_pix[0]) > cam.GetParameters().GetUndistortedHalfSize()[0] ||
-            std::abs(undist_centered_pix[1]) > cam.GetParameters().GetUndistortedHalfSize()[1]) {
-          // If we are out of acceptable undistorted region, there's some uncertainty whether
-          // the distortion computation in the next operation will work, so quit early.
-          visible = false;
-          break;
-        }
-
-        // Get the distorted pixel value
-        Eigen::Vector2d dist_pix;
-        cam.GetParameters().Convert<camera::UNDISTORTED_C, camera::DISTORTED>
-          (undist_centered_pix, &dist_pix);
-
-        // Skip pixels that don't project in the image, and potentially nan pixels.
-        bool is_good = (dist_pix.x() >= 0 && dist_pix.x() < calib_image_cols - 1 &&
-                        dist_pix.y() >= 0 && dist_pix.y() < calib_image_rows - 1);
-        if (!is_good) continue;
-
-        // Find the pixel value using bilinear interpolation. Note
-        // that we compensate for the image being larger by 'factor'
-        // compared to what is calibrated.
-        // TODO(oalexan1): Maybe use bicubic
-        cv::Size s(1, 1);
-        cv::Mat interp_pix_val;
-        cv::Point2f pix;
-        pix.x = factor * dist_pix[0];
-        pix.y = factor * dist_pix[1];
-        cv::getRectSubPix(image, s, pix, interp_pix_val);
-        cv::Vec3b color = interp_pix_val.at<cv::Vec3b>(0, 0);
-
-        // Find the location where to put the pixel. Use a int64_t as an int may overflow.
-        int64_t offset = texture->channels() * ((F.shift_u + iy) + (F.shift_v + iz) * texture->width());
-
-        // Copy the color
-        for (int64_t channel = 0; channel < NUM_CHANNELS - 1; channel++) texture_ptr[offset + channel] = color[channel];
-
-        // Make it non-transparent
-        texture_ptr[offset + NUM_CHANNELS - 1] = 255;
-      }
+      for (int64_t iy = min_iy; iy <= max_iy; iy++)
+        samples_yz.push_back(std::make_pair(iy, iz));
     }
 
-#pragma omp critical
-    {
-      // Here we integrate the results from each loop iteration so have
-      // to use a lock (critical section).
-
-      // Sanity check, to ensure nothing got mixed up with the multiple
-      // threads
-      if (cost_val >= smallest_cost_per_face[face_id])
-        LOG(FATAL) << "Book-keeping error in estimating cost per face.";
-
-      smallest_cost_per_face[face_id] = cost_val;
+    // The samples in world coordinates. Do not form the point in the
+    // y-z plane and then transform it to the plane of the triangle,
+    // but apply the combined transform T to it.
+    int64_t num_samples = samples_yz.size();
+    camera::PointBatch world_pts(num_samples, 3);
+    for (int64_t it = 0; it < num_samples; it++)
+      world_pts.row(it) = (T * Eigen::Vector3d(0, samples_yz[it].first,
+                                               samples_yz[it].second)).transpose();
+
+    // Get the distorted pixel values. This skips points that project
+    // behind the camera, or out of the acceptable undistorted region,
+    // for which it is uncertain whether distortion will work.
+    camera::PixelBatch dist_pixels;
+    camera::MaskBatch valid;
+    cam.DistortedImageCoordinates(world_pts, &dist_pixels, &valid);
+
+    for (int64_t it = 0; it < num_samples; it++) {
+      if (!valid[it]) continue;
+
+      int64_t iy = samples_yz[it].first, iz = samples_yz[it].second;
+      Eigen::Vector2d dist_pix = dist_pixels.row(it).transpose();
+
+      // Skip pixels that don't project in the image, and potentially nan pixels.
+      bool is_good = (dist_pix.x() >= 0 && dist_pix.x() < calib_image_cols - 1 &&
+                      dist_pix.y() >= 0 && dist_pix.y() < calib_image_rows - 1);
+      if (!is_good) continue;
+
+      // Find the pixel value using bilinear interpolation. Note
+      // that we compensate for the image being larger by 'factor'
+      // compared to what is calibrated.
+      // TODO(oalexan1): Maybe use bicubic
+      cv::Size s(1, 1);
+      cv::Mat interp_pix_val;
+      cv::Point2f pix;
+      pix.x = factor * dist_pix[0];
+      pix.y = factor * dist_pix[1];
+      cv::getRectSubPix(image, s, pix, interp_pix_val);
+      cv::Vec3b color = interp_pix_val.at<cv::Vec3b>(0, 0);
+
+      // Find the location where to put the pixel. Use a int64_t as an int may overflow.
+      int64_t offset = texture->channels() * ((F.shift_u + iy) + (F.shift_v + iz) * texture->width());
+
+      // Copy the color
+      for (int64_t channel = 0; channel < NUM_CHANNELS - 1; channel++) texture_ptr[offset + channel] = color[channel];
+
+      // Make it non-transparent
+      texture_ptr[offset + NUM_CHANNELS - 1] = 255;
     }
+
+    smallest_cost_per_face[face_id] = cost_val;
   }  // End loop over mesh faces
 
   // Create an OpenCV matrix in place, for export. Note that we have four channels
@@ -1478,18 +1872,69 @@ bool ray_mesh_intersect(Eigen::Vector2d const& dist_pix,
   return false;
 }
 
+// The same as above for many distorted pixels in the same camera
+void ray_mesh_intersect(std::vector<Eigen::Vector2d> const& dist_pixels,
+                        camera::CameraParameters const& cam_params,
+                        Eigen::Affine3d const& world_to_cam,
+                        mve::TriangleMesh::Ptr const& mesh,
+                        std::shared_ptr<BVHTree> const& bvh_tree,
+                        double min_ray_dist, double max_ray_dist,
+                        // Outputs
+                        std::vector<Eigen::Vector3d>& intersections,
+                        std::vector<char>& have_intersection) {
+  // Initialize the outputs
+  size_t num_pixels = dist_pixels.size();
+  intersections.assign(num_pixels, Eigen::Vector3d(0.0, 0.0, 0.0));
+  have_intersection.assign(num_pixels, 0);
+
+  // Undistort all pixels at once
+  std::vector<Eigen::Vector2d> undist_centered_pixels;
+  cam_params.UndistortPixels(dist_pixels, &undist_centered_pixels);
+
+  Eigen::Affine3d cam_to_world = world_to_cam.inverse();
+  Eigen::Vector3d cam_ctr = cam_to_world.translation();
+  math::Vec3f bvh_origin = dense_map::eigen_to_vec3f(cam_ctr);
+  Eigen::Vector2d const& focal_vector = cam_params.GetFocalVector();
+
+  // All rays start at the camera center, so they go through nearby
+  // parts of the tree, which is good for caching
+  for (size_t it = 0; it < num_pixels; it++) {
+    // Ray from camera going through the undistorted and centered pixel
+    Eigen::Vector3d cam_ray(undist_centered_pixels[it].x() / focal_vector[0],
+                            undist_centered_pixels[it].y() / focal_vector[1], 1.0);
+    cam_ray.normalize();
+    Eigen::Vector3d world_ray = cam_to_world.linear() * cam_ray;
+
+    // Set up the ray structure for the mesh
+    BVHTree::Ray bvh_ray;
+    bvh_ray.origin = bvh_origin;
+    bvh_ray.dir = dense_map::eigen_to_vec3f(world_ray);
+    bvh_ray.dir.normalize();
+    bvh_ray.tmin = min_ray_dist;
+    bvh_ray.tmax = max_ray_dist;
+
+    // Intersect the ray with the mesh
+    BVHTree::Hit hit;
+    if (bvh_tree->intersect(bvh_ray, &hit)) {
+      intersections[it] = cam_ctr + hit.t * world_ray;
+      have_intersection[it] = 1;
+    }
+  }
+}
+
 // Project and save a mesh as an obj file to out_prefix.obj,
 // out_prefix.mtl, out_prefix.png.
 void meshProject(mve::TriangleMesh::Ptr const& mesh, std::shared_ptr<BVHTree> const& bvh_tree,
+                 FaceGeometry const& face_geom,
                  cv::Mat const& image, Eigen::Affine3d const& world_to_cam,
                  camera::CameraParameters const& cam_params,
-                 std::string const& out_prefix) {
+                 std::string const& out_prefix, bool save_ply) {
   // Create the output directory, if needed
   std::string out_dir = boost::filesystem::path(out_prefix).parent_path().string();
   if (out_dir != "") dense_map::createDir(out_dir);
 
   std::vector<Eigen::Vector3i> face_vec;
-  std::map<int, Eigen::Vector2d> uv_map;
+  std::vector<Eigen::Vector2d> vertex_uv;
 
   std::vector<unsigned int> const& faces = mesh->get_faces();
   int64_t num_faces = faces.size();
@@ -1498,23 +1943,22 @@ void meshProject(mve::TriangleMesh::Ptr const& mesh, std::shared_ptr<BVHTree> co
   camera::CameraModel cam(world_to_cam, cam_params);
 
   // Find the UV coordinates and the faces having them
-  dense_map::projectTexture(mesh, bvh_tree, image, cam, smallest_cost_per_face, face_vec, uv_map);
+  dense_map::projectTexture(mesh, bvh_tree, face_geom, image, cam, smallest_cost_per_face,
+                            face_vec, vertex_uv);
 
   // Strip the directory name, according to .obj file conventions.
   std::string suffix = boost::filesystem::path(out_prefix).filename().string();
 
-  std::string obj_str;
-  dense_map::formObjCustomUV(mesh, face_vec, uv_map, suffix, obj_str);
+  std::string obj_file = out_prefix + ".obj";
+  std::cout << "Writing: " << obj_file << std::endl;
+  dense_map::saveObjCustomUV(mesh, face_vec, vertex_uv, suffix, obj_file);
+
+  if (save_ply)
+    dense_map::saveTexturedPly(mesh, face_vec, vertex_uv, suffix + ".png", out_prefix + ".ply");
 
   std::string mtl_str;
   dense_map::formMtl(suffix, mtl_str);
 
-  std::string obj_file = out_prefix + ".obj";
-  std::cout << "Writing: " << obj_file << std::endl;
-  std::ofstream obj_handle(obj_file);
-  obj_handle << obj_str;
-  obj_handle.close();
-
   std::string mtl_file = out_prefix + ".mtl";
   std::cout << "Writing: " << mtl_file << std::endl;
   std::ofstream mtl_handle(mtl_file);
@@ -1535,7 +1979,8 @@ void meshProjectCameras(std::vector<std::string> const& cam_names,
                         std::vector<Eigen::Affine3d> const& world_to_cam,
                         mve::TriangleMesh::Ptr const& mesh,
                         std::shared_ptr<BVHTree> const& bvh_tree,
-                        std::string const& out_dir) {
+                        std::string const& out_dir, int num_threads,
+                        bool save_ply) {
   if (cam_names.size() != cam_params.size())
     LOG(FATAL) << "There must be as many camera names as sets of camera parameters.\n";
   if (cam_images.size() != world_to_cam.size())
@@ -1543,21 +1988,47 @@ void meshProjectCameras(std::vector<std::string> const& cam_names,
   if (out_dir.empty())
     LOG(FATAL) << "The output directory is empty.\n";
   
-  char filename_buffer[1000];
-
-  for (size_t cid = 0; cid < cam_images.size(); cid++) {
-    double timestamp = cam_images[cid].timestamp;
-    int cam_type = cam_images[cid].camera_type;
-
-    // Must use the 10.7f format for the timestamp as everywhere else in the code
-    snprintf(filename_buffer, sizeof(filename_buffer), "%s/%10.7f_%s",
-             out_dir.c_str(), timestamp, cam_names[cam_type].c_str());
-    std::string out_prefix = filename_buffer;  // convert to string
-
-    std::cout << "Creating texture for: " << out_prefix << std::endl;
-    meshProject(mesh, bvh_tree, cam_images[cid].image, world_to_cam[cid], cam_params[cam_type],
-                out_prefix);
-  }
+  // This does not depend on the camera
+  dense_map::FaceGeometry face_geom;
+  dense_map::computeFaceGeometry(mesh, face_geom);
+
+  // Read the images ahead in parallel, and project them and write the
+  // results on another pool of threads. Adding a task to the pool
+  // waits when too many are queued, so not many images are kept in
+  // memory. Reading is mostly waiting on the disk, so it gets fewer
+  // of the threads.
+  std::vector<int> cids(cam_images.size());
+  for (size_t cid = 0; cid < cam_images.size(); cid++)
+    cids[cid] = cid;
+
+  dense_map::createDir(out_dir);
+  int num_read_threads = std::max(num_threads / 4, 1);
+  dense_map::ThreadPool thread_pool(std::max(num_threads - num_read_threads, 1));
+  dense_map::visitCameraData
+    (cam_images, cids, true, false, num_read_threads,  // images only
+     [&](int cid, cv::Mat const& image, cv::Mat const& depth_cloud) {
+      double timestamp = cam_images[cid].timestamp;
+      int cam_type = cam_images[cid].camera_type;
+
+      // Must use the 10.7f format for the timestamp as everywhere else in the code
+      char filename_buffer[1000];
+      snprintf(filename_buffer, sizeof(filename_buffer), "%s/%10.7f_%s",
+               out_dir.c_str(), timestamp, cam_names[cam_type].c_str());
+      std::string out_prefix = filename_buffer;  // convert to string
+
+      // The images are projected in parallel, so the OpenMP loops
+      // in each projection must use only the thread they are run in.
+      std::cout << "Creating texture for: " << out_prefix << std::endl;
+      Eigen::Affine3d const* cam_pose = &world_to_cam[cid];
+      camera::CameraParameters const* params = &cam_params[cam_type];
+      thread_pool.AddTask([&mesh, &bvh_tree, &face_geom, image, cam_pose, params,
+                           out_prefix, save_ply]() {
+        omp_set_num_threads(1);
+        meshProject(mesh, bvh_tree, face_geom, image, *cam_pose, *params,
+                    out_prefix, save_ply);
+      });
+    });
+  thread_pool.Join();
 }
 
 //  Consider several rays which are supposed to intersect at a 3D point.
@@ -1567,47 +2038,71 @@ void meshTriangulations(// Inputs
   std::vector<camera::CameraParameters> const& cam_params,
   std::vector<dense_map::cameraImage> const& cams,
   std::vector<Eigen::Affine3d> const& world_to_cam,
-  std::vector<std::map<int, int>> const& pid_to_cid_fid,
-  std::vector<std::map<int, std::map<int, int>>> const& pid_cid_fid_inlier,
+  dense_map::TrackStore const& tracks,
   std::vector<std::vector<std::pair<float, float>>> const& keypoint_vec,
   Eigen::Vector3d const& bad_xyz, double min_ray_dist, double max_ray_dist,
   mve::TriangleMesh::Ptr const& mesh, std::shared_ptr<BVHTree> const& bvh_tree,
   // Outputs
-  std::vector<std::map<int, std::map<int, Eigen::Vector3d>>>& pid_cid_fid_mesh_xyz,
+  std::vector<Eigen::Vector3d>& obs_mesh_xyz,
   std::vector<Eigen::Vector3d>& pid_mesh_xyz) {
-  // Initialize the outputs
-  pid_cid_fid_mesh_xyz.resize(pid_to_cid_fid.size());
-  pid_mesh_xyz.resize(pid_to_cid_fid.size());
+  // Initialize the outputs. The intersection for each feature is
+  // stored at the index of that feature in the tracks.
+  obs_mesh_xyz.clear();
+  obs_mesh_xyz.resize(tracks.numObs(), bad_xyz);
+  pid_mesh_xyz.resize(tracks.size());
+
+  // Group the inlier features by camera, so that for each camera the
+  // rays are set up once and cast together. Store for each feature
+  // its index in the tracks and its fid.
+  std::vector<std::vector<std::pair<size_t, int>>> cid_to_obs(cams.size());
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
+    for (auto const& obs : tracks[pid]) {
+      // Deal with inliers only
+      if (obs.inlier)
+        cid_to_obs[obs.cid].push_back(std::make_pair(tracks.obsIndex(obs), obs.fid));
+    }
+  }
 
-  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
-    Eigen::Vector3d avg_mesh_xyz(0, 0, 0);
-    int num_intersections = 0;
+  // Each feature is in one camera only, so each thread writes to
+  // different entries of obs_mesh_xyz and have_obs_xyz
+  std::vector<char> have_obs_xyz(tracks.numObs(), 0);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t cid = 0; cid < cams.size(); cid++) {
+    std::vector<std::pair<size_t, int>> const& obs_vec = cid_to_obs[cid];  // alias
+    if (obs_vec.empty())
+      continue;
 
-    for (auto cid_fid = pid_to_cid_fid[pid].begin(); cid_fid != pid_to_cid_fid[pid].end();
-         cid_fid++) {
-      int cid = cid_fid->first;
-      int fid = cid_fid->second;
+    std::vector<Eigen::Vector2d> dist_pixels(obs_vec.size());
+    for (size_t it = 0; it < obs_vec.size(); it++) {
+      std::pair<float, float> const& kp = keypoint_vec[cid][obs_vec[it].second];
+      dist_pixels[it] = Eigen::Vector2d(kp.first, kp.second);
+    }
 
-      // Initialize this
-      pid_cid_fid_mesh_xyz[pid][cid][fid] = bad_xyz;
+    // Intersect the rays with the mesh
+    std::vector<Eigen::Vector3d> intersections;
+    std::vector<char> have_intersection;
+    dense_map::ray_mesh_intersect(dist_pixels, cam_params[cams[cid].camera_type],
+                                  world_to_cam[cid], mesh, bvh_tree,
+                                  min_ray_dist, max_ray_dist,
+                                  // Outputs
+                                  intersections, have_intersection);
+
+    for (size_t it = 0; it < obs_vec.size(); it++) {
+      if (have_intersection[it]) {
+        obs_mesh_xyz[obs_vec[it].first] = intersections[it];
+        have_obs_xyz[obs_vec[it].first] = 1;
+      }
+    }
+  }
 
-      // Deal with inliers only
-      if (!dense_map::getMapValue(pid_cid_fid_inlier, pid, cid, fid))
-        continue;
-
-      // Intersect the ray with the mesh
-      Eigen::Vector2d dist_ip(keypoint_vec[cid][fid].first, keypoint_vec[cid][fid].second);
-      Eigen::Vector3d mesh_xyz(0.0, 0.0, 0.0);
-      bool have_mesh_intersection
-        = dense_map::ray_mesh_intersect(dist_ip, cam_params[cams[cid].camera_type],
-                                        world_to_cam[cid], mesh, bvh_tree,
-                                        min_ray_dist, max_ray_dist,
-                                        // Output
-                                        mesh_xyz);
-
-      if (have_mesh_intersection) {
-        pid_cid_fid_mesh_xyz[pid][cid][fid] = mesh_xyz;
-        avg_mesh_xyz += mesh_xyz;
+  for (size_t pid = 0; pid < tracks.size(); pid++) {
+    Eigen::Vector3d avg_mesh_xyz(0, 0, 0);
+    int num_intersections = 0;
+
+    for (auto const& obs : tracks[pid]) {
+      size_t obs_index = tracks.obsIndex(obs);
+      if (have_obs_xyz[obs_index]) {
+        avg_mesh_xyz += obs_mesh_xyz[obs_index];
         num_intersections += 1;
       }
     }
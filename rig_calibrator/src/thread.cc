@@ -21,80 +21,86 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
-#include <sys/time.h>
+#include <cstdlib>
 #include <thread>
 
 DEFINE_int32(num_threads, (std::thread::hardware_concurrency() == 0 ? 2 : std::thread::hardware_concurrency()),
              "Number of threads to use for processing.");
 
-void* dense_map::HolderFunction(void* ptr) {
-  dense_map::ThreadPool::VarsTuple* vars = reinterpret_cast<dense_map::ThreadPool::VarsTuple*>(ptr);
+dense_map::ThreadPool::ThreadPool(): ThreadPool(FLAGS_num_threads) {}
 
-  // Run the function
-  std::get<0>(*vars)();
-
-  // Set out boolean so someone can know they can delete this
-  std::get<3>(*vars) = true;
-
-  // Signal that we are finished
-  pthread_mutex_lock(std::get<1>(*vars));
-  pthread_cond_signal(std::get<2>(*vars));
-  pthread_mutex_unlock(std::get<1>(*vars));
+dense_map::ThreadPool::ThreadPool(int num_threads)
+  : max_queued_tasks_(0), num_unfinished_(0), stop_(false) {
+  size_t num_workers = num_threads;
+  if (num_threads <= 0) {
+    LOG(ERROR) << "Thread pool without threads created. Will use one thread.";
+    num_workers = 1;
+  }
 
-  return NULL;
-}
+  // Enough waiting tasks to keep all workers busy, but not so many
+  // that their bound arguments use up a lot of memory.
+  max_queued_tasks_ = 4 * num_workers;
 
-dense_map::ThreadPool::ThreadPool()
-  : max_concurrent_jobs_(FLAGS_num_threads) {
-  pthread_mutex_init(&cond_mutex_, NULL);
-  pthread_cond_init(&cond_, NULL);
-  if (max_concurrent_jobs_ <= 0) {
-    LOG(ERROR) << "Thread pool without threads created...";
-  }
+  for (size_t it = 0; it < num_workers; it++)
+    workers_.push_back(std::thread(&dense_map::ThreadPool::WorkerLoop, this));
 }
 
 dense_map::ThreadPool::~ThreadPool() {
   Join();
-  pthread_cond_destroy(&cond_);
-  pthread_mutex_destroy(&cond_mutex_);
+
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    stop_ = true;
+  }
+  work_cond_.notify_all();
+
+  for (size_t it = 0; it < workers_.size(); it++)
+    workers_[it].join();
 }
 
 void dense_map::ThreadPool::Join() {
-  while (threads_.size()) {
-    pthread_join(threads_.front(), NULL);
-    threads_.pop_front();
-    var_bindings_.pop_front();
+  std::unique_lock<std::mutex> lock(state_mutex_);
+  done_cond_.wait(lock, [this] { return num_unfinished_ == 0; });
+}
+
+void dense_map::ThreadPool::ReportTaskFailure(std::string const& what) {
+  LOG(FATAL) << "A task failed with: " << what << "\n";
+  std::abort();  // not reached
+}
+
+void dense_map::ThreadPool::Enqueue(std::function<void(void)> const& task) {
+  {
+    std::unique_lock<std::mutex> lock(state_mutex_);
+    space_cond_.wait(lock, [this] { return tasks_.size() < max_queued_tasks_; });
+    tasks_.push_back(task);
+    num_unfinished_++;
   }
+  work_cond_.notify_one();
 }
 
-void dense_map::ThreadPool::WaitTillJobOpening() {
-  while (threads_.size() >= max_concurrent_jobs_) {
-    // Wait for a condition event to signal a free job or time out
-    // after one second. I do a time out because somehow I still have
-    // a deadlock. I think it occurs if a task just finishes faster
-    // than we can get back into a state to wait for condition.
-    pthread_mutex_lock(&cond_mutex_);
-    struct timeval tv;
-    struct timespec ts;
-    gettimeofday(&tv, NULL);
-    ts.tv_sec = tv.tv_sec + 1;
-    ts.tv_nsec = 0;
-    pthread_cond_timedwait(&cond_, &cond_mutex_, &ts);
-    pthread_mutex_unlock(&cond_mutex_);
-
-    // Iterate through and clean out all the finished jobs
-    std::list<pthread_t>::iterator thread_it = threads_.begin();
-    std::list<VarsTuple>::iterator vars_it = var_bindings_.begin();
-    while (thread_it != threads_.end()) {
-      if (std::get<3>(*vars_it)) {
-        // Thread says it has finished. Join.
-        pthread_join(*thread_it, NULL);
-        thread_it = threads_.erase(thread_it);
-        vars_it = var_bindings_.erase(vars_it);
-      } else {
-        thread_it++;
-        vars_it++;
-      }
+void dense_map::ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void(void)> task;
+    {
+      // Take a task, or quit when the pool is being destroyed
+      std::unique_lock<std::mutex> lock(state_mutex_);
+      work_cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty())
+        return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    space_cond_.notify_one();
+
+    task();
+
+    bool all_done = false;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      num_unfinished_--;
+      all_done = (num_unfinished_ == 0);
     }
+    if (all_done)
+      done_cond_.notify_all();
   }
 }
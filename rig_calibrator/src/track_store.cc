@@ -0,0 +1,69 @@
+/* Copyright (c) 2021, United States Government, as represented by the
+ * Administrator of the National Aeronautics and Space Administration.
+ *
+ * All rights reserved.
+ *
+ * The "ISAAC - Integrated System for Autonomous and Adaptive Caretaking
+ * platform" software is licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with the
+ * License. You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <rig_calibrator/track_store.h>
+
+namespace dense_map {
+
+TrackStore::TrackStore(std::vector<std::map<int, int>> const& pid_to_cid_fid) {
+  size_t num_obs = 0;
+  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++)
+    num_obs += pid_to_cid_fid[pid].size();
+
+  m_offsets.resize(pid_to_cid_fid.size() + 1);
+  m_obs.resize(num_obs);
+
+  // A std::map is sorted by key, so the features in each track
+  // will be in increasing order of cid.
+  size_t pos = 0;
+  for (size_t pid = 0; pid < pid_to_cid_fid.size(); pid++) {
+    m_offsets[pid] = pos;
+    for (auto cid_fid = pid_to_cid_fid[pid].begin(); cid_fid != pid_to_cid_fid[pid].end();
+         cid_fid++) {
+      TrackObs& obs = m_obs[pos];
+      obs.cid            = cid_fid->first;
+      obs.fid            = cid_fid->second;
+      obs.inlier         = 1;
+      obs.residual_index = -1;
+      pos++;
+    }
+  }
+  m_offsets[pid_to_cid_fid.size()] = pos;
+}
+
+void TrackStore::setAllInliers(int inlier) {
+  for (size_t it = 0; it < m_obs.size(); it++)
+    m_obs[it].inlier = inlier;
+}
+
+void TrackStore::resetResidualIndices() {
+  for (size_t it = 0; it < m_obs.size(); it++)
+    m_obs[it].residual_index = -1;
+}
+
+void TrackStore::toMaps(std::vector<std::map<int, int>> & pid_to_cid_fid) const {
+  pid_to_cid_fid.clear();
+  pid_to_cid_fid.resize(size());
+  for (size_t pid = 0; pid < size(); pid++) {
+    for (auto const& obs : (*this)[pid])
+      pid_to_cid_fid[pid][obs.cid] = obs.fid;
+  }
+}
+
+}  // end namespace dense_map